@@ -31,12 +31,74 @@ var readEvents = function(service, request, response, next) {
 };
 exports.readEvents = readEvents;
 
+var readSeries = function(service, request, response, next) {
+  var start = parseInt(request.query.start) || 0;
+  var length = parseInt(request.query.length) || Number.MAX_SAFE_INTEGER;
+  service.readSeries(
+      {
+        user_id: request.user.googleId,
+        stat_id: request.query.stat_id.split(','),
+        start_time: {seconds: start},
+        duration: {seconds: length},
+        bucket_count: parseInt(request.query.buckets) || 0,
+      },
+      rpcResultToResponseBody(response, next));
+};
+exports.readSeries = readSeries;
+
+var aggregateEvents = function(service, request, response, next) {
+  var start = parseInt(request.query.start) || 0;
+  var length = parseInt(request.query.length) || Number.MAX_SAFE_INTEGER;
+  service.aggregateEvents(
+      {
+        user_id: request.user.googleId,
+        stat_id: request.query.stat_id.split(','),
+        start_time: {seconds: start},
+        duration: {seconds: length},
+      },
+      rpcResultToResponseBody(response, next));
+};
+exports.aggregateEvents = aggregateEvents;
+
+var aggregateValues = function(service, request, response, next) {
+  var start = parseInt(request.query.start) || 0;
+  var length = parseInt(request.query.length) || Number.MAX_SAFE_INTEGER;
+  service.aggregateValues(
+      {
+        user_id: request.user.googleId,
+        stat_id: request.query.stat_id.split(','),
+        start_time: {seconds: start},
+        duration: {seconds: length},
+      },
+      rpcResultToResponseBody(response, next));
+};
+exports.aggregateValues = aggregateValues;
+
+var queryQuantiles = function(service, request, response, next) {
+  var start = parseInt(request.query.start) || 0;
+  var length = parseInt(request.query.length) || Number.MAX_SAFE_INTEGER;
+  service.queryQuantiles(
+      {
+        user_id: request.user.googleId,
+        stat_id: request.query.stat_id.split(','),
+        start_time: {seconds: start},
+        duration: {seconds: length},
+        quantile: request.query.quantiles.split(',').map(parseFloat),
+      },
+      rpcResultToResponseBody(response, next));
+};
+exports.queryQuantiles = queryQuantiles;
+
 var defineStat = function(service, request, response, next) {
   service.defineStat(
       {
         user_id: request.user.googleId,
         stat: {
           display_name: request.query.display_name,
+          retention: {
+            max_age: {seconds: parseInt(request.query.max_age_s) || 0},
+            max_event_count: parseInt(request.query.max_event_count) || 0,
+          },
         },
       },
       rpcResultToResponseBody(response, next));
@@ -80,6 +142,18 @@ var deleteEvent = function(service, request, response, next) {
 };
 exports.deleteEvent = deleteEvent;
 
+var deleteEventsInRange = function(service, request, response, next) {
+  service.deleteEventsInRange(
+      {
+        user_id: request.user.googleId,
+        stat_id: request.query.stat_id,
+        start_time: {seconds: parseInt(request.query.start) || 0},
+        duration: {seconds: parseInt(request.query.length) || 0},
+      },
+      rpcResultToResponseBody(response, next));
+};
+exports.deleteEventsInRange = deleteEventsInRange;
+
 var newStatService = function(options) {
   var serviceProtoPath = options.serviceProtoPath;
   var serverHostPort = options.serverHostPort;
@@ -113,6 +187,14 @@ exports.registerStatServiceHttpHandlers = function(
     readStats(statService, request, response, next); });
   app.get(urlPrefix + 'read_events', (request, response, next) => {
     readEvents(statService, request, response, next); });
+  app.get(urlPrefix + 'read_series', (request, response, next) => {
+    readSeries(statService, request, response, next); });
+  app.get(urlPrefix + 'aggregate_events', (request, response, next) => {
+    aggregateEvents(statService, request, response, next); });
+  app.get(urlPrefix + 'aggregate_values', (request, response, next) => {
+    aggregateValues(statService, request, response, next); });
+  app.get(urlPrefix + 'query_quantiles', (request, response, next) => {
+    queryQuantiles(statService, request, response, next); });
   app.get(urlPrefix + 'define_stat', (request, response, next) => {
     defineStat(statService, request, response, next); });
   app.get(urlPrefix + 'delete_stat', (request, response, next) => {
@@ -121,4 +203,6 @@ exports.registerStatServiceHttpHandlers = function(
     recordEvent(statService, request, response, next); });
   app.get(urlPrefix + 'delete_event', (request, response, next) => {
     deleteEvent(statService, request, response, next); });
+  app.get(urlPrefix + 'delete_events_in_range', (request, response, next) => {
+    deleteEventsInRange(statService, request, response, next); });
 };
@@ -17,11 +17,67 @@ var readEvents = function(statIds, start, length) {
   });
 };
 
-var defineStat = function(displayName) {
+var readSeries = function(statIds, start, length, buckets) {
+  return $.ajax({
+    url: "/api/read_series",
+    data: {
+      "stat_id": statIds.join(','),
+      "start": start,
+      "length": length,
+      "buckets": buckets,
+    },
+    type: "GET",
+  });
+};
+
+// The count, total duration and first and last start of each stat's events
+// in the range, so callers needn't sum the events themselves.
+var aggregateEvents = function(statIds, start, length) {
+  return $.ajax({
+    url: "/api/aggregate_events",
+    data: {
+      "stat_id": statIds.join(','),
+      "start": start,
+      "length": length,
+    },
+    type: "GET",
+  });
+};
+
+var aggregateValues = function(statIds, start, length) {
+  return $.ajax({
+    url: "/api/aggregate_values",
+    data: {
+      "stat_id": statIds.join(','),
+      "start": start,
+      "length": length,
+    },
+    type: "GET",
+  });
+};
+
+var queryQuantiles = function(statIds, start, length, quantiles) {
+  return $.ajax({
+    url: "/api/query_quantiles",
+    data: {
+      "stat_id": statIds.join(','),
+      "start": start,
+      "length": length,
+      "quantiles": quantiles.join(','),
+    },
+    type: "GET",
+  });
+};
+
+// maxAgeSeconds and maxEventCount are optional; events past either are
+// expired.
+var defineStat = function(displayName, maxAgeSeconds, maxEventCount) {
   return $.ajax({
     url: "/api/define_stat",
     data: {
       "display_name": displayName,
+      "max_age_s": maxAgeSeconds || 0,
+      "max_event_count": maxEventCount || 0,
     },
     type: "GET",
   });
@@ -70,3 +126,15 @@ var deleteEvent = function(statId, eventId) {
   });
 };
 
+var deleteEventsInRange = function(statId, start, length) {
+  return $.ajax({
+    url: "/api/delete_events_in_range",
+    data: {
+      "stat_id": statId,
+      "start": start,
+      "length": length,
+    },
+    type: "GET",
+  });
+};
+
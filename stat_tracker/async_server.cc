@@ -0,0 +1,357 @@
+#include "stat_tracker/async_server.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "absl/time/clock.h"
+#include "glog/logging.h"
+#include "google/protobuf/arena.h"
+#include "storage/storage.h"
+
+namespace stat_tracker {
+
+namespace {
+
+grpc::Status Overloaded() {
+  return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                      "too many calls waiting for a worker");
+}
+
+}  // namespace
+
+// An RPC from the moment it's asked for until it's finished. Every operation
+// it starts is tagged with the call, and it has at most one pending at a
+// time, so it's never advanced by two threads at once.
+class AsyncStatServer::Call {
+ public:
+  Call(AsyncStatServer* server, grpc::ServerCompletionQueue* cq)
+      : server_(server), cq_(cq) {
+    absl::MutexLock l(&server_->mu_);
+    ++server_->num_calls_;
+  }
+  virtual ~Call() {
+    absl::MutexLock l(&server_->mu_);
+    --server_->num_calls_;
+  }
+
+  // Waits for the next call of the method on `cq_`.
+  virtual void Request() = 0;
+
+  // Advances the call once its pending operation completed, successfully if
+  // `ok`. Deletes the call when it's done.
+  virtual void Proceed(bool ok) = 0;
+
+ protected:
+  // Returns false, without running `fn`, if too many calls wait for workers.
+  bool Schedule(std::function<void()> fn) {
+    return server_->workers_.TrySchedule(std::move(fn));
+  }
+
+  AsyncStatServer* const server_;
+  grpc::ServerCompletionQueue* const cq_;
+  grpc::ServerContext context_;
+};
+
+template <typename Req, typename Resp>
+class AsyncStatServer::UnaryCall : public Call {
+ public:
+  using RequestFn = void (StatService::AsyncService::*)(
+      grpc::ServerContext*, Req*, grpc::ServerAsyncResponseWriter<Resp>*,
+      grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*);
+  using HandlerFn = grpc::Status (StatServiceImpl::*)(grpc::ServerContext*,
+                                                      const Req*, Resp*);
+
+  UnaryCall(AsyncStatServer* server, grpc::ServerCompletionQueue* cq,
+            RequestFn request_fn, HandlerFn handler_fn)
+      : Call(server, cq),
+        request_fn_(request_fn),
+        handler_fn_(handler_fn),
+        request_(google::protobuf::Arena::CreateMessage<Req>(&arena_)),
+        response_(google::protobuf::Arena::CreateMessage<Resp>(&arena_)),
+        responder_(&context_) {}
+
+  void Request() override {
+    (server_->async_service_.*request_fn_)(&context_, request_, &responder_,
+                                           cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    if (!ok || finishing_) {
+      delete this;
+      return;
+    }
+    server_->Accept(new UnaryCall(server_, cq_, request_fn_, handler_fn_));
+    finishing_ = true;
+    if (!Schedule([this]() {
+          const grpc::Status status =
+              (server_->service_->*handler_fn_)(&context_, request_,
+                                                response_);
+          responder_.Finish(*response_, status, this);
+        })) {
+      responder_.FinishWithError(Overloaded(), this);
+    }
+  }
+
+ private:
+  const RequestFn request_fn_;
+  const HandlerFn handler_fn_;
+  // The request and response, down to the events and map entries of large
+  // reads, are allocated on the call's arena and freed in one go with it.
+  google::protobuf::Arena arena_;
+  Req* const request_;
+  Resp* const response_;
+  grpc::ServerAsyncResponseWriter<Resp> responder_;
+  bool finishing_ = false;
+};
+
+// Reads each page on a worker and writes it from the completion queue, so
+// that no thread waits for a slow reader. Every page reads the snapshot taken
+// for the first one, as in StatServiceImpl::StreamEvents.
+class AsyncStatServer::StreamEventsCall : public Call {
+ public:
+  StreamEventsCall(AsyncStatServer* server, grpc::ServerCompletionQueue* cq)
+      : Call(server, cq), writer_(&context_) {}
+
+  void Request() override {
+    server_->async_service_.RequestStreamEvents(&context_, &request_,
+                                                &writer_, cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    // A failed write means the client is gone; there's no one to finish for.
+    if (!ok || state_ == State::kFinishing) {
+      delete this;
+      return;
+    }
+    if (state_ == State::kRequested) {
+      server_->Accept(new StreamEventsCall(server_, cq_));
+    } else {
+      request_.set_cursor(page_.next_cursor());
+    }
+    ReadPage();
+  }
+
+ private:
+  enum class State { kRequested, kWriting, kFinishing };
+
+  void ReadPage() {
+    if (!Schedule([this]() {
+          page_.Clear();
+          if (snapshot_ == nullptr) {
+            snapshot_ = server_->service_->NewStreamSnapshot();
+          }
+          const grpc::Status status = server_->service_->ReadStreamPage(
+              context_, request_, *snapshot_, &page_);
+          if (!status.ok() || page_.events().empty()) {
+            Finish(status);
+          } else if (page_.next_cursor().empty()) {
+            state_ = State::kFinishing;
+            writer_.WriteAndFinish(page_, grpc::WriteOptions(),
+                                   grpc::Status::OK, this);
+          } else {
+            state_ = State::kWriting;
+            writer_.Write(page_, this);
+          }
+        })) {
+      Finish(Overloaded());
+    }
+  }
+
+  void Finish(const grpc::Status& status) {
+    state_ = State::kFinishing;
+    writer_.Finish(status, this);
+  }
+
+  StreamEventsRequest request_;
+  std::unique_ptr<storage::ScopedSnapshot> snapshot_;
+  StreamEventsResponse page_;
+  grpc::ServerAsyncWriter<StreamEventsResponse> writer_;
+  State state_ = State::kRequested;
+};
+
+// Records each batch on a worker as it arrives.
+class AsyncStatServer::RecordEventStreamCall : public Call {
+ public:
+  RecordEventStreamCall(AsyncStatServer* server,
+                        grpc::ServerCompletionQueue* cq)
+      : Call(server, cq), reader_(&context_) {}
+
+  void Request() override {
+    server_->async_service_.RequestRecordEventStream(&context_, &reader_, cq_,
+                                                     cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    switch (state_) {
+      case State::kRequested:
+        if (!ok) break;
+        server_->Accept(new RecordEventStreamCall(server_, cq_));
+        Read();
+        return;
+      case State::kReading:
+        if (!ok) {
+          // The client is done writing.
+          state_ = State::kFinishing;
+          reader_.Finish(response_, grpc::Status::OK, this);
+          return;
+        }
+        if (!Schedule([this]() {
+              const grpc::Status status = server_->service_->RecordEventBatch(
+                  context_, request_, &response_);
+              if (status.ok()) {
+                Read();
+              } else {
+                FinishWithError(status);
+              }
+            })) {
+          FinishWithError(Overloaded());
+        }
+        return;
+      case State::kFinishing:
+        break;
+    }
+    delete this;
+  }
+
+ private:
+  enum class State { kRequested, kReading, kFinishing };
+
+  void Read() {
+    state_ = State::kReading;
+    reader_.Read(&request_, this);
+  }
+
+  void FinishWithError(const grpc::Status& status) {
+    state_ = State::kFinishing;
+    reader_.FinishWithError(status, this);
+  }
+
+  RecordEventsRequest request_;
+  RecordEventsResponse response_;
+  grpc::ServerAsyncReader<RecordEventsResponse, RecordEventsRequest> reader_;
+  State state_ = State::kRequested;
+};
+
+AsyncStatServer::AsyncStatServer(StatServiceImpl* service,
+                                 const Options& options)
+    : service_(service),
+      options_(options),
+      workers_(options.num_workers, options.max_pending_calls) {}
+
+bool AsyncStatServer::Start() {
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(options_.listening_hostport,
+                           grpc::InsecureServerCredentials(), &selected_port_);
+  builder.RegisterService(&async_service_);
+  const int num_cqs =
+      options_.num_completion_queues > 0
+          ? options_.num_completion_queues
+          : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  for (int i = 0; i < num_cqs; ++i) {
+    cqs_.push_back(builder.AddCompletionQueue());
+  }
+  server_ = builder.BuildAndStart();
+  if (server_ == nullptr) return false;
+  for (const auto& cq : cqs_) {
+    RequestCalls(cq.get());
+    grpc::ServerCompletionQueue* const polled = cq.get();
+    pollers_.emplace_back([this, polled]() { Poll(polled); });
+  }
+  LOG(INFO) << "serving from " << num_cqs << " completion queues with "
+            << options_.num_workers << " workers";
+  return true;
+}
+
+void AsyncStatServer::Wait() { shut_down_.WaitForNotification(); }
+
+void AsyncStatServer::Shutdown() {
+  bool already_shutting_down;
+  {
+    absl::MutexLock l(&mu_);
+    already_shutting_down = shutting_down_;
+    shutting_down_ = true;
+  }
+  if (already_shutting_down) {
+    shut_down_.WaitForNotification();
+    return;
+  }
+  if (server_ != nullptr) {
+    // Cancels what's left of the calls at the deadline. The calls waiting to
+    // be called fail, so every call finishes and is deleted by the pollers.
+    server_->Shutdown(
+        absl::ToChronoTime(absl::Now() + options_.shutdown_grace_period));
+    auto no_calls = [this]() { return num_calls_ == 0; };
+    absl::MutexLock l(&mu_);
+    mu_.Await(absl::Condition(&no_calls));
+  }
+  for (const auto& cq : cqs_) cq->Shutdown();
+  // Drains the queues.
+  if (pollers_.empty()) {
+    for (const auto& cq : cqs_) Poll(cq.get());
+  }
+  for (std::thread& poller : pollers_) poller.join();
+  shut_down_.Notify();
+}
+
+void AsyncStatServer::RequestCalls(grpc::ServerCompletionQueue* cq) {
+  using AsyncService = StatService::AsyncService;
+  Accept(new UnaryCall<DefineStatRequest, DefineStatResponse>(
+      this, cq, &AsyncService::RequestDefineStat,
+      &StatServiceImpl::DefineStat));
+  Accept(new UnaryCall<DeleteStatRequest, google::protobuf::Empty>(
+      this, cq, &AsyncService::RequestDeleteStat,
+      &StatServiceImpl::DeleteStat));
+  Accept(new UnaryCall<ReadStatsRequest, ReadStatsResponse>(
+      this, cq, &AsyncService::RequestReadStats, &StatServiceImpl::ReadStats));
+  Accept(new UnaryCall<ReadEventsRequest, ReadEventsResponse>(
+      this, cq, &AsyncService::RequestReadEvents,
+      &StatServiceImpl::ReadEvents));
+  Accept(new UnaryCall<AggregateEventsRequest, AggregateEventsResponse>(
+      this, cq, &AsyncService::RequestAggregateEvents,
+      &StatServiceImpl::AggregateEvents));
+  Accept(new UnaryCall<AggregateValuesRequest, AggregateValuesResponse>(
+      this, cq, &AsyncService::RequestAggregateValues,
+      &StatServiceImpl::AggregateValues));
+  Accept(new UnaryCall<ReadSeriesRequest, ReadSeriesResponse>(
+      this, cq, &AsyncService::RequestReadSeries,
+      &StatServiceImpl::ReadSeries));
+  Accept(new UnaryCall<QueryQuantilesRequest, QueryQuantilesResponse>(
+      this, cq, &AsyncService::RequestQueryQuantiles,
+      &StatServiceImpl::QueryQuantiles));
+  Accept(new UnaryCall<RecordEventRequest, google::protobuf::Empty>(
+      this, cq, &AsyncService::RequestRecordEvent,
+      &StatServiceImpl::RecordEvent));
+  Accept(new UnaryCall<RecordEventsRequest, RecordEventsResponse>(
+      this, cq, &AsyncService::RequestRecordEvents,
+      &StatServiceImpl::RecordEvents));
+  Accept(new UnaryCall<DeleteEventRequest, google::protobuf::Empty>(
+      this, cq, &AsyncService::RequestDeleteEvent,
+      &StatServiceImpl::DeleteEvent));
+  Accept(
+      new UnaryCall<DeleteEventsInRangeRequest, DeleteEventsInRangeResponse>(
+          this, cq, &AsyncService::RequestDeleteEventsInRange,
+          &StatServiceImpl::DeleteEventsInRange));
+  Accept(new StreamEventsCall(this, cq));
+  Accept(new RecordEventStreamCall(this, cq));
+}
+
+void AsyncStatServer::Accept(Call* call) {
+  {
+    absl::ReaderMutexLock l(&mu_);
+    if (!shutting_down_) {
+      call->Request();
+      return;
+    }
+  }
+  delete call;
+}
+
+void AsyncStatServer::Poll(grpc::ServerCompletionQueue* cq) {
+  void* tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) static_cast<Call*>(tag)->Proceed(ok);
+}
+
+}  // namespace stat_tracker
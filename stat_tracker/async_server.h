@@ -0,0 +1,97 @@
+#ifndef STAT_TRACKER_ASYNC_SERVER_H_
+#define STAT_TRACKER_ASYNC_SERVER_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "include/grpcpp/grpcpp.h"
+#include "stat_tracker/service.grpc.pb.h"
+#include "stat_tracker/service_impl.h"
+#include "util/thread_pool.h"
+
+namespace stat_tracker {
+
+// Serves a StatServiceImpl from completion queues instead of a thread per
+// call. Every queue is polled by its own thread, which only moves calls from
+// one state to the next; handlers run on a bounded pool of workers, and a call
+// that finds the pool's queue full fails with RESOURCE_EXHAUSTED. Streams hold
+// no thread between messages, so slow clients cost memory, not threads.
+class AsyncStatServer {
+ public:
+  struct Options {
+    std::string listening_hostport;
+    // Completion queues, each polled by one thread. 0 means one per core.
+    int num_completion_queues = 0;
+    // Threads that run the handlers.
+    int num_workers = 16;
+    // How many handlers may wait for a worker before calls are turned away.
+    size_t max_pending_calls = 1024;
+    // How long Shutdown lets the calls in progress finish before cancelling
+    // them.
+    absl::Duration shutdown_grace_period = absl::Seconds(5);
+  };
+
+  // `service` must outlive the server.
+  AsyncStatServer(StatServiceImpl* service, const Options& options);
+
+  AsyncStatServer(const AsyncStatServer&) = delete;
+  AsyncStatServer& operator=(const AsyncStatServer&) = delete;
+
+  ~AsyncStatServer() { Shutdown(); }
+
+  // Starts listening and polling. Returns false if the server couldn't be
+  // started.
+  bool Start();
+
+  // The port the server listens on, e.g. when the hostport asked for port 0.
+  int selected_port() const { return selected_port_; }
+
+  // Blocks until the server is shut down from another thread.
+  void Wait();
+
+  // Stops taking calls, lets the calls in progress finish within the grace
+  // period, and stops polling once every call is gone. Idempotent.
+  void Shutdown();
+
+ private:
+  class Call;
+  template <typename Request, typename Response>
+  class UnaryCall;
+  class StreamEventsCall;
+  class RecordEventStreamCall;
+
+  // Waits for one call of every method on `cq`.
+  void RequestCalls(grpc::ServerCompletionQueue* cq);
+  // Has `call` wait for the next call of its method, or deletes it if the
+  // server is shutting down.
+  void Accept(Call* call);
+  void Poll(grpc::ServerCompletionQueue* cq);
+
+  StatServiceImpl* const service_;
+  const Options options_;
+  StatService::AsyncService async_service_;
+  // Before server_, which must be destroyed first.
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+  std::unique_ptr<grpc::Server> server_;
+  int selected_port_ = 0;
+  util::ThreadPool workers_;
+
+  absl::Mutex mu_;
+  bool shutting_down_ = false;
+  // Calls that exist, whether they're waiting to be called or in progress.
+  // The queues are shut down once none are left, so that no call starts an
+  // operation on a queue that's shut down.
+  int num_calls_ = 0;
+  absl::Notification shut_down_;
+  std::vector<std::thread> pollers_;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_ASYNC_SERVER_H_
@@ -0,0 +1,161 @@
+#include "stat_tracker/async_server.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "include/grpc++/grpc++.h"
+#include "stat_tracker/time_util.h"
+#include "storage/testing/leveldb.h"
+#include "util/status.h"
+#include "util/status_test_macros.h"
+
+namespace stat_tracker {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+using ::testing::Property;
+using ::testing::SizeIs;
+
+class AsyncStatServerTest : public ::testing::Test {
+ protected:
+  AsyncStatServerTest()
+      : leveldb_env_("async_server_test.leveldb"),
+        service_(StatServiceImpl::Options{
+            leveldb_env_.db(),
+            {absl::Seconds(1), absl::Minutes(1), absl::Hours(1)}}) {
+    AsyncStatServer::Options options;
+    options.listening_hostport = "localhost:0";
+    options.num_completion_queues = 2;
+    options.num_workers = 2;
+    server_ = absl::make_unique<AsyncStatServer>(&service_, options);
+    CHECK(server_->Start());
+    stub_ = StatService::NewStub(grpc::CreateChannel(
+        absl::StrCat("localhost:", server_->selected_port()),
+        grpc::InsecureChannelCredentials()));
+  }
+
+  template <typename Req, typename Resp>
+  util::StatusOr<grpc::Status, Resp> Call(
+      grpc::Status (StatService::Stub::*fn)(grpc::ClientContext*, const Req&,
+                                            Resp*),
+      const Req& req) {
+    grpc::ClientContext ctx;
+    Resp resp;
+    RETURN_IF_ERROR((stub_.get()->*fn)(&ctx, req, &resp));
+    return resp;
+  }
+
+  util::StatusOr<grpc::Status, std::string> DefineStat(
+      const std::string& name) {
+    DefineStatRequest req;
+    req.set_user_id("jack");
+    req.mutable_stat()->set_display_name(name);
+    ASSIGN_OR_RETURN(DefineStatResponse resp,
+                     Call(&StatService::Stub::DefineStat, req));
+    return resp.new_stat_id();
+  }
+
+  storage::LevelDbTestEnvironment leveldb_env_;
+  StatServiceImpl service_;
+  std::unique_ptr<AsyncStatServer> server_;
+  std::unique_ptr<StatService::Stub> stub_;
+};
+
+TEST_F(AsyncStatServerTest, UnaryCalls) {
+  ASSERT_GRPC_OK_AND_ASSIGN(const std::string foo_id, DefineStat("foo"));
+  RecordEventRequest event_req;
+  event_req.set_user_id("jack");
+  event_req.mutable_event()->set_stat_id(foo_id);
+  event_req.mutable_event()->mutable_start_time()->set_seconds(100);
+  event_req.mutable_event()->mutable_duration()->set_seconds(50);
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+
+  ReadEventsRequest read_req;
+  read_req.set_user_id("jack");
+  read_req.add_stat_id(foo_id);
+  read_req.mutable_start_time()->set_seconds(120);
+  read_req.mutable_duration()->set_seconds(1);
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadEventsResponse read_resp,
+                            Call(&StatService::Stub::ReadEvents, read_req));
+  EXPECT_THAT(read_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  foo_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                   SizeIs(1)))));
+
+  event_req.mutable_event()->set_stat_id("asdf");
+  EXPECT_EQ(Call(&StatService::Stub::RecordEvent, event_req)
+                .status()
+                .error_code(),
+            grpc::StatusCode::NOT_FOUND);
+}
+
+TEST_F(AsyncStatServerTest, Streams) {
+  ASSERT_GRPC_OK_AND_ASSIGN(const std::string foo_id, DefineStat("foo"));
+  {
+    grpc::ClientContext ctx;
+    RecordEventsResponse events_resp;
+    auto writer = stub_->RecordEventStream(&ctx, &events_resp);
+    for (int batch = 0; batch < 3; ++batch) {
+      RecordEventsRequest events_req;
+      events_req.set_user_id("jack");
+      for (int i = 0; i < 2; ++i) {
+        Event* event = events_req.add_events();
+        event->set_stat_id(foo_id);
+        event->mutable_start_time()->set_seconds(100 - batch * 10 - i);
+      }
+      ASSERT_TRUE(writer->Write(events_req));
+    }
+    ASSERT_TRUE(writer->WritesDone());
+    ASSERT_GRPC_OK(writer->Finish());
+    EXPECT_THAT(events_resp.results(), SizeIs(6));
+  }
+
+  StreamEventsRequest stream_req;
+  stream_req.set_user_id("jack");
+  stream_req.add_stat_id(foo_id);
+  *stream_req.mutable_duration() = ToProtoDuration(absl::InfiniteDuration());
+  stream_req.set_page_size(4);
+  grpc::ClientContext ctx;
+  auto reader = stub_->StreamEvents(&ctx, stream_req);
+  std::vector<int64_t> start_seconds;
+  std::vector<std::string> cursors;
+  StreamEventsResponse page;
+  while (reader->Read(&page)) {
+    for (const auto& streamed : page.events()) {
+      start_seconds.push_back(streamed.event().start_time().seconds());
+    }
+    cursors.push_back(page.next_cursor());
+    if (cursors.size() == 1) {
+      // Recorded after the stream's snapshot, so not streamed.
+      RecordEventRequest event_req;
+      event_req.set_user_id("jack");
+      event_req.mutable_event()->set_stat_id(foo_id);
+      event_req.mutable_event()->mutable_start_time()->set_seconds(95);
+      ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+    }
+  }
+  ASSERT_GRPC_OK(reader->Finish());
+  EXPECT_THAT(start_seconds, ElementsAre(79, 80, 89, 90, 99, 100));
+  ASSERT_THAT(cursors, SizeIs(2));
+  EXPECT_FALSE(cursors[0].empty());
+  EXPECT_TRUE(cursors[1].empty());
+}
+
+TEST_F(AsyncStatServerTest, ShutdownIsIdempotent) {
+  ASSERT_GRPC_OK(DefineStat("foo").status());
+  server_->Shutdown();
+  server_->Shutdown();
+  ReadStatsRequest req;
+  req.set_user_id("jack");
+  EXPECT_FALSE(Call(&StatService::Stub::ReadStats, req).ok());
+}
+
+}  // namespace
+}  // namespace stat_tracker
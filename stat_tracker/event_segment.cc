@@ -0,0 +1,128 @@
+#include "stat_tracker/event_segment.h"
+
+#include <algorithm>
+#include <limits>
+#include <tuple>
+
+#include "util/varint.h"
+
+namespace stat_tracker {
+
+namespace {
+
+// ToUnixNanos and ToInt64Nanoseconds saturate, so a lossless conversion is one
+// that converts back to the same value.
+bool ToNanos(absl::Time time_pt, int64_t* nanos) {
+  *nanos = absl::ToUnixNanos(time_pt);
+  return absl::FromUnixNanos(*nanos) == time_pt;
+}
+
+bool ToNanos(absl::Duration duration, int64_t* nanos) {
+  *nanos = absl::ToInt64Nanoseconds(duration);
+  return absl::Nanoseconds(*nanos) == duration;
+}
+
+}  // namespace
+
+bool EventSegmentBuilder::Add(uint64_t id, absl::Time start_time,
+                              absl::Duration duration,
+                              absl::string_view value) {
+  int64_t start_nanos, duration_nanos, end_nanos;
+  if (!ToNanos(start_time, &start_nanos) ||
+      !ToNanos(duration, &duration_nanos) ||
+      !ToNanos(start_time + duration, &end_nanos)) {
+    return false;
+  }
+  events_.push_back({start_nanos, duration_nanos, id,
+                     std::string(value.data(), value.size())});
+  return true;
+}
+
+void EventSegmentBuilder::Finish(std::string* header, std::string* columns) {
+  std::sort(events_.begin(), events_.end(),
+            [](const Event& lhs, const Event& rhs) {
+              return std::tie(lhs.start_nanos, lhs.id) <
+                     std::tie(rhs.start_nanos, rhs.id);
+            });
+
+  int64_t min_nanos = std::numeric_limits<int64_t>::max();
+  int64_t max_nanos = std::numeric_limits<int64_t>::min();
+  for (const Event& event : events_) {
+    const int64_t end_nanos = event.start_nanos + event.duration_nanos;
+    min_nanos = std::min({min_nanos, event.start_nanos, end_nanos});
+    max_nanos = std::max({max_nanos, event.start_nanos, end_nanos});
+  }
+  header->clear();
+  util::PutZigZag64(min_nanos, header);
+  util::PutZigZag64(max_nanos, header);
+  util::PutVarint64(events_.size(), header);
+
+  columns->clear();
+  util::PutVarint64(events_.size(), columns);
+  uint64_t prev_id = base_;
+  for (const Event& event : events_) {
+    util::PutZigZag64(event.id - prev_id, columns);
+    prev_id = event.id;
+  }
+  int64_t prev_start = 0;
+  for (const Event& event : events_) {
+    util::PutZigZag64(event.start_nanos - prev_start, columns);
+    prev_start = event.start_nanos;
+  }
+  for (const Event& event : events_) {
+    util::PutZigZag64(event.duration_nanos, columns);
+  }
+  for (const Event& event : events_) {
+    util::PutVarint64(event.value.size(), columns);
+  }
+  for (const Event& event : events_) {
+    columns->append(event.value);
+  }
+  events_.clear();
+}
+
+bool DecodeEventSegmentHeader(absl::string_view header,
+                              EventSegmentHeader* decoded) {
+  util::VarintReader reader(header);
+  decoded->min_time = absl::FromUnixNanos(reader.ZigZag());
+  decoded->max_time = absl::FromUnixNanos(reader.ZigZag());
+  decoded->num_events = reader.Varint();
+  return reader.ok() && reader.done();
+}
+
+bool DecodeEventSegment(uint64_t base, absl::string_view columns,
+                        std::vector<SegmentEvent>* events) {
+  util::VarintReader reader(columns);
+  const uint64_t num_events = reader.Varint();
+  // Every event takes at least four bytes, which bounds a corrupt count.
+  if (!reader.ok() || num_events > columns.size() / 4) return false;
+  const size_t first = events->size();
+  events->resize(first + num_events);
+  const auto column = [&](auto&& read) {
+    for (size_t i = first; i < events->size(); ++i) read(&(*events)[i]);
+  };
+
+  uint64_t id = base;
+  column([&](SegmentEvent* event) { event->id = id += reader.ZigZag(); });
+  int64_t start_nanos = 0;
+  column([&](SegmentEvent* event) {
+    start_nanos += reader.ZigZag();
+    event->start_time = absl::FromUnixNanos(start_nanos);
+  });
+  column([&](SegmentEvent* event) {
+    event->duration = absl::Nanoseconds(reader.ZigZag());
+  });
+  std::vector<uint64_t> sizes;
+  sizes.reserve(num_events);
+  for (uint64_t i = 0; i < num_events; ++i) sizes.push_back(reader.Varint());
+  auto size = sizes.begin();
+  column([&](SegmentEvent* event) { event->value = reader.Bytes(*size++); });
+
+  if (!reader.ok() || !reader.done()) {
+    events->resize(first);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace stat_tracker
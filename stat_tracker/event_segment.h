@@ -0,0 +1,85 @@
+#ifndef STAT_TRACKER_EVENT_SEGMENT_H_
+#define STAT_TRACKER_EVENT_SEGMENT_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "stat_tracker/posting_block.h"
+
+namespace stat_tracker {
+
+// Once every id in [b, b + kEventSegmentSpan) has been allocated, the events
+// of a stat in that range are sealed from their rows into an immutable event
+// segment with base b. A segment stores its events sorted by start time,
+// column by column, so a range read decodes a few contiguous values instead of
+// looking up one row per event:
+//
+//   header   zigzag min time, zigzag max time, count
+//   columns  count,
+//            count x zigzag event id delta (the first from b)
+//            count x zigzag start time delta (the first from 0)
+//            count x zigzag duration
+//            count x value size, then the values back to back
+//
+// All numbers are varints and times are nanoseconds since the epoch. The
+// header is a separate row so that a read can skip segments by scanning the
+// headers alone. Segments span whole posting blocks, so sealing a segment
+// empties the posting blocks of its events.
+constexpr uint64_t kEventSegmentSpan = 4 * kPostingBlockSpan;
+
+inline uint64_t EventSegmentBase(uint64_t event_id) {
+  return event_id - event_id % kEventSegmentSpan;
+}
+
+struct EventSegmentHeader {
+  // Bounds of the start and end times of every event in the segment.
+  absl::Time min_time;
+  absl::Time max_time;
+  uint64_t num_events;
+};
+
+struct SegmentEvent {
+  uint64_t id;
+  absl::Time start_time;
+  absl::Duration duration;
+  // A serialized google.protobuf.Any, empty if the event has no value. Points
+  // into the decoded columns.
+  absl::string_view value;
+};
+
+class EventSegmentBuilder {
+ public:
+  explicit EventSegmentBuilder(uint64_t base) : base_(base) {}
+
+  // Returns false, and adds nothing, if the times don't fit in nanoseconds.
+  bool Add(uint64_t id, absl::Time start_time, absl::Duration duration,
+           absl::string_view value);
+
+  bool empty() const { return events_.empty(); }
+
+  void Finish(std::string* header, std::string* columns);
+
+ private:
+  struct Event {
+    int64_t start_nanos;
+    int64_t duration_nanos;
+    uint64_t id;
+    std::string value;
+  };
+
+  uint64_t base_;
+  std::vector<Event> events_;
+};
+
+// Both return false if the input is malformed.
+bool DecodeEventSegmentHeader(absl::string_view header,
+                              EventSegmentHeader* decoded);
+bool DecodeEventSegment(uint64_t base, absl::string_view columns,
+                        std::vector<SegmentEvent>* events);
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_EVENT_SEGMENT_H_
@@ -0,0 +1,120 @@
+#include "stat_tracker/event_segment.h"
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace stat_tracker {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Lt;
+using ::testing::SizeIs;
+
+MATCHER_P4(SegmentEventIs, id, start_time, duration, value, "") {
+  return arg.id == static_cast<uint64_t>(id) && arg.start_time == start_time &&
+         arg.duration == duration && arg.value == value;
+}
+
+TEST(EventSegmentTest, Base) {
+  EXPECT_EQ(EventSegmentBase(kEventSegmentSpan - 1), 0);
+  EXPECT_EQ(EventSegmentBase(2 * kEventSegmentSpan + 5),
+            2 * kEventSegmentSpan);
+  EXPECT_EQ(kEventSegmentSpan % kPostingBlockSpan, 0);
+}
+
+TEST(EventSegmentTest, SortsByStartTime) {
+  const absl::Time epoch = absl::UnixEpoch();
+  EventSegmentBuilder builder(1024);
+  ASSERT_TRUE(builder.Add(1024, epoch + absl::Seconds(30), absl::Seconds(5),
+                          "first"));
+  ASSERT_TRUE(builder.Add(1030, epoch - absl::Seconds(10), absl::Seconds(50),
+                          ""));
+  ASSERT_TRUE(builder.Add(1027, epoch + absl::Seconds(20),
+                          absl::Milliseconds(1), "third"));
+  std::string header, columns;
+  builder.Finish(&header, &columns);
+  EXPECT_TRUE(builder.empty());
+
+  EventSegmentHeader decoded_header;
+  ASSERT_TRUE(DecodeEventSegmentHeader(header, &decoded_header));
+  EXPECT_EQ(decoded_header.min_time, epoch - absl::Seconds(10));
+  EXPECT_EQ(decoded_header.max_time, epoch + absl::Seconds(40));
+  EXPECT_EQ(decoded_header.num_events, 3);
+
+  std::vector<SegmentEvent> events;
+  ASSERT_TRUE(DecodeEventSegment(1024, columns, &events));
+  EXPECT_THAT(events,
+              ElementsAre(SegmentEventIs(1030, epoch - absl::Seconds(10),
+                                         absl::Seconds(50), ""),
+                          SegmentEventIs(1027, epoch + absl::Seconds(20),
+                                         absl::Milliseconds(1), "third"),
+                          SegmentEventIs(1024, epoch + absl::Seconds(30),
+                                         absl::Seconds(5), "first")));
+}
+
+TEST(EventSegmentTest, NegativeDuration) {
+  const absl::Time epoch = absl::UnixEpoch();
+  EventSegmentBuilder builder(0);
+  ASSERT_TRUE(builder.Add(3, epoch, absl::Seconds(-4), "x"));
+  std::string header, columns;
+  builder.Finish(&header, &columns);
+
+  EventSegmentHeader decoded_header;
+  ASSERT_TRUE(DecodeEventSegmentHeader(header, &decoded_header));
+  EXPECT_EQ(decoded_header.min_time, epoch - absl::Seconds(4));
+  EXPECT_EQ(decoded_header.max_time, epoch);
+  std::vector<SegmentEvent> events;
+  ASSERT_TRUE(DecodeEventSegment(0, columns, &events));
+  EXPECT_THAT(events, ElementsAre(SegmentEventIs(3, epoch, absl::Seconds(-4),
+                                                 "x")));
+}
+
+TEST(EventSegmentTest, RejectsTimesBeyondNanoseconds) {
+  EventSegmentBuilder builder(0);
+  EXPECT_FALSE(builder.Add(1, absl::InfiniteFuture(), absl::ZeroDuration(),
+                           ""));
+  EXPECT_FALSE(builder.Add(2, absl::UnixEpoch() + absl::Hours(24 * 365 * 300),
+                           absl::ZeroDuration(), ""));
+  EXPECT_FALSE(builder.Add(3, absl::UnixEpoch(), absl::Hours(24 * 365 * 300),
+                           ""));
+  EXPECT_TRUE(builder.empty());
+}
+
+TEST(EventSegmentTest, RegularEventsAreCompact) {
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  EventSegmentBuilder builder(0);
+  for (uint64_t id = 0; id < kEventSegmentSpan; ++id) {
+    ASSERT_TRUE(builder.Add(id, start + id * absl::Seconds(1),
+                            absl::Milliseconds(100), ""));
+  }
+  std::string header, columns;
+  builder.Finish(&header, &columns);
+  // Per event: one byte of id delta, five of start delta, four of duration
+  // and one of value size.
+  EXPECT_THAT(columns, SizeIs(Lt(12 * kEventSegmentSpan)));
+  std::vector<SegmentEvent> events;
+  ASSERT_TRUE(DecodeEventSegment(0, columns, &events));
+  EXPECT_THAT(events, SizeIs(kEventSegmentSpan));
+  EXPECT_EQ(events.back().start_time,
+            start + (kEventSegmentSpan - 1) * absl::Seconds(1));
+}
+
+TEST(EventSegmentTest, Malformed) {
+  EventSegmentBuilder builder(0);
+  ASSERT_TRUE(builder.Add(1, absl::UnixEpoch(), absl::Seconds(1), "value"));
+  std::string header, columns;
+  builder.Finish(&header, &columns);
+
+  std::vector<SegmentEvent> events;
+  EXPECT_FALSE(
+      DecodeEventSegment(0, columns.substr(0, columns.size() - 1), &events));
+  EXPECT_FALSE(DecodeEventSegment(0, columns + "x", &events));
+  EXPECT_FALSE(DecodeEventSegment(0, "\xff\xff\x03", &events));
+  EXPECT_THAT(events, IsEmpty());
+  EventSegmentHeader decoded_header;
+  EXPECT_FALSE(DecodeEventSegmentHeader(header.substr(1), &decoded_header));
+}
+
+}  // namespace
+}  // namespace stat_tracker
@@ -0,0 +1,71 @@
+#include "stat_tracker/id_allocator.h"
+
+#include <algorithm>
+
+#include "absl/hash/hash.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "google/protobuf/wrappers.pb.h"
+#include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+
+namespace stat_tracker {
+
+constexpr uint64_t IdAllocator::kDefaultBlockSize;
+constexpr size_t IdAllocator::kNumShards;
+
+IdAllocator::Shard& IdAllocator::ShardFor(const std::string& key) {
+  return shards_[absl::Hash<std::string>()(key) % kNumShards];
+}
+
+util::StatusOr<leveldb::Status, IdAllocator::Counter*> IdAllocator::Load(
+    const std::string& key, Shard* shard) {
+  auto it = shard->counters.find(key);
+  if (it != shard->counters.end()) return &it->second;
+
+  std::string value_bytes;
+  const leveldb::Status status =
+      storage_->Get(leveldb::ReadOptions(), key, &value_bytes);
+  google::protobuf::UInt64Value mark;
+  if (status.ok() && !mark.ParseFromString(value_bytes)) {
+    return leveldb::Status::Corruption(
+        absl::StrCat("key ", absl::CHexEscape(key), " not parseable."));
+  }
+  if (!status.ok() && !status.IsNotFound()) return status;
+  // Nothing past the mark is reserved by this process yet.
+  return &shard->counters.emplace(key, Counter{mark.value(), mark.value()})
+              .first->second;
+}
+
+util::StatusOr<leveldb::Status, uint64_t> IdAllocator::AllocateRange(
+    const Key& key, uint64_t count) {
+  Shard& shard = ShardFor(key);
+  absl::MutexLock l(&shard.mu);
+  ASSIGN_OR_RETURN(Counter* const counter, Load(key, &shard));
+  if (counter->reserved_end - counter->next < count) {
+    google::protobuf::UInt64Value mark;
+    mark.set_value(counter->next + std::max(count, block_size_));
+    leveldb::WriteBatch batch;
+    batch.Put(key, mark.SerializeAsString());
+    RETURN_IF_ERROR(storage_->Write(leveldb::WriteOptions(), &batch));
+    counter->reserved_end = mark.value();
+  }
+  const uint64_t first = counter->next;
+  counter->next += count;
+  return first;
+}
+
+util::StatusOr<leveldb::Status, uint64_t> IdAllocator::Peek(const Key& key) {
+  Shard& shard = ShardFor(key);
+  absl::MutexLock l(&shard.mu);
+  ASSIGN_OR_RETURN(const Counter* const counter, Load(key, &shard));
+  return counter->next;
+}
+
+void IdAllocator::Forget(const Key& key) {
+  Shard& shard = ShardFor(key);
+  absl::MutexLock l(&shard.mu);
+  shard.counters.erase(static_cast<const std::string&>(key));
+}
+
+}  // namespace stat_tracker
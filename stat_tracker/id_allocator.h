@@ -0,0 +1,80 @@
+#ifndef STAT_TRACKER_ID_ALLOCATOR_H_
+#define STAT_TRACKER_ID_ALLOCATOR_H_
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "leveldb/status.h"
+#include "stat_tracker/key.h"
+#include "storage/storage.h"
+#include "util/status.h"
+
+namespace stat_tracker {
+
+// Hands out increasing ids from counters stored as UInt64Value rows, such as
+// the next stat and next event id of Key. Counters are cached in memory once
+// read, and instead of the next id a row holds a high-water mark: every id
+// below it may have been handed out. Ids are reserved `block_size` at a time,
+// so the row is written once per block and never read again while cached.
+// After a restart the ids between the last one handed out and the mark are
+// skipped, so ids stay unique but may have gaps. Rows holding an exact next
+// id, as written before this class, are valid marks.
+class IdAllocator {
+ public:
+  static constexpr uint64_t kDefaultBlockSize = 1000;
+
+  explicit IdAllocator(std::shared_ptr<storage::StorageInterface> storage,
+                       uint64_t block_size = kDefaultBlockSize)
+      : storage_(std::move(storage)), block_size_(block_size) {}
+
+  // Returns the next id of the counter at `key`, starting from 0. Writes a new
+  // mark when the reserved block is used up.
+  util::StatusOr<leveldb::Status, uint64_t> Allocate(const Key& key) {
+    return AllocateRange(key, 1);
+  }
+
+  // Allocates `count` consecutive ids and returns the first one. Writes at
+  // most one new mark.
+  util::StatusOr<leveldb::Status, uint64_t> AllocateRange(const Key& key,
+                                                          uint64_t count);
+
+  // Returns the id that Allocate would return next. Every id below it has
+  // been handed out or skipped.
+  util::StatusOr<leveldb::Status, uint64_t> Peek(const Key& key);
+
+  // Drops the cached counter of `key`. Must be called after its row is
+  // deleted, before the counter is used again.
+  void Forget(const Key& key);
+
+ private:
+  struct Counter {
+    uint64_t next;
+    uint64_t reserved_end;
+  };
+
+  // Counters are spread over shards so that allocations for different users
+  // rarely wait for each other, even while one of them writes a mark.
+  struct Shard {
+    absl::Mutex mu;
+    absl::flat_hash_map<std::string, Counter> counters;
+  };
+  static constexpr size_t kNumShards = 16;
+
+  Shard& ShardFor(const std::string& key);
+  // Returns the cached counter of `key`, reading it if it isn't cached yet.
+  // `shard` must be locked.
+  util::StatusOr<leveldb::Status, Counter*> Load(const std::string& key,
+                                                 Shard* shard);
+
+  std::shared_ptr<storage::StorageInterface> storage_;
+  const uint64_t block_size_;
+  std::array<Shard, kNumShards> shards_;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_ID_ALLOCATOR_H_
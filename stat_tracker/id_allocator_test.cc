@@ -0,0 +1,114 @@
+#include "stat_tracker/id_allocator.h"
+
+#include <string>
+
+#include "google/protobuf/wrappers.pb.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "stat_tracker/key.h"
+#include "storage/testing/leveldb.h"
+#include "util/status_test_macros.h"
+
+namespace stat_tracker {
+namespace {
+
+class IdAllocatorTest : public ::testing::Test {
+ protected:
+  IdAllocatorTest() : leveldb_env_("id_allocator_test.leveldb") {}
+
+  util::StatusOr<leveldb::Status, uint64_t> StoredMark(const Key& key) {
+    ASSIGN_OR_RETURN(const std::string value_bytes, leveldb_env_.Get(key));
+    google::protobuf::UInt64Value mark;
+    if (!mark.ParseFromString(value_bytes)) {
+      return leveldb::Status::Corruption("mark not parseable");
+    }
+    return mark.value();
+  }
+
+  storage::LevelDbTestEnvironment leveldb_env_;
+};
+
+TEST_F(IdAllocatorTest, AllocatesSequentiallyPerKey) {
+  IdAllocator ids(leveldb_env_.db());
+  for (uint64_t expected = 0; expected < 3; ++expected) {
+    ASSERT_OK_AND_ASSIGN(const uint64_t id, ids.Allocate(Key::NextStatId(7)));
+    EXPECT_EQ(id, expected);
+  }
+  ASSERT_OK_AND_ASSIGN(const uint64_t other, ids.Allocate(Key::NextStatId(8)));
+  EXPECT_EQ(other, 0);
+  ASSERT_OK_AND_ASSIGN(const uint64_t next, ids.Peek(Key::NextStatId(7)));
+  EXPECT_EQ(next, 3);
+}
+
+TEST_F(IdAllocatorTest, PersistsOneMarkPerBlock) {
+  IdAllocator ids(leveldb_env_.db(), /*block_size=*/10);
+  const Key key = Key::NextStatId(7);
+  ASSERT_OK(ids.Allocate(key).status());
+  ASSERT_OK_AND_ASSIGN(uint64_t mark, StoredMark(key));
+  EXPECT_EQ(mark, 10);
+
+  // The mark isn't read back while cached, so changing it has no effect until
+  // the block is used up.
+  ASSERT_OK(leveldb_env_.Put(key, "garbage"));
+  for (int i = 1; i < 10; ++i) ASSERT_OK(ids.Allocate(key).status());
+  ASSERT_OK_AND_ASSIGN(const uint64_t id, ids.Allocate(key));
+  EXPECT_EQ(id, 10);
+  ASSERT_OK_AND_ASSIGN(mark, StoredMark(key));
+  EXPECT_EQ(mark, 20);
+}
+
+TEST_F(IdAllocatorTest, RangesLargerThanABlock) {
+  IdAllocator ids(leveldb_env_.db(), /*block_size=*/10);
+  const Key key = Key::NextEventId(7, 3);
+  ASSERT_OK_AND_ASSIGN(const uint64_t first, ids.AllocateRange(key, 8));
+  EXPECT_EQ(first, 0);
+  ASSERT_OK_AND_ASSIGN(const uint64_t second, ids.AllocateRange(key, 25));
+  EXPECT_EQ(second, 8);
+  ASSERT_OK_AND_ASSIGN(const uint64_t mark, StoredMark(key));
+  EXPECT_EQ(mark, 33);
+  ASSERT_OK_AND_ASSIGN(const uint64_t next, ids.Allocate(key));
+  EXPECT_EQ(next, 33);
+}
+
+TEST_F(IdAllocatorTest, RestartSkipsReservedIds) {
+  const Key key = Key::NextEventId(7, 3);
+  {
+    IdAllocator ids(leveldb_env_.db(), /*block_size=*/10);
+    for (int i = 0; i < 4; ++i) ASSERT_OK(ids.Allocate(key).status());
+  }
+  IdAllocator ids(leveldb_env_.db(), /*block_size=*/10);
+  ASSERT_OK_AND_ASSIGN(const uint64_t next, ids.Peek(key));
+  EXPECT_EQ(next, 10);
+  ASSERT_OK_AND_ASSIGN(const uint64_t id, ids.Allocate(key));
+  EXPECT_EQ(id, 10);
+}
+
+TEST_F(IdAllocatorTest, ContinuesFromExactNextId) {
+  const Key key = Key::NextEventId(7, 3);
+  google::protobuf::UInt64Value next_id;
+  next_id.set_value(13);
+  ASSERT_OK(leveldb_env_.Put(key, next_id.SerializeAsString()));
+  IdAllocator ids(leveldb_env_.db());
+  ASSERT_OK_AND_ASSIGN(const uint64_t id, ids.Allocate(key));
+  EXPECT_EQ(id, 13);
+}
+
+TEST_F(IdAllocatorTest, ForgetRereadsTheMark) {
+  const Key key = Key::NextEventId(7, 3);
+  IdAllocator ids(leveldb_env_.db());
+  ASSERT_OK(ids.Allocate(key).status());
+  ASSERT_OK(leveldb_env_.Delete(key));
+  ids.Forget(key);
+  ASSERT_OK_AND_ASSIGN(const uint64_t id, ids.Allocate(key));
+  EXPECT_EQ(id, 0);
+}
+
+TEST_F(IdAllocatorTest, CorruptMark) {
+  const Key key = Key::NextStatId(7);
+  ASSERT_OK(leveldb_env_.Put(key, "\xff"));
+  IdAllocator ids(leveldb_env_.db());
+  EXPECT_TRUE(ids.Allocate(key).status().IsCorruption());
+}
+
+}  // namespace
+}  // namespace stat_tracker
@@ -0,0 +1,148 @@
+#include "stat_tracker/index_cache.h"
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "glog/logging.h"
+#include "util/status.h"
+
+namespace stat_tracker {
+
+leveldb::Status IndexCache::Load(storage::StorageInterface* storage,
+                                 const leveldb::ReadOptions& options,
+                                 uint64_t user, uint64_t stat_id,
+                                 StatIndex* index) {
+  const Key prefix = Key::StatIndexPrefix(user, stat_id);
+  std::vector<uint64_t> ids;
+  auto it = storage->NewIterator(options);
+  for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+       it->Next()) {
+    const absl::string_view key(it->key().data(), it->key().size());
+    uint64_t block_user, block_stat_id, base;
+    IndexToken token;
+    ids.clear();
+    if (!Key::ParsePostingBlock(key, &block_user, &block_stat_id, &token,
+                                &base) ||
+        !DecodePostingBlock(
+            base, absl::string_view(it->value().data(), it->value().size()),
+            &ids)) {
+      return leveldb::Status::Corruption(absl::StrCat(
+          "posting block ", absl::CHexEscape(key), " not parseable."));
+    }
+    const TimeRangeToken time_token(token.level, token.index);
+    InMemoryIndex* kind_index = index->ForKind(token.kind);
+    for (uint64_t id : ids) kind_index->AddItem(id, {time_token});
+  }
+  return it->status();
+}
+
+leveldb::Status IndexCache::Query(storage::StorageInterface* storage,
+                                  const leveldb::ReadOptions& options,
+                                  uint64_t user, uint64_t stat_id,
+                                  absl::Span<const IndexToken> tokens,
+                                  std::vector<uint64_t>* ids) {
+  const StatKey key(user, stat_id);
+  std::shared_ptr<StatIndex> index = Lookup(key);
+  if (index == nullptr) {
+    index = std::make_shared<StatIndex>();
+    RETURN_IF_ERROR(Load(storage, options, user, stat_id, index.get()));
+    Insert(key, index);
+  }
+
+  std::vector<TimeRangeToken> points, ranges;
+  for (const IndexToken& token : tokens) {
+    (token.kind == TokenKind::kPoint ? points : ranges)
+        .emplace_back(token.level, token.index);
+  }
+  util::RoaringBitmap hits = index->points.QueryUnion(points);
+  hits |= index->ranges.QueryUnion(ranges);
+  *ids = hits.ToVector();
+  return leveldb::Status::OK();
+}
+
+void IndexCache::Apply(absl::Span<const PostingEdit> edits) {
+  absl::MutexLock lock(&mu_);
+  const auto update_bytes = [this](Entry* entry) {
+    bytes_ -= entry->bytes;
+    entry->bytes = entry->index->MemoryUsage();
+    bytes_ += entry->bytes;
+  };
+  // Edits come in runs of the same stat.
+  StatKey key;
+  Entry* entry = nullptr;
+  for (size_t i = 0; i < edits.size(); ++i) {
+    const PostingEdit& edit = edits[i];
+    if (i == 0 || key != StatKey(edit.user, edit.stat_id)) {
+      if (entry != nullptr) update_bytes(entry);
+      key = StatKey(edit.user, edit.stat_id);
+      auto it = entries_.find(key);
+      entry = it == entries_.end() ? nullptr : &it->second;
+    }
+    if (entry == nullptr) continue;
+    const TimeRangeToken token(edit.token.level, edit.token.index);
+    InMemoryIndex* index = entry->index->ForKind(edit.token.kind);
+    if (edit.added) {
+      index->AddItem(edit.event_id, {token});
+    } else {
+      index->RemoveItem(edit.event_id, {token});
+    }
+  }
+  if (entry != nullptr) update_bytes(entry);
+  EvictToBudget();
+}
+
+void IndexCache::Forget(uint64_t user, uint64_t stat_id) {
+  absl::MutexLock lock(&mu_);
+  auto it = entries_.find(StatKey(user, stat_id));
+  if (it != entries_.end()) Erase(it);
+}
+
+void IndexCache::Clear() {
+  absl::MutexLock lock(&mu_);
+  entries_.clear();
+  lru_.clear();
+  bytes_ = 0;
+}
+
+size_t IndexCache::MemoryUsage() const {
+  absl::MutexLock lock(&mu_);
+  return bytes_;
+}
+
+std::shared_ptr<IndexCache::StatIndex> IndexCache::Lookup(
+    const StatKey& key) {
+  absl::MutexLock lock(&mu_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+  return it->second.index;
+}
+
+void IndexCache::Insert(const StatKey& key, std::shared_ptr<StatIndex> index) {
+  const size_t bytes = index->MemoryUsage();
+  if (bytes > max_bytes_) {
+    VLOG(1) << "index of user " << key.first << " stat " << key.second
+            << " takes " << bytes << " bytes, over the cache's budget";
+    return;
+  }
+  absl::MutexLock lock(&mu_);
+  // Another query may have loaded it meanwhile.
+  if (entries_.find(key) != entries_.end()) return;
+  lru_.push_front(key);
+  entries_.emplace(key, Entry{std::move(index), bytes, lru_.begin()});
+  bytes_ += bytes;
+  EvictToBudget();
+}
+
+void IndexCache::Erase(absl::flat_hash_map<StatKey, Entry>::iterator it) {
+  bytes_ -= it->second.bytes;
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+}
+
+void IndexCache::EvictToBudget() {
+  while (bytes_ > max_bytes_ && !lru_.empty()) {
+    Erase(entries_.find(lru_.back()));
+  }
+}
+
+}  // namespace stat_tracker
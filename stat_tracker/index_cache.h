@@ -0,0 +1,92 @@
+#ifndef STAT_TRACKER_INDEX_CACHE_H_
+#define STAT_TRACKER_INDEX_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "leveldb/options.h"
+#include "leveldb/status.h"
+#include "stat_tracker/key.h"
+#include "stat_tracker/posting_block.h"
+#include "stat_tracker/time_index.h"
+#include "storage/storage.h"
+
+namespace stat_tracker {
+
+// Keeps the index of recently read stats in memory, loaded from their posting
+// blocks on first use and evicted least recently used first once the cached
+// indexes take up more than a budget. Callers keep it current by applying the
+// edits of every write that changes an index, once the write has succeeded,
+// and must keep those writes from overlapping reads of the same stat.
+class IndexCache {
+ public:
+  explicit IndexCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // Like ReadPostings, but from the cached index of the stat, which is loaded
+  // with `options` if it isn't cached.
+  leveldb::Status Query(storage::StorageInterface* storage,
+                        const leveldb::ReadOptions& options, uint64_t user,
+                        uint64_t stat_id, absl::Span<const IndexToken> tokens,
+                        std::vector<uint64_t>* ids);
+
+  // Applies edits already written to storage to the cached indexes. Edits of
+  // stats that aren't cached are dropped; they'll be read when loaded.
+  void Apply(absl::Span<const PostingEdit> edits);
+
+  void Forget(uint64_t user, uint64_t stat_id);
+  void Clear();
+
+  // Approximate heap bytes held by the cached indexes.
+  size_t MemoryUsage() const;
+
+ private:
+  // A stat's hits, split by token kind since TimeRangeToken has no kind.
+  struct StatIndex {
+    InMemoryIndex points;
+    InMemoryIndex ranges;
+
+    InMemoryIndex* ForKind(TokenKind kind) {
+      return kind == TokenKind::kPoint ? &points : &ranges;
+    }
+    size_t MemoryUsage() const {
+      return points.MemoryUsage() + ranges.MemoryUsage();
+    }
+  };
+  using StatKey = std::pair<uint64_t, uint64_t>;
+  struct Entry {
+    // Shared so that eviction doesn't pull it from under a running query.
+    std::shared_ptr<StatIndex> index;
+    size_t bytes;
+    std::list<StatKey>::iterator lru_position;
+  };
+
+  static leveldb::Status Load(storage::StorageInterface* storage,
+                              const leveldb::ReadOptions& options,
+                              uint64_t user, uint64_t stat_id,
+                              StatIndex* index);
+
+  // The cached index of the stat, marked as most recently used, or null.
+  std::shared_ptr<StatIndex> Lookup(const StatKey& key);
+  void Insert(const StatKey& key, std::shared_ptr<StatIndex> index);
+  void Erase(absl::flat_hash_map<StatKey, Entry>::iterator it);
+  void EvictToBudget();
+
+  const size_t max_bytes_;
+
+  mutable absl::Mutex mu_;
+  absl::flat_hash_map<StatKey, Entry> entries_;
+  // Most recently used first.
+  std::list<StatKey> lru_;
+  size_t bytes_ = 0;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_INDEX_CACHE_H_
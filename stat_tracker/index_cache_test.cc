@@ -0,0 +1,124 @@
+#include "stat_tracker/index_cache.h"
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "leveldb/write_batch.h"
+#include "storage/testing/leveldb.h"
+#include "util/status_test_macros.h"
+
+namespace stat_tracker {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+constexpr IndexToken kPoint = {TokenKind::kPoint, 0, -3};
+constexpr IndexToken kRange = {TokenKind::kRange, 0, -3};
+constexpr IndexToken kOther = {TokenKind::kPoint, 2, 9};
+
+class IndexCacheTest : public ::testing::Test {
+ protected:
+  IndexCacheTest() : leveldb_env_("index_cache_test.leveldb") {}
+
+  // Writes the writer's edits, then applies them to `cache`.
+  leveldb::Status Write(PostingBlockWriter* writer, IndexCache* cache) {
+    leveldb::WriteBatch batch;
+    writer->Flush(&batch);
+    RETURN_IF_ERROR(
+        leveldb_env_.db()->Write(leveldb::WriteOptions(), &batch));
+    cache->Apply(writer->edits());
+    return leveldb::Status::OK();
+  }
+
+  std::vector<uint64_t> Query(IndexCache* cache, uint64_t stat_id,
+                              absl::Span<const IndexToken> tokens) {
+    std::vector<uint64_t> ids;
+    EXPECT_OK(cache->Query(leveldb_env_.db().get(), leveldb::ReadOptions(), 1,
+                           stat_id, tokens, &ids));
+    return ids;
+  }
+
+  storage::LevelDbTestEnvironment leveldb_env_;
+};
+
+TEST_F(IndexCacheTest, LoadsThenFollowsEdits) {
+  IndexCache cache(1 << 20);
+  PostingBlockWriter writer(leveldb_env_.db().get(), /*track_edits=*/true);
+  ASSERT_OK(writer.Add(1, 2, kPoint, 5));
+  ASSERT_OK(writer.Add(1, 2, kRange, 7));
+  ASSERT_OK(writer.Add(1, 2, kOther, kPostingBlockSpan + 1));
+  ASSERT_OK(writer.Add(1, 3, kPoint, 6));
+  ASSERT_OK(Write(&writer, &cache));
+  EXPECT_EQ(cache.MemoryUsage(), 0);
+
+  // Tokens of the same time but another kind don't match.
+  EXPECT_THAT(Query(&cache, 2, {kPoint}), ElementsAre(5));
+  EXPECT_THAT(Query(&cache, 2, {kRange, kOther}),
+              ElementsAre(7, kPostingBlockSpan + 1));
+  EXPECT_GT(cache.MemoryUsage(), 0);
+
+  PostingBlockWriter edits(leveldb_env_.db().get(), /*track_edits=*/true);
+  ASSERT_OK(edits.Remove(1, 2, kPoint, 5));
+  ASSERT_OK(edits.Add(1, 2, kPoint, 8));
+  ASSERT_OK(edits.Add(1, 3, kPoint, 9));
+  ASSERT_OK(Write(&edits, &cache));
+  EXPECT_THAT(Query(&cache, 2, {kPoint}), ElementsAre(8));
+  EXPECT_THAT(Query(&cache, 3, {kPoint}), ElementsAre(6, 9));
+
+  std::vector<uint64_t> ids;
+  ASSERT_OK(ReadPostings(leveldb_env_.db().get(), leveldb::ReadOptions(), 1, 2,
+                         {kPoint}, &ids));
+  EXPECT_THAT(ids, ElementsAre(8));
+}
+
+TEST_F(IndexCacheTest, EvictsLeastRecentlyUsed) {
+  PostingBlockWriter writer(leveldb_env_.db().get());
+  for (uint64_t stat_id = 1; stat_id <= 3; ++stat_id) {
+    for (uint64_t event_id = 0; event_id < 100; ++event_id) {
+      ASSERT_OK(writer.Add(1, stat_id, kPoint, event_id * stat_id));
+    }
+  }
+  IndexCache measure(1 << 20);
+  ASSERT_OK(Write(&writer, &measure));
+  Query(&measure, 1, {kPoint});
+  const size_t one_stat = measure.MemoryUsage();
+
+  // Room for two stats' indexes.
+  IndexCache cache(2 * one_stat + one_stat / 2);
+  Query(&cache, 1, {kPoint});
+  Query(&cache, 2, {kPoint});
+  Query(&cache, 1, {kPoint});
+  Query(&cache, 3, {kPoint});
+  EXPECT_LE(cache.MemoryUsage(), 2 * one_stat + one_stat / 2);
+
+  // Edits not applied to the cache show only in the evicted stat, which is
+  // reloaded.
+  PostingBlockWriter unapplied(leveldb_env_.db().get());
+  for (uint64_t stat_id = 1; stat_id <= 3; ++stat_id) {
+    ASSERT_OK(unapplied.Add(1, stat_id, kOther, 1000));
+  }
+  leveldb::WriteBatch batch;
+  unapplied.Flush(&batch);
+  ASSERT_OK(leveldb_env_.db()->Write(leveldb::WriteOptions(), &batch));
+  EXPECT_THAT(Query(&cache, 1, {kOther}), IsEmpty());
+  EXPECT_THAT(Query(&cache, 3, {kOther}), IsEmpty());
+  EXPECT_THAT(Query(&cache, 2, {kOther}), ElementsAre(1000));
+
+  cache.Forget(1, 2);
+  cache.Forget(1, 3);
+  cache.Forget(1, 1);
+  EXPECT_EQ(cache.MemoryUsage(), 0);
+}
+
+TEST_F(IndexCacheTest, IndexOverBudgetIsNotCached) {
+  PostingBlockWriter writer(leveldb_env_.db().get());
+  ASSERT_OK(writer.Add(1, 2, kPoint, 5));
+  IndexCache cache(0);
+  ASSERT_OK(Write(&writer, &cache));
+  EXPECT_THAT(Query(&cache, 2, {kPoint}), ElementsAre(5));
+  EXPECT_THAT(Query(&cache, 2, {kOther}), IsEmpty());
+  EXPECT_EQ(cache.MemoryUsage(), 0);
+}
+
+}  // namespace
+}  // namespace stat_tracker
@@ -1,64 +1,441 @@
 #include "stat_tracker/key.h"
 
-#include "absl/strings/str_cat.h"
-#include "absl/strings/str_split.h"
+#include <algorithm>
+
+#include "absl/strings/strip.h"
 
 namespace stat_tracker {
 
-Key Key::UserStatsPrefix(absl::string_view user_id) {
-  return Key(absl::StrCat(user_id, " SD:"));
+namespace {
+
+constexpr char kGlobalNamespace = '\x00';
+constexpr char kUserNamespace = '\x01';
+constexpr char kLegacyNamespace = '\x02';
+
+constexpr char kNextIdTag = 'N';
+constexpr char kUserIdTag = 'U';
+constexpr char kRetainedStatTag = 'R';
+constexpr char kDeletedStatTag = 'X';
+constexpr char kGranularitiesTag = 'T';
+constexpr char kStatTag = 'D';
+constexpr char kStatEventsTag = 'E';
+constexpr char kEventTag = 'e';
+constexpr char kStatIndexTag = 'I';
+constexpr char kStatSegmentsTag = 'G';
+constexpr char kSegmentHeaderTag = 'h';
+constexpr char kSegmentColumnsTag = 'c';
+constexpr char kStatStartsTag = 'S';
+constexpr char kStatRollupsTag = 'A';
+constexpr char kStatSketchesTag = 'Q';
+
+constexpr size_t kFixed64Size = 8;
+constexpr size_t kIndexTokenSize = 2 + kFixed64Size;
+constexpr size_t kFixed32Size = 4;
+constexpr int64_t kNanosPerSecond = 1000000000;
+
+void PutFixed64(uint64_t value, std::string* dst) {
+  char buf[kFixed64Size];
+  for (int i = kFixed64Size - 1; i >= 0; --i) {
+    buf[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+  dst->append(buf, kFixed64Size);
+}
+
+// Flipping the sign bit makes big-endian two's complement sort numerically.
+uint64_t ToOrderedUint64(int64_t value) {
+  return static_cast<uint64_t>(value) ^ (uint64_t{1} << 63);
+}
+
+int64_t FromOrderedUint64(uint64_t value) {
+  return static_cast<int64_t>(value ^ (uint64_t{1} << 63));
+}
+
+void PutFixed32(uint32_t value, std::string* dst) {
+  char buf[kFixed32Size];
+  for (int i = kFixed32Size - 1; i >= 0; --i) {
+    buf[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+  dst->append(buf, kFixed32Size);
+}
+
+bool ConsumeFixed32(absl::string_view* in, uint32_t* value) {
+  if (in->size() < kFixed32Size) return false;
+  uint32_t result = 0;
+  for (size_t i = 0; i < kFixed32Size; ++i) {
+    result = (result << 8) | static_cast<uint8_t>((*in)[i]);
+  }
+  in->remove_prefix(kFixed32Size);
+  *value = result;
+  return true;
+}
+
+bool ConsumeFixed64(absl::string_view* in, uint64_t* value) {
+  if (in->size() < kFixed64Size) return false;
+  uint64_t result = 0;
+  for (size_t i = 0; i < kFixed64Size; ++i) {
+    result = (result << 8) | static_cast<uint8_t>((*in)[i]);
+  }
+  in->remove_prefix(kFixed64Size);
+  *value = result;
+  return true;
+}
+
+bool ConsumeTag(absl::string_view* in, char tag) {
+  if (in->empty() || in->front() != tag) return false;
+  in->remove_prefix(1);
+  return true;
+}
+
+bool ConsumeUserTag(absl::string_view* in, uint64_t* user, char tag) {
+  return ConsumeTag(in, kUserNamespace) && ConsumeFixed64(in, user) &&
+         ConsumeTag(in, tag);
+}
+
+std::string UserPrefix(uint64_t user, char tag, size_t reserve) {
+  std::string data;
+  data.reserve(2 + kFixed64Size + reserve);
+  data.push_back(kUserNamespace);
+  PutFixed64(user, &data);
+  data.push_back(tag);
+  return data;
+}
+
+std::string StatPrefix(uint64_t user, char tag, uint64_t stat_id,
+                       size_t reserve) {
+  std::string data = UserPrefix(user, tag, kFixed64Size + reserve);
+  PutFixed64(stat_id, &data);
+  return data;
+}
+
+void PutIndexToken(const IndexToken& token, std::string* dst) {
+  dst->push_back(static_cast<char>(token.kind));
+  dst->push_back(static_cast<char>(token.level));
+  PutFixed64(ToOrderedUint64(token.index), dst);
+}
+
+bool ConsumeIndexToken(absl::string_view* in, IndexToken* token) {
+  if (in->size() < kIndexTokenSize) return false;
+  const char kind = (*in)[0];
+  if (kind != static_cast<char>(TokenKind::kPoint) &&
+      kind != static_cast<char>(TokenKind::kRange)) {
+    return false;
+  }
+  token->kind = static_cast<TokenKind>(kind);
+  token->level = static_cast<uint8_t>((*in)[1]);
+  in->remove_prefix(2);
+  uint64_t index;
+  ConsumeFixed64(in, &index);
+  token->index = FromOrderedUint64(index);
+  return true;
+}
+
+}  // namespace
+
+Key Key::NextUserId() {
+  return Key(std::string({kGlobalNamespace, kNextIdTag}));
+}
+
+Key Key::ForUserId(absl::string_view user_id) {
+  std::string data;
+  data.reserve(2 + user_id.size());
+  data.push_back(kGlobalNamespace);
+  data.push_back(kUserIdTag);
+  data.append(user_id.data(), user_id.size());
+  return Key(std::move(data));
+}
+
+Key Key::RetainedStatsPrefix() {
+  return Key(std::string({kGlobalNamespace, kRetainedStatTag}));
+}
+
+Key Key::ForRetainedStat(uint64_t user, uint64_t stat_id) {
+  std::string data;
+  data.reserve(2 + 2 * kFixed64Size);
+  data.push_back(kGlobalNamespace);
+  data.push_back(kRetainedStatTag);
+  PutFixed64(user, &data);
+  PutFixed64(stat_id, &data);
+  return Key(std::move(data));
+}
+
+bool Key::ParseRetainedStat(absl::string_view key, uint64_t* user,
+                            uint64_t* stat_id) {
+  return ConsumeTag(&key, kGlobalNamespace) &&
+         ConsumeTag(&key, kRetainedStatTag) && ConsumeFixed64(&key, user) &&
+         ConsumeFixed64(&key, stat_id) && key.empty();
+}
+
+Key Key::DeletedStatsPrefix() {
+  return Key(std::string({kGlobalNamespace, kDeletedStatTag}));
+}
+
+Key Key::ForDeletedStat(uint64_t user, uint64_t stat_id) {
+  std::string data;
+  data.reserve(2 + 2 * kFixed64Size);
+  data.push_back(kGlobalNamespace);
+  data.push_back(kDeletedStatTag);
+  PutFixed64(user, &data);
+  PutFixed64(stat_id, &data);
+  return Key(std::move(data));
 }
 
-Key Key::NextStatId(absl::string_view user_id) {
-  return Key(absl::StrCat(user_id, " next_stat"));
+bool Key::ParseDeletedStat(absl::string_view key, uint64_t* user,
+                           uint64_t* stat_id) {
+  return ConsumeTag(&key, kGlobalNamespace) &&
+         ConsumeTag(&key, kDeletedStatTag) && ConsumeFixed64(&key, user) &&
+         ConsumeFixed64(&key, stat_id) && key.empty();
 }
 
-Key Key::ForStat(absl::string_view user_id, absl::string_view stat_id) {
-  const std::string prefix = Key::UserStatsPrefix(user_id);
-  return Key(absl::StrCat(prefix, stat_id));
+Key Key::Granularities() {
+  return Key(std::string({kGlobalNamespace, kGranularitiesTag}));
 }
 
-bool Key::ParseStat(absl::string_view key, std::string* user_id,
-                    std::string* stat_id) {
-  std::pair<absl::string_view, absl::string_view> parts =
-      absl::StrSplit(key, absl::MaxSplits(" SD:", 1));
-  if (parts.first.empty() || parts.second.empty()) {
+Key Key::UserStatsPrefix(uint64_t user) {
+  return Key(UserPrefix(user, kStatTag, 0));
+}
+
+Key Key::NextStatId(uint64_t user) {
+  return Key(UserPrefix(user, kNextIdTag, 0));
+}
+
+Key Key::ForStat(uint64_t user, uint64_t stat_id) {
+  return Key(StatPrefix(user, kStatTag, stat_id, 0));
+}
+
+bool Key::ParseStat(absl::string_view key, uint64_t* user,
+                    uint64_t* stat_id) {
+  return ConsumeUserTag(&key, user, kStatTag) &&
+         ConsumeFixed64(&key, stat_id) && key.empty();
+}
+
+Key Key::StatEventsPrefix(uint64_t user, uint64_t stat_id) {
+  return Key(StatPrefix(user, kStatEventsTag, stat_id, 0));
+}
+
+Key Key::NextEventId(uint64_t user, uint64_t stat_id) {
+  std::string data = StatPrefix(user, kStatEventsTag, stat_id, 1);
+  data.push_back(kNextIdTag);
+  return Key(std::move(data));
+}
+
+Key Key::ForEvent(uint64_t user, uint64_t stat_id, uint64_t event_id) {
+  std::string data =
+      StatPrefix(user, kStatEventsTag, stat_id, 1 + kFixed64Size);
+  data.push_back(kEventTag);
+  PutFixed64(event_id, &data);
+  return Key(std::move(data));
+}
+
+bool Key::ParseEvent(absl::string_view key, uint64_t* user, uint64_t* stat_id,
+                     uint64_t* event_id) {
+  return ConsumeUserTag(&key, user, kStatEventsTag) &&
+         ConsumeFixed64(&key, stat_id) && ConsumeTag(&key, kEventTag) &&
+         ConsumeFixed64(&key, event_id) && key.empty();
+}
+
+Key Key::StatIndexPrefix(uint64_t user, uint64_t stat_id) {
+  return Key(StatPrefix(user, kStatIndexTag, stat_id, 0));
+}
+
+Key Key::IndexHitsPrefix(uint64_t user, uint64_t stat_id,
+                         const IndexToken& token) {
+  std::string data =
+      StatPrefix(user, kStatIndexTag, stat_id, kIndexTokenSize + kFixed64Size);
+  PutIndexToken(token, &data);
+  return Key(std::move(data));
+}
+
+Key Key::ForPostingBlock(uint64_t user, uint64_t stat_id,
+                         const IndexToken& token, uint64_t base) {
+  std::string data =
+      StatPrefix(user, kStatIndexTag, stat_id, kIndexTokenSize + kFixed64Size);
+  PutIndexToken(token, &data);
+  PutFixed64(base, &data);
+  return Key(std::move(data));
+}
+
+bool Key::ParsePostingBlock(absl::string_view key, uint64_t* user,
+                            uint64_t* stat_id, IndexToken* token,
+                            uint64_t* base) {
+  return ConsumeUserTag(&key, user, kStatIndexTag) &&
+         ConsumeFixed64(&key, stat_id) && ConsumeIndexToken(&key, token) &&
+         ConsumeFixed64(&key, base) && key.empty();
+}
+
+Key Key::StatSegmentsPrefix(uint64_t user, uint64_t stat_id) {
+  return Key(StatPrefix(user, kStatSegmentsTag, stat_id, 0));
+}
+
+Key Key::SegmentHeadersPrefix(uint64_t user, uint64_t stat_id) {
+  std::string data = StatPrefix(user, kStatSegmentsTag, stat_id, 1);
+  data.push_back(kSegmentHeaderTag);
+  return Key(std::move(data));
+}
+
+Key Key::ForSegmentHeader(uint64_t user, uint64_t stat_id, uint64_t base) {
+  std::string data =
+      StatPrefix(user, kStatSegmentsTag, stat_id, 1 + kFixed64Size);
+  data.push_back(kSegmentHeaderTag);
+  PutFixed64(base, &data);
+  return Key(std::move(data));
+}
+
+Key Key::ForSegmentColumns(uint64_t user, uint64_t stat_id, uint64_t base) {
+  std::string data =
+      StatPrefix(user, kStatSegmentsTag, stat_id, 1 + kFixed64Size);
+  data.push_back(kSegmentColumnsTag);
+  PutFixed64(base, &data);
+  return Key(std::move(data));
+}
+
+bool Key::ParseSegmentHeader(absl::string_view key, uint64_t* user,
+                             uint64_t* stat_id, uint64_t* base) {
+  return ConsumeUserTag(&key, user, kStatSegmentsTag) &&
+         ConsumeFixed64(&key, stat_id) && ConsumeTag(&key, kSegmentHeaderTag) &&
+         ConsumeFixed64(&key, base) && key.empty();
+}
+
+Key Key::StatStartsPrefix(uint64_t user, uint64_t stat_id) {
+  return Key(StatPrefix(user, kStatStartsTag, stat_id, 0));
+}
+
+// Times are floored to whole seconds plus nanoseconds, so that every time
+// proto Timestamps can hold, and the infinite ones, keep their order.
+Key Key::ForEventStart(uint64_t user, uint64_t stat_id, absl::Time start_time,
+                       uint64_t event_id) {
+  std::string data = StatPrefix(user, kStatStartsTag, stat_id,
+                                kFixed64Size + kFixed32Size + kFixed64Size);
+  const int64_t seconds = absl::ToUnixSeconds(start_time);
+  const int64_t nanos = absl::ToInt64Nanoseconds(
+      start_time - absl::FromUnixSeconds(seconds));
+  PutFixed64(ToOrderedUint64(seconds), &data);
+  PutFixed32(static_cast<uint32_t>(
+                 std::max<int64_t>(0, std::min(nanos, kNanosPerSecond - 1))),
+             &data);
+  PutFixed64(event_id, &data);
+  return Key(std::move(data));
+}
+
+bool Key::ParseEventStart(absl::string_view key, uint64_t* user,
+                          uint64_t* stat_id, absl::Time* start_time,
+                          uint64_t* event_id) {
+  uint64_t seconds;
+  uint32_t nanos;
+  if (!ConsumeUserTag(&key, user, kStatStartsTag) ||
+      !ConsumeFixed64(&key, stat_id) || !ConsumeFixed64(&key, &seconds) ||
+      !ConsumeFixed32(&key, &nanos) || !ConsumeFixed64(&key, event_id) ||
+      !key.empty()) {
     return false;
   }
-  *user_id = std::string(parts.first);
-  *stat_id = std::string(parts.second);
+  *start_time = absl::FromUnixSeconds(FromOrderedUint64(seconds)) +
+                absl::Nanoseconds(nanos);
   return true;
 }
 
-Key Key::StatEventsPrefix(absl::string_view user_id, absl::string_view stat_id) {
-  return Key(absl::StrCat(user_id, " S:", stat_id));
+Key Key::StatRollupsPrefix(uint64_t user, uint64_t stat_id) {
+  return Key(StatPrefix(user, kStatRollupsTag, stat_id, 0));
+}
+
+Key Key::ForRollup(uint64_t user, uint64_t stat_id, uint8_t level,
+                   int64_t index) {
+  std::string data =
+      StatPrefix(user, kStatRollupsTag, stat_id, 1 + kFixed64Size);
+  data.push_back(static_cast<char>(level));
+  PutFixed64(ToOrderedUint64(index), &data);
+  return Key(std::move(data));
 }
 
-Key Key::NextEventId(absl::string_view user_id, absl::string_view stat_id) {
-  const std::string prefix = Key::StatEventsPrefix(user_id, stat_id);
-  return Key(absl::StrCat(prefix, " next_event"));
+bool Key::ParseRollup(absl::string_view key, uint64_t* user,
+                      uint64_t* stat_id, uint8_t* level, int64_t* index) {
+  uint64_t ordered_index;
+  if (!ConsumeUserTag(&key, user, kStatRollupsTag) ||
+      !ConsumeFixed64(&key, stat_id) || key.empty()) {
+    return false;
+  }
+  *level = static_cast<uint8_t>(key.front());
+  key.remove_prefix(1);
+  if (!ConsumeFixed64(&key, &ordered_index) || !key.empty()) return false;
+  *index = FromOrderedUint64(ordered_index);
+  return true;
 }
 
-Key Key::ForEvent(absl::string_view user_id, absl::string_view stat_id,
-                  absl::string_view event_id) {
-  const std::string prefix = Key::StatEventsPrefix(user_id, stat_id);
-  return Key(absl::StrCat(prefix, " E:", event_id));
+Key Key::StatSketchesPrefix(uint64_t user, uint64_t stat_id) {
+  return Key(StatPrefix(user, kStatSketchesTag, stat_id, 0));
 }
 
-Key Key::StatIndexPrefix(absl::string_view user_id, absl::string_view stat_id) {
-  return Key(absl::StrCat(user_id, " IS:", stat_id));
+Key Key::ForSketches(uint64_t user, uint64_t stat_id, uint8_t level,
+                     int64_t index) {
+  std::string data =
+      StatPrefix(user, kStatSketchesTag, stat_id, 1 + kFixed64Size);
+  data.push_back(static_cast<char>(level));
+  PutFixed64(ToOrderedUint64(index), &data);
+  return Key(std::move(data));
 }
 
-Key Key::IndexHitsPrefix(absl::string_view user_id, absl::string_view stat_id,
-                         absl::string_view token_id) {
-  const std::string prefix = Key::StatIndexPrefix(user_id, stat_id);
-  return Key(absl::StrCat(prefix, " T:", token_id));
+bool Key::ParseSketches(absl::string_view key, uint64_t* user,
+                        uint64_t* stat_id, uint8_t* level, int64_t* index) {
+  uint64_t ordered_index;
+  if (!ConsumeUserTag(&key, user, kStatSketchesTag) ||
+      !ConsumeFixed64(&key, stat_id) || key.empty()) {
+    return false;
+  }
+  *level = static_cast<uint8_t>(key.front());
+  key.remove_prefix(1);
+  if (!ConsumeFixed64(&key, &ordered_index) || !key.empty()) return false;
+  *index = FromOrderedUint64(ordered_index);
+  return true;
 }
 
-Key Key::ForIndexHit(absl::string_view user_id, absl::string_view stat_id,
-                     absl::string_view token_id, absl::string_view event_id) {
-  const std::string prefix = Key::IndexHitsPrefix(user_id, stat_id, token_id);
-  return Key(absl::StrCat(prefix, " H:", event_id));
+Key Key::LegacyKeysBegin() { return Key(std::string(1, kLegacyNamespace)); }
+
+// Legacy user ids are everything up to the first space; user ids containing
+// spaces were already ambiguous in that schema.
+bool LegacyKey::Parse(absl::string_view key, LegacyKey* parsed) {
+  const size_t user_end = key.find(' ');
+  if (user_end == 0 || user_end == absl::string_view::npos) return false;
+  parsed->user_id = key.substr(0, user_end);
+  parsed->stat_id = absl::string_view();
+  parsed->event_id = absl::string_view();
+  absl::string_view rest = key.substr(user_end);
+
+  if (rest == " next_stat") {
+    parsed->type = Type::kNextStatId;
+    return true;
+  }
+  if (absl::ConsumePrefix(&rest, " SD:")) {
+    parsed->type = Type::kStat;
+    parsed->stat_id = rest;
+    return !rest.empty();
+  }
+  if (absl::ConsumePrefix(&rest, " S:")) {
+    const size_t stat_end = rest.find(' ');
+    if (stat_end == 0 || stat_end == absl::string_view::npos) return false;
+    parsed->stat_id = rest.substr(0, stat_end);
+    rest.remove_prefix(stat_end);
+    if (rest == " next_event") {
+      parsed->type = Type::kNextEventId;
+      return true;
+    }
+    parsed->type = Type::kEvent;
+    parsed->event_id = rest;
+    return absl::ConsumePrefix(&parsed->event_id, " E:") &&
+           !parsed->event_id.empty();
+  }
+  if (absl::ConsumePrefix(&rest, " IS:")) {
+    const size_t stat_end = rest.find(" T:");
+    const size_t event_start = rest.rfind(" H:");
+    if (stat_end == 0 || stat_end == absl::string_view::npos ||
+        event_start == absl::string_view::npos || event_start < stat_end) {
+      return false;
+    }
+    parsed->type = Type::kIndexHit;
+    parsed->stat_id = rest.substr(0, stat_end);
+    parsed->event_id = rest.substr(event_start + 3);
+    return true;
+  }
+  return false;
 }
 
 }  // namespace stat_tracker
@@ -1,6 +1,7 @@
 #ifndef STAT_TRACKER_KEY_H_
 #define STAT_TRACKER_KEY_H_
 
+#include <cstdint>
 #include <string>
 
 #include "absl/strings/string_view.h"
@@ -9,28 +10,131 @@
 
 namespace stat_tracker {
 
+// Keys are binary and order-preserving: numeric fields are fixed-width
+// big-endian, so leveldb's bytewise order is the numeric order. Users are
+// referred to by an interned 64-bit id rather than by their user_id string.
+//
+//   \x00 'N'                                    next interned user id
+//   \x00 'U' <user_id>                          interned id of user_id
+//   \x00 'R' <user:8> <stat:8>                  user_id of a stat with a
+//                                               retention policy
+//   \x00 'X' <user:8> <stat:8>                  user_id of a deleted stat
+//                                               whose rows aren't reaped yet
+//   \x00 'T'                                    granularity sets levels
+//                                               refer to
+//   \x01 <user:8> 'N'                           stat id high-water mark
+//   \x01 <user:8> 'D' <stat:8>                  Stat
+//   \x01 <user:8> 'E' <stat:8> 'N'              event id high-water mark
+//   \x01 <user:8> 'E' <stat:8> 'e' <event:8>    Event
+//   \x01 <user:8> 'I' <stat:8> <token:10> <base:8>
+//                                               posting block
+//   \x01 <user:8> 'G' <stat:8> 'h' <base:8>     event segment header
+//   \x01 <user:8> 'G' <stat:8> 'c' <base:8>     event segment columns
+//   \x01 <user:8> 'S' <stat:8> <seconds:8> <nanos:4> <event:8>
+//                                               event by start time
+//   \x01 <user:8> 'A' <stat:8> <level:1> <index:8>
+//                                               rollup of a time bucket
+//   \x01 <user:8> 'Q' <stat:8> <level:1> <index:8>
+//                                               quantile sketches of a bucket
+//
+// An index token is a kind byte, the granularity level (its position in the
+// tokenizer's granularity set) and the token index as a big-endian int64 with
+// the sign bit flipped, and so are the Unix seconds of a start time. The sets
+// levels refer to are kept in the 'T' row, so that a server configured with
+// other sets refuses the rows rather than misreading them. Start time rows
+// order a stat's events by (start time, id), and the event is wherever its id
+// says; they hold only its numeric value, if any. Posting blocks are
+// described in posting_block.h, event segments in event_segment.h, rollups in
+// rollup.h, quantile sketches in quantile_sketch.h, numeric values in
+// value_column.h and high-water marks in id_allocator.h.
+enum class TokenKind : char {
+  kPoint = 'p',
+  kRange = 'r',
+};
+
+struct IndexToken {
+  TokenKind kind;
+  uint8_t level;
+  int64_t index;
+};
+
 class Key {
  public:
-  static Key UserStatsPrefix(absl::string_view user_id);
-  static Key NextStatId(absl::string_view user_id);
-  static Key ForStat(absl::string_view user_id, absl::string_view stat_id);
-  static bool ParseStat(absl::string_view key, std::string* user_id,
-                        std::string* stat_id);
-
-  static Key StatEventsPrefix(absl::string_view user_id,
-                              absl::string_view stat_id);
-  static Key NextEventId(absl::string_view user_id, absl::string_view stat_id);
-  static Key ForEvent(absl::string_view user_id, absl::string_view stat_id,
-                      absl::string_view event_id);
-
-  static Key StatIndexPrefix(absl::string_view user_id,
-                             absl::string_view stat_id);
-  static Key IndexHitsPrefix(absl::string_view user_id,
-                             absl::string_view stat_id,
-                             absl::string_view token_id);
-  static Key ForIndexHit(absl::string_view user_id, absl::string_view stat_id,
-                         absl::string_view token_id,
-                         absl::string_view event_id);
+  static Key NextUserId();
+  static Key ForUserId(absl::string_view user_id);
+
+  // Stats with a retention policy, for expiry to find without a scan of
+  // every stat.
+  static Key RetainedStatsPrefix();
+  static Key ForRetainedStat(uint64_t user, uint64_t stat_id);
+  static bool ParseRetainedStat(absl::string_view key, uint64_t* user,
+                                uint64_t* stat_id);
+
+  // Tombstones of deleted stats, whose rows the reaper deletes in the
+  // background.
+  static Key DeletedStatsPrefix();
+  static Key ForDeletedStat(uint64_t user, uint64_t stat_id);
+  static bool ParseDeletedStat(absl::string_view key, uint64_t* user,
+                               uint64_t* stat_id);
+
+  // The index and sketched granularity sets that the levels in index, rollup
+  // and sketch keys are positions in.
+  static Key Granularities();
+
+  static Key UserStatsPrefix(uint64_t user);
+  static Key NextStatId(uint64_t user);
+  static Key ForStat(uint64_t user, uint64_t stat_id);
+  static bool ParseStat(absl::string_view key, uint64_t* user,
+                        uint64_t* stat_id);
+
+  static Key StatEventsPrefix(uint64_t user, uint64_t stat_id);
+  static Key NextEventId(uint64_t user, uint64_t stat_id);
+  static Key ForEvent(uint64_t user, uint64_t stat_id, uint64_t event_id);
+  static bool ParseEvent(absl::string_view key, uint64_t* user,
+                         uint64_t* stat_id, uint64_t* event_id);
+
+  static Key StatIndexPrefix(uint64_t user, uint64_t stat_id);
+  static Key IndexHitsPrefix(uint64_t user, uint64_t stat_id,
+                             const IndexToken& token);
+  static Key ForPostingBlock(uint64_t user, uint64_t stat_id,
+                             const IndexToken& token, uint64_t base);
+  static bool ParsePostingBlock(absl::string_view key, uint64_t* user,
+                                uint64_t* stat_id, IndexToken* token,
+                                uint64_t* base);
+
+  static Key StatSegmentsPrefix(uint64_t user, uint64_t stat_id);
+  static Key SegmentHeadersPrefix(uint64_t user, uint64_t stat_id);
+  static Key ForSegmentHeader(uint64_t user, uint64_t stat_id, uint64_t base);
+  static Key ForSegmentColumns(uint64_t user, uint64_t stat_id, uint64_t base);
+  static bool ParseSegmentHeader(absl::string_view key, uint64_t* user,
+                                 uint64_t* stat_id, uint64_t* base);
+
+  static Key StatStartsPrefix(uint64_t user, uint64_t stat_id);
+  static Key ForEventStart(uint64_t user, uint64_t stat_id,
+                           absl::Time start_time, uint64_t event_id);
+  static bool ParseEventStart(absl::string_view key, uint64_t* user,
+                              uint64_t* stat_id, absl::Time* start_time,
+                              uint64_t* event_id);
+
+  // Rollups are keyed by the level and index of a point token.
+  static Key StatRollupsPrefix(uint64_t user, uint64_t stat_id);
+  static Key ForRollup(uint64_t user, uint64_t stat_id, uint8_t level,
+                       int64_t index);
+  static bool ParseRollup(absl::string_view key, uint64_t* user,
+                          uint64_t* stat_id, uint8_t* level, int64_t* index);
+
+  // Quantile sketches are keyed by the level, among the sketched
+  // granularities, and index of a point token.
+  static Key StatSketchesPrefix(uint64_t user, uint64_t stat_id);
+  static Key ForSketches(uint64_t user, uint64_t stat_id, uint8_t level,
+                         int64_t index);
+  static bool ParseSketches(absl::string_view key, uint64_t* user,
+                            uint64_t* stat_id, uint8_t* level,
+                            int64_t* index);
+
+  // The first key after every key written by this schema. Rows at or past it
+  // were written by the legacy text schema; see LegacyKey.
+  static Key LegacyKeysBegin();
 
   operator absl::string_view() const { return data_; }
   operator leveldb::Slice() const { return leveldb::Slice(data_); }
@@ -42,6 +146,25 @@ class Key {
   std::string data_;
 };
 
+// A key of the text schema that predates Key, e.g. "jack S:3 E:12". Only used
+// to migrate existing databases; the views point into the parsed key.
+struct LegacyKey {
+  enum class Type {
+    kNextStatId,
+    kStat,
+    kNextEventId,
+    kEvent,
+    kIndexHit,
+  };
+
+  static bool Parse(absl::string_view key, LegacyKey* parsed);
+
+  Type type;
+  absl::string_view user_id;
+  absl::string_view stat_id;
+  absl::string_view event_id;
+};
+
 }  // namespace stat_tracker
 
 #endif  // STAT_TRACKER_KEY_H_
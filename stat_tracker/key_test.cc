@@ -8,45 +8,249 @@
 namespace stat_tracker {
 namespace {
 
+using ::testing::AllOf;
+using ::testing::Not;
+using ::testing::SizeIs;
+using ::testing::StartsWith;
+
+TEST(KeyTest, UserId) {
+  const std::string key = Key::ForUserId("jack");
+  EXPECT_EQ(key, std::string("\x00Ujack", 6));
+}
+
+TEST(KeyTest, RetainedStat) {
+  const std::string key = Key::ForRetainedStat(7, 258);
+  EXPECT_THAT(key, StartsWith(Key::RetainedStatsPrefix()));
+  EXPECT_LT(key, std::string(Key::ForRetainedStat(8, 0)));
+  uint64_t user, stat_id;
+  ASSERT_TRUE(Key::ParseRetainedStat(key, &user, &stat_id));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_FALSE(
+      Key::ParseRetainedStat(Key::ForStat(7, 258), &user, &stat_id));
+}
+
+TEST(KeyTest, DeletedStat) {
+  const std::string key = Key::ForDeletedStat(7, 258);
+  EXPECT_THAT(key, AllOf(StartsWith(Key::DeletedStatsPrefix()),
+                         Not(StartsWith(Key::RetainedStatsPrefix()))));
+  uint64_t user, stat_id;
+  ASSERT_TRUE(Key::ParseDeletedStat(key, &user, &stat_id));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_FALSE(Key::ParseDeletedStat(Key::ForRetainedStat(7, 258), &user,
+                                     &stat_id));
+}
+
+TEST(KeyTest, Granularities) {
+  EXPECT_EQ(std::string(Key::Granularities()), std::string("\x00T", 2));
+}
+
 TEST(KeyTest, NextStatId) {
-  const std::string key = Key::NextStatId("jack");
-  EXPECT_EQ(key, "jack next_stat");
+  const std::string key = Key::NextStatId(7);
+  EXPECT_EQ(key, std::string("\x01\x00\x00\x00\x00\x00\x00\x00\x07N", 10));
 }
 
 TEST(KeyTest, Stat) {
-  const std::string key = Key::ForStat("jack", "foo_stat");
-  EXPECT_EQ(key, "jack SD:foo_stat");
+  const std::string key = Key::ForStat(7, 258);
+  EXPECT_EQ(key, std::string("\x01\x00\x00\x00\x00\x00\x00\x00\x07"
+                             "D\x00\x00\x00\x00\x00\x00\x01\x02",
+                             18));
+  EXPECT_THAT(key, StartsWith(Key::UserStatsPrefix(7)));
 }
 
 TEST(KeyTest, ParseStatOk) {
-  std::string user_id, stat_id;
-  EXPECT_TRUE(
-      Key::ParseStat(Key::ForStat("jack", "foo_stat"), &user_id, &stat_id));
-  EXPECT_EQ(user_id, "jack");
-  EXPECT_EQ(stat_id, "foo_stat");
+  uint64_t user, stat_id;
+  EXPECT_TRUE(Key::ParseStat(Key::ForStat(7, 258), &user, &stat_id));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
 }
 
 TEST(KeyTest, ParseBadStat) {
-  std::string user_id, stat_id;
-  EXPECT_FALSE(Key::ParseStat("asdf", &user_id, &stat_id));
-  EXPECT_FALSE(Key::ParseStat("jack SD:", &user_id, &stat_id));
-  EXPECT_FALSE(Key::ParseStat(Key::ForEvent("jack", "foo_stat", "bar_event"),
-                              &user_id, &stat_id));
+  uint64_t user, stat_id;
+  EXPECT_FALSE(Key::ParseStat("asdf", &user, &stat_id));
+  EXPECT_FALSE(Key::ParseStat(Key::UserStatsPrefix(7), &user, &stat_id));
+  EXPECT_FALSE(Key::ParseStat(Key::ForEvent(7, 258, 3), &user, &stat_id));
 }
 
 TEST(KeyTest, StatIdPrefix) {
-  const std::string key = Key::StatEventsPrefix("jack", "foo_stat");
-  EXPECT_EQ(key, "jack S:foo_stat");
+  const std::string events_prefix = Key::StatEventsPrefix(7, 258);
+  EXPECT_THAT(std::string(Key::NextEventId(7, 258)), StartsWith(events_prefix));
+  EXPECT_THAT(std::string(Key::ForEvent(7, 258, 3)), StartsWith(events_prefix));
+  EXPECT_THAT(std::string(Key::ForEvent(7, 2580, 3)),
+              Not(StartsWith(events_prefix)));
+}
+
+TEST(KeyTest, Event) {
+  const std::string key = Key::ForEvent(7, 258, 3);
+  EXPECT_THAT(key, SizeIs(27));
+  uint64_t user, stat_id, event_id;
+  ASSERT_TRUE(Key::ParseEvent(key, &user, &stat_id, &event_id));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_EQ(event_id, 3);
 }
 
-TEST(KeyTest, NextEventId) {
-  const std::string key = Key::NextEventId("jack", "foo_stat");
-  EXPECT_EQ(key, "jack S:foo_stat next_event");
+TEST(KeyTest, EventIdsSortNumerically) {
+  EXPECT_LT(std::string(Key::ForEvent(7, 1, 2)),
+            std::string(Key::ForEvent(7, 1, 10)));
+  EXPECT_LT(std::string(Key::ForEvent(7, 1, 255)),
+            std::string(Key::ForEvent(7, 1, 256)));
 }
 
-TEST(KeyTest, Event) {
-  const std::string key = Key::ForEvent("jack", "foo_stat", "bar_event");
-  EXPECT_EQ(key, "jack S:foo_stat E:bar_event");
+TEST(KeyTest, PostingBlock) {
+  const IndexToken token = {TokenKind::kRange, 4, -12};
+  const std::string key = Key::ForPostingBlock(7, 258, token, 512);
+  EXPECT_THAT(key, StartsWith(Key::IndexHitsPrefix(7, 258, token)));
+  EXPECT_THAT(key, StartsWith(Key::StatIndexPrefix(7, 258)));
+
+  uint64_t user, stat_id, base;
+  IndexToken parsed_token;
+  ASSERT_TRUE(
+      Key::ParsePostingBlock(key, &user, &stat_id, &parsed_token, &base));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_EQ(parsed_token.kind, TokenKind::kRange);
+  EXPECT_EQ(parsed_token.level, 4);
+  EXPECT_EQ(parsed_token.index, -12);
+  EXPECT_EQ(base, 512);
+}
+
+TEST(KeyTest, IndexTokensSortNumerically) {
+  const auto hits_prefix = [](int64_t index) {
+    return std::string(
+        Key::IndexHitsPrefix(7, 1, {TokenKind::kPoint, 0, index}));
+  };
+  EXPECT_LT(hits_prefix(-2), hits_prefix(-1));
+  EXPECT_LT(hits_prefix(-1), hits_prefix(0));
+  EXPECT_LT(hits_prefix(0), hits_prefix(1));
+}
+
+TEST(KeyTest, SegmentHeader) {
+  const std::string key = Key::ForSegmentHeader(7, 258, 1024);
+  EXPECT_THAT(key, StartsWith(Key::SegmentHeadersPrefix(7, 258)));
+  EXPECT_THAT(key, StartsWith(Key::StatSegmentsPrefix(7, 258)));
+  EXPECT_THAT(std::string(Key::ForSegmentColumns(7, 258, 1024)),
+              AllOf(StartsWith(Key::StatSegmentsPrefix(7, 258)),
+                    Not(StartsWith(Key::SegmentHeadersPrefix(7, 258)))));
+
+  uint64_t user, stat_id, base;
+  ASSERT_TRUE(Key::ParseSegmentHeader(key, &user, &stat_id, &base));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_EQ(base, 1024);
+  EXPECT_FALSE(Key::ParseSegmentHeader(Key::ForSegmentColumns(7, 258, 1024),
+                                       &user, &stat_id, &base));
+}
+
+TEST(KeyTest, EventStart) {
+  const absl::Time start = absl::FromUnixSeconds(-5) + absl::Milliseconds(250);
+  const std::string key = Key::ForEventStart(7, 258, start, 3);
+  EXPECT_THAT(key, StartsWith(Key::StatStartsPrefix(7, 258)));
+
+  uint64_t user, stat_id, event_id;
+  absl::Time parsed_start;
+  ASSERT_TRUE(
+      Key::ParseEventStart(key, &user, &stat_id, &parsed_start, &event_id));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_EQ(parsed_start, start);
+  EXPECT_EQ(event_id, 3);
+  EXPECT_FALSE(Key::ParseEventStart(Key::StatStartsPrefix(7, 258), &user,
+                                    &stat_id, &parsed_start, &event_id));
+}
+
+TEST(KeyTest, EventStartsSortByTimeThenId) {
+  const auto start_key = [](absl::Time start, uint64_t event_id) {
+    return std::string(Key::ForEventStart(7, 1, start, event_id));
+  };
+  const absl::Time epoch = absl::UnixEpoch();
+  EXPECT_LT(start_key(absl::InfinitePast(), 9),
+            start_key(epoch - absl::Seconds(1), 0));
+  EXPECT_LT(start_key(epoch - absl::Seconds(1), 9),
+            start_key(epoch - absl::Nanoseconds(1), 0));
+  EXPECT_LT(start_key(epoch - absl::Nanoseconds(1), 9), start_key(epoch, 0));
+  EXPECT_LT(start_key(epoch, 0), start_key(epoch, 1));
+  EXPECT_LT(start_key(epoch, 9), start_key(epoch + absl::Nanoseconds(1), 0));
+  EXPECT_LT(start_key(epoch + absl::Hours(1e6), 9),
+            start_key(absl::InfiniteFuture(), 0));
+}
+
+TEST(KeyTest, Rollup) {
+  const std::string key = Key::ForRollup(7, 258, 3, -12);
+  EXPECT_THAT(key, StartsWith(Key::StatRollupsPrefix(7, 258)));
+  EXPECT_LT(key, std::string(Key::ForRollup(7, 258, 3, 0)));
+  EXPECT_LT(std::string(Key::ForRollup(7, 258, 2, 5)), key);
+
+  uint64_t user, stat_id;
+  uint8_t level;
+  int64_t index;
+  ASSERT_TRUE(Key::ParseRollup(key, &user, &stat_id, &level, &index));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_EQ(level, 3);
+  EXPECT_EQ(index, -12);
+  EXPECT_FALSE(Key::ParseRollup(Key::StatRollupsPrefix(7, 258), &user,
+                                &stat_id, &level, &index));
+}
+
+TEST(KeyTest, Sketches) {
+  const std::string key = Key::ForSketches(7, 258, 1, 40);
+  EXPECT_THAT(key, StartsWith(Key::StatSketchesPrefix(7, 258)));
+  EXPECT_THAT(key, Not(StartsWith(Key::StatRollupsPrefix(7, 258))));
+
+  uint64_t user, stat_id;
+  uint8_t level;
+  int64_t index;
+  ASSERT_TRUE(Key::ParseSketches(key, &user, &stat_id, &level, &index));
+  EXPECT_EQ(user, 7);
+  EXPECT_EQ(stat_id, 258);
+  EXPECT_EQ(level, 1);
+  EXPECT_EQ(index, 40);
+  EXPECT_FALSE(Key::ParseSketches(Key::ForRollup(7, 258, 1, 40), &user,
+                                  &stat_id, &level, &index));
+}
+
+TEST(KeyTest, BinaryKeysSortBeforeLegacyKeys) {
+  EXPECT_LT(std::string(Key::ForUserId("\xff")),
+            std::string(Key::LegacyKeysBegin()));
+  EXPECT_LT(std::string(Key::ForEvent(~uint64_t{0}, ~uint64_t{0}, 0)),
+            std::string(Key::LegacyKeysBegin()));
+  EXPECT_GT(std::string("jack S:1 E:2"), std::string(Key::LegacyKeysBegin()));
+}
+
+TEST(LegacyKeyTest, Parse) {
+  LegacyKey key;
+  ASSERT_TRUE(LegacyKey::Parse("jack next_stat", &key));
+  EXPECT_EQ(key.type, LegacyKey::Type::kNextStatId);
+  EXPECT_EQ(key.user_id, "jack");
+
+  ASSERT_TRUE(LegacyKey::Parse("jack SD:3", &key));
+  EXPECT_EQ(key.type, LegacyKey::Type::kStat);
+  EXPECT_EQ(key.user_id, "jack");
+  EXPECT_EQ(key.stat_id, "3");
+
+  ASSERT_TRUE(LegacyKey::Parse("jack S:3 next_event", &key));
+  EXPECT_EQ(key.type, LegacyKey::Type::kNextEventId);
+  EXPECT_EQ(key.stat_id, "3");
+
+  ASSERT_TRUE(LegacyKey::Parse("jack S:3 E:12", &key));
+  EXPECT_EQ(key.type, LegacyKey::Type::kEvent);
+  EXPECT_EQ(key.stat_id, "3");
+  EXPECT_EQ(key.event_id, "12");
+
+  ASSERT_TRUE(LegacyKey::Parse("jack IS:3 T:p-1h@5 H:12", &key));
+  EXPECT_EQ(key.type, LegacyKey::Type::kIndexHit);
+  EXPECT_EQ(key.stat_id, "3");
+  EXPECT_EQ(key.event_id, "12");
+}
+
+TEST(LegacyKeyTest, ParseBad) {
+  LegacyKey key;
+  EXPECT_FALSE(LegacyKey::Parse("asdf", &key));
+  EXPECT_FALSE(LegacyKey::Parse("jack SD:", &key));
+  EXPECT_FALSE(LegacyKey::Parse("jack S:3 E:", &key));
+  EXPECT_FALSE(LegacyKey::Parse("jack S:3", &key));
 }
 
 }  // namespace
@@ -0,0 +1,225 @@
+#include "stat_tracker/posting_block.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "leveldb/options.h"
+#include "util/status.h"
+#include "util/varint.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace stat_tracker {
+
+namespace {
+
+// Number of leading bytes of `p` that are whole single-byte varints, which is
+// all of them when the result equals the width scanned.
+#ifdef __SSE2__
+constexpr int kScanWidth = 16;
+
+int CountSingleByteVarints(const uint8_t* p) {
+  const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  const uint32_t continuation_bits = _mm_movemask_epi8(bytes);
+  return continuation_bits == 0 ? kScanWidth
+                                : __builtin_ctz(continuation_bits);
+}
+#else
+constexpr int kScanWidth = 8;
+constexpr uint64_t kSingleByteMask = 0x8080808080808080;
+
+int CountSingleByteVarints(const uint8_t* p) {
+  uint64_t word;
+  std::memcpy(&word, p, sizeof(word));
+  const uint64_t continuation_bits = word & kSingleByteMask;
+  if (continuation_bits == 0) return kScanWidth;
+  // Little-endian load: the first byte with its high bit set is the lowest.
+  return __builtin_ctzll(continuation_bits) / 8;
+}
+#endif
+
+}  // namespace
+
+void EncodePostingBlock(uint64_t base, absl::Span<const uint64_t> ids,
+                        std::string* dst) {
+  uint64_t prev = base;
+  for (uint64_t id : ids) {
+    util::PutVarint64(id - prev, dst);
+    prev = id;
+  }
+}
+
+// Deltas are almost always below 128, so runs of single-byte varints are
+// decoded a vector at a time and only multi-byte ones take the slow path.
+bool DecodePostingBlock(uint64_t base, absl::string_view block,
+                        std::vector<uint64_t>* ids) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(block.data());
+  const uint8_t* const end = p + block.size();
+  uint64_t prev = base;
+  while (p < end) {
+    if (end - p >= kScanWidth) {
+      const int num_single = CountSingleByteVarints(p);
+      for (int i = 0; i < num_single; ++i) {
+        prev += p[i];
+        ids->push_back(prev);
+      }
+      p += num_single;
+      if (num_single == kScanWidth) continue;
+    }
+    uint64_t delta;
+    p = util::GetVarint64(p, end, &delta);
+    if (p == nullptr) return false;
+    prev += delta;
+    ids->push_back(prev);
+  }
+  return true;
+}
+
+leveldb::Status ReadPostings(storage::StorageInterface* storage,
+                             const leveldb::ReadOptions& options, uint64_t user,
+                             uint64_t stat_id,
+                             absl::Span<const IndexToken> tokens,
+                             std::vector<uint64_t>* ids) {
+  std::vector<std::string> prefixes;
+  prefixes.reserve(tokens.size());
+  for (const IndexToken& token : tokens) {
+    prefixes.push_back(Key::IndexHitsPrefix(user, stat_id, token));
+  }
+  std::sort(prefixes.begin(), prefixes.end());
+  prefixes.erase(std::unique(prefixes.begin(), prefixes.end()),
+                 prefixes.end());
+
+  ids->clear();
+  auto it = storage->NewIterator(options);
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    const std::string& prefix = prefixes[i];
+    // Past the first prefix the iterator is already at or after the end of
+    // the previous one's blocks, often right at this one's.
+    if (i == 0 || (it->Valid() && it->key().compare(prefix) < 0)) {
+      it->Seek(prefix);
+    }
+    if (!it->Valid()) break;
+    for (; it->Valid() && it->key().starts_with(prefix); it->Next()) {
+      const absl::string_view key(it->key().data(), it->key().size());
+      uint64_t block_user, block_stat_id, base;
+      IndexToken token;
+      if (!Key::ParsePostingBlock(key, &block_user, &block_stat_id, &token,
+                                  &base) ||
+          !DecodePostingBlock(
+              base, absl::string_view(it->value().data(), it->value().size()),
+              ids)) {
+        return leveldb::Status::Corruption(absl::StrCat(
+            "posting block ", absl::CHexEscape(key), " not parseable."));
+      }
+    }
+  }
+  RETURN_IF_ERROR(it->status());
+  std::sort(ids->begin(), ids->end());
+  ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+  return leveldb::Status::OK();
+}
+
+leveldb::Status PostingBlockWriter::Load(uint64_t user, uint64_t stat_id,
+                                         const IndexToken& token,
+                                         uint64_t event_id, Block** block) {
+  const uint64_t base = PostingBlockBase(event_id);
+  const Key key = Key::ForPostingBlock(user, stat_id, token, base);
+  auto it = blocks_.find(key);
+  if (it == blocks_.end()) {
+    Block loaded = {base, {}, /*added=*/false};
+    auto cached = cache_ != nullptr ? cache_->Lookup(key) : nullptr;
+    if (cached != nullptr) {
+      loaded.ids = *cached;
+    } else {
+      std::string value;
+      const leveldb::Status status =
+          storage_->Get(leveldb::ReadOptions(), key, &value);
+      if (!status.ok() && !status.IsNotFound()) return status;
+      if (!DecodePostingBlock(base, value, &loaded.ids)) {
+        return leveldb::Status::Corruption(
+            absl::StrCat("posting block ",
+                         absl::CHexEscape(absl::string_view(key)),
+                         " not parseable."));
+      }
+    }
+    it = blocks_.emplace(key, std::move(loaded)).first;
+  }
+  *block = &it->second;
+  return leveldb::Status::OK();
+}
+
+leveldb::Status PostingBlockWriter::Add(uint64_t user, uint64_t stat_id,
+                                        const IndexToken& token,
+                                        uint64_t event_id) {
+  Block* block;
+  RETURN_IF_ERROR(Load(user, stat_id, token, event_id, &block));
+  // Event ids are allocated in increasing order, so this is nearly always an
+  // append.
+  auto pos = std::lower_bound(block->ids.begin(), block->ids.end(), event_id);
+  if (pos == block->ids.end() || *pos != event_id) {
+    block->ids.insert(pos, event_id);
+  }
+  block->added = true;
+  if (track_edits_) {
+    edits_.push_back({user, stat_id, token, event_id, /*added=*/true});
+  }
+  return leveldb::Status::OK();
+}
+
+leveldb::Status PostingBlockWriter::Remove(uint64_t user, uint64_t stat_id,
+                                           const IndexToken& token,
+                                           uint64_t event_id) {
+  Block* block;
+  RETURN_IF_ERROR(Load(user, stat_id, token, event_id, &block));
+  auto pos = std::lower_bound(block->ids.begin(), block->ids.end(), event_id);
+  if (pos != block->ids.end() && *pos == event_id) {
+    block->ids.erase(pos);
+  }
+  if (track_edits_) {
+    edits_.push_back({user, stat_id, token, event_id, /*added=*/false});
+  }
+  return leveldb::Status::OK();
+}
+
+void PostingBlockWriter::Flush(leveldb::WriteBatch* batch) {
+  std::string value;
+  flushed_.clear();
+  for (auto& key_and_block : blocks_) {
+    Block& block = key_and_block.second;
+    if (block.ids.empty()) {
+      batch->Delete(key_and_block.first);
+    } else {
+      value.clear();
+      EncodePostingBlock(block.base, block.ids, &value);
+      batch->Put(key_and_block.first, value);
+    }
+    if (cache_ != nullptr) {
+      std::shared_ptr<std::vector<uint64_t>> ids;
+      if (block.added) {
+        ids = std::make_shared<std::vector<uint64_t>>(std::move(block.ids));
+      }
+      flushed_.emplace_back(key_and_block.first, std::move(ids));
+    }
+  }
+  blocks_.clear();
+}
+
+void PostingBlockWriter::UpdateCache() {
+  if (cache_ == nullptr) return;
+  for (auto& key_and_ids : flushed_) {
+    if (key_and_ids.second == nullptr) {
+      cache_->Erase(key_and_ids.first);
+    } else {
+      const size_t charge = key_and_ids.first.size() +
+                            key_and_ids.second->size() * sizeof(uint64_t);
+      cache_->Insert(key_and_ids.first, std::move(key_and_ids.second), charge);
+    }
+  }
+  flushed_.clear();
+}
+
+}  // namespace stat_tracker
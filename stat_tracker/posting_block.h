@@ -0,0 +1,118 @@
+#ifndef STAT_TRACKER_POSTING_BLOCK_H_
+#define STAT_TRACKER_POSTING_BLOCK_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "leveldb/status.h"
+#include "leveldb/write_batch.h"
+#include "stat_tracker/key.h"
+#include "storage/storage.h"
+#include "util/lru_cache.h"
+
+namespace stat_tracker {
+
+// The hits of one index token are split into posting blocks by event id: the
+// block with base b holds the sorted ids in [b, b + kPostingBlockSpan). An
+// encoded block is the varint delta of each id from its predecessor, the first
+// one from b, so a full block of consecutive ids is kPostingBlockSpan bytes.
+constexpr uint64_t kPostingBlockSpan = 256;
+
+inline uint64_t PostingBlockBase(uint64_t event_id) {
+  return event_id - event_id % kPostingBlockSpan;
+}
+
+// `ids` must be sorted, unique and within the block starting at `base`.
+void EncodePostingBlock(uint64_t base, absl::Span<const uint64_t> ids,
+                        std::string* dst);
+
+// Appends the ids of the block to `ids`. Returns false if it's malformed.
+bool DecodePostingBlock(uint64_t base, absl::string_view block,
+                        std::vector<uint64_t>* ids);
+
+// Sets `ids` to the union of the hits of `tokens` in a stat's index, sorted
+// and unique. The tokens' blocks are read in key order with one iterator,
+// which only seeks when the next token's blocks lie ahead of it.
+leveldb::Status ReadPostings(storage::StorageInterface* storage,
+                             const leveldb::ReadOptions& options, uint64_t user,
+                             uint64_t stat_id,
+                             absl::Span<const IndexToken> tokens,
+                             std::vector<uint64_t>* ids);
+
+// A hit added to or removed from a stat's index.
+struct PostingEdit {
+  uint64_t user;
+  uint64_t stat_id;
+  IndexToken token;
+  uint64_t event_id;
+  bool added;
+};
+
+// The stored ids of recently appended-to posting blocks, by key. Event ids
+// only grow, so these are mostly the open tail block of each token of the
+// stats being recorded into, which every new event appends to.
+using PostingBlockCache =
+    util::ShardedLruCache<std::string, std::vector<uint64_t>>;
+
+// Buffers edits to posting blocks so that all the hits written to a block
+// within one WriteBatch cost a single read and a single Put, and no read at
+// all if the block is in the cache.
+class PostingBlockWriter {
+ public:
+  // If `track_edits`, also records every Add and Remove, so that in-memory
+  // copies of the index can replay them once the batch is written. A `cache`
+  // is only kept in step with the storage if every write of its blocks goes
+  // through writers given it, and writers of one stat don't overlap.
+  explicit PostingBlockWriter(storage::StorageInterface* storage,
+                              bool track_edits = false,
+                              PostingBlockCache* cache = nullptr)
+      : storage_(storage), track_edits_(track_edits), cache_(cache) {}
+
+  leveldb::Status Add(uint64_t user, uint64_t stat_id, const IndexToken& token,
+                      uint64_t event_id);
+  leveldb::Status Remove(uint64_t user, uint64_t stat_id,
+                         const IndexToken& token, uint64_t event_id);
+
+  // Writes every modified block to `batch`, deleting the ones left empty.
+  void Flush(leveldb::WriteBatch* batch);
+  // Once the batch of the last Flush is written, caches the blocks it
+  // appended to and drops the ones it only removed from. Not calling it, as
+  // when the write fails, leaves the cache as it was.
+  void UpdateCache();
+
+  // The edits since construction, if tracked, including flushed ones.
+  const std::vector<PostingEdit>& edits() const { return edits_; }
+
+ private:
+  struct Block {
+    uint64_t base;
+    std::vector<uint64_t> ids;
+    bool added;
+  };
+
+  // Finds the block `event_id` belongs in, reading it on first use unless
+  // it's cached.
+  leveldb::Status Load(uint64_t user, uint64_t stat_id,
+                       const IndexToken& token, uint64_t event_id,
+                       Block** block);
+
+  storage::StorageInterface* storage_;
+  std::map<std::string, Block> blocks_;
+  const bool track_edits_;
+  std::vector<PostingEdit> edits_;
+  PostingBlockCache* const cache_;
+  // The blocks of the last Flush, for UpdateCache: the ids of the ones added
+  // to, and null for the others.
+  std::vector<std::pair<std::string, std::shared_ptr<std::vector<uint64_t>>>>
+      flushed_;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_POSTING_BLOCK_H_
@@ -0,0 +1,38 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "stat_tracker/posting_block.h"
+
+namespace {
+
+// Ids of one block in which each id is present with the given probability, in
+// percent. Sparser blocks have larger deltas and more multi-byte varints.
+std::vector<uint64_t> GenerateBlockIds(int density_percent) {
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::vector<uint64_t> ids;
+  for (uint64_t id = 0; id < stat_tracker::kPostingBlockSpan; ++id) {
+    if (percent(rng) < density_percent) ids.push_back(id);
+  }
+  return ids;
+}
+
+}  // namespace
+
+static void BM_DecodePostingBlock(benchmark::State& state) {
+  const std::vector<uint64_t> ids = GenerateBlockIds(state.range(0));
+  std::string block;
+  stat_tracker::EncodePostingBlock(0, ids, &block);
+  std::vector<uint64_t> decoded;
+  int64_t num_decoded = 0;
+  for (auto _ : state) {
+    decoded.clear();
+    stat_tracker::DecodePostingBlock(0, block, &decoded);
+    num_decoded += decoded.size();
+    benchmark::DoNotOptimize(decoded.data());
+  }
+  state.SetItemsProcessed(num_decoded);
+}
+BENCHMARK(BM_DecodePostingBlock)->Arg(1)->Arg(10)->Arg(50)->Arg(100);
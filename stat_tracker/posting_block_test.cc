@@ -0,0 +1,194 @@
+#include "stat_tracker/posting_block.h"
+
+#include <numeric>
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "leveldb/write_batch.h"
+#include "storage/testing/leveldb.h"
+#include "util/status_test_macros.h"
+
+namespace stat_tracker {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+
+std::vector<uint64_t> RoundTrip(uint64_t base,
+                                 const std::vector<uint64_t>& ids) {
+  std::string block;
+  EncodePostingBlock(base, ids, &block);
+  std::vector<uint64_t> decoded;
+  EXPECT_TRUE(DecodePostingBlock(base, block, &decoded));
+  return decoded;
+}
+
+TEST(PostingBlockTest, Base) {
+  EXPECT_EQ(PostingBlockBase(0), 0);
+  EXPECT_EQ(PostingBlockBase(kPostingBlockSpan - 1), 0);
+  EXPECT_EQ(PostingBlockBase(kPostingBlockSpan), kPostingBlockSpan);
+  EXPECT_EQ(PostingBlockBase(3 * kPostingBlockSpan + 7),
+            3 * kPostingBlockSpan);
+}
+
+TEST(PostingBlockTest, EmptyBlock) {
+  EXPECT_THAT(RoundTrip(512, {}), IsEmpty());
+}
+
+TEST(PostingBlockTest, ConsecutiveIdsAreOneByteEach) {
+  std::vector<uint64_t> ids(kPostingBlockSpan);
+  std::iota(ids.begin(), ids.end(), 512);
+  std::string block;
+  EncodePostingBlock(512, ids, &block);
+  EXPECT_THAT(block, SizeIs(kPostingBlockSpan));
+  EXPECT_THAT(RoundTrip(512, ids), ElementsAreArray(ids));
+}
+
+TEST(PostingBlockTest, MultiByteDeltas) {
+  const std::vector<uint64_t> ids = {
+      1,   2,   3,   4,   5,   6,   7,   8,   9,   10,  11,  12,
+      13,  14,  15,  16,  17,  200, 201, 202, 203, 204, 205, 206,
+      207, 208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 255};
+  EXPECT_THAT(RoundTrip(0, ids), ElementsAreArray(ids));
+  EXPECT_THAT(RoundTrip(0, {0, 130, 255}), ElementsAre(0, 130, 255));
+}
+
+TEST(PostingBlockTest, DecodeAppends) {
+  std::string block;
+  EncodePostingBlock(256, {260, 300}, &block);
+  std::vector<uint64_t> ids = {1, 2};
+  ASSERT_TRUE(DecodePostingBlock(256, block, &ids));
+  EXPECT_THAT(ids, ElementsAre(1, 2, 260, 300));
+}
+
+TEST(PostingBlockTest, TruncatedVarint) {
+  std::vector<uint64_t> ids;
+  EXPECT_FALSE(DecodePostingBlock(0, "\x01\x02\x83", &ids));
+}
+
+class PostingBlockWriterTest : public ::testing::Test {
+ protected:
+  PostingBlockWriterTest() : leveldb_env_("posting_block_test.leveldb") {}
+
+  std::vector<uint64_t> ReadBlock(const IndexToken& token, uint64_t base) {
+    auto value_or = leveldb_env_.Get(Key::ForPostingBlock(1, 2, token, base));
+    std::vector<uint64_t> ids;
+    if (value_or.ok()) {
+      EXPECT_TRUE(DecodePostingBlock(base, value_or.ValueOrDie(), &ids));
+    }
+    return ids;
+  }
+
+  leveldb::Status Flush(PostingBlockWriter* writer) {
+    leveldb::WriteBatch batch;
+    writer->Flush(&batch);
+    return leveldb_env_.db()->Write(leveldb::WriteOptions(), &batch);
+  }
+
+  storage::LevelDbTestEnvironment leveldb_env_;
+};
+
+TEST_F(PostingBlockWriterTest, AddSplitsByBase) {
+  const IndexToken token = {TokenKind::kPoint, 3, 100};
+  PostingBlockWriter writer(leveldb_env_.db().get());
+  ASSERT_OK(writer.Add(1, 2, token, 1));
+  ASSERT_OK(writer.Add(1, 2, token, 3));
+  ASSERT_OK(writer.Add(1, 2, token, 3));
+  ASSERT_OK(writer.Add(1, 2, token, kPostingBlockSpan + 1));
+  ASSERT_OK(Flush(&writer));
+
+  EXPECT_THAT(ReadBlock(token, 0), ElementsAre(1, 3));
+  EXPECT_THAT(ReadBlock(token, kPostingBlockSpan),
+              ElementsAre(kPostingBlockSpan + 1));
+}
+
+TEST_F(PostingBlockWriterTest, AddToExistingBlock) {
+  const IndexToken token = {TokenKind::kRange, 0, -5};
+  PostingBlockWriter writer(leveldb_env_.db().get());
+  ASSERT_OK(writer.Add(1, 2, token, 1));
+  ASSERT_OK(Flush(&writer));
+  ASSERT_OK(writer.Add(1, 2, token, 2));
+  ASSERT_OK(writer.Add(1, 2, token, 0));
+  ASSERT_OK(Flush(&writer));
+
+  EXPECT_THAT(ReadBlock(token, 0), ElementsAre(0, 1, 2));
+}
+
+TEST_F(PostingBlockWriterTest, RemoveLastIdDeletesBlock) {
+  const IndexToken token = {TokenKind::kPoint, 0, 7};
+  PostingBlockWriter writer(leveldb_env_.db().get());
+  ASSERT_OK(writer.Add(1, 2, token, 1));
+  ASSERT_OK(writer.Add(1, 2, token, 2));
+  ASSERT_OK(Flush(&writer));
+
+  ASSERT_OK(writer.Remove(1, 2, token, 1));
+  ASSERT_OK(Flush(&writer));
+  EXPECT_THAT(ReadBlock(token, 0), ElementsAre(2));
+
+  ASSERT_OK(writer.Remove(1, 2, token, 2));
+  ASSERT_OK(Flush(&writer));
+  EXPECT_TRUE(leveldb_env_.Get(Key::ForPostingBlock(1, 2, token, 0))
+                  .status()
+                  .IsNotFound());
+}
+
+TEST_F(PostingBlockWriterTest, CachedBlocksAreNotReadBack) {
+  const IndexToken token = {TokenKind::kPoint, 1, 8};
+  const Key key = Key::ForPostingBlock(1, 2, token, 0);
+  PostingBlockCache cache(1 << 20);
+  PostingBlockWriter writer(leveldb_env_.db().get(), /*track_edits=*/false,
+                            &cache);
+  ASSERT_OK(writer.Add(1, 2, token, 1));
+  ASSERT_OK(Flush(&writer));
+  writer.UpdateCache();
+
+  // Appends start from the cached block, not the stored one.
+  ASSERT_OK(leveldb_env_.Delete(key));
+  ASSERT_OK(writer.Add(1, 2, token, 2));
+  ASSERT_OK(Flush(&writer));
+  writer.UpdateCache();
+  EXPECT_THAT(ReadBlock(token, 0), ElementsAre(1, 2));
+  EXPECT_EQ(cache.counters().hits, 1);
+
+  // Removals drop the block from the cache, so it's read again next time.
+  ASSERT_OK(writer.Remove(1, 2, token, 1));
+  ASSERT_OK(Flush(&writer));
+  writer.UpdateCache();
+  std::string block;
+  EncodePostingBlock(0, {2, 3}, &block);
+  ASSERT_OK(leveldb_env_.Put(key, block));
+  ASSERT_OK(writer.Add(1, 2, token, 4));
+  ASSERT_OK(Flush(&writer));
+  writer.UpdateCache();
+  EXPECT_THAT(ReadBlock(token, 0), ElementsAre(2, 3, 4));
+}
+
+TEST_F(PostingBlockWriterTest, ReadPostingsMergesTokens) {
+  const IndexToken a = {TokenKind::kPoint, 0, -3};
+  const IndexToken b = {TokenKind::kPoint, 2, 9};
+  const IndexToken c = {TokenKind::kRange, 1, 4};
+  const IndexToken missing = {TokenKind::kPoint, 1, 0};
+  PostingBlockWriter writer(leveldb_env_.db().get());
+  ASSERT_OK(writer.Add(1, 2, a, 5));
+  ASSERT_OK(writer.Add(1, 2, a, kPostingBlockSpan + 9));
+  ASSERT_OK(writer.Add(1, 2, b, 5));
+  ASSERT_OK(writer.Add(1, 2, b, 1));
+  ASSERT_OK(writer.Add(1, 2, c, 700));
+  // Same token in another stat.
+  ASSERT_OK(writer.Add(1, 3, a, 6));
+  ASSERT_OK(Flush(&writer));
+
+  std::vector<uint64_t> ids = {42};
+  ASSERT_OK(ReadPostings(leveldb_env_.db().get(), leveldb::ReadOptions(), 1,
+                         2, {c, missing, b, a, c}, &ids));
+  EXPECT_THAT(ids, ElementsAre(1, 5, kPostingBlockSpan + 9, 700));
+
+  ASSERT_OK(ReadPostings(leveldb_env_.db().get(), leveldb::ReadOptions(), 1,
+                         2, {missing}, &ids));
+  EXPECT_THAT(ids, IsEmpty());
+}
+
+}  // namespace
+}  // namespace stat_tracker
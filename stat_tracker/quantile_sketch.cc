@@ -0,0 +1,191 @@
+#include "stat_tracker/quantile_sketch.h"
+
+#include <algorithm>
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "util/status.h"
+#include "util/varint.h"
+
+namespace stat_tracker {
+
+namespace {
+
+void PutSketch(const util::KllSketch& sketch, std::string* dst) {
+  std::string encoded;
+  sketch.Encode(&encoded);
+  util::PutVarint64(encoded.size(), dst);
+  dst->append(encoded);
+}
+
+// Advances `p` past the sketch, or sets it to null if it's malformed.
+void GetSketch(const uint8_t** p, const uint8_t* end,
+               util::KllSketch* sketch) {
+  uint64_t size;
+  if (*p == nullptr || (*p = util::GetVarint64(*p, end, &size)) == nullptr) {
+    return;
+  }
+  if (size > static_cast<uint64_t>(end - *p) ||
+      !util::KllSketch::Decode(
+          absl::string_view(reinterpret_cast<const char*>(*p), size),
+          sketch)) {
+    *p = nullptr;
+    return;
+  }
+  *p += size;
+}
+
+// Rows with more removed than this fraction of what they sketched are
+// rebuilt, so that a row's error stays within a constant factor of that of
+// the events left, and rebuilding costs a constant per removal.
+constexpr double kMaxRemovedFraction = 0.5;
+
+leveldb::Status NotParseable(absl::string_view key) {
+  return leveldb::Status::Corruption(absl::StrCat(
+      "quantile sketches ", absl::CHexEscape(key), " not parseable."));
+}
+
+}  // namespace
+
+absl::Duration QuantileSketches::DurationQuantile(double q) const {
+  return absl::Seconds(
+      util::KllSketch::Quantile(durations, removed_durations, q));
+}
+
+double QuantileSketches::ValueQuantile(double q) const {
+  return util::KllSketch::Quantile(values, removed_values, q);
+}
+
+bool QuantileSketches::MostlyRemoved() const {
+  return removed_durations.count() >
+             kMaxRemovedFraction * durations.count() ||
+         removed_values.count() > kMaxRemovedFraction * values.count();
+}
+
+void QuantileSketches::Merge(const QuantileSketches& other) {
+  durations.Merge(other.durations);
+  removed_durations.Merge(other.removed_durations);
+  values.Merge(other.values);
+  removed_values.Merge(other.removed_values);
+}
+
+void EncodeQuantileSketches(const QuantileSketches& sketches,
+                            std::string* dst) {
+  PutSketch(sketches.durations, dst);
+  PutSketch(sketches.removed_durations, dst);
+  PutSketch(sketches.values, dst);
+  PutSketch(sketches.removed_values, dst);
+}
+
+bool DecodeQuantileSketches(absl::string_view row,
+                            QuantileSketches* sketches) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(row.data());
+  const uint8_t* const end = p + row.size();
+  GetSketch(&p, end, &sketches->durations);
+  GetSketch(&p, end, &sketches->removed_durations);
+  GetSketch(&p, end, &sketches->values);
+  GetSketch(&p, end, &sketches->removed_values);
+  return p == end;
+}
+
+leveldb::Status ReadQuantileSketches(storage::StorageInterface* storage,
+                                     const leveldb::ReadOptions& options,
+                                     uint64_t user, uint64_t stat_id,
+                                     absl::Span<const TimeRangeToken> tokens,
+                                     QuantileSketches* sketches) {
+  std::vector<std::string> keys;
+  keys.reserve(tokens.size());
+  for (const TimeRangeToken& token : tokens) {
+    keys.push_back(
+        Key::ForSketches(user, stat_id, token.level(), token.index()));
+  }
+  std::sort(keys.begin(), keys.end());
+
+  auto it = storage->NewIterator(options);
+  for (const std::string& key : keys) {
+    if (!it->Valid() || it->key().compare(key) < 0) it->Seek(key);
+    if (!it->Valid()) break;
+    if (it->key() != leveldb::Slice(key)) continue;
+    QuantileSketches row;
+    if (!DecodeQuantileSketches(
+            absl::string_view(it->value().data(), it->value().size()),
+            &row)) {
+      return NotParseable(key);
+    }
+    sketches->Merge(row);
+  }
+  return it->status();
+}
+
+leveldb::Status QuantileSketchWriter::Load(uint64_t user, uint64_t stat_id,
+                                           TimeRangeToken token,
+                                           QuantileSketches** row) {
+  const Key key =
+      Key::ForSketches(user, stat_id, token.level(), token.index());
+  auto it = rows_.find(key);
+  if (it == rows_.end()) {
+    QuantileSketches loaded;
+    std::string value;
+    const leveldb::Status status =
+        storage_->Get(leveldb::ReadOptions(), key, &value);
+    if (!status.ok() && !status.IsNotFound()) return status;
+    if (status.ok() && !DecodeQuantileSketches(value, &loaded)) {
+      return NotParseable(key);
+    }
+    it = rows_.emplace(key, std::move(loaded)).first;
+  }
+  *row = &it->second;
+  return leveldb::Status::OK();
+}
+
+leveldb::Status QuantileSketchWriter::Add(uint64_t user, uint64_t stat_id,
+                                          absl::Time start,
+                                          absl::Duration duration,
+                                          absl::optional<double> value) {
+  tokens_.clear();
+  tokenizer_->TokenizeTimePoint(start, &tokens_);
+  for (TimeRangeToken token : tokens_) {
+    QuantileSketches* row;
+    RETURN_IF_ERROR(Load(user, stat_id, token, &row));
+    row->durations.Add(absl::ToDoubleSeconds(duration));
+    if (value.has_value()) row->values.Add(*value);
+  }
+  return leveldb::Status::OK();
+}
+
+leveldb::Status QuantileSketchWriter::Remove(uint64_t user, uint64_t stat_id,
+                                             absl::Time start,
+                                             absl::Duration duration,
+                                             absl::optional<double> value) {
+  tokens_.clear();
+  tokenizer_->TokenizeTimePoint(start, &tokens_);
+  for (TimeRangeToken token : tokens_) {
+    QuantileSketches* row;
+    RETURN_IF_ERROR(Load(user, stat_id, token, &row));
+    row->removed_durations.Add(absl::ToDoubleSeconds(duration));
+    if (value.has_value()) row->removed_values.Add(*value);
+  }
+  return leveldb::Status::OK();
+}
+
+void QuantileSketchWriter::Flush(leveldb::WriteBatch* batch) {
+  stale_rows_.clear();
+  std::string value;
+  for (const auto& key_and_row : rows_) {
+    // Rows of events that predate sketches may be missing; once every event
+    // sketched is removed, start over.
+    if (key_and_row.second.duration_count() <= 0) {
+      batch->Delete(key_and_row.first);
+      continue;
+    }
+    value.clear();
+    EncodeQuantileSketches(key_and_row.second, &value);
+    batch->Put(key_and_row.first, value);
+    if (key_and_row.second.MostlyRemoved()) {
+      stale_rows_.push_back(key_and_row.first);
+    }
+  }
+  rows_.clear();
+}
+
+}  // namespace stat_tracker
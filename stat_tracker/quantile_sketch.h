@@ -0,0 +1,106 @@
+#ifndef STAT_TRACKER_QUANTILE_SKETCH_H_
+#define STAT_TRACKER_QUANTILE_SKETCH_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "leveldb/status.h"
+#include "leveldb/write_batch.h"
+#include "stat_tracker/key.h"
+#include "stat_tracker/time_index.h"
+#include "storage/storage.h"
+#include "util/kll_sketch.h"
+
+namespace stat_tracker {
+
+// Sketches of the durations and numeric values of the events starting in
+// some span of time. A sketch can't forget a value, so those of removed
+// events are sketched apart and subtracted when quantiles are taken.
+struct QuantileSketches {
+  // Durations are sketched in seconds.
+  util::KllSketch durations;
+  util::KllSketch removed_durations;
+  util::KllSketch values;
+  util::KllSketch removed_values;
+
+  int64_t duration_count() const {
+    return durations.count() - removed_durations.count();
+  }
+  int64_t value_count() const {
+    return values.count() - removed_values.count();
+  }
+  // The approximate q-quantiles of the durations and values left, for q in
+  // [0, 1]. Only meaningful if there are any.
+  absl::Duration DurationQuantile(double q) const;
+  double ValueQuantile(double q) const;
+  // Whether more than a fixed fraction of the durations or values sketched
+  // are removed. The rank error grows with all of them, not just those left,
+  // so such rows are better sketched anew.
+  bool MostlyRemoved() const;
+
+  void Merge(const QuantileSketches& other);
+};
+
+// Each stat keeps a row of sketches per point token of its events' start
+// times at the coarse granularities only, as rows are a few kilobytes each:
+// the sketches of a range are the merge of the rows of the tokens covering
+// it. An encoded row is the four sketches, each after its varint length.
+void EncodeQuantileSketches(const QuantileSketches& sketches,
+                            std::string* dst);
+
+// Returns false if `row` is malformed.
+bool DecodeQuantileSketches(absl::string_view row,
+                            QuantileSketches* sketches);
+
+// Merges into `sketches` the rows of `tokens` in a stat's sketches, read in
+// key order with one iterator. Tokens without a row sketch nothing.
+leveldb::Status ReadQuantileSketches(storage::StorageInterface* storage,
+                                     const leveldb::ReadOptions& options,
+                                     uint64_t user, uint64_t stat_id,
+                                     absl::Span<const TimeRangeToken> tokens,
+                                     QuantileSketches* sketches);
+
+// Buffers edits to sketch rows so that all the events written to a row within
+// one WriteBatch cost a single read and a single Put, like RollupWriter.
+// `tokenizer` has the sketched granularities; its levels key the rows.
+class QuantileSketchWriter {
+ public:
+  QuantileSketchWriter(storage::StorageInterface* storage,
+                       const Tokenizer* tokenizer)
+      : storage_(storage), tokenizer_(tokenizer) {}
+
+  // `value` is the event's numeric value, if it has one.
+  leveldb::Status Add(uint64_t user, uint64_t stat_id, absl::Time start,
+                      absl::Duration duration, absl::optional<double> value);
+  // Takes what the event was added with.
+  leveldb::Status Remove(uint64_t user, uint64_t stat_id, absl::Time start,
+                         absl::Duration duration,
+                         absl::optional<double> value);
+
+  // Writes every modified row to `batch`, deleting the ones left empty.
+  void Flush(leveldb::WriteBatch* batch);
+  // The keys of the rows the last Flush wrote MostlyRemoved, in order, for
+  // the caller to rebuild once the batch is written.
+  const std::vector<std::string>& stale_rows() const { return stale_rows_; }
+
+ private:
+  // Reads the row of `token` on first use.
+  leveldb::Status Load(uint64_t user, uint64_t stat_id, TimeRangeToken token,
+                       QuantileSketches** row);
+
+  storage::StorageInterface* storage_;
+  const Tokenizer* tokenizer_;
+  std::map<std::string, QuantileSketches> rows_;
+  std::vector<TimeRangeToken> tokens_;
+  std::vector<std::string> stale_rows_;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_QUANTILE_SKETCH_H_
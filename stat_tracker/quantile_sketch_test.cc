@@ -0,0 +1,141 @@
+#include "stat_tracker/quantile_sketch.h"
+
+#include "googletest/include/gtest/gtest.h"
+#include "leveldb/write_batch.h"
+#include "storage/testing/leveldb.h"
+#include "util/status_test_macros.h"
+
+namespace stat_tracker {
+namespace {
+
+const absl::Time kEpoch = absl::UnixEpoch();
+
+TEST(QuantileSketchTest, RoundTrip) {
+  QuantileSketches sketches;
+  for (int i = 0; i < 1000; ++i) sketches.durations.Add(i);
+  sketches.removed_durations.Add(3);
+  sketches.values.Add(-2.5);
+  std::string row;
+  EncodeQuantileSketches(sketches, &row);
+
+  QuantileSketches decoded;
+  ASSERT_TRUE(DecodeQuantileSketches(row, &decoded));
+  EXPECT_EQ(999, decoded.duration_count());
+  EXPECT_EQ(1, decoded.value_count());
+  EXPECT_EQ(sketches.DurationQuantile(0.5), decoded.DurationQuantile(0.5));
+  EXPECT_EQ(-2.5, decoded.ValueQuantile(1));
+  EXPECT_FALSE(DecodeQuantileSketches(row.substr(0, row.size() - 1),
+                                      &decoded));
+  EXPECT_FALSE(DecodeQuantileSketches(row + "x", &decoded));
+}
+
+class QuantileSketchWriterTest : public ::testing::Test {
+ protected:
+  QuantileSketchWriterTest()
+      : leveldb_env_("quantile_sketch_test.leveldb"),
+        tokenizer_({absl::Seconds(10), absl::Seconds(100)}) {}
+
+  // Writes the writer's rows and `batch`.
+  leveldb::Status Write(QuantileSketchWriter* writer,
+                        leveldb::WriteBatch* batch) {
+    writer->Flush(batch);
+    return leveldb_env_.db()->Write(leveldb::WriteOptions(), batch);
+  }
+
+  QuantileSketches Read(absl::Time start, absl::Time end) {
+    QuantileSketches sketches;
+    EXPECT_OK(ReadQuantileSketches(
+        leveldb_env_.db().get(), leveldb::ReadOptions(), 1, 2,
+        tokenizer_.TokenizeTimeRange(start, end), &sketches));
+    return sketches;
+  }
+
+  storage::LevelDbTestEnvironment leveldb_env_;
+  const Tokenizer tokenizer_;
+};
+
+TEST_F(QuantileSketchWriterTest, SketchesEveryLevel) {
+  QuantileSketchWriter writer(leveldb_env_.db().get(), &tokenizer_);
+  // Durations of 1s to 100s over [0s, 100s), and values of the even ones.
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_OK(writer.Add(
+        1, 2, kEpoch + absl::Seconds(i), absl::Seconds(i + 1),
+        i % 2 == 0 ? absl::make_optional<double>(i) : absl::nullopt));
+  }
+  ASSERT_OK(writer.Add(1, 3, kEpoch, absl::Hours(1), 1.0));
+  leveldb::WriteBatch batch;
+  ASSERT_OK(Write(&writer, &batch));
+
+  const QuantileSketches all = Read(kEpoch, kEpoch + absl::Seconds(100));
+  EXPECT_EQ(100, all.duration_count());
+  EXPECT_EQ(50, all.value_count());
+  EXPECT_EQ(absl::Seconds(1), all.DurationQuantile(0));
+  EXPECT_EQ(absl::Seconds(50), all.DurationQuantile(0.5));
+  EXPECT_EQ(absl::Seconds(100), all.DurationQuantile(1));
+  EXPECT_EQ(48, all.ValueQuantile(0.5));
+
+  const QuantileSketches some =
+      Read(kEpoch + absl::Seconds(20), kEpoch + absl::Seconds(40));
+  EXPECT_EQ(20, some.duration_count());
+  EXPECT_EQ(absl::Seconds(30), some.DurationQuantile(0.5));
+  EXPECT_EQ(38, some.ValueQuantile(1));
+}
+
+TEST_F(QuantileSketchWriterTest, RemovesSketchedEvents) {
+  QuantileSketchWriter writer(leveldb_env_.db().get(), &tokenizer_);
+  ASSERT_OK(writer.Add(1, 2, kEpoch, absl::Seconds(1), 10.0));
+  ASSERT_OK(writer.Add(1, 2, kEpoch, absl::Seconds(2), absl::nullopt));
+  ASSERT_OK(writer.Add(1, 2, kEpoch + absl::Seconds(50), absl::Seconds(3),
+                       30.0));
+  leveldb::WriteBatch batch;
+  ASSERT_OK(Write(&writer, &batch));
+
+  ASSERT_OK(writer.Remove(1, 2, kEpoch, absl::Seconds(1), 10.0));
+  batch.Clear();
+  ASSERT_OK(Write(&writer, &batch));
+  QuantileSketches sketches = Read(kEpoch, kEpoch + absl::Seconds(100));
+  EXPECT_EQ(2, sketches.duration_count());
+  EXPECT_EQ(absl::Seconds(2), sketches.DurationQuantile(0));
+  EXPECT_EQ(1, sketches.value_count());
+  EXPECT_EQ(30, sketches.ValueQuantile(0));
+
+  // Rows left empty are deleted.
+  ASSERT_OK(writer.Remove(1, 2, kEpoch, absl::Seconds(2), absl::nullopt));
+  ASSERT_OK(writer.Remove(1, 2, kEpoch + absl::Seconds(50), absl::Seconds(3),
+                          30.0));
+  batch.Clear();
+  ASSERT_OK(Write(&writer, &batch));
+  auto it = leveldb_env_.db()->NewIterator(leveldb::ReadOptions());
+  it->Seek(Key::StatSketchesPrefix(1, 2));
+  EXPECT_FALSE(it->Valid());
+}
+
+TEST_F(QuantileSketchWriterTest, ReportsMostlyRemovedRows) {
+  QuantileSketchWriter writer(leveldb_env_.db().get(), &tokenizer_);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_OK(writer.Add(1, 2, kEpoch + absl::Seconds(i * 10),
+                         absl::Seconds(i), absl::nullopt));
+  }
+  leveldb::WriteBatch batch;
+  ASSERT_OK(Write(&writer, &batch));
+  EXPECT_TRUE(writer.stale_rows().empty());
+
+  // Half of the coarse row's events are removed. The fine rows left empty
+  // are deleted instead.
+  ASSERT_OK(writer.Remove(1, 2, kEpoch, absl::ZeroDuration(), absl::nullopt));
+  ASSERT_OK(writer.Remove(1, 2, kEpoch + absl::Seconds(10), absl::Seconds(1),
+                          absl::nullopt));
+  batch.Clear();
+  ASSERT_OK(Write(&writer, &batch));
+  EXPECT_TRUE(writer.stale_rows().empty());
+
+  ASSERT_OK(writer.Remove(1, 2, kEpoch + absl::Seconds(20), absl::Seconds(2),
+                          absl::nullopt));
+  batch.Clear();
+  ASSERT_OK(Write(&writer, &batch));
+  EXPECT_EQ(writer.stale_rows(),
+            std::vector<std::string>({Key::ForSketches(1, 2, 1, 0)}));
+}
+
+}  // namespace
+}  // namespace stat_tracker
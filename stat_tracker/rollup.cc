@@ -0,0 +1,232 @@
+#include "stat_tracker/rollup.h"
+
+#include <algorithm>
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
+#include "util/status.h"
+#include "util/varint.h"
+
+namespace stat_tracker {
+
+namespace {
+
+// Whole seconds and the nanoseconds past them, so that sums of durations
+// don't overflow like int64 nanoseconds would.
+void PutDuration(absl::Duration duration, std::string* dst) {
+  absl::Duration remainder;
+  int64_t seconds = absl::IDivDuration(duration, absl::Seconds(1), &remainder);
+  if (remainder < absl::ZeroDuration()) {
+    --seconds;
+    remainder += absl::Seconds(1);
+  }
+  util::PutZigZag64(seconds, dst);
+  util::PutVarint64(absl::ToInt64Nanoseconds(remainder), dst);
+}
+
+absl::Duration GetDuration(util::VarintReader* reader) {
+  const int64_t seconds = reader->ZigZag();
+  // Varints past int64 come out negative.
+  const absl::Duration nanos =
+      absl::Nanoseconds(static_cast<int64_t>(reader->Varint()));
+  if (nanos < absl::ZeroDuration() || nanos >= absl::Seconds(1)) {
+    reader->Fail();
+  }
+  return absl::Seconds(seconds) + nanos;
+}
+
+}  // namespace
+
+void EventRollup::Add(absl::Duration duration) {
+  ++count;
+  total_duration += duration;
+}
+
+void EventRollup::Merge(const EventRollup& other) {
+  count += other.count;
+  total_duration += other.total_duration;
+}
+
+void EncodeRollup(const EventRollup& rollup, std::string* dst) {
+  util::PutVarint64(rollup.count, dst);
+  PutDuration(rollup.total_duration, dst);
+}
+
+bool DecodeRollup(absl::string_view row, EventRollup* rollup) {
+  util::VarintReader reader(row);
+  rollup->count = static_cast<int64_t>(reader.Varint());
+  rollup->total_duration = GetDuration(&reader);
+  if (!reader.done()) {
+    // The min and max start of an older row, as durations since the epoch.
+    GetDuration(&reader);
+    GetDuration(&reader);
+  }
+  return reader.ok() && reader.done();
+}
+
+leveldb::Status ReadRollups(storage::StorageInterface* storage,
+                            const leveldb::ReadOptions& options, uint64_t user,
+                            uint64_t stat_id,
+                            absl::Span<const TimeRangeToken> tokens,
+                            EventRollup* rollup) {
+  std::vector<std::string> keys;
+  keys.reserve(tokens.size());
+  for (const TimeRangeToken& token : tokens) {
+    keys.push_back(
+        Key::ForRollup(user, stat_id, token.level(), token.index()));
+  }
+  std::sort(keys.begin(), keys.end());
+
+  auto it = storage->NewIterator(options);
+  for (const std::string& key : keys) {
+    if (!it->Valid() || it->key().compare(key) < 0) it->Seek(key);
+    if (!it->Valid()) break;
+    if (it->key() != leveldb::Slice(key)) continue;
+    EventRollup row;
+    if (!DecodeRollup(absl::string_view(it->value().data(), it->value().size()),
+                      &row)) {
+      return leveldb::Status::Corruption(
+          absl::StrCat("rollup ", absl::CHexEscape(key), " not parseable."));
+    }
+    rollup->Merge(row);
+  }
+  return it->status();
+}
+
+// Truncating division puts the times of (-g, g) in the bucket of index 0 at
+// granularity g, and those of ((i - 1) * g, i * g] in a negative bucket i, so
+// the span starts a bucket early for those and the starts in it are filtered
+// by token. The tokens of a range are contiguous, so past that edge the first
+// start found from either end is counted.
+leveldb::Status ReadStartBounds(storage::StorageInterface* storage,
+                                const leveldb::ReadOptions& options,
+                                uint64_t user, uint64_t stat_id,
+                                const Tokenizer& tokenizer,
+                                absl::Span<const TimeRangeToken> tokens,
+                                absl::Time* min_start, absl::Time* max_start) {
+  if (tokens.empty()) return leveldb::Status::OK();
+  std::vector<TimeRangeToken> sorted_tokens(tokens.begin(), tokens.end());
+  std::sort(sorted_tokens.begin(), sorted_tokens.end());
+  absl::Time begin = absl::InfiniteFuture(), end = absl::InfinitePast();
+  for (const TimeRangeToken& token : sorted_tokens) {
+    begin = std::min(begin, token.index() > 0
+                                ? tokenizer.StartTime(token)
+                                : tokenizer.StartTime(token) -
+                                      tokenizer.granularity(token.level()));
+    end = std::max(end, tokenizer.EndTime(token));
+  }
+  const Key begin_key = Key::ForEventStart(user, stat_id, begin, 0);
+  const Key end_key = Key::ForEventStart(user, stat_id, end, 0);
+
+  // Parses the start of a row, and whether the tokens count it.
+  std::vector<TimeRangeToken> point_tokens;
+  const auto parse_counted =
+      [&](const leveldb::Slice& key_slice,
+          absl::Time* start) -> util::StatusOr<leveldb::Status, bool> {
+    const absl::string_view key(key_slice.data(), key_slice.size());
+    uint64_t start_user, start_stat_id, event_id;
+    if (!Key::ParseEventStart(key, &start_user, &start_stat_id, start,
+                              &event_id)) {
+      return leveldb::Status::Corruption(
+          absl::StrCat("start time row ", absl::CHexEscape(key),
+                       " not parseable."));
+    }
+    point_tokens.clear();
+    tokenizer.TokenizeTimePoint(*start, &point_tokens);
+    for (const TimeRangeToken& token : point_tokens) {
+      if (std::binary_search(sorted_tokens.begin(), sorted_tokens.end(),
+                             token)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto it = storage->NewIterator(options);
+  absl::Time start;
+  for (it->Seek(begin_key); it->Valid() && it->key().compare(end_key) < 0;
+       it->Next()) {
+    ASSIGN_OR_RETURN(const bool counted, parse_counted(it->key(), &start));
+    if (counted) {
+      *min_start = start;
+      break;
+    }
+  }
+  RETURN_IF_ERROR(it->status());
+  it->Seek(end_key);
+  for (it->Valid() ? it->Prev() : it->SeekToLast();
+       it->Valid() && it->key().compare(begin_key) >= 0; it->Prev()) {
+    ASSIGN_OR_RETURN(const bool counted, parse_counted(it->key(), &start));
+    if (counted) {
+      *max_start = start;
+      break;
+    }
+  }
+  return it->status();
+}
+
+leveldb::Status RollupWriter::Load(uint64_t user, uint64_t stat_id,
+                                   TimeRangeToken token, EventRollup** rollup) {
+  const Key key =
+      Key::ForRollup(user, stat_id, token.level(), token.index());
+  auto it = rows_.find(key);
+  if (it == rows_.end()) {
+    EventRollup loaded;
+    std::string value;
+    const leveldb::Status status =
+        storage_->Get(leveldb::ReadOptions(), key, &value);
+    if (!status.ok() && !status.IsNotFound()) return status;
+    if (status.ok() && !DecodeRollup(value, &loaded)) {
+      return leveldb::Status::Corruption(
+          absl::StrCat("rollup ", absl::CHexEscape(absl::string_view(key)),
+                       " not parseable."));
+    }
+    it = rows_.emplace(key, loaded).first;
+  }
+  *rollup = &it->second;
+  return leveldb::Status::OK();
+}
+
+leveldb::Status RollupWriter::Add(uint64_t user, uint64_t stat_id,
+                                  absl::Time start, absl::Duration duration) {
+  tokens_.clear();
+  tokenizer_->TokenizeTimePoint(start, &tokens_);
+  for (TimeRangeToken token : tokens_) {
+    EventRollup* rollup;
+    RETURN_IF_ERROR(Load(user, stat_id, token, &rollup));
+    rollup->Add(duration);
+  }
+  return leveldb::Status::OK();
+}
+
+leveldb::Status RollupWriter::Remove(uint64_t user, uint64_t stat_id,
+                                     absl::Time start,
+                                     absl::Duration duration) {
+  tokens_.clear();
+  tokenizer_->TokenizeTimePoint(start, &tokens_);
+  for (TimeRangeToken token : tokens_) {
+    EventRollup* rollup;
+    RETURN_IF_ERROR(Load(user, stat_id, token, &rollup));
+    --rollup->count;
+    rollup->total_duration -= duration;
+  }
+  return leveldb::Status::OK();
+}
+
+void RollupWriter::Flush(leveldb::WriteBatch* batch) {
+  std::string value;
+  for (const auto& key_and_rollup : rows_) {
+    const EventRollup& rollup = key_and_rollup.second;
+    // Rows of events that predate rollups may be missing; never go negative.
+    if (rollup.count <= 0) {
+      batch->Delete(key_and_rollup.first);
+      continue;
+    }
+    value.clear();
+    EncodeRollup(rollup, &value);
+    batch->Put(key_and_rollup.first, value);
+  }
+  rows_.clear();
+}
+
+}  // namespace stat_tracker
@@ -0,0 +1,86 @@
+#ifndef STAT_TRACKER_ROLLUP_H_
+#define STAT_TRACKER_ROLLUP_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "leveldb/status.h"
+#include "leveldb/write_batch.h"
+#include "stat_tracker/key.h"
+#include "stat_tracker/time_index.h"
+#include "storage/storage.h"
+
+namespace stat_tracker {
+
+// Aggregates of the events starting in some span of time.
+struct EventRollup {
+  int64_t count = 0;
+  absl::Duration total_duration;
+
+  void Add(absl::Duration duration);
+  void Merge(const EventRollup& other);
+};
+
+// Each stat keeps a rollup row per point token of its events' start times:
+// the row of a token aggregates the events whose start falls in the token's
+// bucket, so the rollup of a range is the merge of the rows of the tokens
+// covering it. An encoded row is the varint count, then the total duration
+// as zigzag varint seconds and varint nanos. Rows used to go on with the min
+// and the max start, encoded likewise, which are skipped.
+void EncodeRollup(const EventRollup& rollup, std::string* dst);
+
+// Returns false if `row` is malformed.
+bool DecodeRollup(absl::string_view row, EventRollup* rollup);
+
+// Merges into `rollup` the rows of `tokens` in a stat's rollups, read in key
+// order with one iterator. Tokens without a row count nothing.
+leveldb::Status ReadRollups(storage::StorageInterface* storage,
+                            const leveldb::ReadOptions& options, uint64_t user,
+                            uint64_t stat_id,
+                            absl::Span<const TimeRangeToken> tokens,
+                            EventRollup* rollup);
+
+// Sets `min_start` and `max_start` to the first and last starts among a
+// stat's start time rows that the rollups of `tokens` count, seeking in from
+// each end of the tokens' span. Leaves them unchanged if there are none.
+leveldb::Status ReadStartBounds(storage::StorageInterface* storage,
+                                const leveldb::ReadOptions& options,
+                                uint64_t user, uint64_t stat_id,
+                                const Tokenizer& tokenizer,
+                                absl::Span<const TimeRangeToken> tokens,
+                                absl::Time* min_start, absl::Time* max_start);
+
+// Buffers edits to rollup rows so that all the events written to a row within
+// one WriteBatch cost a single read and a single Put, like PostingBlockWriter.
+class RollupWriter {
+ public:
+  RollupWriter(storage::StorageInterface* storage, const Tokenizer* tokenizer)
+      : storage_(storage), tokenizer_(tokenizer) {}
+
+  leveldb::Status Add(uint64_t user, uint64_t stat_id, absl::Time start,
+                      absl::Duration duration);
+  leveldb::Status Remove(uint64_t user, uint64_t stat_id, absl::Time start,
+                         absl::Duration duration);
+
+  // Writes every modified row to `batch`, deleting the ones left empty.
+  void Flush(leveldb::WriteBatch* batch);
+
+ private:
+  // Reads the row of `token` on first use.
+  leveldb::Status Load(uint64_t user, uint64_t stat_id, TimeRangeToken token,
+                       EventRollup** rollup);
+
+  storage::StorageInterface* storage_;
+  const Tokenizer* tokenizer_;
+  std::map<std::string, EventRollup> rows_;
+  std::vector<TimeRangeToken> tokens_;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_ROLLUP_H_
@@ -0,0 +1,177 @@
+#include "stat_tracker/rollup.h"
+
+#include <string>
+#include <utility>
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "leveldb/write_batch.h"
+#include "storage/testing/leveldb.h"
+#include "util/status_test_macros.h"
+
+namespace stat_tracker {
+namespace {
+
+const absl::Time kEpoch = absl::UnixEpoch();
+
+MATCHER_P2(RollupIs, count, total_duration, "") {
+  return arg.count == count && arg.total_duration == total_duration;
+}
+
+TEST(RollupTest, RoundTrip) {
+  EventRollup rollup;
+  rollup.Add(absl::Hours(2e6));
+  rollup.Add(absl::Hours(2e6));
+  rollup.Add(-absl::Nanoseconds(3));
+  std::string row;
+  EncodeRollup(rollup, &row);
+
+  EventRollup decoded;
+  ASSERT_TRUE(DecodeRollup(row, &decoded));
+  EXPECT_THAT(decoded, RollupIs(3, absl::Hours(4e6) - absl::Nanoseconds(3)));
+  EXPECT_FALSE(DecodeRollup(row.substr(0, row.size() - 1), &decoded));
+  EXPECT_FALSE(DecodeRollup(row + "x", &decoded));
+}
+
+TEST(RollupTest, DecodeSkipsBounds) {
+  // Count 2, 3.5s in total, then starts at 1s and 2s.
+  EventRollup decoded;
+  ASSERT_TRUE(DecodeRollup(std::string("\x02\x06\x80\xca\xb5\xee\x01"
+                                       "\x02\x00\x04\x00",
+                                       11),
+                           &decoded));
+  EXPECT_THAT(decoded, RollupIs(2, absl::Milliseconds(3500)));
+}
+
+class RollupWriterTest : public ::testing::Test {
+ protected:
+  RollupWriterTest()
+      : leveldb_env_("rollup_test.leveldb"),
+        tokenizer_({absl::Seconds(1), absl::Seconds(10)}) {}
+
+  // Writes the writer's rows and `batch`.
+  leveldb::Status Write(RollupWriter* writer, leveldb::WriteBatch* batch) {
+    writer->Flush(batch);
+    return leveldb_env_.db()->Write(leveldb::WriteOptions(), batch);
+  }
+
+  EventRollup Read(absl::Time start, absl::Time end) {
+    EventRollup rollup;
+    EXPECT_OK(ReadRollups(leveldb_env_.db().get(), leveldb::ReadOptions(), 1,
+                          2, tokenizer_.TokenizeTimeRange(start, end),
+                          &rollup));
+    return rollup;
+  }
+
+  // The min and max start counted in [start, end), or InfiniteFuture and
+  // InfinitePast if there are none.
+  std::pair<absl::Time, absl::Time> ReadBounds(absl::Time start,
+                                               absl::Time end) {
+    std::pair<absl::Time, absl::Time> bounds(absl::InfiniteFuture(),
+                                             absl::InfinitePast());
+    EXPECT_OK(ReadStartBounds(leveldb_env_.db().get(), leveldb::ReadOptions(),
+                              1, 2, tokenizer_,
+                              tokenizer_.TokenizeTimeRange(start, end),
+                              &bounds.first, &bounds.second));
+    return bounds;
+  }
+
+  // Records an event's rollups and start time row.
+  leveldb::Status AddEvent(uint64_t stat_id, uint64_t event_id,
+                           absl::Time start, absl::Duration duration) {
+    RollupWriter writer(leveldb_env_.db().get(), &tokenizer_);
+    RETURN_IF_ERROR(writer.Add(1, stat_id, start, duration));
+    leveldb::WriteBatch batch;
+    batch.Put(Key::ForEventStart(1, stat_id, start, event_id), "");
+    return Write(&writer, &batch);
+  }
+
+  storage::LevelDbTestEnvironment leveldb_env_;
+  const Tokenizer tokenizer_;
+};
+
+TEST_F(RollupWriterTest, AddsToEveryLevel) {
+  RollupWriter writer(leveldb_env_.db().get(), &tokenizer_);
+  ASSERT_OK(writer.Add(1, 2, kEpoch + absl::Seconds(3), absl::Seconds(1)));
+  ASSERT_OK(writer.Add(1, 2, kEpoch + absl::Seconds(12), absl::Seconds(2)));
+  ASSERT_OK(writer.Add(1, 2, kEpoch + absl::Milliseconds(12500),
+                       absl::Seconds(4)));
+  ASSERT_OK(writer.Add(1, 3, kEpoch + absl::Seconds(4), absl::Seconds(8)));
+  leveldb::WriteBatch batch;
+  ASSERT_OK(Write(&writer, &batch));
+
+  EXPECT_THAT(Read(kEpoch, kEpoch + absl::Seconds(20)),
+              RollupIs(3, absl::Seconds(7)));
+  // [2s, 13s) is covered by the second buckets 2s to 12s.
+  EXPECT_THAT(Read(kEpoch + absl::Seconds(2), kEpoch + absl::Seconds(13)),
+              RollupIs(3, absl::Seconds(7)));
+  EXPECT_THAT(Read(kEpoch + absl::Seconds(12), kEpoch + absl::Seconds(13)),
+              RollupIs(2, absl::Seconds(6)));
+  EXPECT_THAT(Read(kEpoch + absl::Seconds(4), kEpoch + absl::Seconds(12)),
+              RollupIs(0, absl::ZeroDuration()));
+}
+
+TEST_F(RollupWriterTest, RemoveDeletesEmptyRows) {
+  const absl::Time start = kEpoch + absl::Seconds(11);
+  ASSERT_OK(AddEvent(2, 0, start, absl::Seconds(1)));
+  ASSERT_OK(AddEvent(2, 1, start, absl::Seconds(2)));
+
+  RollupWriter writer(leveldb_env_.db().get(), &tokenizer_);
+  leveldb::WriteBatch batch;
+  ASSERT_OK(writer.Remove(1, 2, start, absl::Seconds(1)));
+  ASSERT_OK(Write(&writer, &batch));
+  EXPECT_THAT(Read(kEpoch, kEpoch + absl::Seconds(20)),
+              RollupIs(1, absl::Seconds(2)));
+
+  ASSERT_OK(writer.Remove(1, 2, start, absl::Seconds(2)));
+  ASSERT_OK(Write(&writer, &batch));
+  EXPECT_THAT(Read(kEpoch, kEpoch + absl::Seconds(20)),
+              RollupIs(0, absl::ZeroDuration()));
+  auto it = leveldb_env_.db()->NewIterator(leveldb::ReadOptions());
+  it->Seek(Key::StatRollupsPrefix(1, 2));
+  EXPECT_FALSE(it->Valid() &&
+               it->key().starts_with(Key::StatRollupsPrefix(1, 2)));
+}
+
+TEST_F(RollupWriterTest, StartBoundsOfRange) {
+  const absl::Time starts[] = {kEpoch + absl::Seconds(3),
+                               kEpoch + absl::Seconds(11),
+                               kEpoch + absl::Milliseconds(15500),
+                               kEpoch + absl::Seconds(18)};
+  for (uint64_t event_id = 0; event_id < 4; ++event_id) {
+    ASSERT_OK(AddEvent(2, event_id, starts[event_id], absl::Seconds(1)));
+  }
+  // Same times in another stat.
+  ASSERT_OK(AddEvent(3, 0, kEpoch, absl::Seconds(1)));
+  ASSERT_OK(AddEvent(3, 1, kEpoch + absl::Seconds(30), absl::Seconds(1)));
+
+  EXPECT_EQ(ReadBounds(kEpoch, kEpoch + absl::Seconds(20)),
+            std::make_pair(starts[0], starts[3]));
+  // Rounded down to whole seconds, like the rollups.
+  EXPECT_EQ(ReadBounds(kEpoch + absl::Milliseconds(10500),
+                       kEpoch + absl::Milliseconds(16200)),
+            std::make_pair(starts[1], starts[2]));
+  EXPECT_EQ(ReadBounds(kEpoch + absl::Seconds(11), kEpoch + absl::Seconds(15)),
+            std::make_pair(starts[1], starts[1]));
+  EXPECT_EQ(ReadBounds(kEpoch + absl::Seconds(4), kEpoch + absl::Seconds(11)),
+            std::make_pair(absl::InfiniteFuture(), absl::InfinitePast()));
+}
+
+TEST_F(RollupWriterTest, NegativeTimesShareBucketZero) {
+  // Truncation puts -0.5s and 0.5s in the same buckets of every level, and
+  // -1.5s in the second's bucket -1.
+  const absl::Time before = kEpoch - absl::Milliseconds(500);
+  const absl::Time after = kEpoch + absl::Milliseconds(500);
+  ASSERT_OK(AddEvent(2, 0, kEpoch - absl::Milliseconds(1500),
+                     absl::Seconds(1)));
+  ASSERT_OK(AddEvent(2, 1, before, absl::Seconds(1)));
+  ASSERT_OK(AddEvent(2, 2, after, absl::Seconds(1)));
+
+  EXPECT_THAT(Read(kEpoch, kEpoch + absl::Seconds(1)),
+              RollupIs(2, absl::Seconds(2)));
+  EXPECT_EQ(ReadBounds(kEpoch, kEpoch + absl::Seconds(1)),
+            std::make_pair(before, after));
+}
+
+}  // namespace
+}  // namespace stat_tracker
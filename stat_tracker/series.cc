@@ -0,0 +1,85 @@
+#include "stat_tracker/series.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace stat_tracker {
+
+namespace {
+
+constexpr size_t kBlockSize = 256;
+
+// The bucket of `x`, clamped to [0, max_bucket]. The reciprocal is off by at
+// most one bucket, which the remainder corrects.
+inline int64_t BucketOf(int64_t x, int64_t width, double inverse_width,
+                        int64_t max_bucket) {
+  int64_t q = static_cast<int64_t>(x * inverse_width);
+  q = std::max<int64_t>(0, std::min(q, max_bucket));
+  const int64_t r = x - q * width;
+  q += (r >= width) - (r < 0);
+  return std::max<int64_t>(0, std::min(q, max_bucket));
+}
+
+}  // namespace
+
+void BucketIntervals(absl::Span<const int64_t> starts,
+                     absl::Span<const int64_t> ends, int64_t width,
+                     absl::Span<int64_t> counts,
+                     absl::Span<int64_t> active_nanos) {
+  CHECK_EQ(starts.size(), ends.size());
+  CHECK_EQ(counts.size(), active_nanos.size());
+  CHECK_GT(width, 0);
+  const int64_t num_buckets = counts.size();
+  if (num_buckets == 0) return;
+  const int64_t span = width * num_buckets;
+  const double inverse_width = 1.0 / width;
+
+  // covering[b] - covering[b - 1] intervals overlap bucket b but not b - 1.
+  // Each one is taken to cover its buckets in full, and the parts of its
+  // first and last bucket it doesn't cover are subtracted in `uncovered`.
+  std::vector<int64_t> covering(num_buckets + 1, 0);
+  std::vector<int64_t> uncovered(num_buckets, 0);
+
+  int64_t first[kBlockSize], last[kBlockSize], head[kBlockSize],
+      tail[kBlockSize], valid[kBlockSize];
+  for (size_t begin = 0; begin < starts.size(); begin += kBlockSize) {
+    const size_t size = std::min(kBlockSize, starts.size() - begin);
+    const int64_t* block_starts = starts.data() + begin;
+    const int64_t* block_ends = ends.data() + begin;
+
+    // Branch-free once BucketOf is inlined, so that this loop vectorizes.
+    for (size_t i = 0; i < size; ++i) {
+      const int64_t start = block_starts[i];
+      const int64_t end = block_ends[i];
+      const bool instant = end <= start;
+      const int64_t s = std::max<int64_t>(0, std::min(start, span));
+      const int64_t e =
+          instant ? s : std::max<int64_t>(0, std::min(end, span));
+      valid[i] = instant ? (start >= 0 && start < span) : e > s;
+
+      first[i] = BucketOf(s, width, inverse_width, num_buckets - 1);
+      last[i] =
+          BucketOf(std::max(e - 1, s), width, inverse_width, num_buckets - 1);
+      head[i] = s - first[i] * width;
+      tail[i] = (last[i] + 1) * width - e;
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+      covering[first[i]] += valid[i];
+      covering[last[i] + 1] -= valid[i];
+      uncovered[first[i]] += head[i] * valid[i];
+      uncovered[last[i]] += tail[i] * valid[i];
+    }
+  }
+
+  int64_t overlapping = 0;
+  for (int64_t b = 0; b < num_buckets; ++b) {
+    overlapping += covering[b];
+    counts[b] += overlapping;
+    active_nanos[b] += overlapping * width - uncovered[b];
+  }
+}
+
+}  // namespace stat_tracker
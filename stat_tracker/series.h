@@ -0,0 +1,31 @@
+#ifndef STAT_TRACKER_SERIES_H_
+#define STAT_TRACKER_SERIES_H_
+
+#include <cstdint>
+
+#include "absl/types/span.h"
+
+namespace stat_tracker {
+
+// Adds to counts[b] the number of intervals [starts[i], ends[i]) that overlap
+// bucket b, and to active_nanos[b] the sum of their overlaps with it. Times
+// are nanoseconds from the start of bucket 0, and bucket b covers
+// [b * width, (b + 1) * width); width * counts.size() must fit in an int64.
+// An interval with ends[i] <= starts[i] is an instant, counted in the bucket
+// holding its start, if any, with no active time.
+//
+// Intervals are handled a block at a time: a branch-free pass over the block
+// finds the first and last bucket of each interval by multiplying by the
+// reciprocal of the width, which compilers can vectorize where they can't a
+// division, and a second pass adds them to difference arrays. A final prefix
+// sum over the buckets turns those into the results, so the cost is linear in
+// the number of intervals plus the number of buckets, however long the
+// intervals.
+void BucketIntervals(absl::Span<const int64_t> starts,
+                     absl::Span<const int64_t> ends, int64_t width,
+                     absl::Span<int64_t> counts,
+                     absl::Span<int64_t> active_nanos);
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_SERIES_H_
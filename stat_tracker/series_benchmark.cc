@@ -0,0 +1,45 @@
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "stat_tracker/series.h"
+
+namespace {
+
+constexpr int64_t kWidth = 1000000007;
+
+// Intervals within a range of `num_buckets` buckets, lasting up to a tenth of
+// it.
+void GenerateIntervals(int num_intervals, int num_buckets,
+                       std::vector<int64_t>* starts,
+                       std::vector<int64_t>* ends) {
+  std::mt19937_64 rng(0);
+  const int64_t span = kWidth * num_buckets;
+  std::uniform_int_distribution<int64_t> start(-span / 10, span);
+  std::uniform_int_distribution<int64_t> duration(0, span / 10);
+  for (int i = 0; i < num_intervals; ++i) {
+    starts->push_back(start(rng));
+    ends->push_back(starts->back() + duration(rng));
+  }
+}
+
+}  // namespace
+
+static void BM_BucketIntervals(benchmark::State& state) {
+  const int num_buckets = state.range(1);
+  std::vector<int64_t> starts, ends;
+  GenerateIntervals(state.range(0), num_buckets, &starts, &ends);
+  std::vector<int64_t> counts(num_buckets), active_nanos(num_buckets);
+  for (auto _ : state) {
+    stat_tracker::BucketIntervals(starts, ends, kWidth,
+                                  absl::MakeSpan(counts),
+                                  absl::MakeSpan(active_nanos));
+    benchmark::DoNotOptimize(counts.data());
+    benchmark::DoNotOptimize(active_nanos.data());
+  }
+  state.SetItemsProcessed(state.iterations() * starts.size());
+}
+BENCHMARK(BM_BucketIntervals)
+    ->Args({1000, 100})
+    ->Args({100000, 100})
+    ->Args({100000, 2000});
@@ -0,0 +1,91 @@
+#include "stat_tracker/series.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace stat_tracker {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+
+struct Series {
+  std::vector<int64_t> counts;
+  std::vector<int64_t> active_nanos;
+};
+
+Series Bucket(const std::vector<int64_t>& starts,
+              const std::vector<int64_t>& ends, int64_t width,
+              int num_buckets) {
+  Series series{std::vector<int64_t>(num_buckets),
+                std::vector<int64_t>(num_buckets)};
+  BucketIntervals(starts, ends, width, absl::MakeSpan(series.counts),
+                  absl::MakeSpan(series.active_nanos));
+  return series;
+}
+
+// One interval and bucket at a time.
+Series BucketSlowly(const std::vector<int64_t>& starts,
+                    const std::vector<int64_t>& ends, int64_t width,
+                    int num_buckets) {
+  Series series{std::vector<int64_t>(num_buckets),
+                std::vector<int64_t>(num_buckets)};
+  for (size_t i = 0; i < starts.size(); ++i) {
+    for (int b = 0; b < num_buckets; ++b) {
+      const int64_t bucket_start = b * width, bucket_end = bucket_start + width;
+      if (ends[i] <= starts[i]) {
+        if (starts[i] >= bucket_start && starts[i] < bucket_end) {
+          ++series.counts[b];
+        }
+        continue;
+      }
+      const int64_t overlap = std::min(ends[i], bucket_end) -
+                              std::max(starts[i], bucket_start);
+      if (overlap > 0) {
+        ++series.counts[b];
+        series.active_nanos[b] += overlap;
+      }
+    }
+  }
+  return series;
+}
+
+TEST(SeriesTest, Intervals) {
+  // Instants at 12 and 30, and nothing at or past the end.
+  const Series series = Bucket({5, 12, -10, -5, 40, 30},
+                               {25, 12, -1, 100, 50, 30}, 10, 4);
+  EXPECT_THAT(series.counts, ElementsAre(2, 3, 2, 2));
+  EXPECT_THAT(series.active_nanos, ElementsAre(15, 20, 15, 10));
+}
+
+TEST(SeriesTest, NoBuckets) {
+  const Series series = Bucket({1}, {2}, 10, 0);
+  EXPECT_TRUE(series.counts.empty());
+}
+
+TEST(SeriesTest, MatchesBucketingSlowly) {
+  std::mt19937_64 rng(0);
+  // Wide enough buckets that times lose precision as doubles.
+  for (int64_t width : {int64_t{1}, int64_t{7}, int64_t{1000000000007}}) {
+    const int num_buckets = 50;
+    const int64_t span = width * num_buckets;
+    std::uniform_int_distribution<int64_t> time(-span / 4, span + span / 4);
+    std::vector<int64_t> starts, ends;
+    for (int i = 0; i < 1000; ++i) {
+      const int64_t start = time(rng);
+      starts.push_back(start);
+      ends.push_back(i % 10 == 0 ? start : std::max(start, time(rng)));
+    }
+    const Series expected = BucketSlowly(starts, ends, width, num_buckets);
+    const Series series = Bucket(starts, ends, width, num_buckets);
+    EXPECT_THAT(series.counts, ElementsAreArray(expected.counts));
+    EXPECT_THAT(series.active_nanos, ElementsAreArray(expected.active_nanos));
+  }
+}
+
+}  // namespace
+}  // namespace stat_tracker
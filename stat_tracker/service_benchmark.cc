@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "include/grpcpp/server_context.h"
+#include "stat_tracker/service_impl.h"
+#include "stat_tracker/time_util.h"
+#include "storage/storage.h"
+#include "storage/testing/leveldb.h"
+
+// Benchmarks of StatServiceImpl called directly, without gRPC in between.
+
+namespace stat_tracker {
+namespace {
+
+constexpr int kNumWriters = 2;
+constexpr int kInitialEvents = 1000;
+
+std::set<absl::Duration> Granularities() {
+  return {absl::Seconds(1), absl::Minutes(1), absl::Hours(1), absl::Hours(24)};
+}
+
+std::string DefineStat(StatServiceImpl* service,
+                       const std::string& display_name) {
+  grpc::ServerContext context;
+  DefineStatRequest request;
+  request.set_user_id("jack");
+  request.mutable_stat()->set_display_name(display_name);
+  DefineStatResponse response;
+  service->DefineStat(&context, &request, &response);
+  return response.new_stat_id();
+}
+
+void RecordEvent(StatServiceImpl* service, const std::string& stat_id,
+                 int seconds) {
+  grpc::ServerContext context;
+  RecordEventRequest request;
+  request.set_user_id("jack");
+  request.mutable_event()->set_stat_id(stat_id);
+  *request.mutable_event()->mutable_start_time() =
+      ToProtoTimestamp(absl::FromUnixSeconds(seconds));
+  *request.mutable_event()->mutable_duration() =
+      ToProtoDuration(absl::Seconds(1));
+  google::protobuf::Empty empty;
+  service->RecordEvent(&context, &request, &empty);
+}
+
+// Counts the point reads of the storage it forwards to.
+class CountingStorage : public storage::StorageInterface {
+ public:
+  explicit CountingStorage(std::shared_ptr<storage::StorageInterface> storage)
+      : storage_(std::move(storage)) {}
+
+  leveldb::Status Get(const leveldb::ReadOptions& options,
+                      const leveldb::Slice& key, std::string* value) override {
+    ++num_gets_;
+    return storage_->Get(options, key, value);
+  }
+  std::unique_ptr<leveldb::Iterator> NewIterator(
+      const leveldb::ReadOptions& options) override {
+    return storage_->NewIterator(options);
+  }
+  leveldb::Status Write(const leveldb::WriteOptions& options,
+                        leveldb::WriteBatch* batch) override {
+    return storage_->Write(options, batch);
+  }
+  const leveldb::Snapshot* GetSnapshot() override {
+    return storage_->GetSnapshot();
+  }
+  void ReleaseSnapshot(const leveldb::Snapshot* snapshot) override {
+    storage_->ReleaseSnapshot(snapshot);
+  }
+  void CompactRange(const leveldb::Slice* begin,
+                    const leveldb::Slice* end) override {
+    storage_->CompactRange(begin, end);
+  }
+
+  int64_t num_gets() const { return num_gets_; }
+
+ private:
+  const std::shared_ptr<storage::StorageInterface> storage_;
+  std::atomic<int64_t> num_gets_{0};
+};
+
+double Percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  return sorted[std::min(sorted.size() - 1,
+                         static_cast<size_t>(sorted.size() * p))];
+}
+
+void LockingAndBackends(benchmark::internal::Benchmark* benchmark) {
+  for (int snapshot_reads : {0, 1}) {
+    for (storage::Backend backend :
+         {storage::Backend::kLevelDb, storage::Backend::kInMemory}) {
+      benchmark->Args({snapshot_reads, static_cast<int>(backend)});
+    }
+  }
+}
+
+// Read latency of one user's events while other threads keep recording events
+// for that user. The first argument is whether reads use snapshots (1) or the
+// user lock (0), the second the storage backend.
+void BM_ReadEventsUnderWrites(benchmark::State& state) {
+  const auto backend = static_cast<storage::Backend>(state.range(1));
+  storage::LevelDbTestEnvironment env("service_benchmark.leveldb", backend);
+  StatServiceImpl::Options options{env.db(), Granularities()};
+  options.snapshot_reads = state.range(0) != 0;
+  StatServiceImpl service(options);
+
+  // The writers record into their own stat, so they contend for the user but
+  // leave the data that is read unchanged.
+  const std::string written_stat_id = DefineStat(&service, "bar");
+  const std::string read_stat_id = DefineStat(&service, "foo");
+  for (int i = 0; i < kInitialEvents; ++i) {
+    RecordEvent(&service, read_stat_id, i);
+  }
+
+  std::atomic<bool> done(false);
+  std::atomic<int> next_event(0);
+  std::vector<std::thread> writers;
+  for (int i = 0; i < kNumWriters; ++i) {
+    writers.emplace_back([&] {
+      while (!done.load(std::memory_order_relaxed)) {
+        RecordEvent(&service, written_stat_id, next_event.fetch_add(1));
+      }
+    });
+  }
+
+  ReadEventsRequest read;
+  read.set_user_id("jack");
+  read.add_stat_id(read_stat_id);
+  *read.mutable_start_time() = ToProtoTimestamp(absl::FromUnixSeconds(0));
+  *read.mutable_duration() = ToProtoDuration(absl::Seconds(600));
+  std::vector<double> latencies_us;
+  for (auto _ : state) {
+    grpc::ServerContext context;
+    ReadEventsResponse response;
+    const absl::Time start = absl::Now();
+    service.ReadEvents(&context, &read, &response);
+    latencies_us.push_back(absl::ToDoubleMicroseconds(absl::Now() - start));
+    benchmark::DoNotOptimize(response);
+  }
+  done = true;
+  for (std::thread& writer : writers) writer.join();
+
+  std::sort(latencies_us.begin(), latencies_us.end());
+  state.counters["p50_us"] = Percentile(latencies_us, 0.5);
+  state.counters["p99_us"] = Percentile(latencies_us, 0.99);
+  state.counters["writes"] = next_event.load();
+  state.SetLabel(absl::StrCat(state.range(0) ? "snapshot" : "user_lock", "/",
+                              storage::BackendName(backend)));
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ReadEventsUnderWrites)->Apply(LockingAndBackends)->UseRealTime();
+
+// Events recorded one RecordEvent call each (1), or in RecordEvents batches of
+// the argument's size.
+void BM_Backfill(benchmark::State& state) {
+  storage::LevelDbTestEnvironment env("service_benchmark.leveldb",
+                                      storage::Backend::kLevelDb);
+  StatServiceImpl service(StatServiceImpl::Options{env.db(), Granularities()});
+  const std::string stat_id = DefineStat(&service, "foo");
+  const int batch_size = state.range(0);
+  int seconds = 0;
+  for (auto _ : state) {
+    if (batch_size == 1) {
+      RecordEvent(&service, stat_id, seconds++);
+      continue;
+    }
+    grpc::ServerContext context;
+    RecordEventsRequest request;
+    request.set_user_id("jack");
+    for (int i = 0; i < batch_size; ++i) {
+      Event* event = request.add_events();
+      event->set_stat_id(stat_id);
+      *event->mutable_start_time() =
+          ToProtoTimestamp(absl::FromUnixSeconds(seconds++));
+      *event->mutable_duration() = ToProtoDuration(absl::Seconds(1));
+    }
+    RecordEventsResponse response;
+    service.RecordEvents(&context, &request, &response);
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_Backfill)->Arg(1)->Arg(10)->Arg(100)->Arg(1000);
+
+// Cost of the write path of RecordEvent, with the posting block cache off (0)
+// or on (1). Reports the storage reads per event besides the time.
+void BM_RecordEvent(benchmark::State& state) {
+  storage::LevelDbTestEnvironment env("service_benchmark.leveldb",
+                                      storage::Backend::kLevelDb);
+  auto storage = std::make_shared<CountingStorage>(env.db());
+  StatServiceImpl::Options options{storage, Granularities()};
+  if (state.range(0) != 0) options.posting_block_cache_bytes = 16 << 20;
+  StatServiceImpl service(options);
+  const std::string stat_id = DefineStat(&service, "foo");
+  const int64_t gets_before = storage->num_gets();
+  int seconds = 0;
+  for (auto _ : state) {
+    RecordEvent(&service, stat_id, seconds++);
+  }
+  state.counters["gets_per_event"] =
+      static_cast<double>(storage->num_gets() - gets_before) /
+      state.iterations();
+  state.SetLabel(state.range(0) ? "posting_block_cache" : "uncached");
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RecordEvent)->Arg(0)->Arg(1);
+
+}  // namespace
+}  // namespace stat_tracker
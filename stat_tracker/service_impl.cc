@@ -1,40 +1,133 @@
 #include "stat_tracker/service_impl.h"
 
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/escaping.h"
 #include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
 #include "glog/logging.h"
-#include "google/protobuf/wrappers.pb.h"
+#include "google/protobuf/arena.h"
 #include "leveldb/options.h"
 #include "leveldb/slice.h"
 #include "leveldb/status.h"
 #include "leveldb/write_batch.h"
 #include "stat_tracker/key.h"
+#include "stat_tracker/series.h"
 #include "stat_tracker/time_util.h"
+#include "stat_tracker/value_column.h"
 #include "storage/status_util.h"
 
 namespace stat_tracker {
 
 namespace {
 
-std::string ToTokenString(absl::string_view prefix,
-                          const TimeRangeToken& token) {
-  return absl::StrCat(prefix, "-", absl::FormatDuration(token.granularity), "@",
-                      token.index);
+// Legacy rows are migrated in batches of roughly this many bytes.
+constexpr size_t kMaxMigrationBatchBytes = 4 << 20;
+
+// The reaper deletes the rows of deleted stats in batches of this many.
+constexpr int kMaxReapBatchRows = 1000;
+
+// DeleteEventsInRange deletes this many events per write.
+constexpr int kMaxDeleteBatchEvents = 1000;
+
+// StreamEvents pages hold at most this many events, by default or at all, and
+// end once their events take up this many bytes.
+constexpr int kDefaultStreamPageSize = 1000;
+constexpr int kMaxStreamPageSize = 10000;
+constexpr size_t kMaxStreamPageBytes = 1 << 20;
+
+// ReadSeries splits its range into this many buckets, by default or at most.
+constexpr int kDefaultSeriesBuckets = 100;
+constexpr int kMaxSeriesBuckets = 10000;
+
+absl::string_view ToStringView(const leveldb::Slice& slice) {
+  return absl::string_view(slice.data(), slice.size());
 }
 
-template <typename T>
-util::StatusOr<leveldb::Status, T> ProtoGet(leveldb::DB* db,
-                                            const leveldb::ReadOptions& options,
-                                            const leveldb::Slice& key) {
-  std::string value_bytes;
-  RETURN_IF_ERROR(db->Get(options, key, &value_bytes));
+grpc::Status StatNotFound(absl::string_view stat_id) {
+  return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                      absl::StrCat("stat ", stat_id, " not found"));
+}
+
+bool IsNotFound(const grpc::Status& status) {
+  return status.error_code() == grpc::StatusCode::NOT_FOUND;
+}
+
+void SetResult(const grpc::Status& status,
+               RecordEventsResponse::Result* result) {
+  result->set_code(status.error_code());
+  result->set_error_message(status.error_message());
+}
 
-  T proto_value;
-  if (!proto_value.ParseFromString(value_bytes)) {
-    return leveldb::Status::Corruption(
-        absl::StrCat("key ", key.ToString(), " not parseable."));
+// Approximate bytes a cached proto takes: the object and its encoded fields.
+size_t CacheCharge(const google::protobuf::Message& message,
+                   size_t object_size) {
+  return object_size + message.ByteSizeLong();
+}
+
+bool HasRetention(const Stat& stat) {
+  return stat.retention().max_event_count() > 0 ||
+         FromProtoDuration(stat.retention().max_age()) > absl::ZeroDuration();
+}
+
+IndexToken ToIndexToken(TokenKind kind, TimeRangeToken token) {
+  return {kind, static_cast<uint8_t>(token.level()), token.index()};
+}
+
+// The row holds the event's numeric value, if it has one.
+void PutEventStart(uint64_t user, uint64_t stat_id, uint64_t event_id,
+                   const Event& event, leveldb::WriteBatch* batch) {
+  std::string value;
+  const absl::optional<NumericValue> numeric_value =
+      ParseNumericValue(event.value());
+  if (numeric_value.has_value()) EncodeNumericValue(*numeric_value, &value);
+  batch->Put(Key::ForEventStart(user, stat_id,
+                                FromProtoTimestamp(event.start_time()),
+                                event_id),
+             value);
+}
+
+// Only numeric values are sketched.
+absl::optional<double> SketchedValue(const google::protobuf::Any& value) {
+  const absl::optional<NumericValue> numeric_value = ParseNumericValue(value);
+  if (!numeric_value.has_value()) return absl::nullopt;
+  return numeric_value->ToDouble();
+}
+
+// Fills `event` in place, so that it can be a response's own, on its arena.
+grpc::Status ToEvent(uint64_t stat_id, const SegmentEvent& segment_event,
+                     Event* event) {
+  event->set_stat_id(absl::StrCat(stat_id));
+  *event->mutable_start_time() = ToProtoTimestamp(segment_event.start_time);
+  *event->mutable_duration() = ToProtoDuration(segment_event.duration);
+  if (!segment_event.value.empty() &&
+      !event->mutable_value()->ParseFromArray(segment_event.value.data(),
+                                              segment_event.value.size())) {
+    return grpc::Status(
+        grpc::StatusCode::INTERNAL,
+        absl::StrCat("value of event ", segment_event.id, " not parseable"));
   }
-  return std::move(proto_value);
+  return grpc::Status::OK;
+}
+
+// Parses the row in place, like ToEvent.
+leveldb::Status ProtoGet(storage::StorageInterface* storage,
+                         const leveldb::ReadOptions& options,
+                         const leveldb::Slice& key,
+                         google::protobuf::Message* value) {
+  std::string value_bytes;
+  RETURN_IF_ERROR(storage->Get(options, key, &value_bytes));
+  if (!value->ParseFromString(value_bytes)) {
+    return leveldb::Status::Corruption(absl::StrCat(
+        "key ", absl::CHexEscape(key.ToString()), " not parseable."));
+  }
+  return leveldb::Status::OK();
 }
 
 util::StatusOr<leveldb::Status, std::string> SerializeAsString(
@@ -54,13 +147,34 @@ leveldb::Status ProtoPut(const leveldb::Slice& key,
   return leveldb::Status::OK();
 }
 
+// E.g. "1s,1m,1h". Formatted durations are exact, whatever their size.
+void AppendGranularities(const Tokenizer& tokenizer, std::string* dst) {
+  for (int level = 0; level < tokenizer.num_levels(); ++level) {
+    if (level > 0) dst->push_back(',');
+    dst->append(absl::FormatDuration(tokenizer.granularity(level)));
+  }
+}
+
 }  // namespace
 
+std::set<absl::Duration> StatServiceImpl::SketchGranularities(
+    const Options& options) {
+  std::set<absl::Duration> granularities(
+      options.index_granularities.lower_bound(
+          options.quantile_sketch_granularity),
+      options.index_granularities.end());
+  if (granularities.empty()) {
+    granularities.insert(options.quantile_sketch_granularity);
+  }
+  return granularities;
+}
+
 util::StatusOr<grpc::Status, util::LockMap<std::string>::Lock>
 StatServiceImpl::AcquireUserLock(const grpc::ServerContext& context,
-                                 const std::string& user_id) {
-  auto user_lock =
-      user_locks_.AcquireWithTimeout(user_id, TimeoutFromContext(context));
+                                 const std::string& user_id,
+                                 util::LockMap<std::string>::Mode mode) {
+  auto user_lock = user_locks_.AcquireWithDeadline(
+      user_id, DeadlineFromContext(context), mode);
   if (!user_lock.has_value()) {
     return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
                         "deadline exceeded while waiting for user lock");
@@ -68,122 +182,275 @@ StatServiceImpl::AcquireUserLock(const grpc::ServerContext& context,
   return std::move(user_lock.value());
 }
 
-util::StatusOr<grpc::Status, uint64_t> StatServiceImpl::PostIncrement(
-    const Key& key, leveldb::WriteBatch* batch) {
-  auto value_or = ProtoGet<google::protobuf::UInt64Value>(
-      leveldb_.get(), leveldb::ReadOptions(), key);
-  if (value_or.status().IsNotFound()) {
-    value_or = google::protobuf::UInt64Value();
+util::StatusOr<grpc::Status, absl::optional<util::LockMap<std::string>::Lock>>
+StatServiceImpl::AcquireReadLock(const grpc::ServerContext& context,
+                                 const std::string& user_id,
+                                 bool uses_index_cache) {
+  if (snapshot_reads_ && !(uses_index_cache && index_cache_ != nullptr)) {
+    return absl::optional<util::LockMap<std::string>::Lock>();
   }
-  RETURN_IF_ERROR(storage::ToGrpcStatus(value_or.status()));
-  google::protobuf::UInt64Value& uint64_value = value_or.ValueOrDie();
-  uint64_t value = uint64_value.value();
-  uint64_value.set_value(value + 1);
-  RETURN_IF_ERROR(storage::ToGrpcStatus(ProtoPut(key, uint64_value, batch)));
-  return value;
+  ASSIGN_OR_RETURN(auto lock,
+                   AcquireUserLock(context, user_id,
+                                   util::LockMap<std::string>::Mode::kShared));
+  return absl::make_optional(std::move(lock));
 }
 
-grpc::Status StatServiceImpl::AppendEvent(const std::string& user_id,
-                                          const Event& event,
-                                          leveldb::WriteBatch* batch) {
-  const Key stat_key = Key::ForStat(user_id, event.stat_id());
-  RETURN_IF_ERROR(storage::ToGrpcStatus(
-      ProtoGet<Stat>(leveldb_.get(), leveldb::ReadOptions(), stat_key)
-          .status()));
+grpc::Status StatServiceImpl::WriteWithPostings(PostingBlockWriter* postings,
+                                                leveldb::WriteBatch* batch) {
+  postings->Flush(batch);
+  RETURN_IF_ERROR(
+      storage::ToGrpcStatus(storage_->Write(write_options_, batch)));
+  postings->UpdateCache();
+  if (index_cache_ != nullptr) index_cache_->Apply(postings->edits());
+  return grpc::Status::OK;
+}
 
-  ASSIGN_OR_RETURN(
-      const uint64_t event_id,
-      PostIncrement(Key::NextEventId(user_id, event.stat_id()), batch));
-  const std::string event_id_str = absl::StrCat(event_id);
+util::StatusOr<grpc::Status, uint64_t> StatServiceImpl::LookupUser(
+    const std::string& user_id) {
+  auto user_or = user_ids_.Lookup(user_id);
+  RETURN_IF_ERROR(storage::ToGrpcStatus(user_or.status()));
+  return user_or.ValueOrDie();
+}
 
-  const Key key = Key::ForEvent(user_id, event.stat_id(), event_id_str);
-  RETURN_IF_ERROR(storage::ToGrpcStatus(ProtoPut(key, event, batch)));
+util::StatusOr<grpc::Status, uint64_t> StatServiceImpl::InternUser(
+    const std::string& user_id) {
+  auto user_or = user_ids_.Intern(user_id);
+  RETURN_IF_ERROR(storage::ToGrpcStatus(user_or.status()));
+  return user_or.ValueOrDie();
+}
+
+util::StatusOr<grpc::Status, uint64_t> StatServiceImpl::AllocateIds(
+    const Key& key, uint64_t count) {
+  auto id_or = ids_.AllocateRange(key, count);
+  RETURN_IF_ERROR(storage::ToGrpcStatus(id_or.status()));
+  return id_or.ValueOrDie();
+}
+
+util::StatusOr<grpc::Status,
+               std::shared_ptr<const StatServiceImpl::StatCatalog>>
+StatServiceImpl::ReadStatCatalog(uint64_t user) {
+  uint64_t generation = 0;
+  if (stat_cache_ != nullptr) {
+    auto cached = stat_cache_->Lookup(user, &generation);
+    if (cached != nullptr) return cached;
+  }
+  // Snapshotted after the lookup, so that it has every write whose cache
+  // update the lookup missed, or the fill below is dropped.
+  const storage::ScopedSnapshot snapshot(storage_.get());
+  auto catalog = std::make_shared<StatCatalog>();
+  size_t charge = 0;
+  RETURN_IF_ERROR(ReadPrefix(
+      snapshot.read_options(), Key::UserStatsPrefix(user),
+      [&](const leveldb::Slice& key, const leveldb::Slice& value) {
+        uint64_t stat_user, stat_id;
+        Stat stat;
+        if (Key::ParseStat(ToStringView(key), &stat_user, &stat_id) &&
+            stat.ParseFromArray(value.data(), value.size())) {
+          charge += CacheCharge(stat, sizeof(StatCatalog::value_type));
+          catalog->emplace(stat_id, std::move(stat));
+        }
+      }));
+  if (stat_cache_ != nullptr) {
+    stat_cache_->InsertIfUnchanged(user, catalog, charge, generation);
+  }
+  return std::shared_ptr<const StatCatalog>(std::move(catalog));
+}
+
+grpc::Status StatServiceImpl::CheckStatExists(uint64_t user,
+                                              uint64_t stat_id) {
+  if (stat_cache_ == nullptr) {
+    Stat stat;
+    return storage::ToGrpcStatus(ProtoGet(storage_.get(),
+                                          leveldb::ReadOptions(),
+                                          Key::ForStat(user, stat_id), &stat));
+  }
+  ASSIGN_OR_RETURN(const auto stats, ReadStatCatalog(user));
+  if (stats->count(stat_id) == 0) return StatNotFound(absl::StrCat(stat_id));
+  return grpc::Status::OK;
+}
+
+util::StatusOr<grpc::Status, bool> StatServiceImpl::IsStatDefined(
+    const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id) {
+  std::string value;
+  const leveldb::Status status =
+      storage_->Get(options, Key::ForStat(user, stat_id), &value);
+  if (status.IsNotFound()) return false;
+  RETURN_IF_ERROR(storage::ToGrpcStatus(status));
+  return true;
+}
 
+void StatServiceImpl::UpdateCachedStats(
+    uint64_t user, const std::function<void(StatCatalog*)>& update) {
+  if (stat_cache_ == nullptr) return;
+  const auto cached = stat_cache_->Lookup(user);
+  if (cached == nullptr) {
+    // Drops fills that read the stats from before the write.
+    stat_cache_->Erase(user);
+    return;
+  }
+  auto updated = std::make_shared<StatCatalog>(*cached);
+  update(updated.get());
+  size_t charge = 0;
+  for (const auto& id_and_stat : *updated) {
+    charge += CacheCharge(id_and_stat.second, sizeof(StatCatalog::value_type));
+  }
+  stat_cache_->Insert(user, std::move(updated), charge);
+}
+
+void StatServiceImpl::CacheEvent(const EventKey& key, const Event& event) {
+  if (event_cache_ == nullptr) return;
+  event_cache_->Insert(key, std::make_shared<const Event>(event),
+                       CacheCharge(event, sizeof(Event)));
+}
+
+StatServiceImpl::CacheCounters StatServiceImpl::cache_counters() const {
+  CacheCounters counters;
+  if (stat_cache_ != nullptr) counters.stats = stat_cache_->counters();
+  if (event_cache_ != nullptr) counters.events = event_cache_->counters();
+  if (posting_block_cache_ != nullptr) {
+    counters.posting_blocks = posting_block_cache_->counters();
+  }
+  return counters;
+}
+
+std::vector<IndexToken> StatServiceImpl::IndexTokens(const Event& event) const {
   const absl::Time start_time = FromProtoTimestamp(event.start_time());
   const absl::Time end_time = start_time + FromProtoDuration(event.duration());
-  for (const TimeRangeToken& token :
-       tokenizer_.TokenizeTimeRange(start_time, end_time)) {
-    const Key hit_key = Key::ForIndexHit(
-        user_id, event.stat_id(), ToTokenString("r", token), event_id_str);
-    batch->Put(hit_key, event_id_str);
-  }
-  for (const TimeRangeToken& token : tokenizer_.TokenizeTimePoint(start_time)) {
-    const Key hit_key = Key::ForIndexHit(
-        user_id, event.stat_id(), ToTokenString("p", token), event_id_str);
-    batch->Put(hit_key, event_id_str);
-  }
-  for (const TimeRangeToken& token : tokenizer_.TokenizeTimePoint(end_time)) {
-    const Key hit_key = Key::ForIndexHit(
-        user_id, event.stat_id(), ToTokenString("p", token), event_id_str);
-    batch->Put(hit_key, event_id_str);
+  std::vector<TimeRangeToken> time_tokens;
+  tokenizer_.TokenizeTimeRange(start_time, end_time, &time_tokens);
+  const size_t num_range_tokens = time_tokens.size();
+  time_tokens.resize(num_range_tokens + 2 * tokenizer_.num_levels());
+  const absl::Time time_pts[] = {start_time, end_time};
+  tokenizer_.TokenizeTimePoints(time_pts,
+                                time_tokens.data() + num_range_tokens);
+
+  std::vector<IndexToken> tokens;
+  tokens.reserve(time_tokens.size());
+  for (size_t i = 0; i < time_tokens.size(); ++i) {
+    tokens.push_back(ToIndexToken(
+        i < num_range_tokens ? TokenKind::kRange : TokenKind::kPoint,
+        time_tokens[i]));
   }
-  return grpc::Status::OK;
+  return tokens;
 }
 
-util::StatusOr<grpc::Status, std::string> StatServiceImpl::AppendStat(
-    const std::string& user_id, const Stat& stat, leveldb::WriteBatch* batch) {
+util::StatusOr<grpc::Status, uint64_t> StatServiceImpl::AppendEvent(
+    uint64_t user, const Event& event, PostingBlockWriter* postings,
+    RollupWriter* rollups, QuantileSketchWriter* sketches,
+    leveldb::WriteBatch* batch) {
+  uint64_t stat_id;
+  if (!absl::SimpleAtoi(event.stat_id(), &stat_id)) {
+    return StatNotFound(event.stat_id());
+  }
+  RETURN_IF_ERROR(CheckStatExists(user, stat_id));
+
+  ASSIGN_OR_RETURN(const uint64_t event_id,
+                   AllocateIds(Key::NextEventId(user, stat_id), 1));
+
+  const Key key = Key::ForEvent(user, stat_id, event_id);
+  RETURN_IF_ERROR(storage::ToGrpcStatus(ProtoPut(key, event, batch)));
+  PutEventStart(user, stat_id, event_id, event, batch);
+
+  for (const IndexToken& token : IndexTokens(event)) {
+    RETURN_IF_ERROR(storage::ToGrpcStatus(
+        postings->Add(user, stat_id, token, event_id)));
+  }
+  const absl::Time start_time = FromProtoTimestamp(event.start_time());
+  const absl::Duration duration = FromProtoDuration(event.duration());
+  RETURN_IF_ERROR(storage::ToGrpcStatus(
+      rollups->Add(user, stat_id, start_time, duration)));
+  RETURN_IF_ERROR(storage::ToGrpcStatus(sketches->Add(
+      user, stat_id, start_time, duration, SketchedValue(event.value()))));
+  return event_id;
+}
+
+util::StatusOr<grpc::Status, uint64_t> StatServiceImpl::AppendStat(
+    uint64_t user, const Stat& stat, leveldb::WriteBatch* batch) {
   ASSIGN_OR_RETURN(const uint64_t stat_id,
-                   PostIncrement(Key::NextStatId(user_id), batch));
-  std::string new_stat_id = absl::StrCat(stat_id);
-  const Key key = Key::ForStat(user_id, new_stat_id);
+                   AllocateIds(Key::NextStatId(user), 1));
+  const Key key = Key::ForStat(user, stat_id);
   RETURN_IF_ERROR(storage::ToGrpcStatus(ProtoPut(key, stat, batch)));
-  return std::move(new_stat_id);
+  return stat_id;
 }
 
 grpc::Status StatServiceImpl::DefineStat(grpc::ServerContext* context,
                                          const DefineStatRequest* request,
                                          DefineStatResponse* response) {
   ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
+  ASSIGN_OR_RETURN(const uint64_t user, InternUser(request->user_id()));
   leveldb::WriteBatch batch;
-  ASSIGN_OR_RETURN(const std::string new_stat_id,
-                   AppendStat(request->user_id(), request->stat(), &batch));
+  ASSIGN_OR_RETURN(const uint64_t new_stat_id,
+                   AppendStat(user, request->stat(), &batch));
+  if (HasRetention(request->stat())) {
+    batch.Put(Key::ForRetainedStat(user, new_stat_id), request->user_id());
+  }
   RETURN_IF_ERROR(
-      storage::ToGrpcStatus(leveldb_->Write(leveldb::WriteOptions(), &batch)));
-  response->set_new_stat_id(new_stat_id);
+      storage::ToGrpcStatus(storage_->Write(write_options_, &batch)));
+  UpdateCachedStats(user, [&](StatCatalog* stats) {
+    (*stats)[new_stat_id] = request->stat();
+  });
+  response->set_new_stat_id(absl::StrCat(new_stat_id));
   LOG(INFO) << "DefineStat request: " << request->ShortDebugString()
             << " response: " << response->ShortDebugString();
   return grpc::Status::OK;
 }
 
 grpc::Status StatServiceImpl::ReadPrefix(
-    const Key& key_prefix,
+    const leveldb::ReadOptions& options, const Key& key_prefix,
     const std::function<void(const leveldb::Slice& key,
                              const leveldb::Slice& value)>& on_row) {
-  auto it = absl::WrapUnique(leveldb_->NewIterator(leveldb::ReadOptions()));
+  auto it = storage_->NewIterator(options);
   for (it->Seek(key_prefix); it->Valid() && it->key().starts_with(key_prefix);
        it->Next()) {
-    VLOG(1) << "prefix read for " << absl::string_view(key_prefix) << " | "
-            << it->key().ToString() << ": " << it->value().ToString();
+    VLOG(1) << "prefix read for "
+            << absl::CHexEscape(absl::string_view(key_prefix)) << " | "
+            << absl::CHexEscape(it->key().ToString()) << ": "
+            << absl::CHexEscape(it->value().ToString());
     on_row(it->key(), it->value());
   }
   return storage::ToGrpcStatus(it->status());
 }
 
-grpc::Status StatServiceImpl::DeletePrefix(const Key& key_prefix,
-                                           leveldb::WriteBatch* batch) {
-  return ReadPrefix(
-      key_prefix, [&](const leveldb::Slice& key, const leveldb::Slice& value) {
-        batch->Delete(key);
-      });
-}
-
 grpc::Status StatServiceImpl::DeleteStat(grpc::ServerContext* context,
                                          const DeleteStatRequest* request,
                                          google::protobuf::Empty*) {
   ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
-  leveldb::WriteBatch batch;
-  batch.Delete(Key::ForStat(request->user_id(), request->stat_id()));
-
-  const Key events_prefix =
-      Key::StatEventsPrefix(request->user_id(), request->stat_id());
-  RETURN_IF_ERROR(DeletePrefix(events_prefix, &batch));
-
-  const Key index_prefix =
-      Key::StatIndexPrefix(request->user_id(), request->stat_id());
-  RETURN_IF_ERROR(DeletePrefix(index_prefix, &batch));
+  auto user_or = LookupUser(request->user_id());
+  uint64_t stat_id;
+  if (IsNotFound(user_or.status()) ||
+      !absl::SimpleAtoi(request->stat_id(), &stat_id)) {
+    LOG(INFO) << "DeleteStat request for nonexistent stat: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
+  const Key stat_key = Key::ForStat(user, stat_id);
+  Stat stat;
+  const leveldb::Status stat_status =
+      ProtoGet(storage_.get(), leveldb::ReadOptions(), stat_key, &stat);
+  if (stat_status.IsNotFound()) {
+    LOG(INFO) << "DeleteStat request for nonexistent stat: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(storage::ToGrpcStatus(stat_status));
 
+  // Without its Stat row, the stat is gone for every request; the tombstone
+  // leaves the rest of its rows to the reaper.
+  leveldb::WriteBatch batch;
+  batch.Delete(stat_key);
+  batch.Delete(Key::ForRetainedStat(user, stat_id));
+  batch.Put(Key::ForDeletedStat(user, stat_id), request->user_id());
   RETURN_IF_ERROR(
-      storage::ToGrpcStatus(leveldb_->Write(leveldb::WriteOptions(), &batch)));
+      storage::ToGrpcStatus(storage_->Write(write_options_, &batch)));
+  ids_.Forget(Key::NextEventId(user, stat_id));
+  if (index_cache_ != nullptr) index_cache_->Forget(user, stat_id);
+  UpdateCachedStats(user,
+                    [stat_id](StatCatalog* stats) { stats->erase(stat_id); });
+  // The stat's cached events are left to age out: stat ids aren't reused and
+  // every read checks the stat first, so they're never served again.
+  ScheduleReaping();
   LOG(INFO) << "DeleteState request: " << request->ShortDebugString();
   return grpc::Status::OK;
 }
@@ -191,75 +458,126 @@ grpc::Status StatServiceImpl::DeleteStat(grpc::ServerContext* context,
 grpc::Status StatServiceImpl::ReadStats(grpc::ServerContext* context,
                                         const ReadStatsRequest* request,
                                         ReadStatsResponse* response) {
-  ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
-  const Key prefix = Key::UserStatsPrefix(request->user_id());
-  RETURN_IF_ERROR(ReadPrefix(
-      prefix, [&](const leveldb::Slice& key, const leveldb::Slice& value) {
-        std::string user_id, stat_id;
-        Stat stat;
-        if (Key::ParseStat(key.ToString(), &user_id, &stat_id) &&
-            stat.ParseFromString(value.ToString())) {
-          response->mutable_stats()->insert({stat_id, stat});
-        }
-      }));
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(*context, request->user_id()));
+  auto user_or = LookupUser(request->user_id());
+  if (!IsNotFound(user_or.status())) {
+    RETURN_IF_ERROR(user_or.status());
+    ASSIGN_OR_RETURN(const auto stats,
+                     ReadStatCatalog(user_or.ValueOrDie()));
+    for (const auto& id_and_stat : *stats) {
+      (*response->mutable_stats())[absl::StrCat(id_and_stat.first)] =
+          id_and_stat.second;
+    }
+  }
   LOG(INFO) << "ReadStats request: " << request->ShortDebugString()
             << " response: " << response->ShortDebugString();
   return grpc::Status::OK;
 }
 
-util::StatusOr<grpc::Status, ReadEventsResponse::Events>
-StatServiceImpl::ReadEventsForStat(const std::string& user_id,
-                                   const std::string& stat_id, absl::Time start,
-                                   absl::Time end) {
-  std::set<std::string> event_id_hits;
+grpc::Status StatServiceImpl::QueryIndex(const leveldb::ReadOptions& options,
+                                         uint64_t user, uint64_t stat_id,
+                                         absl::Time start, absl::Time end,
+                                         std::vector<uint64_t>* event_ids) {
+  // Events indexed by a point in the range, or by a range around its start.
+  std::vector<IndexToken> tokens;
   for (const TimeRangeToken& token : tokenizer_.TokenizeTimeRange(start, end)) {
-    const Key hits_prefix =
-        Key::IndexHitsPrefix(user_id, stat_id, ToTokenString("p", token));
-    RETURN_IF_ERROR(ReadPrefix(hits_prefix, [&](const leveldb::Slice& key,
-                                                const leveldb::Slice& value) {
-      event_id_hits.insert(value.ToString());
-    }));
+    tokens.push_back(ToIndexToken(TokenKind::kPoint, token));
   }
   for (const TimeRangeToken& token : tokenizer_.TokenizeTimePoint(start)) {
-    const Key hits_prefix =
-        Key::IndexHitsPrefix(user_id, stat_id, ToTokenString("r", token));
-    RETURN_IF_ERROR(ReadPrefix(hits_prefix, [&](const leveldb::Slice& key,
-                                                const leveldb::Slice& value) {
-      event_id_hits.insert(value.ToString());
-    }));
+    tokens.push_back(ToIndexToken(TokenKind::kRange, token));
+  }
+  if (index_cache_ != nullptr) {
+    return storage::ToGrpcStatus(index_cache_->Query(
+        storage_.get(), options, user, stat_id, tokens, event_ids));
   }
+  return storage::ToGrpcStatus(ReadPostings(storage_.get(), options, user,
+                                            stat_id, tokens, event_ids));
+}
 
-  ReadEventsResponse::Events result;
-  for (absl::string_view event_id : event_id_hits) {
-    const Key event_key = Key::ForEvent(user_id, stat_id, event_id);
-    auto event_or =
-        ProtoGet<Event>(leveldb_.get(), leveldb::ReadOptions(), event_key);
-    RETURN_IF_ERROR(storage::ToGrpcStatus(event_or.status()));
-    result.mutable_event_by_id()->insert(
-        {std::string(event_id), std::move(event_or.ValueOrDie())});
+grpc::Status StatServiceImpl::ReadEventsForStat(
+    const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id,
+    absl::Time start, absl::Time end, ReadEventsResponse::Events* result) {
+  std::vector<uint64_t> event_ids;
+  RETURN_IF_ERROR(QueryIndex(options, user, stat_id, start, end, &event_ids));
+
+  // The ids are sorted, as are the event rows, so one iterator walks them
+  // forward: it steps over runs of neighbouring hits and seeks across gaps.
+  auto& event_by_id = *result->mutable_event_by_id();
+  auto it = storage_->NewIterator(options);
+  for (uint64_t event_id : event_ids) {
+    const EventKey cache_key(user, stat_id, event_id);
+    uint64_t generation = 0;
+    if (event_cache_ != nullptr) {
+      const auto cached = event_cache_->Lookup(cache_key, &generation);
+      if (cached != nullptr) {
+        event_by_id[absl::StrCat(event_id)] = *cached;
+        continue;
+      }
+    }
+    const Key event_key = Key::ForEvent(user, stat_id, event_id);
+    if (!it->Valid() || it->key() != event_key) {
+      it->Seek(event_key);
+      if (!it->Valid() || it->key() != event_key) {
+        RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+        return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                            absl::StrCat("event ", event_id, " not found"));
+      }
+    }
+    // Parsed straight into the result, which the cache copies if it's on.
+    Event& event = event_by_id[absl::StrCat(event_id)];
+    if (!event.ParseFromArray(it->value().data(), it->value().size())) {
+      return grpc::Status(
+          grpc::StatusCode::INTERNAL,
+          absl::StrCat("value of event ", event_id, " not parseable"));
+    }
+    if (event_cache_ != nullptr) {
+      event_cache_->InsertIfUnchanged(cache_key,
+                                      std::make_shared<const Event>(event),
+                                      CacheCharge(event, sizeof(Event)),
+                                      generation);
+    }
+    it->Next();
   }
-  return std::move(result);
+  RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+  return ReadSegmentEventsForStat(options, user, stat_id, start, end, result);
 }
 
 grpc::Status StatServiceImpl::ReadEvents(grpc::ServerContext* context,
                                          const ReadEventsRequest* request,
                                          ReadEventsResponse* response) {
-  ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(*context, request->user_id(),
+                                           /*uses_index_cache=*/true));
+  auto user_or = LookupUser(request->user_id());
+  if (IsNotFound(user_or.status())) {
+    LOG(INFO) << "ReadEvents request for unknown user: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
 
   const absl::Time requested_start_time =
       FromProtoTimestamp(request->start_time());
   const absl::Time requested_end_time =
       requested_start_time + FromProtoDuration(request->duration());
 
+  // One snapshot for all the stats, so the response is a single point in time.
+  const storage::ScopedSnapshot snapshot(storage_.get());
+  auto& events_by_stat_id = *response->mutable_events_by_stat_id();
   for (const std::string& stat_id : request->stat_id()) {
-    ASSIGN_OR_RETURN(
-        ReadEventsResponse::Events events,
-        ReadEventsForStat(request->user_id(), stat_id, requested_start_time,
-                          requested_end_time));
-    if (!events.event_by_id().empty()) {
-      response->mutable_events_by_stat_id()->insert(
-          {stat_id, std::move(events)});
-    }
+    uint64_t parsed_stat_id;
+    if (!absl::SimpleAtoi(stat_id, &parsed_stat_id)) continue;
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(snapshot.read_options(), user,
+                                   parsed_stat_id));
+    if (!defined) continue;
+    // Read into the response's own slot, rather than moved into it, which
+    // would copy across arenas.
+    ReadEventsResponse::Events& events = events_by_stat_id[stat_id];
+    RETURN_IF_ERROR(ReadEventsForStat(snapshot.read_options(), user,
+                                      parsed_stat_id, requested_start_time,
+                                      requested_end_time, &events));
+    if (events.event_by_id().empty()) events_by_stat_id.erase(stat_id);
   }
 
   LOG(INFO) << "ReadEvents request: " << request->ShortDebugString()
@@ -267,66 +585,1404 @@ grpc::Status StatServiceImpl::ReadEvents(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+// Walks the start time rows of each stat from `cursor`, so that it holds no
+// more than the page and one decoded segment however many events match.
+grpc::Status StatServiceImpl::ReadEventsPage(
+    const leveldb::ReadOptions& options, uint64_t user,
+    const StreamEventsRequest& request, const std::string& cursor,
+    CachedSegment* segment, StreamEventsResponse* page) {
+  const absl::Time start = FromProtoTimestamp(request.start_time());
+  const absl::Time end = start + FromProtoDuration(request.duration());
+  const int page_size = request.page_size() > 0
+                            ? std::min(request.page_size(), kMaxStreamPageSize)
+                            : kDefaultStreamPageSize;
+
+  // The cursor is the start time key of the next event to stream.
+  int first_stat = 0;
+  if (!cursor.empty()) {
+    uint64_t cursor_user, cursor_stat_id, event_id;
+    absl::Time cursor_start;
+    if (!Key::ParseEventStart(cursor, &cursor_user, &cursor_stat_id,
+                              &cursor_start, &event_id) ||
+        cursor_user != user) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "bad cursor");
+    }
+    const std::string cursor_stat = absl::StrCat(cursor_stat_id);
+    while (first_stat < request.stat_id_size() &&
+           request.stat_id(first_stat) != cursor_stat) {
+      ++first_stat;
+    }
+    if (first_stat == request.stat_id_size()) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "cursor doesn't match the requested stats");
+    }
+  }
+
+  size_t page_bytes = 0;
+  for (int i = first_stat; i < request.stat_id_size(); ++i) {
+    uint64_t stat_id;
+    if (!absl::SimpleAtoi(request.stat_id(i), &stat_id)) continue;
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(options, user, stat_id));
+    if (!defined) continue;
+    const Key prefix = Key::StatStartsPrefix(user, stat_id);
+    auto it = storage_->NewIterator(options);
+    if (i == first_stat && !cursor.empty()) {
+      it->Seek(cursor);
+    } else {
+      it->Seek(Key::ForEventStart(user, stat_id, start, 0));
+    }
+    for (; it->Valid() && it->key().starts_with(prefix); it->Next()) {
+      uint64_t start_user, start_stat_id, event_id;
+      absl::Time event_start;
+      if (!Key::ParseEventStart(ToStringView(it->key()), &start_user,
+                                &start_stat_id, &event_start, &event_id)) {
+        return grpc::Status(grpc::StatusCode::INTERNAL,
+                            "start time key not parseable");
+      }
+      if (event_start >= end) break;
+      if (page->events_size() == page_size ||
+          page_bytes >= kMaxStreamPageBytes) {
+        page->set_next_cursor(it->key().ToString());
+        return grpc::Status::OK;
+      }
+      StreamEventsResponse::StreamedEvent* streamed = page->add_events();
+      streamed->set_event_id(absl::StrCat(event_id));
+      RETURN_IF_ERROR(ReadEventOrSegmentEvent(options, user, stat_id, event_id,
+                                              segment,
+                                              streamed->mutable_event()));
+      page_bytes += streamed->ByteSizeLong();
+    }
+    RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::ReadStreamPage(
+    const grpc::ServerContext& context, const StreamEventsRequest& request,
+    const storage::ScopedSnapshot& snapshot, StreamEventsResponse* page) {
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(context, request.user_id()));
+  auto user_or = LookupUser(request.user_id());
+  if (IsNotFound(user_or.status())) return grpc::Status::OK;
+  RETURN_IF_ERROR(user_or.status());
+  CachedSegment segment;
+  return ReadEventsPage(snapshot.read_options(), user_or.ValueOrDie(),
+                        request, request.cursor(), &segment, page);
+}
+
+grpc::Status StatServiceImpl::StreamEvents(
+    grpc::ServerContext* context, const StreamEventsRequest* request,
+    grpc::ServerWriter<StreamEventsResponse>* writer) {
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(*context, request->user_id()));
+  auto user_or = LookupUser(request->user_id());
+  if (IsNotFound(user_or.status())) {
+    LOG(INFO) << "StreamEvents request for unknown user: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+
+  // Every page reads the same snapshot, so the stream is a single point in
+  // time.
+  const storage::ScopedSnapshot snapshot(storage_.get());
+  CachedSegment segment;
+  StreamEventsResponse page;
+  std::string cursor = request->cursor();
+  int64_t num_streamed = 0;
+  do {
+    page.Clear();
+    RETURN_IF_ERROR(ReadEventsPage(snapshot.read_options(),
+                                   user_or.ValueOrDie(), *request, cursor,
+                                   &segment, &page));
+    if (page.events().empty()) break;
+    if (!writer->Write(page)) {
+      return grpc::Status(grpc::StatusCode::CANCELLED,
+                          "stream closed by the client");
+    }
+    num_streamed += page.events_size();
+    cursor = page.next_cursor();
+  } while (!cursor.empty());
+
+  LOG(INFO) << "StreamEvents request: " << request->ShortDebugString()
+            << " streamed " << num_streamed << " events";
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::AggregateEvents(
+    grpc::ServerContext* context, const AggregateEventsRequest* request,
+    AggregateEventsResponse* response) {
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(*context, request->user_id()));
+  auto user_or = LookupUser(request->user_id());
+  if (IsNotFound(user_or.status())) {
+    LOG(INFO) << "AggregateEvents request for unknown user: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
+
+  const absl::Time start = FromProtoTimestamp(request->start_time());
+  const std::vector<TimeRangeToken> tokens = tokenizer_.TokenizeTimeRange(
+      start, start + FromProtoDuration(request->duration()));
+  const storage::ScopedSnapshot snapshot(storage_.get());
+  for (const std::string& stat_id : request->stat_id()) {
+    uint64_t parsed_stat_id;
+    if (!absl::SimpleAtoi(stat_id, &parsed_stat_id)) continue;
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(snapshot.read_options(), user,
+                                   parsed_stat_id));
+    if (!defined) continue;
+    EventRollup rollup;
+    RETURN_IF_ERROR(storage::ToGrpcStatus(
+        ReadRollups(storage_.get(), snapshot.read_options(), user,
+                    parsed_stat_id, tokens, &rollup)));
+    EventAggregate& aggregate =
+        (*response->mutable_aggregate_by_stat_id())[stat_id];
+    aggregate.set_count(rollup.count);
+    *aggregate.mutable_total_duration() =
+        ToProtoDuration(rollup.total_duration);
+    if (rollup.count > 0) {
+      absl::Time min_start = absl::InfiniteFuture();
+      absl::Time max_start = absl::InfinitePast();
+      RETURN_IF_ERROR(storage::ToGrpcStatus(ReadStartBounds(
+          storage_.get(), snapshot.read_options(), user, parsed_stat_id,
+          tokenizer_, tokens, &min_start, &max_start)));
+      if (min_start <= max_start) {
+        *aggregate.mutable_min_start_time() = ToProtoTimestamp(min_start);
+        *aggregate.mutable_max_start_time() = ToProtoTimestamp(max_start);
+      }
+    }
+  }
+
+  LOG(INFO) << "AggregateEvents request: " << request->ShortDebugString()
+            << " response: " << response->ShortDebugString();
+  return grpc::Status::OK;
+}
+
+// Scans the stat's start time rows in the range, collecting the values into
+// columns for the aggregation kernels.
+grpc::Status StatServiceImpl::AggregateValues(
+    grpc::ServerContext* context, const AggregateValuesRequest* request,
+    AggregateValuesResponse* response) {
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(*context, request->user_id()));
+  auto user_or = LookupUser(request->user_id());
+  if (IsNotFound(user_or.status())) {
+    LOG(INFO) << "AggregateValues request for unknown user: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
+
+  const absl::Time start = FromProtoTimestamp(request->start_time());
+  const absl::Time end = start + FromProtoDuration(request->duration());
+  const storage::ScopedSnapshot snapshot(storage_.get());
+  auto it = storage_->NewIterator(snapshot.read_options());
+  for (const std::string& stat_id : request->stat_id()) {
+    uint64_t parsed_stat_id;
+    if (!absl::SimpleAtoi(stat_id, &parsed_stat_id)) continue;
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(snapshot.read_options(), user,
+                                   parsed_stat_id));
+    if (!defined) continue;
+    const Key end_key = Key::ForEventStart(user, parsed_stat_id, end, 0);
+    ValueColumn column;
+    for (it->Seek(Key::ForEventStart(user, parsed_stat_id, start, 0));
+         it->Valid() && it->key().compare(end_key) < 0; it->Next()) {
+      absl::optional<NumericValue> value;
+      if (!DecodeNumericValue(ToStringView(it->value()), &value)) {
+        return grpc::Status(
+            grpc::StatusCode::INTERNAL,
+            absl::StrCat("value of start time row ",
+                         absl::CHexEscape(ToStringView(it->key())),
+                         " not parseable"));
+      }
+      if (value.has_value()) column.Add(*value);
+    }
+    RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+    const NumericAggregate aggregate = column.Aggregate();
+    ValueAggregate& result =
+        (*response->mutable_aggregate_by_stat_id())[stat_id];
+    result.set_count(aggregate.count);
+    if (aggregate.count > 0) {
+      result.set_sum(aggregate.sum);
+      result.set_min(aggregate.min);
+      result.set_max(aggregate.max);
+      result.set_mean(aggregate.mean());
+    }
+  }
+
+  LOG(INFO) << "AggregateValues request: " << request->ShortDebugString()
+            << " response: " << response->ShortDebugString();
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::ReadSeries(grpc::ServerContext* context,
+                                         const ReadSeriesRequest* request,
+                                         ReadSeriesResponse* response) {
+  const int num_buckets =
+      request->bucket_count() > 0
+          ? std::min(request->bucket_count(), kMaxSeriesBuckets)
+          : kDefaultSeriesBuckets;
+  const absl::Duration duration = FromProtoDuration(request->duration());
+  if (duration <= absl::ZeroDuration()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "duration must be positive");
+  }
+  // Saturates, so that every bucket boundary fits in an int64 from the start.
+  const int64_t range_nanos =
+      std::min(absl::ToInt64Nanoseconds(duration),
+               std::numeric_limits<int64_t>::max() - num_buckets);
+  const int64_t width = (range_nanos - 1) / num_buckets + 1;
+  *response->mutable_bucket_width() =
+      ToProtoDuration(absl::Nanoseconds(width));
+
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(*context, request->user_id(),
+                                           /*uses_index_cache=*/true));
+  auto user_or = LookupUser(request->user_id());
+  if (IsNotFound(user_or.status())) {
+    LOG(INFO) << "ReadSeries request for unknown user: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
+
+  const absl::Time start = FromProtoTimestamp(request->start_time());
+  const absl::Time end = start + absl::Nanoseconds(width) * num_buckets;
+  const storage::ScopedSnapshot snapshot(storage_.get());
+  std::vector<int64_t> starts, ends;
+  // Each stat's events are only read for their times, so they're parsed onto
+  // an arena that's reset for the next.
+  google::protobuf::Arena arena;
+  for (const std::string& stat_id : request->stat_id()) {
+    uint64_t parsed_stat_id;
+    if (!absl::SimpleAtoi(stat_id, &parsed_stat_id)) continue;
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(snapshot.read_options(), user,
+                                   parsed_stat_id));
+    if (!defined) continue;
+    arena.Reset();
+    auto* events =
+        google::protobuf::Arena::CreateMessage<ReadEventsResponse::Events>(
+            &arena);
+    RETURN_IF_ERROR(ReadEventsForStat(snapshot.read_options(), user,
+                                      parsed_stat_id, start, end, events));
+    starts.clear();
+    ends.clear();
+    for (const auto& id_and_event : events->event_by_id()) {
+      const Event& event = id_and_event.second;
+      const absl::Duration from_start =
+          FromProtoTimestamp(event.start_time()) - start;
+      starts.push_back(absl::ToInt64Nanoseconds(from_start));
+      ends.push_back(absl::ToInt64Nanoseconds(
+          from_start + FromProtoDuration(event.duration())));
+    }
+    Series& series = (*response->mutable_series_by_stat_id())[stat_id];
+    series.mutable_event_count()->Resize(num_buckets, 0);
+    series.mutable_active_nanos()->Resize(num_buckets, 0);
+    BucketIntervals(
+        starts, ends, width,
+        absl::MakeSpan(series.mutable_event_count()->mutable_data(),
+                       num_buckets),
+        absl::MakeSpan(series.mutable_active_nanos()->mutable_data(),
+                       num_buckets));
+  }
+
+  LOG(INFO) << "ReadSeries request: " << request->ShortDebugString()
+            << " response: " << response->series_by_stat_id_size()
+            << " series of " << num_buckets << " buckets";
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::QueryQuantiles(
+    grpc::ServerContext* context, const QueryQuantilesRequest* request,
+    QueryQuantilesResponse* response) {
+  const absl::Duration duration = FromProtoDuration(request->duration());
+  if (duration <= absl::ZeroDuration()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "duration must be positive");
+  }
+  for (double q : request->quantile()) {
+    if (!(q >= 0 && q <= 1)) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          absl::StrCat("quantile ", q, " not in [0, 1]"));
+    }
+  }
+  // Rounds the range out to buckets of the finest sketched granularity.
+  const auto round_down = [this](absl::Time time_pt) {
+    return sketch_tokenizer_.StartTime(
+        sketch_tokenizer_.TokenizeTimePoint(time_pt).front());
+  };
+  const absl::Time requested_start = FromProtoTimestamp(request->start_time());
+  const absl::Time start = round_down(requested_start);
+  absl::Time end = round_down(requested_start + duration);
+  if (end < requested_start + duration) {
+    end += sketch_tokenizer_.granularity(0);
+  }
+  *response->mutable_start_time() = ToProtoTimestamp(start);
+  *response->mutable_duration() = ToProtoDuration(end - start);
+
+  ASSIGN_OR_RETURN(auto l, AcquireReadLock(*context, request->user_id()));
+  auto user_or = LookupUser(request->user_id());
+  if (IsNotFound(user_or.status())) {
+    LOG(INFO) << "QueryQuantiles request for unknown user: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
+
+  const std::vector<TimeRangeToken> tokens =
+      sketch_tokenizer_.TokenizeTimeRange(start, end);
+  const storage::ScopedSnapshot snapshot(storage_.get());
+  for (const std::string& stat_id : request->stat_id()) {
+    uint64_t parsed_stat_id;
+    if (!absl::SimpleAtoi(stat_id, &parsed_stat_id)) continue;
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(snapshot.read_options(), user,
+                                   parsed_stat_id));
+    if (!defined) continue;
+    QuantileSketches sketches;
+    RETURN_IF_ERROR(storage::ToGrpcStatus(
+        ReadQuantileSketches(storage_.get(), snapshot.read_options(), user,
+                             parsed_stat_id, tokens, &sketches)));
+    EventQuantiles& quantiles =
+        (*response->mutable_quantiles_by_stat_id())[stat_id];
+    quantiles.set_count(std::max<int64_t>(sketches.duration_count(), 0));
+    quantiles.set_value_count(std::max<int64_t>(sketches.value_count(), 0));
+    for (double q : request->quantile()) {
+      if (quantiles.count() > 0) {
+        *quantiles.add_duration_quantile() =
+            ToProtoDuration(sketches.DurationQuantile(q));
+      }
+      if (quantiles.value_count() > 0) {
+        quantiles.add_value_quantile(sketches.ValueQuantile(q));
+      }
+    }
+  }
+
+  LOG(INFO) << "QueryQuantiles request: " << request->ShortDebugString()
+            << " response: " << response->ShortDebugString();
+  return grpc::Status::OK;
+}
+
 grpc::Status StatServiceImpl::RecordEvent(grpc::ServerContext* context,
                                           const RecordEventRequest* request,
                                           google::protobuf::Empty*) {
   ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
+  auto user_or = LookupUser(request->user_id());
+  if (IsNotFound(user_or.status())) {
+    return StatNotFound(request->event().stat_id());
+  }
+  RETURN_IF_ERROR(user_or.status());
+  PostingBlockWriter postings(storage_.get(), index_cache_ != nullptr,
+                              posting_block_cache_.get());
+  RollupWriter rollups(storage_.get(), &tokenizer_);
+  QuantileSketchWriter sketches(storage_.get(), &sketch_tokenizer_);
   leveldb::WriteBatch batch;
-  RETURN_IF_ERROR(AppendEvent(request->user_id(), request->event(), &batch));
-  RETURN_IF_ERROR(
-      storage::ToGrpcStatus(leveldb_->Write(leveldb::WriteOptions(), &batch)));
+  ASSIGN_OR_RETURN(const uint64_t event_id,
+                   AppendEvent(user_or.ValueOrDie(), request->event(),
+                               &postings, &rollups, &sketches, &batch));
+  rollups.Flush(&batch);
+  sketches.Flush(&batch);
+  RETURN_IF_ERROR(WriteWithPostings(&postings, &batch));
+  // AppendEvent has parsed the stat id.
+  uint64_t stat_id;
+  CHECK(absl::SimpleAtoi(request->event().stat_id(), &stat_id));
+  CacheEvent(EventKey(user_or.ValueOrDie(), stat_id, event_id),
+             request->event());
+  if ((event_id + 1) % kEventSegmentSpan == 0) {
+    ScheduleSealing(request->user_id(), stat_id);
+  }
   LOG(INFO) << "RecordEvent request: " << request->ShortDebugString();
   return grpc::Status::OK;
 }
 
-grpc::Status StatServiceImpl::DeleteEvent(const std::string& user_id,
-                                          const std::string& stat_id,
-                                          const std::string& event_id,
-                                          leveldb::WriteBatch* batch) {
-  const Key primary_event_key = Key::ForEvent(user_id, stat_id, event_id);
-  batch->Delete(primary_event_key);
+// Unlike AppendEvent, looks up each stat and allocates its event ids once per
+// batch, and tokenizes each distinct time range once.
+grpc::Status StatServiceImpl::RecordEventBatch(
+    const grpc::ServerContext& context, const RecordEventsRequest& request,
+    RecordEventsResponse* response) {
+  const int first_result = response->results_size();
+  for (int i = 0; i < request.events_size(); ++i) response->add_results();
+  const auto result = [&](int i) {
+    return response->mutable_results(first_result + i);
+  };
 
-  auto event_or = ProtoGet<Event>(leveldb_.get(), leveldb::ReadOptions(),
-                                  primary_event_key);
-  if (event_or.status().IsNotFound()) {
+  ASSIGN_OR_RETURN(auto l, AcquireUserLock(context, request.user_id()));
+  auto user_or = LookupUser(request.user_id());
+  if (IsNotFound(user_or.status())) {
+    for (int i = 0; i < request.events_size(); ++i) {
+      SetResult(StatNotFound(request.events(i).stat_id()), result(i));
+    }
     return grpc::Status::OK;
   }
-  RETURN_IF_ERROR(storage::ToGrpcStatus(event_or.status()));
-  const Event& event = event_or.ValueOrDie();
+  RETURN_IF_ERROR(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
 
-  const absl::Time start_time = FromProtoTimestamp(event.start_time());
-  const absl::Time end_time = start_time + FromProtoDuration(event.duration());
-  for (const TimeRangeToken& token :
-       tokenizer_.TokenizeTimeRange(start_time, end_time)) {
-    const Key hit_key =
-        Key::ForIndexHit(user_id, stat_id, ToTokenString("r", token), event_id);
-    batch->Delete(hit_key);
+  // Indices of the events of each stat, in request order.
+  std::map<std::string, std::vector<int>> events_by_stat;
+  for (int i = 0; i < request.events_size(); ++i) {
+    events_by_stat[request.events(i).stat_id()].push_back(i);
   }
-  for (const TimeRangeToken& token : tokenizer_.TokenizeTimePoint(start_time)) {
-    const Key hit_key =
-        Key::ForIndexHit(user_id, stat_id, ToTokenString("p", token), event_id);
-    batch->Delete(hit_key);
+
+  PostingBlockWriter postings(storage_.get(), index_cache_ != nullptr,
+                              posting_block_cache_.get());
+  RollupWriter rollups(storage_.get(), &tokenizer_);
+  QuantileSketchWriter sketches(storage_.get(), &sketch_tokenizer_);
+  leveldb::WriteBatch batch;
+  std::map<std::pair<absl::Time, absl::Time>, std::vector<IndexToken>>
+      tokens_by_range;
+  std::vector<uint64_t> stats_to_seal;
+  std::vector<std::pair<EventKey, const Event*>> recorded;
+  for (const auto& stat_events : events_by_stat) {
+    const std::vector<int>& indices = stat_events.second;
+    uint64_t stat_id;
+    grpc::Status stat_status = StatNotFound(stat_events.first);
+    if (absl::SimpleAtoi(stat_events.first, &stat_id)) {
+      stat_status = CheckStatExists(user, stat_id);
+    }
+    if (IsNotFound(stat_status)) {
+      for (int i : indices) SetResult(stat_status, result(i));
+      continue;
+    }
+    RETURN_IF_ERROR(stat_status);
+
+    ASSIGN_OR_RETURN(
+        const uint64_t first_id,
+        AllocateIds(Key::NextEventId(user, stat_id), indices.size()));
+    for (size_t j = 0; j < indices.size(); ++j) {
+      const Event& event = request.events(indices[j]);
+      const uint64_t event_id = first_id + j;
+      RETURN_IF_ERROR(storage::ToGrpcStatus(
+          ProtoPut(Key::ForEvent(user, stat_id, event_id), event, &batch)));
+      PutEventStart(user, stat_id, event_id, event, &batch);
+      const absl::Time start_time = FromProtoTimestamp(event.start_time());
+      const std::pair<absl::Time, absl::Time> range = {
+          start_time, start_time + FromProtoDuration(event.duration())};
+      auto tokens_it = tokens_by_range.find(range);
+      if (tokens_it == tokens_by_range.end()) {
+        tokens_it = tokens_by_range.emplace(range, IndexTokens(event)).first;
+      }
+      for (const IndexToken& token : tokens_it->second) {
+        RETURN_IF_ERROR(storage::ToGrpcStatus(
+            postings.Add(user, stat_id, token, event_id)));
+      }
+      RETURN_IF_ERROR(storage::ToGrpcStatus(rollups.Add(
+          user, stat_id, range.first, range.second - range.first)));
+      RETURN_IF_ERROR(storage::ToGrpcStatus(
+          sketches.Add(user, stat_id, range.first, range.second - range.first,
+                       SketchedValue(event.value()))));
+      result(indices[j])->set_event_id(absl::StrCat(event_id));
+      recorded.emplace_back(EventKey(user, stat_id, event_id), &event);
+    }
+    if (EventSegmentBase(first_id) !=
+        EventSegmentBase(first_id + indices.size())) {
+      stats_to_seal.push_back(stat_id);
+    }
+  }
+  rollups.Flush(&batch);
+  sketches.Flush(&batch);
+  RETURN_IF_ERROR(WriteWithPostings(&postings, &batch));
+  for (const auto& key_and_event : recorded) {
+    CacheEvent(key_and_event.first, *key_and_event.second);
   }
-  for (const TimeRangeToken& token : tokenizer_.TokenizeTimePoint(end_time)) {
-    const Key hit_key =
-        Key::ForIndexHit(user_id, stat_id, ToTokenString("p", token), event_id);
-    batch->Delete(hit_key);
+  for (uint64_t stat_id : stats_to_seal) {
+    ScheduleSealing(request.user_id(), stat_id);
   }
+  return grpc::Status::OK;
+}
 
+grpc::Status StatServiceImpl::RecordEvents(grpc::ServerContext* context,
+                                           const RecordEventsRequest* request,
+                                           RecordEventsResponse* response) {
+  RETURN_IF_ERROR(RecordEventBatch(*context, *request, response));
+  LOG(INFO) << "RecordEvents request for user " << request->user_id() << ": "
+            << request->events_size() << " events";
   return grpc::Status::OK;
 }
 
+grpc::Status StatServiceImpl::RecordEventStream(
+    grpc::ServerContext* context,
+    grpc::ServerReader<RecordEventsRequest>* reader,
+    RecordEventsResponse* response) {
+  RecordEventsRequest request;
+  int64_t num_batches = 0;
+  while (reader->Read(&request)) {
+    RETURN_IF_ERROR(RecordEventBatch(*context, request, response));
+    ++num_batches;
+  }
+  LOG(INFO) << "RecordEventStream request: " << num_batches << " batches, "
+            << response->results_size() << " events";
+  return grpc::Status::OK;
+}
+
+// Like ReadEventsForStat, walks the event rows in id order with one iterator.
+util::StatusOr<grpc::Status, int64_t> StatServiceImpl::DeleteEvents(
+    uint64_t user, uint64_t stat_id, const std::vector<uint64_t>& event_ids,
+    PostingBlockWriter* postings, RollupWriter* rollups,
+    QuantileSketchWriter* sketches, leveldb::WriteBatch* batch) {
+  std::vector<uint64_t> sorted_ids(event_ids);
+  std::sort(sorted_ids.begin(), sorted_ids.end());
+  sorted_ids.erase(std::unique(sorted_ids.begin(), sorted_ids.end()),
+                   sorted_ids.end());
+  int64_t num_deleted = 0;
+  // Events that aren't rows, by the base of the segment they'd be in.
+  std::map<uint64_t, std::set<uint64_t>> segment_event_ids;
+  auto it = storage_->NewIterator(leveldb::ReadOptions());
+  for (uint64_t event_id : sorted_ids) {
+    const Key primary_event_key = Key::ForEvent(user, stat_id, event_id);
+    if (!it->Valid() || it->key() != primary_event_key) {
+      it->Seek(primary_event_key);
+      if (!it->Valid() || it->key() != primary_event_key) {
+        RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+        segment_event_ids[EventSegmentBase(event_id)].insert(event_id);
+        continue;
+      }
+    }
+    Event event;
+    if (!event.ParseFromArray(it->value().data(), it->value().size())) {
+      return grpc::Status(
+          grpc::StatusCode::INTERNAL,
+          absl::StrCat("value of event ", event_id, " not parseable"));
+    }
+    batch->Delete(primary_event_key);
+    const absl::Time start_time = FromProtoTimestamp(event.start_time());
+    batch->Delete(Key::ForEventStart(user, stat_id, start_time, event_id));
+
+    for (const IndexToken& token : IndexTokens(event)) {
+      RETURN_IF_ERROR(storage::ToGrpcStatus(
+          postings->Remove(user, stat_id, token, event_id)));
+    }
+    const absl::Duration duration = FromProtoDuration(event.duration());
+    RETURN_IF_ERROR(storage::ToGrpcStatus(
+        rollups->Remove(user, stat_id, start_time, duration)));
+    RETURN_IF_ERROR(storage::ToGrpcStatus(sketches->Remove(
+        user, stat_id, start_time, duration, SketchedValue(event.value()))));
+    ++num_deleted;
+    it->Next();
+  }
+  RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+  for (const auto& base_and_ids : segment_event_ids) {
+    ASSIGN_OR_RETURN(const int64_t num_segment_deleted,
+                     DeleteSegmentEvents(user, stat_id, base_and_ids.first,
+                                         base_and_ids.second, rollups,
+                                         sketches, batch));
+    num_deleted += num_segment_deleted;
+  }
+  return num_deleted;
+}
+
+// Runs under the user lock once the deletions that left the rows stale are
+// written, so that the start time rows are those of the events left.
+grpc::Status StatServiceImpl::RebuildQuantileSketches(
+    const std::vector<std::string>& keys) {
+  if (keys.empty()) return grpc::Status::OK;
+  leveldb::WriteBatch batch;
+  auto it = storage_->NewIterator(leveldb::ReadOptions());
+  CachedSegment segment;
+  for (const std::string& key : keys) {
+    uint64_t user, stat_id;
+    uint8_t level;
+    int64_t index;
+    if (!Key::ParseSketches(key, &user, &stat_id, &level, &index)) {
+      return grpc::Status(grpc::StatusCode::INTERNAL,
+                          absl::StrCat("quantile sketches ",
+                                       absl::CHexEscape(key),
+                                       " not parseable"));
+    }
+    const TimeRangeToken token(level, index);
+    // Truncating division puts the times up to a bucket before the start of
+    // those at or below the epoch in them too.
+    absl::Time begin = sketch_tokenizer_.StartTime(token);
+    if (index <= 0) begin -= sketch_tokenizer_.granularity(level);
+    const absl::Time end = sketch_tokenizer_.EndTime(token);
+    const Key starts_prefix = Key::StatStartsPrefix(user, stat_id);
+    QuantileSketches sketches;
+    for (it->Seek(Key::ForEventStart(user, stat_id, begin, 0));
+         it->Valid() && it->key().starts_with(starts_prefix); it->Next()) {
+      uint64_t start_user, start_stat_id, event_id;
+      absl::Time start_time;
+      if (!Key::ParseEventStart(ToStringView(it->key()), &start_user,
+                                &start_stat_id, &start_time, &event_id)) {
+        return grpc::Status(
+            grpc::StatusCode::INTERNAL,
+            absl::StrCat("start time row ",
+                         absl::CHexEscape(it->key().ToString()),
+                         " not parseable"));
+      }
+      if (start_time >= end) break;
+      if (!(sketch_tokenizer_.TokenizeTimePoint(start_time)[level] == token)) {
+        continue;
+      }
+      Event event;
+      RETURN_IF_ERROR(ReadEventOrSegmentEvent(leveldb::ReadOptions(), user,
+                                              stat_id, event_id, &segment,
+                                              &event));
+      sketches.durations.Add(
+          absl::ToDoubleSeconds(FromProtoDuration(event.duration())));
+      const absl::optional<double> value = SketchedValue(event.value());
+      if (value.has_value()) sketches.values.Add(*value);
+    }
+    RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+    if (sketches.duration_count() == 0) {
+      batch.Delete(key);
+      continue;
+    }
+    std::string value;
+    EncodeQuantileSketches(sketches, &value);
+    batch.Put(key, value);
+  }
+  VLOG(1) << "rebuilt " << keys.size() << " quantile sketch rows";
+  return storage::ToGrpcStatus(storage_->Write(write_options_, &batch));
+}
+
 grpc::Status StatServiceImpl::DeleteEvent(grpc::ServerContext* context,
                                           const DeleteEventRequest* request,
                                           google::protobuf::Empty*) {
   ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
+  auto user_or = LookupUser(request->user_id());
+  uint64_t stat_id, event_id;
+  if (IsNotFound(user_or.status()) ||
+      !absl::SimpleAtoi(request->stat_id(), &stat_id) ||
+      !absl::SimpleAtoi(request->event_id(), &event_id)) {
+    LOG(INFO) << "DeleteEvent request for nonexistent event: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  RETURN_IF_ERROR(user_or.status());
+  // The rows of deleted stats are the reaper's.
+  ASSIGN_OR_RETURN(const bool defined,
+                   IsStatDefined(leveldb::ReadOptions(), user_or.ValueOrDie(),
+                                 stat_id));
+  if (!defined) {
+    LOG(INFO) << "DeleteEvent request for nonexistent stat: "
+              << request->ShortDebugString();
+    return grpc::Status::OK;
+  }
+  PostingBlockWriter postings(storage_.get(), index_cache_ != nullptr,
+                              posting_block_cache_.get());
+  RollupWriter rollups(storage_.get(), &tokenizer_);
+  QuantileSketchWriter sketches(storage_.get(), &sketch_tokenizer_);
   leveldb::WriteBatch batch;
-  RETURN_IF_ERROR(DeleteEvent(request->user_id(), request->stat_id(),
-                              request->event_id(), &batch));
-  RETURN_IF_ERROR(
-      storage::ToGrpcStatus(leveldb_->Write(leveldb::WriteOptions(), &batch)));
+  RETURN_IF_ERROR(DeleteEvents(user_or.ValueOrDie(), stat_id, {event_id},
+                               &postings, &rollups, &sketches, &batch)
+                      .status());
+  rollups.Flush(&batch);
+  sketches.Flush(&batch);
+  RETURN_IF_ERROR(WriteWithPostings(&postings, &batch));
+  if (event_cache_ != nullptr) {
+    event_cache_->Erase(EventKey(user_or.ValueOrDie(), stat_id, event_id));
+  }
+  RETURN_IF_ERROR(RebuildQuantileSketches(sketches.stale_rows()));
   LOG(INFO) << "DeleteEvent request: " << request->ShortDebugString();
   return grpc::Status::OK;
 }
 
+// The victims are found once, then deleted a batch at a time, each under the
+// user lock and in its own write, so that other requests get in between and
+// the deadline is checked between batches.
+grpc::Status StatServiceImpl::DeleteEventsInRange(
+    grpc::ServerContext* context, const DeleteEventsInRangeRequest* request,
+    DeleteEventsInRangeResponse* response) {
+  const absl::Time start = FromProtoTimestamp(request->start_time());
+  const absl::Time end = start + FromProtoDuration(request->duration());
+  uint64_t user, stat_id;
+  std::vector<uint64_t> event_ids;
+  {
+    ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
+    auto user_or = LookupUser(request->user_id());
+    if (IsNotFound(user_or.status()) ||
+        !absl::SimpleAtoi(request->stat_id(), &stat_id)) {
+      LOG(INFO) << "DeleteEventsInRange request for nonexistent stat: "
+                << request->ShortDebugString();
+      return grpc::Status::OK;
+    }
+    RETURN_IF_ERROR(user_or.status());
+    user = user_or.ValueOrDie();
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(leveldb::ReadOptions(), user, stat_id));
+    if (!defined) {
+      LOG(INFO) << "DeleteEventsInRange request for nonexistent stat: "
+                << request->ShortDebugString();
+      return grpc::Status::OK;
+    }
+    RETURN_IF_ERROR(QueryIndex(leveldb::ReadOptions(), user, stat_id, start,
+                               end, &event_ids));
+    RETURN_IF_ERROR(ForEachSegmentEvent(
+        leveldb::ReadOptions(), user, stat_id, start, end,
+        [&](const SegmentEvent& segment_event) {
+          event_ids.push_back(segment_event.id);
+          return grpc::Status::OK;
+        }));
+  }
+
+  const absl::Time deadline = DeadlineFromContext(*context);
+  int64_t num_deleted = 0;
+  for (size_t begin = 0; begin < event_ids.size();
+       begin += kMaxDeleteBatchEvents) {
+    if (absl::Now() >= deadline) {
+      return grpc::Status(
+          grpc::StatusCode::DEADLINE_EXCEEDED,
+          absl::StrCat("deadline exceeded after deleting ", num_deleted,
+                       " of ", event_ids.size(), " events"));
+    }
+    const std::vector<uint64_t> batch_ids(
+        event_ids.begin() + begin,
+        event_ids.begin() +
+            std::min(event_ids.size(), begin + kMaxDeleteBatchEvents));
+    ASSIGN_OR_RETURN(auto l, AcquireUserLock(*context, request->user_id()));
+    ASSIGN_OR_RETURN(const bool defined,
+                     IsStatDefined(leveldb::ReadOptions(), user, stat_id));
+    if (!defined) break;
+    PostingBlockWriter postings(storage_.get(), index_cache_ != nullptr,
+                                posting_block_cache_.get());
+    RollupWriter rollups(storage_.get(), &tokenizer_);
+    QuantileSketchWriter sketches(storage_.get(), &sketch_tokenizer_);
+    leveldb::WriteBatch batch;
+    ASSIGN_OR_RETURN(const int64_t num_batch_deleted,
+                     DeleteEvents(user, stat_id, batch_ids, &postings,
+                                  &rollups, &sketches, &batch));
+    rollups.Flush(&batch);
+    sketches.Flush(&batch);
+    RETURN_IF_ERROR(WriteWithPostings(&postings, &batch));
+    if (event_cache_ != nullptr) {
+      for (uint64_t event_id : batch_ids) {
+        event_cache_->Erase(EventKey(user, stat_id, event_id));
+      }
+    }
+    RETURN_IF_ERROR(RebuildQuantileSketches(sketches.stale_rows()));
+    num_deleted += num_batch_deleted;
+  }
+  response->set_deleted_count(num_deleted);
+  LOG(INFO) << "DeleteEventsInRange request: " << request->ShortDebugString()
+            << " response: " << response->ShortDebugString();
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::MigrateLegacyRow(const LegacyKey& legacy_key,
+                                               const leveldb::Slice& value,
+                                               PostingBlockWriter* postings,
+                                               RollupWriter* rollups,
+                                               QuantileSketchWriter* sketches,
+                                               leveldb::WriteBatch* batch) {
+  ASSIGN_OR_RETURN(const uint64_t user,
+                   InternUser(std::string(legacy_key.user_id)));
+  if (legacy_key.type == LegacyKey::Type::kNextStatId) {
+    batch->Put(Key::NextStatId(user), value);
+    return grpc::Status::OK;
+  }
+
+  // Legacy stat and event ids were always written as decimal counters.
+  uint64_t stat_id, event_id;
+  if (!absl::SimpleAtoi(legacy_key.stat_id, &stat_id) ||
+      (legacy_key.type == LegacyKey::Type::kEvent &&
+       !absl::SimpleAtoi(legacy_key.event_id, &event_id))) {
+    return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                        absl::StrCat("legacy key for user ", legacy_key.user_id,
+                                     " has a non-numeric id"));
+  }
+  switch (legacy_key.type) {
+    case LegacyKey::Type::kStat:
+      batch->Put(Key::ForStat(user, stat_id), value);
+      break;
+    case LegacyKey::Type::kNextEventId:
+      batch->Put(Key::NextEventId(user, stat_id), value);
+      break;
+    case LegacyKey::Type::kEvent: {
+      Event event;
+      if (!event.ParseFromArray(value.data(), value.size())) {
+        return grpc::Status(grpc::StatusCode::DATA_LOSS,
+                            "legacy event not parseable");
+      }
+      batch->Put(Key::ForEvent(user, stat_id, event_id), value);
+      PutEventStart(user, stat_id, event_id, event, batch);
+      for (const IndexToken& token : IndexTokens(event)) {
+        RETURN_IF_ERROR(storage::ToGrpcStatus(
+            postings->Add(user, stat_id, token, event_id)));
+      }
+      const absl::Time start_time = FromProtoTimestamp(event.start_time());
+      const absl::Duration duration = FromProtoDuration(event.duration());
+      RETURN_IF_ERROR(storage::ToGrpcStatus(
+          rollups->Add(user, stat_id, start_time, duration)));
+      RETURN_IF_ERROR(storage::ToGrpcStatus(sketches->Add(
+          user, stat_id, start_time, duration, SketchedValue(event.value()))));
+      break;
+    }
+    default:
+      // Index hits are rebuilt from their events.
+      break;
+  }
+  return grpc::Status::OK;
+}
+
+// The row holds the index granularities, then a semicolon and the sketched
+// ones. Databases from before the row are taken to match.
+grpc::Status StatServiceImpl::CheckGranularities() {
+  std::string granularities;
+  AppendGranularities(tokenizer_, &granularities);
+  granularities.push_back(';');
+  AppendGranularities(sketch_tokenizer_, &granularities);
+  std::string stored;
+  const leveldb::Status status =
+      storage_->Get(leveldb::ReadOptions(), Key::Granularities(), &stored);
+  if (status.IsNotFound()) {
+    leveldb::WriteBatch batch;
+    batch.Put(Key::Granularities(), granularities);
+    return storage::ToGrpcStatus(storage_->Write(write_options_, &batch));
+  }
+  RETURN_IF_ERROR(storage::ToGrpcStatus(status));
+  if (stored != granularities) {
+    return grpc::Status(
+        grpc::StatusCode::FAILED_PRECONDITION,
+        absl::StrCat("granularities ", granularities,
+                     " differ from those the rows are keyed by, ", stored));
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::MigrateLegacyKeys() {
+  auto it = storage_->NewIterator(leveldb::ReadOptions());
+  PostingBlockWriter postings(storage_.get());
+  RollupWriter rollups(storage_.get(), &tokenizer_);
+  QuantileSketchWriter sketches(storage_.get(), &sketch_tokenizer_);
+  leveldb::WriteBatch batch;
+  int64_t num_migrated = 0;
+  std::set<std::pair<std::string, uint64_t>> migrated_stats;
+  for (it->Seek(Key::LegacyKeysBegin()); it->Valid(); it->Next()) {
+    LegacyKey legacy_key;
+    if (!LegacyKey::Parse(ToStringView(it->key()), &legacy_key)) {
+      LOG(WARNING) << "skipping unrecognized key "
+                   << absl::CHexEscape(it->key().ToString());
+      continue;
+    }
+    RETURN_IF_ERROR(
+        MigrateLegacyRow(legacy_key, it->value(), &postings, &rollups,
+                         &sketches, &batch));
+    uint64_t stat_id;
+    if (legacy_key.type == LegacyKey::Type::kNextEventId &&
+        absl::SimpleAtoi(legacy_key.stat_id, &stat_id)) {
+      migrated_stats.emplace(std::string(legacy_key.user_id), stat_id);
+    }
+    batch.Delete(it->key());
+    ++num_migrated;
+    if (batch.ApproximateSize() >= kMaxMigrationBatchBytes) {
+      postings.Flush(&batch);
+      rollups.Flush(&batch);
+      sketches.Flush(&batch);
+      RETURN_IF_ERROR(storage::ToGrpcStatus(
+          storage_->Write(write_options_, &batch)));
+      batch.Clear();
+    }
+  }
+  RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+  postings.Flush(&batch);
+  rollups.Flush(&batch);
+  sketches.Flush(&batch);
+  RETURN_IF_ERROR(
+      storage::ToGrpcStatus(storage_->Write(write_options_, &batch)));
+  // Migrated stats may have been cached before their legacy rows were
+  // rewritten.
+  if (index_cache_ != nullptr) index_cache_->Clear();
+  if (stat_cache_ != nullptr) stat_cache_->Clear();
+  if (posting_block_cache_ != nullptr) posting_block_cache_->Clear();
+  LOG(INFO) << "migrated " << num_migrated << " legacy rows";
+  for (const auto& user_and_stat : migrated_stats) {
+    ScheduleSealing(user_and_stat.first, user_and_stat.second);
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::ExpireEvents() {
+  // The registry is read up front, as stats may be deleted meanwhile.
+  std::vector<std::tuple<std::string, uint64_t, uint64_t>> retained_stats;
+  RETURN_IF_ERROR(ReadPrefix(
+      leveldb::ReadOptions(), Key::RetainedStatsPrefix(),
+      [&](const leveldb::Slice& key, const leveldb::Slice& value) {
+        uint64_t user, stat_id;
+        if (Key::ParseRetainedStat(ToStringView(key), &user, &stat_id)) {
+          retained_stats.emplace_back(value.ToString(), user, stat_id);
+        }
+      }));
+  const absl::Time now = absl::Now();
+  int64_t num_expired = 0;
+  for (const auto& retained_stat : retained_stats) {
+    const int64_t num_expired_before = num_expired;
+    RETURN_IF_ERROR(ExpireStatEvents(std::get<0>(retained_stat),
+                                     std::get<1>(retained_stat),
+                                     std::get<2>(retained_stat), now,
+                                     &num_expired));
+    if (num_expired > num_expired_before) {
+      CompactStat(std::get<1>(retained_stat), std::get<2>(retained_stat));
+    }
+  }
+  LOG(INFO) << "expired " << num_expired << " events of "
+            << retained_stats.size() << " stats with a retention policy";
+  return grpc::Status::OK;
+}
+
+// Taking the count under the user lock costs a seek to each end of the start
+// time rows and a read per token of the range between them, however many
+// events there are.
+util::StatusOr<grpc::Status, int64_t> StatServiceImpl::CountEvents(
+    uint64_t user, uint64_t stat_id) {
+  const Key begin = Key::StatStartsPrefix(user, stat_id);
+  const Key end = Key::StatStartsPrefix(user, stat_id + 1);
+  auto it = storage_->NewIterator(leveldb::ReadOptions());
+  const auto parse_start = [&](absl::Time* start_time) {
+    uint64_t start_user, start_stat_id, event_id;
+    if (!Key::ParseEventStart(ToStringView(it->key()), &start_user,
+                              &start_stat_id, start_time, &event_id)) {
+      return grpc::Status(grpc::StatusCode::INTERNAL,
+                          absl::StrCat("start time row ",
+                                       absl::CHexEscape(it->key().ToString()),
+                                       " not parseable"));
+    }
+    return grpc::Status::OK;
+  };
+  it->Seek(begin);
+  if (!it->Valid() || !it->key().starts_with(begin)) {
+    RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+    return int64_t{0};
+  }
+  absl::Time first, last;
+  RETURN_IF_ERROR(parse_start(&first));
+  it->Seek(end);
+  if (it->Valid()) {
+    it->Prev();
+  } else {
+    it->SeekToLast();
+  }
+  RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+  RETURN_IF_ERROR(parse_start(&last));
+  // The range goes by the finest tokens of the two rows, which bucket 0
+  // spans on both sides of the epoch.
+  const std::vector<TimeRangeToken> tokens = tokenizer_.TokenizeTimeRange(
+      tokenizer_.StartTime(tokenizer_.TokenizeTimePoint(first).front()),
+      tokenizer_.EndTime(tokenizer_.TokenizeTimePoint(last).front()));
+  EventRollup rollup;
+  RETURN_IF_ERROR(storage::ToGrpcStatus(
+      ReadRollups(storage_.get(), leveldb::ReadOptions(), user, stat_id,
+                  tokens, &rollup)));
+  return rollup.count;
+}
+
+// Start time rows order the events oldest first, so the expired ones, both
+// those past the maximum age and the excess over the maximum count, are the
+// first rows of the stat's.
+grpc::Status StatServiceImpl::ExpireStatEvents(const std::string& user_id,
+                                               uint64_t user, uint64_t stat_id,
+                                               absl::Time now,
+                                               int64_t* num_expired) {
+  const Key starts_prefix = Key::StatStartsPrefix(user, stat_id);
+  // Events over the maximum count, as of the first batch. Events recorded
+  // since are left to the next run.
+  absl::optional<int64_t> excess;
+  for (;;) {
+    std::vector<uint64_t> event_ids;
+    {
+      auto l = user_locks_.Acquire(user_id);
+      Stat stat;
+      const leveldb::Status stat_status =
+          ProtoGet(storage_.get(), leveldb::ReadOptions(),
+                   Key::ForStat(user, stat_id), &stat);
+      if (stat_status.IsNotFound()) return grpc::Status::OK;
+      RETURN_IF_ERROR(storage::ToGrpcStatus(stat_status));
+      const Retention& retention = stat.retention();
+      const absl::Duration max_age = FromProtoDuration(retention.max_age());
+      const absl::Time cutoff =
+          max_age > absl::ZeroDuration() ? now - max_age : absl::InfinitePast();
+      if (!excess.has_value()) {
+        int64_t num_events = 0;
+        if (retention.max_event_count() > 0) {
+          ASSIGN_OR_RETURN(num_events, CountEvents(user, stat_id));
+        }
+        excess = retention.max_event_count() > 0
+                     ? num_events - retention.max_event_count()
+                     : 0;
+      }
+
+      auto it = storage_->NewIterator(leveldb::ReadOptions());
+      for (it->Seek(starts_prefix);
+           it->Valid() && it->key().starts_with(starts_prefix) &&
+           static_cast<int>(event_ids.size()) < expiry_batch_size_;
+           it->Next()) {
+        uint64_t start_user, start_stat_id, event_id;
+        absl::Time start_time;
+        if (!Key::ParseEventStart(ToStringView(it->key()), &start_user,
+                                  &start_stat_id, &start_time, &event_id)) {
+          return grpc::Status(
+              grpc::StatusCode::INTERNAL,
+              absl::StrCat("start time row ",
+                           absl::CHexEscape(it->key().ToString()),
+                           " not parseable"));
+        }
+        if (static_cast<int64_t>(event_ids.size()) >= *excess &&
+            start_time >= cutoff) {
+          break;
+        }
+        event_ids.push_back(event_id);
+      }
+      RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+      if (event_ids.empty()) return grpc::Status::OK;
+
+      PostingBlockWriter postings(storage_.get(), index_cache_ != nullptr,
+                                  posting_block_cache_.get());
+      RollupWriter rollups(storage_.get(), &tokenizer_);
+      QuantileSketchWriter sketches(storage_.get(), &sketch_tokenizer_);
+      leveldb::WriteBatch batch;
+      RETURN_IF_ERROR(DeleteEvents(user, stat_id, event_ids, &postings,
+                                   &rollups, &sketches, &batch)
+                          .status());
+      rollups.Flush(&batch);
+      sketches.Flush(&batch);
+      RETURN_IF_ERROR(WriteWithPostings(&postings, &batch));
+      if (event_cache_ != nullptr) {
+        for (uint64_t event_id : event_ids) {
+          event_cache_->Erase(EventKey(user, stat_id, event_id));
+        }
+      }
+      RETURN_IF_ERROR(RebuildQuantileSketches(sketches.stale_rows()));
+    }
+    *excess -= static_cast<int64_t>(event_ids.size());
+    *num_expired += static_cast<int64_t>(event_ids.size());
+    VLOG(1) << "expired " << event_ids.size() << " events of stat " << stat_id;
+    if (static_cast<int>(event_ids.size()) < expiry_batch_size_) {
+      return grpc::Status::OK;
+    }
+    absl::SleepFor(expiry_pause_);
+  }
+}
+
+// Deleted rows stay in the LSM tree, and slow down the seeks into their
+// ranges, until compactions drop them.
+void StatServiceImpl::CompactStat(uint64_t user, uint64_t stat_id) {
+  const auto compact = [&](Key (*prefix)(uint64_t, uint64_t)) {
+    const Key begin = prefix(user, stat_id);
+    const Key end = prefix(user, stat_id + 1);
+    const leveldb::Slice begin_slice = begin, end_slice = end;
+    storage_->CompactRange(&begin_slice, &end_slice);
+  };
+  compact(&Key::StatEventsPrefix);
+  compact(&Key::StatIndexPrefix);
+  compact(&Key::StatSegmentsPrefix);
+  compact(&Key::StatStartsPrefix);
+}
+
+void StatServiceImpl::ScheduleReaping() {
+  background_.Schedule([this]() {
+    const grpc::Status status = ReapDeletedStats();
+    if (!status.ok()) {
+      LOG(ERROR) << "reaping deleted stats failed: " << status.error_message();
+    }
+  });
+}
+
+grpc::Status StatServiceImpl::ReapDeletedStats() {
+  std::vector<std::pair<uint64_t, uint64_t>> deleted_stats;
+  RETURN_IF_ERROR(ReadPrefix(
+      leveldb::ReadOptions(), Key::DeletedStatsPrefix(),
+      [&](const leveldb::Slice& key, const leveldb::Slice& value) {
+        uint64_t user, stat_id;
+        if (Key::ParseDeletedStat(ToStringView(key), &user, &stat_id)) {
+          deleted_stats.emplace_back(user, stat_id);
+        }
+      }));
+  for (const auto& user_and_stat : deleted_stats) {
+    RETURN_IF_ERROR(ReapStat(user_and_stat.first, user_and_stat.second));
+  }
+  return grpc::Status::OK;
+}
+
+// Nothing writes to a stat once its Stat row is deleted, so this neither
+// takes nor waits for the user lock. Each batch reads on from where the last
+// one stopped, rather than seeking over the deletions it left behind.
+grpc::Status StatServiceImpl::ReapStat(uint64_t user, uint64_t stat_id) {
+  int64_t num_reaped = 0;
+  for (const Key& prefix : {Key::StatEventsPrefix(user, stat_id),
+                            Key::StatIndexPrefix(user, stat_id),
+                            Key::StatSegmentsPrefix(user, stat_id),
+                            Key::StatStartsPrefix(user, stat_id),
+                            Key::StatRollupsPrefix(user, stat_id),
+                            Key::StatSketchesPrefix(user, stat_id)}) {
+    auto it = storage_->NewIterator(leveldb::ReadOptions());
+    it->Seek(prefix);
+    while (it->Valid() && it->key().starts_with(prefix)) {
+      leveldb::WriteBatch batch;
+      int num_rows = 0;
+      for (; it->Valid() && it->key().starts_with(prefix) &&
+             num_rows < kMaxReapBatchRows;
+           it->Next()) {
+        batch.Delete(it->key());
+        ++num_rows;
+      }
+      RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+      RETURN_IF_ERROR(
+          storage::ToGrpcStatus(storage_->Write(write_options_, &batch)));
+      num_reaped += num_rows;
+      if (num_rows == kMaxReapBatchRows) absl::SleepFor(expiry_pause_);
+    }
+    RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+  }
+  leveldb::WriteBatch batch;
+  batch.Delete(Key::ForDeletedStat(user, stat_id));
+  RETURN_IF_ERROR(
+      storage::ToGrpcStatus(storage_->Write(write_options_, &batch)));
+  CompactStat(user, stat_id);
+  LOG(INFO) << "reaped " << num_reaped << " rows of deleted stat " << stat_id;
+  return grpc::Status::OK;
+}
+
+void StatServiceImpl::ScheduleSealing(const std::string& user_id,
+                                      uint64_t stat_id) {
+  background_.Schedule([this, user_id, stat_id]() {
+    const grpc::Status status = SealEventSegments(user_id, stat_id);
+    if (!status.ok()) {
+      LOG(ERROR) << "sealing event segments of user " << user_id << " stat "
+                 << stat_id << " failed: " << status.error_message();
+    }
+  });
+}
+
+grpc::Status StatServiceImpl::SealEventSegments(const std::string& user_id,
+                                                uint64_t stat_id) {
+  auto l = user_locks_.Acquire(user_id);
+  ASSIGN_OR_RETURN(const uint64_t user, LookupUser(user_id));
+  ASSIGN_OR_RETURN(const bool defined,
+                   IsStatDefined(leveldb::ReadOptions(), user, stat_id));
+  if (!defined) return grpc::Status::OK;
+  auto next_event_id_or = ids_.Peek(Key::NextEventId(user, stat_id));
+  RETURN_IF_ERROR(storage::ToGrpcStatus(next_event_id_or.status()));
+  // Ids below this have all been allocated or skipped.
+  const uint64_t completed_end =
+      EventSegmentBase(next_event_id_or.ValueOrDie());
+
+  // Event rows left in a completed segment are usually the whole segment, but
+  // may also be rows that didn't fit into it or were migrated after it was
+  // sealed.
+  const Key events_prefix = Key::StatEventsPrefix(user, stat_id);
+  auto it = storage_->NewIterator(leveldb::ReadOptions());
+  for (uint64_t base = 0; base < completed_end; base += kEventSegmentSpan) {
+    it->Seek(Key::ForEvent(user, stat_id, base));
+    uint64_t event_user, event_stat_id, event_id;
+    if (!it->Valid() || !it->key().starts_with(events_prefix) ||
+        !Key::ParseEvent(ToStringView(it->key()), &event_user, &event_stat_id,
+                         &event_id)) {
+      break;
+    }
+    base = EventSegmentBase(event_id);
+    if (base >= completed_end) break;
+    RETURN_IF_ERROR(SealEventSegment(user, stat_id, base));
+  }
+  return storage::ToGrpcStatus(it->status());
+}
+
+grpc::Status StatServiceImpl::SealEventSegment(uint64_t user, uint64_t stat_id,
+                                               uint64_t base) {
+  std::string columns;
+  std::vector<SegmentEvent> sealed_events;
+  RETURN_IF_ERROR(
+      ReadEventSegment(leveldb::ReadOptions(), user, stat_id, base, &columns,
+                       &sealed_events));
+  EventSegmentBuilder builder(base);
+  for (const SegmentEvent& event : sealed_events) {
+    builder.Add(event.id, event.start_time, event.duration, event.value);
+  }
+
+  PostingBlockWriter postings(storage_.get(), index_cache_ != nullptr,
+                              posting_block_cache_.get());
+  leveldb::WriteBatch batch;
+  int num_sealed = 0;
+  const Key end_key = Key::ForEvent(user, stat_id, base + kEventSegmentSpan);
+  auto it = storage_->NewIterator(leveldb::ReadOptions());
+  for (it->Seek(Key::ForEvent(user, stat_id, base));
+       it->Valid() && it->key().compare(end_key) < 0; it->Next()) {
+    uint64_t event_user, event_stat_id, event_id;
+    Event event;
+    if (!Key::ParseEvent(ToStringView(it->key()), &event_user, &event_stat_id,
+                         &event_id) ||
+        !event.ParseFromArray(it->value().data(), it->value().size())) {
+      return grpc::Status(
+          grpc::StatusCode::INTERNAL,
+          absl::StrCat("event row ", absl::CHexEscape(it->key().ToString()),
+                       " not parseable"));
+    }
+    const absl::Time start_time = FromProtoTimestamp(event.start_time());
+    const std::string value =
+        event.has_value() ? event.value().SerializeAsString() : "";
+    if (!builder.Add(event_id, start_time,
+                     FromProtoDuration(event.duration()), value)) {
+      VLOG(1) << "event " << event_id << " stays a row; its times don't fit";
+      continue;
+    }
+    batch.Delete(it->key());
+    for (const IndexToken& token : IndexTokens(event)) {
+      RETURN_IF_ERROR(storage::ToGrpcStatus(
+          postings.Remove(user, stat_id, token, event_id)));
+    }
+    ++num_sealed;
+  }
+  RETURN_IF_ERROR(storage::ToGrpcStatus(it->status()));
+  if (num_sealed == 0) return grpc::Status::OK;
+
+  WriteEventSegment(user, stat_id, base, &builder, &batch);
+  RETURN_IF_ERROR(WriteWithPostings(&postings, &batch));
+  VLOG(1) << "sealed " << num_sealed << " events of stat " << stat_id
+          << " into segment " << base;
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::ReadEventSegment(
+    const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id,
+    uint64_t base, std::string* columns, std::vector<SegmentEvent>* events) {
+  const leveldb::Status status = storage_->Get(
+      options, Key::ForSegmentColumns(user, stat_id, base), columns);
+  if (status.IsNotFound()) return grpc::Status::OK;
+  RETURN_IF_ERROR(storage::ToGrpcStatus(status));
+  if (!DecodeEventSegment(base, *columns, events)) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        absl::StrCat("event segment ", base, " of stat ",
+                                     stat_id, " not parseable"));
+  }
+  return grpc::Status::OK;
+}
+
+void StatServiceImpl::WriteEventSegment(uint64_t user, uint64_t stat_id,
+                                        uint64_t base,
+                                        EventSegmentBuilder* builder,
+                                        leveldb::WriteBatch* batch) {
+  const Key header_key = Key::ForSegmentHeader(user, stat_id, base);
+  const Key columns_key = Key::ForSegmentColumns(user, stat_id, base);
+  if (builder->empty()) {
+    batch->Delete(header_key);
+    batch->Delete(columns_key);
+    return;
+  }
+  std::string header, columns;
+  builder->Finish(&header, &columns);
+  batch->Put(header_key, header);
+  batch->Put(columns_key, columns);
+}
+
+// Segments are immutable, so deleting some of their events rewrites them.
+util::StatusOr<grpc::Status, int64_t> StatServiceImpl::DeleteSegmentEvents(
+    uint64_t user, uint64_t stat_id, uint64_t base,
+    const std::set<uint64_t>& event_ids, RollupWriter* rollups,
+    QuantileSketchWriter* sketches, leveldb::WriteBatch* batch) {
+  std::string columns;
+  std::vector<SegmentEvent> events;
+  RETURN_IF_ERROR(ReadEventSegment(leveldb::ReadOptions(), user, stat_id, base,
+                                   &columns, &events));
+  EventSegmentBuilder builder(base);
+  int64_t num_deleted = 0;
+  for (const SegmentEvent& event : events) {
+    if (event_ids.count(event.id) > 0) {
+      ++num_deleted;
+      batch->Delete(
+          Key::ForEventStart(user, stat_id, event.start_time, event.id));
+      RETURN_IF_ERROR(storage::ToGrpcStatus(rollups->Remove(
+          user, stat_id, event.start_time, event.duration)));
+      google::protobuf::Any value;
+      absl::optional<double> numeric_value;
+      if (!event.value.empty() &&
+          value.ParseFromArray(event.value.data(), event.value.size())) {
+        numeric_value = SketchedValue(value);
+      }
+      RETURN_IF_ERROR(storage::ToGrpcStatus(
+          sketches->Remove(user, stat_id, event.start_time, event.duration,
+                           numeric_value)));
+      continue;
+    }
+    builder.Add(event.id, event.start_time, event.duration, event.value);
+  }
+  if (num_deleted > 0) {
+    WriteEventSegment(user, stat_id, base, &builder, batch);
+  }
+  return num_deleted;
+}
+
+grpc::Status StatServiceImpl::ReadEventOrSegmentEvent(
+    const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id,
+    uint64_t event_id, CachedSegment* segment, Event* event) {
+  const leveldb::Status status = ProtoGet(
+      storage_.get(), options, Key::ForEvent(user, stat_id, event_id), event);
+  if (!status.IsNotFound()) return storage::ToGrpcStatus(status);
+
+  const uint64_t base = EventSegmentBase(event_id);
+  if (segment->base != base) {
+    segment->base = ~uint64_t{0};
+    segment->events.clear();
+    RETURN_IF_ERROR(ReadEventSegment(options, user, stat_id, base,
+                                     &segment->columns, &segment->events));
+    segment->base = base;
+  }
+  for (const SegmentEvent& segment_event : segment->events) {
+    if (segment_event.id == event_id) {
+      return ToEvent(stat_id, segment_event, event);
+    }
+  }
+  return grpc::Status(
+      grpc::StatusCode::INTERNAL,
+      absl::StrCat("event ", event_id, " of stat ", stat_id, " is missing"));
+}
+
+// Scans the headers of the stat's segments and decodes the columns of the
+// ones that may hold a match.
+grpc::Status StatServiceImpl::ForEachSegmentEvent(
+    const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id,
+    absl::Time start, absl::Time end,
+    const std::function<grpc::Status(const SegmentEvent&)>& on_event) {
+  std::vector<uint64_t> bases;
+  bool corrupt_header = false;
+  RETURN_IF_ERROR(ReadPrefix(
+      options, Key::SegmentHeadersPrefix(user, stat_id),
+      [&](const leveldb::Slice& key, const leveldb::Slice& value) {
+        uint64_t header_user, header_stat_id, base;
+        EventSegmentHeader header;
+        if (!Key::ParseSegmentHeader(ToStringView(key), &header_user,
+                                     &header_stat_id, &base) ||
+            !DecodeEventSegmentHeader(ToStringView(value), &header)) {
+          corrupt_header = true;
+          return;
+        }
+        // An event matching the query implies its bounds do too.
+        if (tokenizer_.Matches(header.min_time, header.max_time, start, end)) {
+          bases.push_back(base);
+        }
+      }));
+  if (corrupt_header) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        "event segment header not parseable");
+  }
+
+  std::string columns;
+  std::vector<SegmentEvent> events;
+  for (uint64_t base : bases) {
+    events.clear();
+    RETURN_IF_ERROR(
+        ReadEventSegment(options, user, stat_id, base, &columns, &events));
+    for (const SegmentEvent& segment_event : events) {
+      if (tokenizer_.Matches(segment_event.start_time,
+                             segment_event.start_time + segment_event.duration,
+                             start, end)) {
+        RETURN_IF_ERROR(on_event(segment_event));
+      }
+    }
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status StatServiceImpl::ReadSegmentEventsForStat(
+    const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id,
+    absl::Time start, absl::Time end, ReadEventsResponse::Events* result) {
+  return ForEachSegmentEvent(
+      options, user, stat_id, start, end,
+      [&](const SegmentEvent& segment_event) {
+        return ToEvent(
+            stat_id, segment_event,
+            &(*result->mutable_event_by_id())[absl::StrCat(segment_event.id)]);
+      });
+}
+
 }  // namespace stat_tracker
@@ -1,29 +1,130 @@
 #ifndef STAT_TRACKER_SERVICE_IMPL_H_
 #define STAT_TRACKER_SERVICE_IMPL_H_
 
+#include <functional>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <tuple>
+#include <vector>
 
+#include "absl/memory/memory.h"
+#include "absl/types/optional.h"
 #include "google/protobuf/empty.pb.h"
 #include "include/grpcpp/server_context.h"
-#include "leveldb/db.h"
+#include "stat_tracker/event_segment.h"
+#include "stat_tracker/id_allocator.h"
+#include "stat_tracker/index_cache.h"
 #include "stat_tracker/key.h"
+#include "stat_tracker/posting_block.h"
+#include "stat_tracker/quantile_sketch.h"
+#include "stat_tracker/rollup.h"
 #include "stat_tracker/service.grpc.pb.h"
 #include "stat_tracker/service.pb.h"
 #include "stat_tracker/time_index.h"
+#include "stat_tracker/user_ids.h"
+#include "storage/storage.h"
 #include "util/lock_map.h"
+#include "util/lru_cache.h"
 #include "util/status.h"
+#include "util/worker_thread.h"
 
 namespace stat_tracker {
 
 class StatServiceImpl final : public StatService::Service {
  public:
   struct Options {
-    std::shared_ptr<leveldb::DB> db;
+    std::shared_ptr<storage::StorageInterface> storage;
     std::set<absl::Duration> index_granularities;
+    // Whether ReadStats and ReadEvents read a snapshot instead of taking the
+    // user lock, so that they neither wait for nor block the user's writes.
+    bool snapshot_reads = true;
+    // Whether writes are synced to disk before they're acknowledged. Wrap
+    // `storage` in a storage::GroupCommitStorage to share syncs between
+    // concurrent requests.
+    bool sync_writes = false;
+    // If nonzero, ReadEvents finds events in an in-memory copy of the index
+    // of recently read stats, holding up to this many bytes. Reads then take
+    // the user lock, shared, since the copy only has the latest state.
+    size_t index_cache_bytes = 0;
+    // If nonzero, the parsed stats of recently active users, and recently
+    // read or recorded events, are cached in up to this many bytes each.
+    size_t stat_cache_bytes = 0;
+    size_t event_cache_bytes = 0;
+    // If nonzero, the recently appended-to posting blocks are cached in up to
+    // this many bytes, so that recording an event needn't read back the
+    // blocks it adds its hits to.
+    size_t posting_block_cache_bytes = 0;
+    // Quantile sketches of event durations and values are kept per bucket of
+    // the index granularities at least this coarse, or of this granularity if
+    // there are none, so QueryQuantiles rounds its range out to it.
+    absl::Duration quantile_sketch_granularity = absl::Hours(1);
+    // ExpireEvents deletes at most this many events of a stat per write, and
+    // pauses this long between writes, so that it only holds a user's lock
+    // briefly and leaves the storage to foreground requests in between. The
+    // reaper of deleted stats pauses as long between its writes.
+    int expiry_batch_size = 1000;
+    absl::Duration expiry_pause = absl::Milliseconds(10);
+  };
+  struct CacheCounters {
+    util::CacheCounters stats;
+    util::CacheCounters events;
+    util::CacheCounters posting_blocks;
   };
   explicit StatServiceImpl(const Options& options)
-      : leveldb_(options.db), tokenizer_(options.index_granularities) {}
+      : storage_(options.storage),
+        user_ids_(options.storage),
+        ids_(options.storage),
+        tokenizer_(options.index_granularities),
+        sketch_tokenizer_(SketchGranularities(options)),
+        snapshot_reads_(options.snapshot_reads),
+        expiry_batch_size_(options.expiry_batch_size),
+        expiry_pause_(options.expiry_pause) {
+    write_options_.sync = options.sync_writes;
+    if (options.index_cache_bytes > 0) {
+      index_cache_ = absl::make_unique<IndexCache>(options.index_cache_bytes);
+    }
+    if (options.stat_cache_bytes > 0) {
+      stat_cache_ = absl::make_unique<StatCache>(options.stat_cache_bytes);
+    }
+    if (options.event_cache_bytes > 0) {
+      event_cache_ = absl::make_unique<EventCache>(options.event_cache_bytes);
+    }
+    if (options.posting_block_cache_bytes > 0) {
+      posting_block_cache_ = absl::make_unique<PostingBlockCache>(
+          options.posting_block_cache_bytes);
+    }
+  }
+
+  // Zero for disabled caches.
+  CacheCounters cache_counters() const;
+
+  // Records the index and sketched granularity sets in a new database, or
+  // fails with FAILED_PRECONDITION if they differ from those it has: keys
+  // refer to granularities by their position in the sets, so the rows would
+  // be misread. Call before serving.
+  grpc::Status CheckGranularities();
+
+  // Rewrites rows written by the text key schema that predates Key into the
+  // binary schema, rebuilding their index hits. Safe to rerun if interrupted.
+  grpc::Status MigrateLegacyKeys();
+
+  // Seals the event rows of every completed segment of the stat into event
+  // segments. Runs in the background whenever RecordEvent completes one.
+  grpc::Status SealEventSegments(const std::string& user_id, uint64_t stat_id);
+
+  // Deletes the rows of every deleted stat that are left. DeleteStat only
+  // hides the stat and schedules this in the background.
+  grpc::Status ReapDeletedStats();
+  // Schedules ReapDeletedStats in the background, e.g. to finish reaping
+  // that a restart interrupted.
+  void ScheduleReaping();
+
+  // Deletes the events of every stat with a Retention that are past it, then
+  // compacts the stat's key ranges to reclaim their space. Meant to run
+  // periodically in the background.
+  grpc::Status ExpireEvents();
 
   grpc::Status DefineStat(grpc::ServerContext* context,
                           const DefineStatRequest* request,
@@ -41,46 +142,237 @@ class StatServiceImpl final : public StatService::Service {
                           const ReadEventsRequest* request,
                           ReadEventsResponse* response) override;
 
+  grpc::Status StreamEvents(
+      grpc::ServerContext* context, const StreamEventsRequest* request,
+      grpc::ServerWriter<StreamEventsResponse>* writer) override;
+
+  grpc::Status AggregateEvents(grpc::ServerContext* context,
+                               const AggregateEventsRequest* request,
+                               AggregateEventsResponse* response) override;
+
+  grpc::Status AggregateValues(grpc::ServerContext* context,
+                               const AggregateValuesRequest* request,
+                               AggregateValuesResponse* response) override;
+
+  grpc::Status ReadSeries(grpc::ServerContext* context,
+                          const ReadSeriesRequest* request,
+                          ReadSeriesResponse* response) override;
+
+  grpc::Status QueryQuantiles(grpc::ServerContext* context,
+                              const QueryQuantilesRequest* request,
+                              QueryQuantilesResponse* response) override;
+
   grpc::Status RecordEvent(grpc::ServerContext* context,
                            const RecordEventRequest* request,
                            google::protobuf::Empty*) override;
 
+  grpc::Status RecordEvents(grpc::ServerContext* context,
+                            const RecordEventsRequest* request,
+                            RecordEventsResponse* response) override;
+
+  grpc::Status RecordEventStream(
+      grpc::ServerContext* context,
+      grpc::ServerReader<RecordEventsRequest>* reader,
+      RecordEventsResponse* response) override;
+
   grpc::Status DeleteEvent(grpc::ServerContext* context,
                            const DeleteEventRequest* request,
                            google::protobuf::Empty*) override;
 
+  grpc::Status DeleteEventsInRange(
+      grpc::ServerContext* context, const DeleteEventsInRangeRequest* request,
+      DeleteEventsInRangeResponse* response) override;
+
+  // The parts of the streaming calls that servers driving the streams
+  // themselves, like AsyncStatServer, run for each message.
+
+  // Takes a snapshot for the pages of one StreamEvents stream to read, so
+  // that like StreamEvents the stream is a single point in time.
+  std::unique_ptr<storage::ScopedSnapshot> NewStreamSnapshot() {
+    return absl::make_unique<storage::ScopedSnapshot>(storage_.get());
+  }
+  // Reads the page of the StreamEvents stream that starts at the request's
+  // cursor from `snapshot`.
+  grpc::Status ReadStreamPage(const grpc::ServerContext& context,
+                              const StreamEventsRequest& request,
+                              const storage::ScopedSnapshot& snapshot,
+                              StreamEventsResponse* page);
+  // Records the events of `request`, appending their results to `response`.
+  grpc::Status RecordEventBatch(const grpc::ServerContext& context,
+                                const RecordEventsRequest& request,
+                                RecordEventsResponse* response);
+
  private:
+  static std::set<absl::Duration> SketchGranularities(const Options& options);
+
   util::StatusOr<grpc::Status, util::LockMap<std::string>::Lock>
   AcquireUserLock(const grpc::ServerContext& context,
-                  const std::string& user_id);
+                  const std::string& user_id,
+                  util::LockMap<std::string>::Mode mode =
+                      util::LockMap<std::string>::Mode::kExclusive);
+  // Takes the user lock, shared, only if snapshot_reads is off or the read
+  // uses the index cache.
+  util::StatusOr<grpc::Status,
+                 absl::optional<util::LockMap<std::string>::Lock>>
+  AcquireReadLock(const grpc::ServerContext& context,
+                  const std::string& user_id, bool uses_index_cache = false);
+
+  // Flushes `postings` to `batch` and writes it, then updates the posting
+  // block cache and applies the edits of `postings`, which tracks them if the
+  // index cache is on, to the index cache.
+  grpc::Status WriteWithPostings(PostingBlockWriter* postings,
+                                 leveldb::WriteBatch* batch);
+
+  util::StatusOr<grpc::Status, uint64_t> LookupUser(const std::string& user_id);
+  util::StatusOr<grpc::Status, uint64_t> InternUser(const std::string& user_id);
+
+  util::StatusOr<grpc::Status, uint64_t> AllocateIds(const Key& key,
+                                                     uint64_t count);
 
-  util::StatusOr<grpc::Status, uint64_t> PostIncrement(
-      const Key& key, leveldb::WriteBatch* batch);
+  // A user's stats by id.
+  using StatCatalog = std::map<uint64_t, Stat>;
+  using StatCache = util::ShardedLruCache<uint64_t, StatCatalog>;
+  // Events by user, stat id and event id.
+  using EventKey = std::tuple<uint64_t, uint64_t, uint64_t>;
+  using EventCache = util::ShardedLruCache<EventKey, Event>;
 
-  grpc::Status AppendEvent(const std::string& user_id, const Event& event,
-                           leveldb::WriteBatch* batch);
-  grpc::Status DeleteEvent(const std::string& user_id,
-                           const std::string& stat_id,
-                           const std::string& event_id,
-                           leveldb::WriteBatch* batch);
+  // Reads the user's stats from a snapshot, or from the stat cache if on.
+  util::StatusOr<grpc::Status, std::shared_ptr<const StatCatalog>>
+  ReadStatCatalog(uint64_t user);
+  // NOT_FOUND if the stat isn't defined.
+  grpc::Status CheckStatExists(uint64_t user, uint64_t stat_id);
+  // Whether the stat is defined as of `options`. Reads skip stats that
+  // aren't, as deleted stats' rows stay until they're reaped.
+  util::StatusOr<grpc::Status, bool> IsStatDefined(
+      const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id);
+  // Applies `update` to the user's cached stats, or drops them if they
+  // aren't cached, once a write that changes them has succeeded.
+  void UpdateCachedStats(uint64_t user,
+                         const std::function<void(StatCatalog*)>& update);
+  void CacheEvent(const EventKey& key, const Event& event);
 
-  util::StatusOr<grpc::Status, std::string> AppendStat(
-      const std::string& user_id, const Stat& stat, leveldb::WriteBatch* batch);
+  std::vector<IndexToken> IndexTokens(const Event& event) const;
+
+  util::StatusOr<grpc::Status, uint64_t> AppendEvent(
+      uint64_t user, const Event& event, PostingBlockWriter* postings,
+      RollupWriter* rollups, QuantileSketchWriter* sketches,
+      leveldb::WriteBatch* batch);
+  // Returns how many of the events there were to delete.
+  util::StatusOr<grpc::Status, int64_t> DeleteEvents(
+      uint64_t user, uint64_t stat_id, const std::vector<uint64_t>& event_ids,
+      PostingBlockWriter* postings, RollupWriter* rollups,
+      QuantileSketchWriter* sketches, leveldb::WriteBatch* batch);
+  // Sketches the rows of `keys` anew from the events whose start time rows
+  // are in their buckets.
+  grpc::Status RebuildQuantileSketches(const std::vector<std::string>& keys);
+
+  // Counts the stat's events from its rollups, over the span between its
+  // first and last start time rows.
+  util::StatusOr<grpc::Status, int64_t> CountEvents(uint64_t user,
+                                                    uint64_t stat_id);
+  // Deletes the stat's events that are past its retention as of `now`,
+  // adding their number to `num_expired`.
+  grpc::Status ExpireStatEvents(const std::string& user_id, uint64_t user,
+                                uint64_t stat_id, absl::Time now,
+                                int64_t* num_expired);
+  void CompactStat(uint64_t user, uint64_t stat_id);
+  // Deletes the rows of the deleted stat in batches, then its tombstone.
+  grpc::Status ReapStat(uint64_t user, uint64_t stat_id);
+
+  void ScheduleSealing(const std::string& user_id, uint64_t stat_id);
+  grpc::Status SealEventSegment(uint64_t user, uint64_t stat_id,
+                                uint64_t base);
+  // Appends the events of the segment at `base`, if there is one, to
+  // `events`. They point into `columns`.
+  grpc::Status ReadEventSegment(const leveldb::ReadOptions& options,
+                                uint64_t user, uint64_t stat_id, uint64_t base,
+                                std::string* columns,
+                                std::vector<SegmentEvent>* events);
+  // Replaces the segment at `base` by the contents of `builder`.
+  void WriteEventSegment(uint64_t user, uint64_t stat_id, uint64_t base,
+                         EventSegmentBuilder* builder,
+                         leveldb::WriteBatch* batch);
+  // Deletes the events of `event_ids` from the segment at `base`, returning
+  // how many it held.
+  util::StatusOr<grpc::Status, int64_t> DeleteSegmentEvents(
+      uint64_t user, uint64_t stat_id, uint64_t base,
+      const std::set<uint64_t>& event_ids, RollupWriter* rollups,
+      QuantileSketchWriter* sketches, leveldb::WriteBatch* batch);
+  // The segment StreamEvents read last.
+  struct CachedSegment {
+    uint64_t base = ~uint64_t{0};
+    std::string columns;
+    std::vector<SegmentEvent> events;
+  };
+  // Reads the event into `event` from its row, or else from its segment,
+  // which replaces the one in `segment` if it isn't that already.
+  grpc::Status ReadEventOrSegmentEvent(const leveldb::ReadOptions& options,
+                                       uint64_t user, uint64_t stat_id,
+                                       uint64_t event_id,
+                                       CachedSegment* segment, Event* event);
+  // Appends the events from `cursor` on to `page`, until it's full.
+  grpc::Status ReadEventsPage(const leveldb::ReadOptions& options,
+                              uint64_t user,
+                              const StreamEventsRequest& request,
+                              const std::string& cursor,
+                              CachedSegment* segment,
+                              StreamEventsResponse* page);
+  // Calls `on_event` for each event in the stat's segments that matches
+  // [start, end) as ReadEvents matches events, until it fails.
+  grpc::Status ForEachSegmentEvent(
+      const leveldb::ReadOptions& options, uint64_t user, uint64_t stat_id,
+      absl::Time start, absl::Time end,
+      const std::function<grpc::Status(const SegmentEvent&)>& on_event);
+  grpc::Status ReadSegmentEventsForStat(const leveldb::ReadOptions& options,
+                                        uint64_t user, uint64_t stat_id,
+                                        absl::Time start, absl::Time end,
+                                        ReadEventsResponse::Events* result);
+
+  util::StatusOr<grpc::Status, uint64_t> AppendStat(
+      uint64_t user, const Stat& stat, leveldb::WriteBatch* batch);
+
+  grpc::Status MigrateLegacyRow(const LegacyKey& legacy_key,
+                                const leveldb::Slice& value,
+                                PostingBlockWriter* postings,
+                                RollupWriter* rollups,
+                                QuantileSketchWriter* sketches,
+                                leveldb::WriteBatch* batch);
 
   grpc::Status ReadPrefix(
-      const Key& key_prefix,
+      const leveldb::ReadOptions& options, const Key& key_prefix,
       const std::function<void(const leveldb::Slice& key,
                                const leveldb::Slice& value)>& on_row);
 
-  util::StatusOr<grpc::Status, ReadEventsResponse::Events> ReadEventsForStat(
-      const std::string& user_id, const std::string& stat_id, absl::Time start,
-      absl::Time end);
-
-  grpc::Status DeletePrefix(const Key& key_prefix, leveldb::WriteBatch* batch);
+  // Appends the ids of the stat's event rows matching [start, end) in the
+  // index, or its copy in the index cache, to `event_ids` in order.
+  grpc::Status QueryIndex(const leveldb::ReadOptions& options, uint64_t user,
+                          uint64_t stat_id, absl::Time start, absl::Time end,
+                          std::vector<uint64_t>* event_ids);
+  // Adds the stat's events matching [start, end) to `result`, which is
+  // usually a slot of the response so that they're parsed in place.
+  grpc::Status ReadEventsForStat(const leveldb::ReadOptions& options,
+                                 uint64_t user, uint64_t stat_id,
+                                 absl::Time start, absl::Time end,
+                                 ReadEventsResponse::Events* result);
 
   util::LockMap<std::string> user_locks_;
-  std::shared_ptr<leveldb::DB> leveldb_;
+  std::shared_ptr<storage::StorageInterface> storage_;
+  UserIds user_ids_;
+  IdAllocator ids_;
   const Tokenizer tokenizer_;
+  // The coarse granularities quantile sketches are kept for.
+  const Tokenizer sketch_tokenizer_;
+  const bool snapshot_reads_;
+  const int expiry_batch_size_;
+  const absl::Duration expiry_pause_;
+  leveldb::WriteOptions write_options_;
+  // Null if disabled.
+  std::unique_ptr<IndexCache> index_cache_;
+  std::unique_ptr<StatCache> stat_cache_;
+  std::unique_ptr<EventCache> event_cache_;
+  std::unique_ptr<PostingBlockCache> posting_block_cache_;
+  // Last, so that pending work finishes before the rest is destroyed.
+  util::WorkerThread background_;
 };
 
 }  // namespace stat_tracker
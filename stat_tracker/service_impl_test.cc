@@ -1,15 +1,18 @@
 #include "stat_tracker/service_impl.h"
 
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
+#include "google/protobuf/wrappers.pb.h"
 #include "googlemock/include/gmock/gmock.h"
 #include "googletest/include/gtest/gtest.h"
 #include "include/grpc++/grpc++.h"
 #include "include/grpc/grpc.h"
 #include "stat_tracker/time_util.h"
+#include "stat_tracker/user_ids.h"
 #include "storage/testing/leveldb.h"
 #include "util/status.h"
 #include "util/status_test_macros.h"
@@ -25,6 +28,8 @@ using ::testing::ElementsAre;
 using ::testing::Contains;
 using ::testing::Not;
 using ::testing::IsEmpty;
+using ::testing::Ge;
+using ::testing::Le;
 using ::testing::Pair;
 using ::testing::Property;
 using ::testing::SizeIs;
@@ -41,12 +46,21 @@ std::set<absl::Duration> GenerateGranularities() {
           absl::Hours(1e11),       absl::Hours(1e12)};
 }
 
+StatServiceImpl::Options WithTestStorage(
+    StatServiceImpl::Options options,
+    std::shared_ptr<storage::StorageInterface> storage) {
+  options.storage = std::move(storage);
+  options.index_granularities = GenerateGranularities();
+  return options;
+}
+
 class ServiceImplTest : public ::testing::Test {
  protected:
-  ServiceImplTest()
+  ServiceImplTest() : ServiceImplTest(StatServiceImpl::Options()) {}
+  // Serves with `options`, but on the test's storage and granularities.
+  explicit ServiceImplTest(StatServiceImpl::Options options)
       : leveldb_env_("test.leveldb"),
-        service_(StatServiceImpl::Options{leveldb_env_.db(),
-                                          GenerateGranularities()}) {
+        service_(WithTestStorage(std::move(options), leveldb_env_.db())) {
     std::string host_port = absl::StrCat("localhost:", FLAGS_port);
     server_ =
         grpc::ServerBuilder()
@@ -279,6 +293,28 @@ TEST_F(ServiceImplTest, DeleteStat) {
       const ReadEventsResponse read_events_resp,
       Call(&StatService::Stub::ReadEvents, read_events_req));
   EXPECT_THAT(read_events_resp.events_by_stat_id(), IsEmpty());
+
+  // Nor can any be recorded.
+  EXPECT_EQ(Call(&StatService::Stub::RecordEvent, event_req).status()
+                .error_code(),
+            grpc::StatusCode::NOT_FOUND);
+
+  // The reaper deletes the rest of its rows, which DeleteStat left.
+  ASSERT_GRPC_OK(service_.ReapDeletedStats());
+  auto user_or = UserIds(leveldb_env_.db()).Lookup("jack");
+  ASSERT_OK(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
+  uint64_t stat_id;
+  ASSERT_TRUE(absl::SimpleAtoi(foo_id, &stat_id));
+  for (const Key& prefix : {Key::StatEventsPrefix(user, stat_id),
+                            Key::StatIndexPrefix(user, stat_id),
+                            Key::StatStartsPrefix(user, stat_id),
+                            Key::StatRollupsPrefix(user, stat_id),
+                            Key::DeletedStatsPrefix()}) {
+    auto it = leveldb_env_.db()->NewIterator(leveldb::ReadOptions());
+    it->Seek(prefix);
+    EXPECT_FALSE(it->Valid() && it->key().starts_with(prefix));
+  }
 }
 
 TEST_F(ServiceImplTest, DeleteEvent) {
@@ -335,6 +371,64 @@ TEST_F(ServiceImplTest, DeleteEvent) {
                                  Not(Contains(Pair(event_to_delete, _))))))));
 }
 
+TEST_F(ServiceImplTest, DeleteEventsInRange) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(const DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // Ten events of 30 seconds, one per minute.
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  for (int i = 0; i < 10; ++i) {
+    RecordEventRequest event_req;
+    event_req.set_user_id("jack");
+    event_req.mutable_event()->set_stat_id(foo_id);
+    *event_req.mutable_event()->mutable_start_time() =
+        ToProtoTimestamp(start + absl::Minutes(i));
+    *event_req.mutable_event()->mutable_duration() =
+        ToProtoDuration(absl::Seconds(30));
+    ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+  }
+
+  // Delete the ones overlapping [3m, 6m).
+  DeleteEventsInRangeRequest delete_req;
+  delete_req.set_user_id("jack");
+  delete_req.set_stat_id(foo_id);
+  *delete_req.mutable_start_time() = ToProtoTimestamp(start + absl::Minutes(3));
+  *delete_req.mutable_duration() = ToProtoDuration(absl::Minutes(3));
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      const DeleteEventsInRangeResponse delete_resp,
+      Call(&StatService::Stub::DeleteEventsInRange, delete_req));
+  EXPECT_EQ(delete_resp.deleted_count(), 3);
+
+  ReadEventsRequest read_req;
+  read_req.set_user_id("jack");
+  read_req.add_stat_id(foo_id);
+  *read_req.mutable_start_time() = ToProtoTimestamp(start);
+  *read_req.mutable_duration() = ToProtoDuration(absl::Hours(1));
+  ASSERT_GRPC_OK_AND_ASSIGN(const ReadEventsResponse read_resp,
+                            Call(&StatService::Stub::ReadEvents, read_req));
+  ASSERT_THAT(read_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  foo_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                   SizeIs(7)))));
+  for (const auto& id_and_event :
+       read_resp.events_by_stat_id().at(foo_id).event_by_id()) {
+    const absl::Time event_start =
+        FromProtoTimestamp(id_and_event.second.start_time());
+    EXPECT_TRUE(event_start < start + absl::Minutes(3) ||
+                event_start >= start + absl::Minutes(6));
+  }
+
+  // Nothing is left to delete.
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      const DeleteEventsInRangeResponse again_resp,
+      Call(&StatService::Stub::DeleteEventsInRange, delete_req));
+  EXPECT_EQ(again_resp.deleted_count(), 0);
+}
+
 TEST_F(ServiceImplTest, DeleteNonExistentEvent) {
   DeleteEventRequest delete_req;
   delete_req.set_user_id("jack");
@@ -353,6 +447,968 @@ TEST_F(ServiceImplTest, RecordEventForNonExistentStatIsError) {
       << result.error_message();
 }
 
+TEST_F(ServiceImplTest, CheckGranularities) {
+  ASSERT_GRPC_OK(service_.CheckGranularities());
+  ASSERT_GRPC_OK(service_.CheckGranularities());
+
+  // Other sets would renumber the levels the rows are keyed by.
+  StatServiceImpl::Options options =
+      WithTestStorage(StatServiceImpl::Options(), leveldb_env_.db());
+  options.index_granularities.erase(absl::Seconds(1));
+  EXPECT_EQ(StatServiceImpl(options).CheckGranularities().error_code(),
+            grpc::StatusCode::FAILED_PRECONDITION);
+  options = WithTestStorage(StatServiceImpl::Options(), leveldb_env_.db());
+  options.quantile_sketch_granularity = absl::Hours(1e1);
+  EXPECT_EQ(StatServiceImpl(options).CheckGranularities().error_code(),
+            grpc::StatusCode::FAILED_PRECONDITION);
+  options = WithTestStorage(StatServiceImpl::Options(), leveldb_env_.db());
+  EXPECT_GRPC_OK(StatServiceImpl(options).CheckGranularities());
+}
+
+TEST_F(ServiceImplTest, MigrateLegacyKeys) {
+  Stat stat;
+  stat.set_display_name("foo");
+  ASSERT_OK(leveldb_env_.Put("jack SD:3", stat.SerializeAsString()));
+  google::protobuf::UInt64Value next_id;
+  next_id.set_value(4);
+  ASSERT_OK(leveldb_env_.Put("jack next_stat", next_id.SerializeAsString()));
+
+  // Event spans [100, 150).
+  Event event;
+  event.set_stat_id("3");
+  event.mutable_start_time()->set_seconds(100);
+  event.mutable_duration()->set_seconds(50);
+  ASSERT_OK(leveldb_env_.Put("jack S:3 E:12", event.SerializeAsString()));
+  next_id.set_value(13);
+  ASSERT_OK(
+      leveldb_env_.Put("jack S:3 next_event", next_id.SerializeAsString()));
+  ASSERT_OK(leveldb_env_.Put("jack IS:3 T:p-1m40s@1 H:12", "12"));
+
+  ASSERT_GRPC_OK(service_.MigrateLegacyKeys());
+  EXPECT_TRUE(leveldb_env_.Get("jack SD:3").status().IsNotFound());
+  EXPECT_TRUE(leveldb_env_.Get("jack S:3 E:12").status().IsNotFound());
+  EXPECT_TRUE(
+      leveldb_env_.Get("jack IS:3 T:p-1m40s@1 H:12").status().IsNotFound());
+
+  ReadStatsRequest read_stats_req;
+  read_stats_req.set_user_id("jack");
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      const ReadStatsResponse read_stats_resp,
+      Call(&StatService::Stub::ReadStats, read_stats_req));
+  EXPECT_THAT(read_stats_resp.stats(),
+              ElementsAre(Pair("3", Property(&Stat::display_name, "foo"))));
+
+  // Read everything overlapping [105, 145).
+  ReadEventsRequest read_events_req;
+  read_events_req.set_user_id("jack");
+  read_events_req.add_stat_id("3");
+  read_events_req.mutable_start_time()->set_seconds(105);
+  read_events_req.mutable_duration()->set_seconds(40);
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      const ReadEventsResponse read_events_resp,
+      Call(&StatService::Stub::ReadEvents, read_events_req));
+  EXPECT_THAT(read_events_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  "3", Property(&ReadEventsResponse::Events::event_by_id,
+                                ElementsAre(Pair("12", _))))));
+
+  // Counters carry over, so new ids don't collide with migrated ones.
+  DefineStatRequest define_bar;
+  define_bar.set_user_id("jack");
+  define_bar.mutable_stat()->set_display_name("bar");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse bar_resp,
+                            Call(&StatService::Stub::DefineStat, define_bar));
+  EXPECT_EQ(bar_resp.new_stat_id(), "4");
+
+  RecordEventRequest event_req;
+  event_req.set_user_id("jack");
+  *event_req.mutable_event() = event;
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      const ReadEventsResponse events_after_record,
+      Call(&StatService::Stub::ReadEvents, read_events_req));
+  EXPECT_THAT(
+      events_after_record.events_by_stat_id(),
+      ElementsAre(Pair("3", Property(&ReadEventsResponse::Events::event_by_id,
+                                     UnorderedElementsAre(Pair("12", _),
+                                                          Pair("13", _))))));
+}
+
+TEST_F(ServiceImplTest, SealEventSegments) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // One complete segment and a few events of the next, one per minute.
+  constexpr int kNumEvents = kEventSegmentSpan + 10;
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  for (int i = 0; i < kNumEvents; ++i) {
+    RecordEventRequest event_req;
+    event_req.set_user_id("jack");
+    event_req.mutable_event()->set_stat_id(foo_id);
+    *event_req.mutable_event()->mutable_start_time() =
+        ToProtoTimestamp(start + absl::Minutes(i));
+    *event_req.mutable_event()->mutable_duration() =
+        ToProtoDuration(absl::Seconds(12));
+    google::protobuf::Int64Value value;
+    value.set_value(i);
+    event_req.mutable_event()->mutable_value()->PackFrom(value);
+    ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+  }
+  uint64_t stat_id;
+  ASSERT_TRUE(absl::SimpleAtoi(foo_id, &stat_id));
+  ASSERT_GRPC_OK(service_.SealEventSegments("jack", stat_id));
+
+  auto user_or = UserIds(leveldb_env_.db()).Lookup("jack");
+  ASSERT_OK(user_or.status());
+  const uint64_t user = user_or.ValueOrDie();
+  EXPECT_OK(leveldb_env_.Get(Key::ForSegmentHeader(user, stat_id, 0)).status());
+  EXPECT_TRUE(
+      leveldb_env_.Get(Key::ForEvent(user, stat_id, 5)).status().IsNotFound());
+  EXPECT_OK(leveldb_env_.Get(Key::ForEvent(user, stat_id, kEventSegmentSpan))
+                .status());
+
+  ReadEventsRequest read_all;
+  read_all.set_user_id("jack");
+  read_all.add_stat_id(foo_id);
+  *read_all.mutable_start_time() = ToProtoTimestamp(start);
+  *read_all.mutable_duration() = ToProtoDuration(absl::InfiniteDuration());
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadEventsResponse all_resp,
+                            Call(&StatService::Stub::ReadEvents, read_all));
+  ASSERT_THAT(all_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  foo_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                   SizeIs(kNumEvents)))));
+  const Event& sealed =
+      all_resp.events_by_stat_id().at(foo_id).event_by_id().at("5");
+  EXPECT_EQ(sealed.stat_id(), foo_id);
+  EXPECT_EQ(FromProtoTimestamp(sealed.start_time()), start + absl::Minutes(5));
+  EXPECT_EQ(FromProtoDuration(sealed.duration()), absl::Seconds(12));
+  google::protobuf::Int64Value value;
+  ASSERT_TRUE(sealed.value().UnpackTo(&value));
+  EXPECT_EQ(value.value(), 5);
+
+  // Only the sealed event overlapping [5m, 5m10s) matches.
+  ReadEventsRequest read_one = read_all;
+  *read_one.mutable_start_time() = ToProtoTimestamp(start + absl::Minutes(5));
+  *read_one.mutable_duration() = ToProtoDuration(absl::Seconds(10));
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadEventsResponse one_resp,
+                            Call(&StatService::Stub::ReadEvents, read_one));
+  EXPECT_THAT(one_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  foo_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                   ElementsAre(Pair("5", _))))));
+
+  DeleteEventRequest delete_req;
+  delete_req.set_user_id("jack");
+  delete_req.set_stat_id(foo_id);
+  delete_req.set_event_id("5");
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteEvent, delete_req).status());
+  ASSERT_GRPC_OK_AND_ASSIGN(one_resp,
+                            Call(&StatService::Stub::ReadEvents, read_one));
+  EXPECT_THAT(one_resp.events_by_stat_id(), IsEmpty());
+  ASSERT_GRPC_OK_AND_ASSIGN(all_resp,
+                            Call(&StatService::Stub::ReadEvents, read_all));
+  EXPECT_THAT(all_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  foo_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                   SizeIs(kNumEvents - 1)))));
+}
+
+TEST_F(ServiceImplTest, AggregateEvents) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // Events a minute apart, lasting 1s, 2s, ... 5s.
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (int i = 0; i < 5; ++i) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(foo_id);
+    *event->mutable_start_time() = ToProtoTimestamp(start + absl::Minutes(i));
+    *event->mutable_duration() = ToProtoDuration(absl::Seconds(i + 1));
+  }
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+
+  AggregateEventsRequest aggregate_req;
+  aggregate_req.set_user_id("jack");
+  aggregate_req.add_stat_id(foo_id);
+  *aggregate_req.mutable_start_time() = ToProtoTimestamp(start);
+  *aggregate_req.mutable_duration() = ToProtoDuration(absl::Hours(1));
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      AggregateEventsResponse aggregate_resp,
+      Call(&StatService::Stub::AggregateEvents, aggregate_req));
+  ASSERT_THAT(aggregate_resp.aggregate_by_stat_id(),
+              ElementsAre(Pair(foo_id, _)));
+  EventAggregate aggregate = aggregate_resp.aggregate_by_stat_id().at(foo_id);
+  EXPECT_EQ(aggregate.count(), 5);
+  EXPECT_EQ(FromProtoDuration(aggregate.total_duration()), absl::Seconds(15));
+  EXPECT_EQ(FromProtoTimestamp(aggregate.min_start_time()), start);
+  EXPECT_EQ(FromProtoTimestamp(aggregate.max_start_time()),
+            start + absl::Minutes(4));
+
+  // Events that start in [1m, 3m) only.
+  AggregateEventsRequest part_req = aggregate_req;
+  *part_req.mutable_start_time() = ToProtoTimestamp(start + absl::Minutes(1));
+  *part_req.mutable_duration() = ToProtoDuration(absl::Minutes(2));
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      aggregate_resp, Call(&StatService::Stub::AggregateEvents, part_req));
+  aggregate = aggregate_resp.aggregate_by_stat_id().at(foo_id);
+  EXPECT_EQ(aggregate.count(), 2);
+  EXPECT_EQ(FromProtoDuration(aggregate.total_duration()), absl::Seconds(5));
+
+  // Deleting the first event moves the min start to the second.
+  DeleteEventRequest delete_req;
+  delete_req.set_user_id("jack");
+  delete_req.set_stat_id(foo_id);
+  delete_req.set_event_id("0");
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteEvent, delete_req).status());
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      aggregate_resp, Call(&StatService::Stub::AggregateEvents, aggregate_req));
+  aggregate = aggregate_resp.aggregate_by_stat_id().at(foo_id);
+  EXPECT_EQ(aggregate.count(), 4);
+  EXPECT_EQ(FromProtoDuration(aggregate.total_duration()), absl::Seconds(14));
+  EXPECT_EQ(FromProtoTimestamp(aggregate.min_start_time()),
+            start + absl::Minutes(1));
+  EXPECT_EQ(FromProtoTimestamp(aggregate.max_start_time()),
+            start + absl::Minutes(4));
+}
+
+TEST_F(ServiceImplTest, ReadSeries) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // Starting before the range and lasting into its second minute, within
+  // its third minute, and past its end.
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  const std::pair<absl::Time, absl::Duration> events[] = {
+      {start - absl::Minutes(1), absl::Seconds(90)},
+      {start + absl::Seconds(130), absl::Seconds(20)},
+      {start + absl::Seconds(170), absl::Hours(1)},
+  };
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (const auto& time_and_duration : events) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(foo_id);
+    *event->mutable_start_time() = ToProtoTimestamp(time_and_duration.first);
+    *event->mutable_duration() = ToProtoDuration(time_and_duration.second);
+  }
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+
+  ReadSeriesRequest series_req;
+  series_req.set_user_id("jack");
+  series_req.add_stat_id(foo_id);
+  *series_req.mutable_start_time() = ToProtoTimestamp(start);
+  *series_req.mutable_duration() = ToProtoDuration(absl::Minutes(4));
+  series_req.set_bucket_count(4);
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadSeriesResponse series_resp,
+                            Call(&StatService::Stub::ReadSeries, series_req));
+  EXPECT_EQ(FromProtoDuration(series_resp.bucket_width()), absl::Minutes(1));
+  ASSERT_THAT(series_resp.series_by_stat_id(), ElementsAre(Pair(foo_id, _)));
+  const Series& series = series_resp.series_by_stat_id().at(foo_id);
+  EXPECT_THAT(series.event_count(), ElementsAre(1, 0, 2, 1));
+  const int64_t second = absl::ToInt64Nanoseconds(absl::Seconds(1));
+  EXPECT_THAT(series.active_nanos(),
+              ElementsAre(30 * second, 0, 30 * second, 60 * second));
+
+  series_req.mutable_duration()->Clear();
+  EXPECT_EQ(Call(&StatService::Stub::ReadSeries, series_req).status()
+                .error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST_F(ServiceImplTest, QueryQuantiles) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // Events a minute apart from 40 minutes past an hour, lasting 1s, 2s, ...
+  // 5s, with values 0, 10, 20, 2.5 and none.
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (int i = 0; i < 5; ++i) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(foo_id);
+    *event->mutable_start_time() = ToProtoTimestamp(start + absl::Minutes(i));
+    *event->mutable_duration() = ToProtoDuration(absl::Seconds(i + 1));
+    if (i < 3) {
+      google::protobuf::Int64Value value;
+      value.set_value(i * 10);
+      event->mutable_value()->PackFrom(value);
+    } else if (i == 3) {
+      google::protobuf::DoubleValue value;
+      value.set_value(2.5);
+      event->mutable_value()->PackFrom(value);
+    }
+  }
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+
+  // Rounded out to the hour.
+  QueryQuantilesRequest quantiles_req;
+  quantiles_req.set_user_id("jack");
+  quantiles_req.add_stat_id(foo_id);
+  *quantiles_req.mutable_start_time() = ToProtoTimestamp(start);
+  *quantiles_req.mutable_duration() = ToProtoDuration(absl::Minutes(1));
+  quantiles_req.add_quantile(0.5);
+  quantiles_req.add_quantile(1);
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      QueryQuantilesResponse quantiles_resp,
+      Call(&StatService::Stub::QueryQuantiles, quantiles_req));
+  EXPECT_EQ(FromProtoTimestamp(quantiles_resp.start_time()),
+            start - absl::Minutes(40));
+  EXPECT_EQ(FromProtoDuration(quantiles_resp.duration()), absl::Hours(1));
+  ASSERT_THAT(quantiles_resp.quantiles_by_stat_id(),
+              ElementsAre(Pair(foo_id, _)));
+  EventQuantiles quantiles = quantiles_resp.quantiles_by_stat_id().at(foo_id);
+  EXPECT_EQ(quantiles.count(), 5);
+  ASSERT_THAT(quantiles.duration_quantile(), SizeIs(2));
+  EXPECT_EQ(FromProtoDuration(quantiles.duration_quantile(0)),
+            absl::Seconds(3));
+  EXPECT_EQ(FromProtoDuration(quantiles.duration_quantile(1)),
+            absl::Seconds(5));
+  EXPECT_EQ(quantiles.value_count(), 4);
+  EXPECT_THAT(quantiles.value_quantile(), ElementsAre(2.5, 20));
+
+  // Deleted events drop out.
+  DeleteEventRequest delete_req;
+  delete_req.set_user_id("jack");
+  delete_req.set_stat_id(foo_id);
+  delete_req.set_event_id("4");
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteEvent, delete_req).status());
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      quantiles_resp, Call(&StatService::Stub::QueryQuantiles, quantiles_req));
+  quantiles = quantiles_resp.quantiles_by_stat_id().at(foo_id);
+  EXPECT_EQ(quantiles.count(), 4);
+  EXPECT_EQ(FromProtoDuration(quantiles.duration_quantile(1)),
+            absl::Seconds(4));
+
+  quantiles_req.add_quantile(1.5);
+  EXPECT_EQ(Call(&StatService::Stub::QueryQuantiles, quantiles_req).status()
+                .error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+// Removed events are subtracted from a row's sketches, whose rank error grows
+// with them, until the row is sketched anew from the events left.
+TEST_F(ServiceImplTest, QueryQuantilesAfterDeletingMost) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // Events a second apart from the start of an hour, lasting 0ms, 1ms, ...
+  // 2999ms, many more than a sketch keeps.
+  constexpr int kNumEvents = 3000;
+  constexpr int kNumKept = 100;
+  const absl::Time start = absl::FromUnixSeconds(1500000000 - 40 * 60);
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (int i = 0; i < kNumEvents; ++i) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(foo_id);
+    *event->mutable_start_time() = ToProtoTimestamp(start + absl::Seconds(i));
+    *event->mutable_duration() = ToProtoDuration(absl::Milliseconds(i));
+  }
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+
+  DeleteEventsInRangeRequest delete_req;
+  delete_req.set_user_id("jack");
+  delete_req.set_stat_id(foo_id);
+  *delete_req.mutable_start_time() = ToProtoTimestamp(start);
+  *delete_req.mutable_duration() =
+      ToProtoDuration(absl::Seconds(kNumEvents - kNumKept));
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      const DeleteEventsInRangeResponse delete_resp,
+      Call(&StatService::Stub::DeleteEventsInRange, delete_req));
+  ASSERT_EQ(delete_resp.deleted_count(), kNumEvents - kNumKept);
+
+  QueryQuantilesRequest quantiles_req;
+  quantiles_req.set_user_id("jack");
+  quantiles_req.add_stat_id(foo_id);
+  *quantiles_req.mutable_start_time() = ToProtoTimestamp(start);
+  *quantiles_req.mutable_duration() = ToProtoDuration(absl::Hours(1));
+  quantiles_req.add_quantile(0);
+  quantiles_req.add_quantile(0.5);
+  quantiles_req.add_quantile(1);
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      const QueryQuantilesResponse quantiles_resp,
+      Call(&StatService::Stub::QueryQuantiles, quantiles_req));
+  const EventQuantiles& quantiles =
+      quantiles_resp.quantiles_by_stat_id().at(foo_id);
+  EXPECT_EQ(quantiles.count(), kNumKept);
+  ASSERT_THAT(quantiles.duration_quantile(), SizeIs(3));
+  // Within 2% of the events kept.
+  const auto near = [](int64_t millis) {
+    return AllOf(Ge(absl::Milliseconds(millis - 2)),
+                 Le(absl::Milliseconds(millis + 2)));
+  };
+  EXPECT_THAT(FromProtoDuration(quantiles.duration_quantile(0)),
+              near(kNumEvents - kNumKept));
+  EXPECT_THAT(FromProtoDuration(quantiles.duration_quantile(1)),
+              near(kNumEvents - kNumKept / 2));
+  EXPECT_THAT(FromProtoDuration(quantiles.duration_quantile(2)),
+              near(kNumEvents - 1));
+}
+
+TEST_F(ServiceImplTest, AggregateValues) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // Events a minute apart with values 10, 20, 2.5, "30" and none.
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (int i = 0; i < 5; ++i) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(foo_id);
+    *event->mutable_start_time() = ToProtoTimestamp(start + absl::Minutes(i));
+    if (i < 2) {
+      google::protobuf::Int64Value value;
+      value.set_value((i + 1) * 10);
+      event->mutable_value()->PackFrom(value);
+    } else if (i == 2) {
+      google::protobuf::DoubleValue value;
+      value.set_value(2.5);
+      event->mutable_value()->PackFrom(value);
+    } else if (i == 3) {
+      google::protobuf::StringValue value;
+      value.set_value("30");
+      event->mutable_value()->PackFrom(value);
+    }
+  }
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+
+  AggregateValuesRequest aggregate_req;
+  aggregate_req.set_user_id("jack");
+  aggregate_req.add_stat_id(foo_id);
+  *aggregate_req.mutable_start_time() = ToProtoTimestamp(start);
+  *aggregate_req.mutable_duration() = ToProtoDuration(absl::Hours(1));
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      AggregateValuesResponse aggregate_resp,
+      Call(&StatService::Stub::AggregateValues, aggregate_req));
+  ASSERT_THAT(aggregate_resp.aggregate_by_stat_id(),
+              ElementsAre(Pair(foo_id, _)));
+  ValueAggregate aggregate = aggregate_resp.aggregate_by_stat_id().at(foo_id);
+  EXPECT_EQ(aggregate.count(), 3);
+  EXPECT_EQ(aggregate.sum(), 32.5);
+  EXPECT_EQ(aggregate.min(), 2.5);
+  EXPECT_EQ(aggregate.max(), 20);
+  EXPECT_EQ(aggregate.mean(), 32.5 / 3);
+
+  // Events that start in [1m, 2m) only.
+  *aggregate_req.mutable_start_time() =
+      ToProtoTimestamp(start + absl::Minutes(1));
+  *aggregate_req.mutable_duration() = ToProtoDuration(absl::Minutes(1));
+  ASSERT_GRPC_OK_AND_ASSIGN(
+      aggregate_resp, Call(&StatService::Stub::AggregateValues, aggregate_req));
+  aggregate = aggregate_resp.aggregate_by_stat_id().at(foo_id);
+  EXPECT_EQ(aggregate.count(), 1);
+  EXPECT_EQ(aggregate.sum(), 20);
+}
+
+TEST_F(ServiceImplTest, RecordEventsBatch) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (const std::string& stat_id : {foo_id, std::string("asdf"), foo_id}) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(stat_id);
+    event->mutable_start_time()->set_seconds(100);
+    event->mutable_duration()->set_seconds(50);
+  }
+  ASSERT_GRPC_OK_AND_ASSIGN(RecordEventsResponse events_resp,
+                            Call(&StatService::Stub::RecordEvents, events_req));
+  ASSERT_THAT(events_resp.results(), SizeIs(3));
+  EXPECT_EQ(events_resp.results(0).code(), grpc::StatusCode::OK);
+  EXPECT_EQ(events_resp.results(1).code(), grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(events_resp.results(2).code(), grpc::StatusCode::OK);
+  const std::string first_id = events_resp.results(0).event_id();
+  const std::string second_id = events_resp.results(2).event_id();
+  EXPECT_NE(first_id, second_id);
+
+  ReadEventsRequest read_req;
+  read_req.set_user_id("jack");
+  read_req.add_stat_id(foo_id);
+  read_req.mutable_start_time()->set_seconds(120);
+  read_req.mutable_duration()->set_seconds(1);
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadEventsResponse read_resp,
+                            Call(&StatService::Stub::ReadEvents, read_req));
+  EXPECT_THAT(read_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  foo_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                   UnorderedElementsAre(Pair(first_id, _),
+                                                        Pair(second_id, _))))));
+}
+
+TEST_F(ServiceImplTest, RecordEventsForUnknownUser) {
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  events_req.add_events()->set_stat_id("0");
+  ASSERT_GRPC_OK_AND_ASSIGN(RecordEventsResponse events_resp,
+                            Call(&StatService::Stub::RecordEvents, events_req));
+  ASSERT_THAT(events_resp.results(), SizeIs(1));
+  EXPECT_EQ(events_resp.results(0).code(), grpc::StatusCode::NOT_FOUND);
+}
+
+TEST_F(ServiceImplTest, RecordEventStream) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  grpc::ClientContext ctx;
+  RecordEventsResponse events_resp;
+  auto writer = stub_->RecordEventStream(&ctx, &events_resp);
+  for (int batch = 0; batch < 3; ++batch) {
+    RecordEventsRequest events_req;
+    events_req.set_user_id("jack");
+    for (int i = 0; i < 2; ++i) {
+      Event* event = events_req.add_events();
+      event->set_stat_id(foo_id);
+      event->mutable_start_time()->set_seconds(100 + batch * 10 + i);
+    }
+    ASSERT_TRUE(writer->Write(events_req));
+  }
+  ASSERT_TRUE(writer->WritesDone());
+  ASSERT_GRPC_OK(writer->Finish());
+  ASSERT_THAT(events_resp.results(), SizeIs(6));
+  for (const RecordEventsResponse::Result& result : events_resp.results()) {
+    EXPECT_EQ(result.code(), grpc::StatusCode::OK) << result.error_message();
+  }
+
+  ReadEventsRequest read_req;
+  read_req.set_user_id("jack");
+  read_req.add_stat_id(foo_id);
+  *read_req.mutable_duration() = ToProtoDuration(absl::InfiniteDuration());
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadEventsResponse read_resp,
+                            Call(&StatService::Stub::ReadEvents, read_req));
+  EXPECT_THAT(read_resp.events_by_stat_id(),
+              ElementsAre(Pair(
+                  foo_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                   SizeIs(6)))));
+}
+
+TEST_F(ServiceImplTest, StreamEvents) {
+  std::vector<std::string> stat_ids;
+  for (const char* name : {"foo", "bar"}) {
+    DefineStatRequest define_req;
+    define_req.set_user_id("jack");
+    define_req.mutable_stat()->set_display_name(name);
+    ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse define_resp,
+                              Call(&StatService::Stub::DefineStat, define_req));
+    stat_ids.push_back(define_resp.new_stat_id());
+  }
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (int seconds : {30, 10, 5, 50, 40, 20}) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(stat_ids[0]);
+    event->mutable_start_time()->set_seconds(seconds);
+    event->mutable_duration()->set_seconds(100);
+  }
+  Event* bar_event = events_req.add_events();
+  bar_event->set_stat_id(stat_ids[1]);
+  bar_event->mutable_start_time()->set_seconds(15);
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+
+  StreamEventsRequest stream_req;
+  stream_req.set_user_id("jack");
+  stream_req.add_stat_id(stat_ids[0]);
+  stream_req.add_stat_id("asdf");
+  stream_req.add_stat_id(stat_ids[1]);
+  stream_req.mutable_start_time()->set_seconds(10);
+  stream_req.mutable_duration()->set_seconds(40);
+  stream_req.set_page_size(2);
+  const auto stream_pages = [this](const StreamEventsRequest& req) {
+    grpc::ClientContext ctx;
+    auto reader = stub_->StreamEvents(&ctx, req);
+    std::vector<StreamEventsResponse> pages;
+    StreamEventsResponse page;
+    while (reader->Read(&page)) pages.push_back(page);
+    EXPECT_GRPC_OK(reader->Finish());
+    return pages;
+  };
+  const auto start_seconds = [](const StreamEventsResponse& page) {
+    std::vector<int64_t> seconds;
+    for (const auto& streamed : page.events()) {
+      seconds.push_back(streamed.event().start_time().seconds());
+    }
+    return seconds;
+  };
+
+  const std::vector<StreamEventsResponse> pages = stream_pages(stream_req);
+  ASSERT_THAT(pages, SizeIs(3));
+  EXPECT_THAT(start_seconds(pages[0]), ElementsAre(10, 20));
+  EXPECT_THAT(start_seconds(pages[1]), ElementsAre(30, 40));
+  EXPECT_THAT(start_seconds(pages[2]), ElementsAre(15));
+  EXPECT_EQ(pages[0].events(0).event_id(), "1");
+  EXPECT_EQ(pages[0].events(0).event().stat_id(), stat_ids[0]);
+  EXPECT_EQ(pages[2].events(0).event().stat_id(), stat_ids[1]);
+  EXPECT_FALSE(pages[0].next_cursor().empty());
+  EXPECT_TRUE(pages[2].next_cursor().empty());
+
+  StreamEventsRequest resume_req = stream_req;
+  resume_req.set_cursor(pages[1].next_cursor());
+  const std::vector<StreamEventsResponse> resumed = stream_pages(resume_req);
+  ASSERT_THAT(resumed, SizeIs(1));
+  EXPECT_THAT(start_seconds(resumed[0]), ElementsAre(15));
+
+  resume_req.clear_stat_id();
+  resume_req.add_stat_id(stat_ids[0]);
+  grpc::ClientContext ctx;
+  auto reader = stub_->StreamEvents(&ctx, resume_req);
+  StreamEventsResponse page;
+  EXPECT_FALSE(reader->Read(&page));
+  EXPECT_EQ(reader->Finish().error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST_F(ServiceImplTest, StreamSealedEvents) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  // Later events start earlier, so start time order is the reverse of ids.
+  constexpr int kNumEvents = kEventSegmentSpan + 10;
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (int i = 0; i < kNumEvents; ++i) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(foo_id);
+    event->mutable_start_time()->set_seconds(kNumEvents - i);
+    google::protobuf::Int64Value value;
+    value.set_value(i);
+    event->mutable_value()->PackFrom(value);
+  }
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+  uint64_t stat_id;
+  ASSERT_TRUE(absl::SimpleAtoi(foo_id, &stat_id));
+  ASSERT_GRPC_OK(service_.SealEventSegments("jack", stat_id));
+
+  DeleteEventRequest delete_req;
+  delete_req.set_user_id("jack");
+  delete_req.set_stat_id(foo_id);
+  delete_req.set_event_id("5");
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteEvent, delete_req).status());
+
+  StreamEventsRequest stream_req;
+  stream_req.set_user_id("jack");
+  stream_req.add_stat_id(foo_id);
+  *stream_req.mutable_duration() = ToProtoDuration(absl::InfiniteDuration());
+  grpc::ClientContext ctx;
+  auto reader = stub_->StreamEvents(&ctx, stream_req);
+  std::vector<int64_t> values;
+  StreamEventsResponse page;
+  while (reader->Read(&page)) {
+    for (const auto& streamed : page.events()) {
+      google::protobuf::Int64Value value;
+      ASSERT_TRUE(streamed.event().value().UnpackTo(&value));
+      EXPECT_EQ(streamed.event_id(), absl::StrCat(value.value()));
+      values.push_back(value.value());
+    }
+  }
+  ASSERT_GRPC_OK(reader->Finish());
+  ASSERT_THAT(values, SizeIs(kNumEvents - 1));
+  EXPECT_EQ(values.front(), kNumEvents - 1);
+  EXPECT_EQ(values.back(), 0);
+  EXPECT_THAT(values, Not(Contains(5)));
+}
+
+class IndexCacheServiceImplTest : public ServiceImplTest {
+ protected:
+  IndexCacheServiceImplTest() : ServiceImplTest(Options()) {}
+
+  static StatServiceImpl::Options Options() {
+    StatServiceImpl::Options options;
+    options.index_cache_bytes = 1 << 20;
+    return options;
+  }
+};
+
+TEST_F(IndexCacheServiceImplTest, ReadEventsFollowsWrites) {
+  DefineStatRequest define_foo;
+  define_foo.set_user_id("jack");
+  define_foo.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_foo));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  constexpr int kNumEvents = kEventSegmentSpan + 10;
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  RecordEventsRequest events_req;
+  events_req.set_user_id("jack");
+  for (int i = 0; i < kNumEvents; ++i) {
+    Event* event = events_req.add_events();
+    event->set_stat_id(foo_id);
+    *event->mutable_start_time() = ToProtoTimestamp(start + absl::Minutes(i));
+    *event->mutable_duration() = ToProtoDuration(absl::Seconds(12));
+  }
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvents, events_req).status());
+
+  const auto event_ids = [&](absl::Time read_start, absl::Duration duration) {
+    ReadEventsRequest read_req;
+    read_req.set_user_id("jack");
+    read_req.add_stat_id(foo_id);
+    *read_req.mutable_start_time() = ToProtoTimestamp(read_start);
+    *read_req.mutable_duration() = ToProtoDuration(duration);
+    std::vector<std::string> ids;
+    auto read_or = Call(&StatService::Stub::ReadEvents, read_req);
+    EXPECT_GRPC_OK(read_or.status());
+    if (!read_or.ok()) return ids;
+    for (const auto& stat_events : read_or.ValueOrDie().events_by_stat_id()) {
+      for (const auto& id_and_event : stat_events.second.event_by_id()) {
+        ids.push_back(id_and_event.first);
+      }
+    }
+    return ids;
+  };
+  const absl::Time five = start + absl::Minutes(5);
+  EXPECT_THAT(event_ids(five, absl::Seconds(10)), ElementsAre("5"));
+
+  RecordEventRequest event_req;
+  event_req.set_user_id("jack");
+  event_req.mutable_event()->set_stat_id(foo_id);
+  *event_req.mutable_event()->mutable_start_time() =
+      ToProtoTimestamp(five + absl::Seconds(1));
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+  const std::string new_id = absl::StrCat(kNumEvents);
+  EXPECT_THAT(event_ids(five, absl::Seconds(10)),
+              UnorderedElementsAre("5", new_id));
+
+  DeleteEventRequest delete_req;
+  delete_req.set_user_id("jack");
+  delete_req.set_stat_id(foo_id);
+  delete_req.set_event_id("5");
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteEvent, delete_req).status());
+  EXPECT_THAT(event_ids(five, absl::Seconds(10)), ElementsAre(new_id));
+
+  uint64_t stat_id;
+  ASSERT_TRUE(absl::SimpleAtoi(foo_id, &stat_id));
+  ASSERT_GRPC_OK(service_.SealEventSegments("jack", stat_id));
+  EXPECT_THAT(event_ids(five, absl::Seconds(10)), ElementsAre(new_id));
+  EXPECT_THAT(event_ids(start, absl::InfiniteDuration()), SizeIs(kNumEvents));
+
+  DeleteStatRequest delete_stat;
+  delete_stat.set_user_id("jack");
+  delete_stat.set_stat_id(foo_id);
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteStat, delete_stat).status());
+  EXPECT_THAT(event_ids(start, absl::InfiniteDuration()), IsEmpty());
+}
+
+class CachingServiceImplTest : public ServiceImplTest {
+ protected:
+  CachingServiceImplTest() : ServiceImplTest(Options()) {}
+
+  static StatServiceImpl::Options Options() {
+    StatServiceImpl::Options options;
+    options.stat_cache_bytes = 1 << 20;
+    options.event_cache_bytes = 1 << 20;
+    options.posting_block_cache_bytes = 1 << 20;
+    return options;
+  }
+};
+
+TEST_F(CachingServiceImplTest, CachesFollowWrites) {
+  DefineStatRequest define_req;
+  define_req.set_user_id("jack");
+  define_req.mutable_stat()->set_display_name("foo");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse foo_resp,
+                            Call(&StatService::Stub::DefineStat, define_req));
+  const std::string foo_id = foo_resp.new_stat_id();
+
+  ReadStatsRequest read_stats;
+  read_stats.set_user_id("jack");
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadStatsResponse stats_resp,
+                            Call(&StatService::Stub::ReadStats, read_stats));
+  EXPECT_THAT(stats_resp.stats(), ElementsAre(Pair(foo_id, _)));
+
+  // Defined while the stats are cached.
+  define_req.mutable_stat()->set_display_name("bar");
+  ASSERT_GRPC_OK_AND_ASSIGN(DefineStatResponse bar_resp,
+                            Call(&StatService::Stub::DefineStat, define_req));
+  const std::string bar_id = bar_resp.new_stat_id();
+  ASSERT_GRPC_OK_AND_ASSIGN(stats_resp,
+                            Call(&StatService::Stub::ReadStats, read_stats));
+  EXPECT_THAT(stats_resp.stats(),
+              UnorderedElementsAre(Pair(foo_id, _), Pair(bar_id, _)));
+
+  RecordEventRequest event_req;
+  event_req.set_user_id("jack");
+  event_req.mutable_event()->set_stat_id(bar_id);
+  event_req.mutable_event()->mutable_start_time()->set_seconds(100);
+  ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+  event_req.mutable_event()->set_stat_id("12345");
+  EXPECT_EQ(Call(&StatService::Stub::RecordEvent, event_req).status()
+                .error_code(),
+            grpc::StatusCode::NOT_FOUND);
+  // The second event appends to the posting blocks the first one cached.
+  event_req.mutable_event()->set_stat_id(foo_id);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+  }
+
+  ReadEventsRequest read_events;
+  read_events.set_user_id("jack");
+  read_events.add_stat_id(bar_id);
+  read_events.mutable_start_time()->set_seconds(100);
+  read_events.mutable_duration()->set_seconds(1);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_GRPC_OK_AND_ASSIGN(
+        ReadEventsResponse events_resp,
+        Call(&StatService::Stub::ReadEvents, read_events));
+    EXPECT_THAT(events_resp.events_by_stat_id(),
+                ElementsAre(Pair(
+                    bar_id, Property(&ReadEventsResponse::Events::event_by_id,
+                                     ElementsAre(Pair("0", _))))));
+  }
+  const StatServiceImpl::CacheCounters counters = service_.cache_counters();
+  EXPECT_EQ(counters.events.hits, 2);
+  EXPECT_GT(counters.stats.hits, 0);
+  EXPECT_GT(counters.posting_blocks.hits, 0);
+
+  DeleteEventRequest delete_event;
+  delete_event.set_user_id("jack");
+  delete_event.set_stat_id(bar_id);
+  delete_event.set_event_id("0");
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteEvent, delete_event).status());
+  ASSERT_GRPC_OK_AND_ASSIGN(ReadEventsResponse events_resp,
+                            Call(&StatService::Stub::ReadEvents, read_events));
+  EXPECT_THAT(events_resp.events_by_stat_id(), IsEmpty());
+
+  DeleteStatRequest delete_stat;
+  delete_stat.set_user_id("jack");
+  delete_stat.set_stat_id(bar_id);
+  ASSERT_GRPC_OK(Call(&StatService::Stub::DeleteStat, delete_stat).status());
+  ASSERT_GRPC_OK_AND_ASSIGN(stats_resp,
+                            Call(&StatService::Stub::ReadStats, read_stats));
+  EXPECT_THAT(stats_resp.stats(), ElementsAre(Pair(foo_id, _)));
+  event_req.mutable_event()->set_stat_id(bar_id);
+  EXPECT_EQ(Call(&StatService::Stub::RecordEvent, event_req).status()
+                .error_code(),
+            grpc::StatusCode::NOT_FOUND);
+}
+
+class ExpiryServiceImplTest : public ServiceImplTest {
+ protected:
+  ExpiryServiceImplTest() : ServiceImplTest(Options()) {}
+
+  static StatServiceImpl::Options Options() {
+    StatServiceImpl::Options options;
+    options.expiry_batch_size = 16;
+    options.expiry_pause = absl::ZeroDuration();
+    return options;
+  }
+
+  std::string DefineStat(const Retention& retention) {
+    DefineStatRequest define_req;
+    define_req.set_user_id("jack");
+    *define_req.mutable_stat()->mutable_retention() = retention;
+    auto resp_or = Call(&StatService::Stub::DefineStat, define_req);
+    EXPECT_GRPC_OK(resp_or.status());
+    return resp_or.ok() ? resp_or.ValueOrDie().new_stat_id() : "";
+  }
+
+  void RecordEvent(const std::string& stat_id, absl::Time start) {
+    RecordEventRequest event_req;
+    event_req.set_user_id("jack");
+    event_req.mutable_event()->set_stat_id(stat_id);
+    *event_req.mutable_event()->mutable_start_time() = ToProtoTimestamp(start);
+    EXPECT_GRPC_OK(Call(&StatService::Stub::RecordEvent, event_req).status());
+  }
+
+  ReadEventsResponse::Events ReadAll(const std::string& stat_id) {
+    ReadEventsRequest read_req;
+    read_req.set_user_id("jack");
+    read_req.add_stat_id(stat_id);
+    *read_req.mutable_start_time() = ToProtoTimestamp(absl::UnixEpoch());
+    *read_req.mutable_duration() = ToProtoDuration(absl::InfiniteDuration());
+    auto resp_or = Call(&StatService::Stub::ReadEvents, read_req);
+    EXPECT_GRPC_OK(resp_or.status());
+    if (!resp_or.ok()) return {};
+    const auto& events_by_stat_id = resp_or.ValueOrDie().events_by_stat_id();
+    const auto it = events_by_stat_id.find(stat_id);
+    return it == events_by_stat_id.end() ? ReadEventsResponse::Events()
+                                         : it->second;
+  }
+};
+
+TEST_F(ExpiryServiceImplTest, ExpireEvents) {
+  // A stat keeping its newest events, which are half sealed.
+  constexpr int kNumEvents = kEventSegmentSpan + 10;
+  constexpr int kMaxEventCount = kEventSegmentSpan / 2 + 10;
+  Retention max_count;
+  max_count.set_max_event_count(kMaxEventCount);
+  const std::string counted_id = DefineStat(max_count);
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  for (int i = 0; i < kNumEvents; ++i) {
+    RecordEvent(counted_id, start + absl::Minutes(i));
+  }
+  uint64_t stat_id;
+  ASSERT_TRUE(absl::SimpleAtoi(counted_id, &stat_id));
+  ASSERT_GRPC_OK(service_.SealEventSegments("jack", stat_id));
+
+  // A stat keeping its last hour, and one keeping everything.
+  Retention max_age;
+  *max_age.mutable_max_age() = ToProtoDuration(absl::Hours(1));
+  const std::string aged_id = DefineStat(max_age);
+  const absl::Time now = absl::Now();
+  RecordEvent(aged_id, now - absl::Hours(2));
+  RecordEvent(aged_id, now - absl::Minutes(1));
+  const std::string kept_id = DefineStat(Retention());
+  RecordEvent(kept_id, start);
+
+  ASSERT_GRPC_OK(service_.ExpireEvents());
+  const ReadEventsResponse::Events counted = ReadAll(counted_id);
+  EXPECT_THAT(counted.event_by_id(), SizeIs(kMaxEventCount));
+  const std::string oldest_kept = absl::StrCat(kNumEvents - kMaxEventCount);
+  EXPECT_THAT(counted.event_by_id(),
+              AllOf(Not(Contains(Pair("0", _))),
+                    Contains(Pair(oldest_kept, _)),
+                    Contains(Pair(absl::StrCat(kNumEvents - 1), _))));
+  const ReadEventsResponse::Events aged = ReadAll(aged_id);
+  ASSERT_THAT(aged.event_by_id(), SizeIs(1));
+  EXPECT_EQ(FromProtoTimestamp(aged.event_by_id().begin()->second.start_time()),
+            now - absl::Minutes(1));
+  EXPECT_THAT(ReadAll(kept_id).event_by_id(), SizeIs(1));
+
+  // Nothing more is past the retention.
+  ASSERT_GRPC_OK(service_.ExpireEvents());
+  EXPECT_THAT(ReadAll(counted_id).event_by_id(), SizeIs(kMaxEventCount));
+}
+
 }  // namespace
 }  // namespace stat_tracker
 
@@ -1,46 +1,94 @@
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "include/grpc/grpc.h"
 #include "include/grpcpp/grpcpp.h"
-#include "leveldb/db.h"
 #include "leveldb/status.h"
+#include "stat_tracker/async_server.h"
 #include "stat_tracker/service_impl.h"
+#include "storage/group_commit_storage.h"
+#include "storage/storage.h"
 #include "util/status.h"
 
 DEFINE_string(listening_hostport, "127.0.0.1:8081",
               "hostport to listen to for running services");
 DEFINE_string(leveldb_path, "/dev/null",
               "path to leveldb where data will be stored");
-
-namespace {
-
-util::StatusOr<leveldb::Status, std::unique_ptr<leveldb::DB>> OpenLevelDbUnique(
-    const std::string& path) {
-  LOG(INFO) << "opening leveldb path: " << path;
-  leveldb::DB* db;
-  leveldb::Options options;
-  options.create_if_missing = true;
-  RETURN_IF_ERROR(leveldb::DB::Open(options, path, &db));
-  return absl::WrapUnique(db);
-}
-
-}  // namespace
+DEFINE_string(storage_backend, "leveldb",
+              "storage engine: leveldb, or leveldb_memenv or in_memory to "
+              "keep everything in memory and ignore --leveldb_path");
+DEFINE_bool(sync_writes, false,
+            "sync every write to disk before acknowledging it");
+DEFINE_int64(max_commit_delay_us, 0,
+             "how long a synced write waits for concurrent writes to share "
+             "its sync with");
+DEFINE_int64(index_cache_mb, 0,
+             "memory for in-memory copies of the index of recently read "
+             "stats, which ReadEvents then uses; 0 disables them");
+DEFINE_int64(stat_cache_mb, 0,
+             "memory for the parsed stats of recently active users; 0 "
+             "disables caching them");
+DEFINE_int64(event_cache_mb, 0,
+             "memory for recently read or recorded events; 0 disables "
+             "caching them");
+DEFINE_int64(posting_block_cache_mb, 16,
+             "memory for recently appended-to posting blocks, so that "
+             "recording an event needn't read them back; 0 disables caching "
+             "them");
+DEFINE_int32(cache_counters_log_interval_s, 60,
+             "how often to log the hits, misses and evictions of the stat, "
+             "event and posting block caches, if any is enabled");
+DEFINE_int32(expiry_interval_s, 300,
+             "how often to delete the events of stats with a retention "
+             "policy that are past it; 0 disables expiry");
+DEFINE_int32(expiry_batch_size, 1000,
+             "events expiry deletes per write, while holding the user lock");
+DEFINE_int64(expiry_pause_ms, 10,
+             "how long expiry pauses between writes, to leave the storage to "
+             "requests");
+DEFINE_bool(migrate_legacy_keys, true,
+            "rewrite rows from the legacy text key schema before serving");
+DEFINE_bool(async_server, true,
+            "serve from completion queues and a worker pool instead of a "
+            "thread per call");
+DEFINE_int32(num_completion_queues, 0,
+             "completion queues of the async server, each polled by one "
+             "thread; 0 means one per core");
+DEFINE_int32(num_workers, 16, "threads that run the async server's handlers");
+DEFINE_int64(max_pending_calls, 1024,
+             "calls that may wait for an async server worker before further "
+             "calls fail with RESOURCE_EXHAUSTED");
 
 int main(int argc, char** argv) {
   google::InitGoogleLogging(argv[0]);
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
-  auto database_or = OpenLevelDbUnique(FLAGS_leveldb_path);
-  CHECK(database_or.ok()) << database_or.status().ToString();
+  storage::Backend backend;
+  CHECK(storage::ParseBackend(FLAGS_storage_backend, &backend))
+      << "unknown --storage_backend " << FLAGS_storage_backend;
+  auto storage_or = storage::OpenStorage(backend, FLAGS_leveldb_path);
+  CHECK(storage_or.ok()) << storage_or.status().ToString();
+
+  storage::GroupCommitStorage::Options commit_options;
+  commit_options.max_delay = absl::Microseconds(FLAGS_max_commit_delay_us);
 
   stat_tracker::StatServiceImpl::Options options;
-  options.db = std::move(database_or.ValueOrDie());
+  options.storage = std::make_shared<storage::GroupCommitStorage>(
+      std::move(storage_or.ValueOrDie()), commit_options);
+  options.sync_writes = FLAGS_sync_writes;
+  options.index_cache_bytes = FLAGS_index_cache_mb << 20;
+  options.stat_cache_bytes = FLAGS_stat_cache_mb << 20;
+  options.event_cache_bytes = FLAGS_event_cache_mb << 20;
+  options.posting_block_cache_bytes = FLAGS_posting_block_cache_mb << 20;
+  options.expiry_batch_size = FLAGS_expiry_batch_size;
+  options.expiry_pause = absl::Milliseconds(FLAGS_expiry_pause_ms);
   options.index_granularities = {
       absl::Milliseconds(100), absl::Milliseconds(500), absl::Seconds(1),
       absl::Seconds(5),        absl::Seconds(10),       absl::Seconds(30),
@@ -51,9 +99,64 @@ int main(int argc, char** argv) {
       absl::Hours(1e8),        absl::Hours(1e9),        absl::Hours(1e10),
       absl::Hours(1e11),       absl::Hours(1e12)};
   stat_tracker::StatServiceImpl service_impl(options);
+  {
+    const grpc::Status status = service_impl.CheckGranularities();
+    CHECK(status.ok()) << status.error_message();
+  }
+  if (FLAGS_migrate_legacy_keys) {
+    const grpc::Status status = service_impl.MigrateLegacyKeys();
+    CHECK(status.ok()) << status.error_message();
+  }
+  // Finishes reaping the stats deleted before a restart.
+  service_impl.ScheduleReaping();
+
+  if ((FLAGS_stat_cache_mb > 0 || FLAGS_event_cache_mb > 0 ||
+       FLAGS_posting_block_cache_mb > 0) &&
+      FLAGS_cache_counters_log_interval_s > 0) {
+    std::thread([&service_impl]() {
+      for (;;) {
+        absl::SleepFor(absl::Seconds(FLAGS_cache_counters_log_interval_s));
+        const auto counters = service_impl.cache_counters();
+        LOG(INFO) << "stat cache: " << counters.stats.hits << " hits, "
+                  << counters.stats.misses << " misses, "
+                  << counters.stats.evictions << " evictions; event cache: "
+                  << counters.events.hits << " hits, "
+                  << counters.events.misses << " misses, "
+                  << counters.events.evictions
+                  << " evictions; posting block cache: "
+                  << counters.posting_blocks.hits << " hits, "
+                  << counters.posting_blocks.misses << " misses, "
+                  << counters.posting_blocks.evictions << " evictions";
+      }
+    }).detach();
+  }
+
+  if (FLAGS_expiry_interval_s > 0) {
+    std::thread([&service_impl]() {
+      for (;;) {
+        absl::SleepFor(absl::Seconds(FLAGS_expiry_interval_s));
+        const grpc::Status status = service_impl.ExpireEvents();
+        if (!status.ok()) {
+          LOG(ERROR) << "expiring events failed: " << status.error_message();
+        }
+      }
+    }).detach();
+  }
 
   const std::string host_port = FLAGS_listening_hostport;
   LOG(INFO) << "starting server: " << host_port;
+  if (FLAGS_async_server) {
+    stat_tracker::AsyncStatServer::Options server_options;
+    server_options.listening_hostport = host_port;
+    server_options.num_completion_queues = FLAGS_num_completion_queues;
+    server_options.num_workers = FLAGS_num_workers;
+    server_options.max_pending_calls = FLAGS_max_pending_calls;
+    stat_tracker::AsyncStatServer server(&service_impl, server_options);
+    CHECK(server.Start()) << "can't listen on " << host_port;
+    LOG(INFO) << "server started.";
+    server.Wait();
+    return 0;
+  }
   grpc::ServerBuilder server_builder;
   server_builder.AddListeningPort(host_port,
                                   grpc::InsecureServerCredentials());
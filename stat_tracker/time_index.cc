@@ -1,6 +1,7 @@
 #include "stat_tracker/time_index.h"
 
-#include <tuple>
+#include <algorithm>
+#include <limits>
 
 #include "glog/logging.h"
 
@@ -8,83 +9,283 @@ namespace stat_tracker {
 
 namespace {
 
-TimeRangeToken GetTokenForTime(absl::Time time_pt, absl::Duration granularity) {
-  const absl::Duration time_since_epoch = time_pt - absl::UnixEpoch();
-  absl::Duration unused_remainder;
-  const int64_t index =
-      absl::IDivDuration(time_since_epoch, granularity, &unused_remainder);
-  return {index, granularity};
-}
-
-}  // namespace
+// Times within this many seconds of the epoch, about 285 years, are a whole
+// number of nanoseconds that fits an int64.
+constexpr int64_t kMaxFastSeconds = 9000000000;
 
-bool operator==(const TimeRangeToken& lhs, const TimeRangeToken& rhs) {
-  return std::tie(lhs.granularity, lhs.index) ==
-         std::tie(rhs.granularity, rhs.index);
+bool ToUnixNanosIfFits(absl::Time time_pt, int64_t* nanos) {
+  const int64_t seconds = absl::ToUnixSeconds(time_pt);
+  if (seconds <= -kMaxFastSeconds || seconds >= kMaxFastSeconds) return false;
+  *nanos = absl::ToUnixNanos(time_pt);
+  return true;
 }
 
-bool operator<(const TimeRangeToken& lhs, const TimeRangeToken& rhs) {
-  return std::tie(lhs.granularity, lhs.index) <
-         std::tie(rhs.granularity, rhs.index);
+// Floor and ceiling of `a / b` for b > 0.
+int64_t FloorDiv(int64_t a, int64_t b) {
+  return a / b - (a % b < 0 ? 1 : 0);
 }
+int64_t CeilDiv(int64_t a, int64_t b) { return a / b + (a % b > 0 ? 1 : 0); }
 
-std::ostream& operator<<(std::ostream& os, const TimeRangeToken& rhs) {
-  os << "{" << rhs.index << "," << rhs.granularity << "}[" << rhs.start_time()
-     << "," << rhs.end_time() << ")";
+}  // namespace
+
+std::ostream& operator<<(std::ostream& os, TimeRangeToken rhs) {
+  os << "{" << rhs.level() << "," << rhs.index() << "}";
   return os;
 }
 
 void InMemoryIndex::AddItem(uint64_t item_id,
                             absl::Span<const TimeRangeToken> tokens) {
-  for (const TimeRangeToken& token : tokens) {
-    hits_[token].push_back(item_id);
+  for (TimeRangeToken token : tokens) {
+    util::RoaringBitmap& items = hits_[token];
+    const size_t old_bytes = items.MemoryUsage();
+    items.Add(item_id);
+    bitmap_bytes_ += items.MemoryUsage() - old_bytes;
   }
 }
 
-void InMemoryIndex::QueryUnion(
-    absl::Span<const TimeRangeToken> tokens,
-    const std::function<void(uint64_t)>& on_item) const {
-  for (const TimeRangeToken& token : tokens) {
+void InMemoryIndex::RemoveItem(uint64_t item_id,
+                               absl::Span<const TimeRangeToken> tokens) {
+  for (TimeRangeToken token : tokens) {
     auto it = hits_.find(token);
     if (it == hits_.end()) continue;
-    for (uint64_t hit : it->second) {
-      on_item(hit);
+    bitmap_bytes_ -= it->second.MemoryUsage();
+    it->second.Remove(item_id);
+    if (it->second.empty()) {
+      hits_.erase(it);
+    } else {
+      bitmap_bytes_ += it->second.MemoryUsage();
     }
   }
 }
 
+util::RoaringBitmap InMemoryIndex::QueryUnion(
+    absl::Span<const TimeRangeToken> tokens) const {
+  util::RoaringBitmap items;
+  for (TimeRangeToken token : tokens) {
+    auto it = hits_.find(token);
+    if (it != hits_.end()) items |= it->second;
+  }
+  return items;
+}
+
+// Intersects starting from the smallest bitmap, which bounds the result.
+util::RoaringBitmap InMemoryIndex::QueryIntersection(
+    absl::Span<const TimeRangeToken> tokens) const {
+  std::vector<const util::RoaringBitmap*> bitmaps;
+  for (TimeRangeToken token : tokens) {
+    auto it = hits_.find(token);
+    if (it == hits_.end()) return util::RoaringBitmap();
+    bitmaps.push_back(&it->second);
+  }
+  if (bitmaps.empty()) return util::RoaringBitmap();
+  std::vector<uint64_t> sizes;
+  for (const util::RoaringBitmap* bitmap : bitmaps) {
+    sizes.push_back(bitmap->cardinality());
+  }
+  const size_t smallest =
+      std::min_element(sizes.begin(), sizes.end()) - sizes.begin();
+  util::RoaringBitmap items = *bitmaps[smallest];
+  for (size_t i = 0; i < bitmaps.size() && !items.empty(); ++i) {
+    if (i != smallest) items &= *bitmaps[i];
+  }
+  return items;
+}
+
+uint64_t InMemoryIndex::QueryCount(
+    absl::Span<const TimeRangeToken> tokens) const {
+  if (tokens.size() == 1) {
+    auto it = hits_.find(tokens[0]);
+    return it == hits_.end() ? 0 : it->second.cardinality();
+  }
+  return QueryUnion(tokens).cardinality();
+}
+
+size_t InMemoryIndex::MemoryUsage() const {
+  return hits_.capacity() * sizeof(*hits_.begin()) + bitmap_bytes_;
+}
+
+Tokenizer::Tokenizer(std::set<absl::Duration> granularities)
+    : granularities_(granularities.begin(), granularities.end()) {
+  CHECK(!granularities_.empty());
+  CHECK_LE(granularities_.size(), 256);
+  for (absl::Duration granularity : granularities_) {
+    CHECK_GT(granularity, absl::ZeroDuration());
+    levels_.emplace(granularity, levels_.size());
+    // Times on the fast path are under 2^63 nanoseconds from the epoch, so a
+    // saturated divisor still yields an index of 0.
+    divisors_.push_back(
+        granularity >= absl::Nanoseconds(std::numeric_limits<int64_t>::max())
+            ? std::numeric_limits<int64_t>::max()
+            : absl::ToInt64Nanoseconds(granularity));
+  }
+  // The ladder nests if every granularity is a whole multiple of the next
+  // finer one, hence of the finest.
+  nested_ = true;
+  for (absl::Duration granularity : granularities_) {
+    absl::Duration remainder;
+    int64_t ratio =
+        absl::IDivDuration(granularity, granularities_[0], &remainder);
+    if (remainder != absl::ZeroDuration() ||
+        ratio * granularities_[0] != granularity) {
+      ratio = 0;
+    }
+    nested_ = nested_ && ratio != 0 &&
+              (ratios_.empty() || ratio % ratios_.back() == 0);
+    ratios_.push_back(ratio);
+  }
+}
+
+int Tokenizer::GranularityLevel(absl::Duration granularity) const {
+  auto it = levels_.find(granularity);
+  return it == levels_.end() ? -1 : it->second;
+}
+
+// The range tokens of [a, b) exactly cover [a, b) rounded down to the finest
+// granularity, and point tokens exist at every granularity, so a point token
+// matches a range iff the point falls in the rounded range.
+bool Tokenizer::Matches(absl::Time start, absl::Time end,
+                        absl::Time query_start, absl::Time query_end) const {
+  if (start > end) std::swap(start, end);
+  const auto round = [this](absl::Time time_pt) {
+    return StartTime(TokenForTime(time_pt, 0));
+  };
+  const absl::Time rounded_start = round(start), rounded_end = round(end);
+  // Only the range is reordered; the point is query_start either way.
+  const absl::Time rounded_query_point = round(query_start);
+  absl::Time rounded_query_start = rounded_query_point,
+             rounded_query_end = round(query_end);
+  if (rounded_query_start > rounded_query_end) {
+    std::swap(rounded_query_start, rounded_query_end);
+  }
+  const auto in_query = [&](absl::Time rounded) {
+    return rounded >= rounded_query_start && rounded < rounded_query_end;
+  };
+  return in_query(rounded_start) || in_query(rounded_end) ||
+         (rounded_query_point >= rounded_start &&
+          rounded_query_point < rounded_end);
+}
+
+TimeRangeToken Tokenizer::TokenForTime(absl::Time time_pt, int level) const {
+  int64_t nanos;
+  if (ToUnixNanosIfFits(time_pt, &nanos)) {
+    return TimeRangeToken(level, nanos / divisors_[level]);
+  }
+  absl::Duration unused_remainder;
+  return TimeRangeToken(
+      level, absl::IDivDuration(time_pt - absl::UnixEpoch(),
+                                granularities_[level], &unused_remainder));
+}
+
 std::vector<TimeRangeToken> Tokenizer::TokenizeTimePoint(
     absl::Time time_pt) const {
   std::vector<TimeRangeToken> tokens;
-  for (absl::Duration granularity : granularities_) {
-    tokens.push_back(GetTokenForTime(time_pt, granularity));
-  }
+  TokenizeTimePoint(time_pt, &tokens);
   return tokens;
 }
 
+void Tokenizer::TokenizeTimePoint(absl::Time time_pt,
+                                  std::vector<TimeRangeToken>* tokens) const {
+  const size_t size = tokens->size();
+  tokens->resize(size + num_levels());
+  TokenizeTimePoints({&time_pt, 1}, tokens->data() + size);
+}
+
+// The hot loop of indexing: one division per level by a precomputed divisor,
+// with no branches, so that it unrolls and pipelines. Times too far from the
+// epoch for int64 nanoseconds are rare and take absl's saturating division.
+void Tokenizer::TokenizeTimePoints(absl::Span<const absl::Time> time_pts,
+                                   TimeRangeToken* tokens) const {
+  const int num_levels = this->num_levels();
+  const int64_t* const divisors = divisors_.data();
+  for (absl::Time time_pt : time_pts) {
+    int64_t nanos;
+    if (ToUnixNanosIfFits(time_pt, &nanos)) {
+      for (int level = 0; level < num_levels; ++level) {
+        tokens[level] = TimeRangeToken(level, nanos / divisors[level]);
+      }
+    } else {
+      for (int level = 0; level < num_levels; ++level) {
+        tokens[level] = TokenForTime(time_pt, level);
+      }
+    }
+    tokens += num_levels;
+  }
+}
+
 std::vector<TimeRangeToken> Tokenizer::TokenizeTimeRange(
     absl::Time start, absl::Time end) const {
+  std::vector<TimeRangeToken> tokens;
+  TokenizeTimeRange(start, end, &tokens);
+  return tokens;
+}
+
+// On a nested ladder, tokens of a level never straddle a boundary of a
+// coarser one. Take the coarsest level that has a whole token in the range:
+// the cover is its tokens, plus below the first of them the tokens that climb
+// from the start through each finer level's boundaries, plus above the last
+// the tokens that descend to the end. Every level is used fewer times than the
+// ratio to the next one at each end, and no cover does with fewer tokens.
+void Tokenizer::TokenizeTimeRange(absl::Time start, absl::Time end,
+                                  std::vector<TimeRangeToken>* tokens) const {
   if (start > end) std::swap(start, end);
-  const absl::Duration finest_granularity = *granularities_.begin();
-  start = GetTokenForTime(start, finest_granularity).start_time();
-  end = GetTokenForTime(end, finest_granularity).start_time();
+  if (!nested_) {
+    TokenizeTimeRangeGreedily(start, end, tokens);
+    return;
+  }
+  // In units of the finest granularity.
+  const int64_t first = TokenForTime(start, 0).index();
+  const int64_t last = TokenForTime(end, 0).index();
+  if (first >= last) return;
+
+  int top = 0;
+  while (top + 1 < num_levels() &&
+         CeilDiv(first, ratios_[top + 1]) < FloorDiv(last, ratios_[top + 1])) {
+    ++top;
+  }
+  const auto add_tokens = [tokens](int level, int64_t begin, int64_t end) {
+    for (int64_t index = begin; index < end; ++index) {
+      tokens->push_back(TimeRangeToken(level, index));
+    }
+  };
+  for (int level = 0; level < top; ++level) {
+    const int64_t ratio = ratios_[level + 1] / ratios_[level];
+    add_tokens(level, CeilDiv(first, ratios_[level]),
+               CeilDiv(first, ratios_[level + 1]) * ratio);
+  }
+  add_tokens(top, CeilDiv(first, ratios_[top]), FloorDiv(last, ratios_[top]));
+  for (int level = top - 1; level >= 0; --level) {
+    const int64_t ratio = ratios_[level + 1] / ratios_[level];
+    add_tokens(level, FloorDiv(last, ratios_[level + 1]) * ratio,
+               FloorDiv(last, ratios_[level]));
+  }
+}
+
+// Walks from the start, taking the coarsest token that starts there and fits.
+// Exact, but not minimal: a coarse token taken early can leave a remainder
+// that needs more fine tokens than a different split would. Granularities
+// that aren't multiples of the finest are skipped, as their tokens could end
+// where no token starts.
+void Tokenizer::TokenizeTimeRangeGreedily(
+    absl::Time start, absl::Time end,
+    std::vector<TimeRangeToken>* tokens) const {
+  start = StartTime(TokenForTime(start, 0));
+  end = StartTime(TokenForTime(end, 0));
 
-  std::vector<TimeRangeToken> tokens;
   while (start < end) {
     VLOG(1) << "tokenizing [" << start << "," << end << ")";
     TimeRangeToken next_token;
-    for (auto it = granularities_.rbegin(); it != granularities_.rend(); ++it) {
-      TimeRangeToken token = GetTokenForTime(start, *it);
-      if (token.start_time() >= start && token.end_time() <= end) {
-        next_token = std::move(token);
+    for (int level = num_levels() - 1; level >= 0; --level) {
+      if (ratios_[level] == 0) continue;
+      const TimeRangeToken token = TokenForTime(start, level);
+      if (StartTime(token) == start && EndTime(token) <= end) {
+        next_token = token;
         break;
       }
       VLOG(1) << "token " << token << " didn't work.";
     }
-    start = next_token.end_time();
-    tokens.push_back(std::move(next_token));
+    start = EndTime(next_token);
+    tokens->push_back(next_token);
   }
-  return tokens;
 }
 
 }  // namespace stat_tracker
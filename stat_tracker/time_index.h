@@ -1,33 +1,64 @@
 #ifndef STAT_TRACKER_TIME_INDEX_H_
 #define STAT_TRACKER_TIME_INDEX_H_
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
-#include <functional>
 #include <map>
 #include <ostream>
 #include <set>
+#include <utility>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
+#include "util/roaring_bitmap.h"
 
 namespace stat_tracker {
 
-struct TimeRangeToken {
-  absl::Time start_time() const {
-    return absl::UnixEpoch() + index * granularity;
+// A bucket of one of a Tokenizer's granularities, packed into 64 bits: the
+// granularity's level in the high 8 bits and the bucket index, offset so that
+// it sorts as a signed number, in the low 56. Tokens order by level, then
+// index. Indexes are clamped to 56 bits, which at 100ms granularity still
+// reaches 100 million years.
+class TimeRangeToken {
+ public:
+  static constexpr int kIndexBits = 56;
+  static constexpr int64_t kMaxIndex = (int64_t{1} << (kIndexBits - 1)) - 1;
+  static constexpr int64_t kMinIndex = -kMaxIndex - 1;
+
+  TimeRangeToken() : packed_(0) {}
+  TimeRangeToken(int level, int64_t index)
+      : packed_(static_cast<uint64_t>(level) << kIndexBits |
+                static_cast<uint64_t>(
+                    std::max(kMinIndex, std::min(index, kMaxIndex)) -
+                    kMinIndex)) {}
+
+  int level() const { return static_cast<int>(packed_ >> kIndexBits); }
+  int64_t index() const {
+    return static_cast<int64_t>(packed_ & kIndexMask) + kMinIndex;
   }
-  absl::Time end_time() const {
-    return absl::UnixEpoch() + (index + 1) * granularity;
+  uint64_t packed() const { return packed_; }
+
+  template <typename H>
+  friend H AbslHashValue(H h, TimeRangeToken token) {
+    return H::combine(std::move(h), token.packed_);
   }
 
-  int64_t index;
-  absl::Duration granularity;
+ private:
+  static constexpr uint64_t kIndexMask = (uint64_t{1} << kIndexBits) - 1;
+
+  uint64_t packed_;
 };
 
-bool operator==(const TimeRangeToken& lhs, const TimeRangeToken& rhs);
-bool operator<(const TimeRangeToken& lhs, const TimeRangeToken& rhs);
-std::ostream& operator<<(std::ostream& os, const TimeRangeToken& rhs);
+inline bool operator==(TimeRangeToken lhs, TimeRangeToken rhs) {
+  return lhs.packed() == rhs.packed();
+}
+inline bool operator<(TimeRangeToken lhs, TimeRangeToken rhs) {
+  return lhs.packed() < rhs.packed();
+}
+std::ostream& operator<<(std::ostream& os, TimeRangeToken rhs);
 
 class IndexInterface {
  public:
@@ -36,38 +67,105 @@ class IndexInterface {
 
   virtual void AddItem(uint64_t item_id,
                        absl::Span<const TimeRangeToken> tokens) = 0;
-
-  virtual void QueryUnion(
-      absl::Span<const TimeRangeToken> tokens,
-      const std::function<void(uint64_t)>& on_item) const = 0;
+  // `tokens` must be those the item was added with.
+  virtual void RemoveItem(uint64_t item_id,
+                          absl::Span<const TimeRangeToken> tokens) = 0;
+
+  // The items with any of `tokens`.
+  virtual util::RoaringBitmap QueryUnion(
+      absl::Span<const TimeRangeToken> tokens) const = 0;
+  // The items with all of `tokens`.
+  virtual util::RoaringBitmap QueryIntersection(
+      absl::Span<const TimeRangeToken> tokens) const = 0;
+  // The number of items QueryUnion would return.
+  virtual uint64_t QueryCount(
+      absl::Span<const TimeRangeToken> tokens) const = 0;
 };
 
+// Keeps the items of each token in a compressed bitmap.
 class InMemoryIndex : public IndexInterface {
  public:
   InMemoryIndex() = default;
 
   void AddItem(uint64_t item_id,
                absl::Span<const TimeRangeToken> tokens) override;
+  void RemoveItem(uint64_t item_id,
+                  absl::Span<const TimeRangeToken> tokens) override;
+
+  util::RoaringBitmap QueryUnion(
+      absl::Span<const TimeRangeToken> tokens) const override;
+  util::RoaringBitmap QueryIntersection(
+      absl::Span<const TimeRangeToken> tokens) const override;
+  uint64_t QueryCount(absl::Span<const TimeRangeToken> tokens) const override;
 
-  void QueryUnion(absl::Span<const TimeRangeToken> tokens,
-                  const std::function<void(uint64_t)>& on_item) const override;
+  // Approximate heap bytes held. Constant time, so callers can check it
+  // after every edit.
+  size_t MemoryUsage() const;
 
  private:
-  std::map<TimeRangeToken, std::vector<uint64_t>> hits_;
+  absl::flat_hash_map<TimeRangeToken, util::RoaringBitmap> hits_;
+  // Sum of the MemoryUsage of the bitmaps in hits_.
+  size_t bitmap_bytes_ = 0;
 };
 
 class Tokenizer {
  public:
-  explicit Tokenizer(std::set<absl::Duration> granularities)
-      : granularities_(std::move(granularities)) {}
+  // At most 256 granularities.
+  explicit Tokenizer(std::set<absl::Duration> granularities);
 
-  std::vector<TimeRangeToken> TokenizeTimePoint(absl::Time time_pt) const;
+  int num_levels() const { return granularities_.size(); }
+  absl::Duration granularity(int level) const { return granularities_[level]; }
 
+  absl::Time StartTime(TimeRangeToken token) const {
+    return absl::UnixEpoch() + token.index() * granularity(token.level());
+  }
+  absl::Time EndTime(TimeRangeToken token) const {
+    return absl::UnixEpoch() + (token.index() + 1) * granularity(token.level());
+  }
+
+  // The token of every granularity that contains `time_pt`, finest first.
+  std::vector<TimeRangeToken> TokenizeTimePoint(absl::Time time_pt) const;
+  // Appends them to `tokens` instead, so that callers can reuse a buffer.
+  void TokenizeTimePoint(absl::Time time_pt,
+                         std::vector<TimeRangeToken>* tokens) const;
+  // Writes the point tokens of each of `time_pts` to `tokens`, num_levels()
+  // per point. `tokens` must have room for all of them.
+  void TokenizeTimePoints(absl::Span<const absl::Time> time_pts,
+                          TimeRangeToken* tokens) const;
+
+  // The tokens that exactly cover [start, end), each rounded down to the
+  // finest granularity, in order. The fewest possible if each granularity is
+  // a multiple of the finer ones.
   std::vector<TimeRangeToken> TokenizeTimeRange(absl::Time start,
                                                 absl::Time end) const;
+  void TokenizeTimeRange(absl::Time start, absl::Time end,
+                         std::vector<TimeRangeToken>* tokens) const;
+
+  // Position of `granularity` among this tokenizer's granularities, finest
+  // first, or -1 if it isn't one of them.
+  int GranularityLevel(absl::Duration granularity) const;
+
+  // Whether querying an index for the range tokens of [query_start,
+  // query_end) and the point tokens of query_start finds an item indexed by
+  // the point tokens of start and end and the range tokens of [start, end).
+  // Lets items stored outside of an index be filtered consistently with it.
+  bool Matches(absl::Time start, absl::Time end, absl::Time query_start,
+               absl::Time query_end) const;
 
  private:
-  std::set<absl::Duration> granularities_;
+  TimeRangeToken TokenForTime(absl::Time time_pt, int level) const;
+  void TokenizeTimeRangeGreedily(absl::Time start, absl::Time end,
+                                 std::vector<TimeRangeToken>* tokens) const;
+
+  // Finest first.
+  std::vector<absl::Duration> granularities_;
+  // The granularities in nanoseconds, saturated to int64. Dividing a time in
+  // nanoseconds by them truncates like absl::IDivDuration.
+  std::vector<int64_t> divisors_;
+  // Each granularity in units of the finest, or 0 if it isn't a multiple.
+  std::vector<int64_t> ratios_;
+  bool nested_;
+  std::map<absl::Duration, int> levels_;
 };
 
 }  // namespace stat_tracker
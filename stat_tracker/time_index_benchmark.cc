@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <random>
 #include <set>
+#include <vector>
 
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
@@ -40,6 +44,26 @@ static void BM_IndexPoint(benchmark::State& state) {
 }
 BENCHMARK(BM_IndexPoint)->DenseRange(4, 64, 4);
 
+// Tokenizes a batch of points into a reused buffer, as indexing does.
+static void BM_IndexPoints(benchmark::State& state) {
+  const stat_tracker::Tokenizer tokenizer =
+      stat_tracker::Tokenizer(GenerateGranularities(
+          absl::Seconds(1), 1000 * 365 * absl::Hours(24), state.range(0)));
+  std::vector<absl::Time> time_pts;
+  const absl::Time now = absl::Now();
+  for (int i = 0; i < 1024; ++i) {
+    time_pts.push_back(now + i * absl::Milliseconds(1234));
+  }
+  std::vector<stat_tracker::TimeRangeToken> tokens(time_pts.size() *
+                                                   tokenizer.num_levels());
+  for (auto _ : state) {
+    tokenizer.TokenizeTimePoints(time_pts, tokens.data());
+    benchmark::DoNotOptimize(tokens.data());
+  }
+  state.SetItemsProcessed(state.iterations() * tokens.size());
+}
+BENCHMARK(BM_IndexPoints)->DenseRange(4, 64, 4);
+
 static void BM_IndexRange(benchmark::State& state) {
   const stat_tracker::Tokenizer tokenizer = stat_tracker::Tokenizer(
       {absl::Milliseconds(100), absl::Milliseconds(500), absl::Seconds(1),
@@ -58,3 +82,45 @@ static void BM_IndexRange(benchmark::State& state) {
   state.counters["tokens_per_iter"] = num_tokens_generated / state.iterations();
 }
 BENCHMARK(BM_IndexRange)->Range(1, 1e6);
+
+// Indexes one item every 250ms by its point tokens, then queries random hours
+// for the items in them. Reports the index's memory per item.
+static void BM_InMemoryIndexQuery(benchmark::State& state) {
+  const stat_tracker::Tokenizer tokenizer = stat_tracker::Tokenizer(
+      {absl::Milliseconds(100), absl::Milliseconds(500), absl::Seconds(1),
+       absl::Seconds(5), absl::Seconds(10), absl::Seconds(30), absl::Minutes(1),
+       absl::Minutes(5), absl::Minutes(10), absl::Minutes(30), absl::Hours(1),
+       absl::Hours(1e1), absl::Hours(1e2), absl::Hours(1e3), absl::Hours(1e4),
+       absl::Hours(1e5), absl::Hours(1e6)});
+  const int64_t num_items = state.range(0);
+  const absl::Time start = absl::FromUnixSeconds(1500000000);
+  const absl::Duration spacing = absl::Milliseconds(250);
+  stat_tracker::InMemoryIndex index;
+  std::vector<stat_tracker::TimeRangeToken> tokens(tokenizer.num_levels());
+  for (int64_t item = 0; item < num_items; ++item) {
+    tokenizer.TokenizeTimePoints({start + item * spacing}, tokens.data());
+    index.AddItem(item, tokens);
+  }
+
+  std::mt19937_64 rng(1);
+  const int64_t num_hours = std::max<int64_t>(
+      1, absl::ToInt64Hours(num_items * spacing) - 1);
+  std::uniform_int_distribution<int64_t> hour(0, num_hours - 1);
+  uint64_t num_hits = 0;
+  for (auto _ : state) {
+    const absl::Time query_start = start + hour(rng) * absl::Hours(1) +
+                                   absl::Minutes(17) + absl::Seconds(3);
+    num_hits += index
+                    .QueryUnion(tokenizer.TokenizeTimeRange(
+                        query_start, query_start + absl::Hours(1)))
+                    .cardinality();
+  }
+  state.SetItemsProcessed(num_hits);
+  state.counters["bytes_per_item"] =
+      static_cast<double>(index.MemoryUsage()) / num_items;
+}
+BENCHMARK(BM_InMemoryIndexQuery)
+    ->Arg(100000)
+    ->Arg(1000000)
+    ->Arg(10000000)
+    ->Unit(benchmark::kMicrosecond);
@@ -1,5 +1,9 @@
 #include "stat_tracker/time_index.h"
 
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 #include "absl/time/clock.h"
 #include "googlemock/include/gmock/gmock.h"
 #include "googletest/include/gtest/gtest.h"
@@ -7,30 +11,33 @@
 namespace stat_tracker {
 namespace {
 
-using ::testing::_;
 using ::testing::ElementsAre;
-using ::testing::MockFunction;
-using ::testing::StrictMock;
-
-TEST(TimeRangeTokenTest, StartTime) {
-  const TimeRangeToken token = {12, absl::Seconds(1)};
-  EXPECT_EQ(token.start_time(), absl::UnixEpoch() + absl::Seconds(12));
-}
+using ::testing::ElementsAreArray;
 
-TEST(TimeRangeTokenTest, EndTime) {
-  const TimeRangeToken token = {12, absl::Seconds(1)};
-  EXPECT_EQ(token.end_time(), absl::UnixEpoch() + absl::Seconds(13));
+TEST(TimeRangeTokenTest, Packs) {
+  const TimeRangeToken token(3, -12);
+  EXPECT_EQ(token.level(), 3);
+  EXPECT_EQ(token.index(), -12);
+  EXPECT_EQ(TimeRangeToken(1, TimeRangeToken::kMaxIndex + 5).index(),
+            TimeRangeToken::kMaxIndex);
+  EXPECT_EQ(TimeRangeToken(1, TimeRangeToken::kMinIndex - 5).index(),
+            TimeRangeToken::kMinIndex);
 }
 
 TEST(TimeRangeTokenTest, SetOfTokens) {
-  const TimeRangeToken five_seconds = {5, absl::Seconds(1)},
-                       three_seconds = {3, absl::Seconds(1)},
-                       seven_seconds = {7, absl::Seconds(1)},
-                       one_hour = {1, absl::Hours(1)};
+  const TimeRangeToken five_seconds(0, 5), three_seconds(0, 3),
+      minus_seven_seconds(0, -7), one_hour(1, 1);
   const std::set<TimeRangeToken> tokens = {five_seconds, three_seconds,
-                                           seven_seconds, one_hour};
-  EXPECT_THAT(tokens, ElementsAre(three_seconds, five_seconds, seven_seconds,
-                                  one_hour));
+                                           minus_seven_seconds, one_hour};
+  EXPECT_THAT(tokens, ElementsAre(minus_seven_seconds, three_seconds,
+                                  five_seconds, one_hour));
+}
+
+TEST(TokenizerTest, StartAndEndTime) {
+  const Tokenizer tokenizer = Tokenizer({absl::Seconds(1), absl::Minutes(1)});
+  const TimeRangeToken token(1, 12);
+  EXPECT_EQ(tokenizer.StartTime(token), absl::UnixEpoch() + absl::Minutes(12));
+  EXPECT_EQ(tokenizer.EndTime(token), absl::UnixEpoch() + absl::Minutes(13));
 }
 
 TEST(TokenizerTest, TimePoint) {
@@ -39,9 +46,43 @@ TEST(TokenizerTest, TimePoint) {
   const absl::Time time_pt =
       absl::UnixEpoch() + absl::Minutes(2) + absl::Seconds(1);
   EXPECT_THAT(tokenizer.TokenizeTimePoint(time_pt),
-              ElementsAre(TimeRangeToken{121, absl::Seconds(1)},
-                          TimeRangeToken{2, absl::Minutes(1)},
-                          TimeRangeToken{0, absl::Hours(1)}));
+              ElementsAre(TimeRangeToken(0, 121), TimeRangeToken(1, 2),
+                          TimeRangeToken(2, 0)));
+}
+
+// The integer kernel must agree with absl's division, which persisted index
+// tokens were computed with, including for times before the epoch or too far
+// from it for int64 nanoseconds.
+TEST(TokenizerTest, TimePointsAgreeWithDurationDivision) {
+  const std::set<absl::Duration> granularities = {
+      absl::Milliseconds(100), absl::Milliseconds(1500), absl::Hours(1),
+      absl::Hours(1e7), absl::Hours(1e12)};
+  const Tokenizer tokenizer = Tokenizer(granularities);
+  const std::vector<absl::Time> time_pts = {
+      absl::UnixEpoch(),
+      absl::FromUnixNanos(1234567890123456789),
+      absl::FromUnixMillis(-2500),
+      absl::UnixEpoch() - absl::Hours(24 * 365 * 300),
+      absl::UnixEpoch() + absl::Hours(24 * 365 * 1e6),
+  };
+  std::vector<TimeRangeToken> tokens(time_pts.size() * granularities.size());
+  tokenizer.TokenizeTimePoints(time_pts, tokens.data());
+
+  auto token = tokens.begin();
+  for (absl::Time time_pt : time_pts) {
+    EXPECT_THAT(tokenizer.TokenizeTimePoint(time_pt),
+                ElementsAreArray(token, token + granularities.size()));
+    int level = 0;
+    for (absl::Duration granularity : granularities) {
+      absl::Duration unused_remainder;
+      EXPECT_EQ(token->level(), level++);
+      EXPECT_EQ(token->index(),
+                absl::IDivDuration(time_pt - absl::UnixEpoch(), granularity,
+                                   &unused_remainder))
+          << time_pt << " / " << granularity;
+      ++token;
+    }
+  }
 }
 
 TEST(TokenizerTest, TimeRange) {
@@ -52,19 +93,82 @@ TEST(TokenizerTest, TimeRange) {
   const absl::Time end_time =
       absl::UnixEpoch() + absl::Hours(3) + absl::Minutes(2) + absl::Seconds(1);
   EXPECT_THAT(tokenizer.TokenizeTimeRange(start_time, end_time),
-              ElementsAre(TimeRangeToken{59, absl::Seconds(1)},
-                          TimeRangeToken{1, absl::Minutes(1)},
-                          TimeRangeToken{1, absl::Minutes(2)},
-                          TimeRangeToken{2, absl::Minutes(2)},
-                          TimeRangeToken{3, absl::Minutes(2)},
-                          TimeRangeToken{4, absl::Minutes(2)},
-                          TimeRangeToken{1, absl::Minutes(10)},
-                          TimeRangeToken{2, absl::Minutes(10)},
-                          TimeRangeToken{1, absl::Minutes(30)},
-                          TimeRangeToken{1, absl::Hours(1)},
-                          TimeRangeToken{2, absl::Hours(1)},
-                          TimeRangeToken{90, absl::Minutes(2)},
-                          TimeRangeToken{3 * 60 * 60 + 2 * 60 /*10920*/, absl::Seconds(1)}));
+              ElementsAre(TimeRangeToken(0, 59),
+                          TimeRangeToken(1, 1),
+                          TimeRangeToken(2, 1),
+                          TimeRangeToken(2, 2),
+                          TimeRangeToken(2, 3),
+                          TimeRangeToken(2, 4),
+                          TimeRangeToken(3, 1),
+                          TimeRangeToken(3, 2),
+                          TimeRangeToken(4, 1),
+                          TimeRangeToken(5, 1),
+                          TimeRangeToken(5, 2),
+                          TimeRangeToken(2, 90),
+                          TimeRangeToken(0, 3 * 60 * 60 + 2 * 60)));
+}
+
+// The fewest tokens that exactly cover [first, last) in units of the finest
+// granularity, by dynamic programming over every boundary.
+int MinimumCover(const Tokenizer& tokenizer, int64_t first, int64_t last) {
+  std::vector<int> fewest(last - first + 1, std::numeric_limits<int>::max());
+  fewest[0] = 0;
+  for (int64_t pos = first; pos < last; ++pos) {
+    if (fewest[pos - first] == std::numeric_limits<int>::max()) continue;
+    for (int level = 0; level < tokenizer.num_levels(); ++level) {
+      const int64_t ratio = tokenizer.granularity(level) /
+                            tokenizer.granularity(0);
+      if (pos % ratio != 0 || pos + ratio > last) continue;
+      fewest[pos + ratio - first] =
+          std::min(fewest[pos + ratio - first], fewest[pos - first] + 1);
+    }
+  }
+  return fewest.back();
+}
+
+// Checks that `tokens` tile [first, last) of the finest granularity in order.
+void ExpectExactCover(const Tokenizer& tokenizer,
+                      const std::vector<TimeRangeToken>& tokens,
+                      absl::Time first, absl::Time last) {
+  absl::Time covered = first;
+  for (TimeRangeToken token : tokens) {
+    EXPECT_EQ(tokenizer.StartTime(token), covered) << token;
+    covered = tokenizer.EndTime(token);
+  }
+  EXPECT_EQ(covered, last);
+}
+
+TEST(TokenizerTest, NestedTimeRangeIsMinimal) {
+  const Tokenizer tokenizer =
+      Tokenizer({absl::Milliseconds(100), absl::Milliseconds(500),
+                 absl::Seconds(1), absl::Seconds(5), absl::Seconds(10),
+                 absl::Seconds(30)});
+  const absl::Duration finest = tokenizer.granularity(0);
+  for (int64_t first = -150; first < 150; first += 7) {
+    for (int64_t last = first; last < first + 900; last += 13) {
+      const absl::Time start = absl::UnixEpoch() + first * finest;
+      const absl::Time end = absl::UnixEpoch() + last * finest;
+      const std::vector<TimeRangeToken> tokens =
+          tokenizer.TokenizeTimeRange(start, end);
+      ExpectExactCover(tokenizer, tokens, start, end);
+      EXPECT_EQ(tokens.size(), MinimumCover(tokenizer, first, last))
+          << "[" << start << "," << end << ")";
+    }
+  }
+}
+
+TEST(TokenizerTest, TimeRangeOfLadderThatDoesNotNest) {
+  const Tokenizer tokenizer =
+      Tokenizer({absl::Seconds(1), absl::Seconds(3), absl::Seconds(4),
+                 absl::Milliseconds(4500)});
+  for (int first = -20; first < 20; ++first) {
+    for (int last = first; last < 40; ++last) {
+      const absl::Time start = absl::FromUnixSeconds(first);
+      const absl::Time end = absl::FromUnixSeconds(last);
+      ExpectExactCover(tokenizer, tokenizer.TokenizeTimeRange(start, end),
+                       start, end);
+    }
+  }
 }
 
 TEST(InMemoryIndexTest, QueryForPointsInRange) {
@@ -77,13 +181,12 @@ TEST(InMemoryIndexTest, QueryForPointsInRange) {
   index.AddItem(2, tokenizer.TokenizeTimePoint(now + absl::Minutes(2)));
   index.AddItem(3, tokenizer.TokenizeTimePoint(now + absl::Minutes(3)));
 
-  StrictMock<MockFunction<void(uint64_t)>> on_item;
-  EXPECT_CALL(on_item, Call(2));
-  EXPECT_CALL(on_item, Call(3));
-  index.QueryUnion(
-      tokenizer.TokenizeTimeRange(now + absl::Minutes(1) + absl::Seconds(1),
-                                  now + absl::Hours(1)),
-      on_item.AsStdFunction());
+  EXPECT_THAT(
+      index
+          .QueryUnion(tokenizer.TokenizeTimeRange(
+              now + absl::Minutes(1) + absl::Seconds(1), now + absl::Hours(1)))
+          .ToVector(),
+      ElementsAre(2, 3));
 }
 
 TEST(InMemoryIndexTest, QueryForRangeContainingPoint) {
@@ -99,12 +202,11 @@ TEST(InMemoryIndexTest, QueryForRangeContainingPoint) {
   index.AddItem(3, tokenizer.TokenizeTimeRange(now + absl::Minutes(1),
                                                now + absl::Minutes(3)));
 
-  StrictMock<MockFunction<void(uint64_t)>> on_item;
-  EXPECT_CALL(on_item, Call(2));
-  EXPECT_CALL(on_item, Call(3));
-  index.QueryUnion(
-      tokenizer.TokenizeTimePoint(now + absl::Minutes(1) + absl::Seconds(23)),
-      on_item.AsStdFunction());
+  EXPECT_THAT(index
+                  .QueryUnion(tokenizer.TokenizeTimePoint(
+                      now + absl::Minutes(1) + absl::Seconds(23)))
+                  .ToVector(),
+              ElementsAre(2, 3));
 }
 
 TEST(InMemoryIndexTest, QueryForPointsIsEmpty) {
@@ -117,12 +219,11 @@ TEST(InMemoryIndexTest, QueryForPointsIsEmpty) {
   index.AddItem(2, tokenizer.TokenizeTimePoint(now + absl::Minutes(2)));
   index.AddItem(3, tokenizer.TokenizeTimePoint(now + absl::Minutes(3)));
 
-  StrictMock<MockFunction<void(uint64_t)>> on_item;
-  EXPECT_CALL(on_item, Call(_)).Times(0);
-  index.QueryUnion(
-      tokenizer.TokenizeTimeRange(now + absl::Minutes(1) + absl::Seconds(1),
-                                  now + absl::Minutes(2) - absl::Seconds(1)),
-      on_item.AsStdFunction());
+  EXPECT_TRUE(index
+                  .QueryUnion(tokenizer.TokenizeTimeRange(
+                      now + absl::Minutes(1) + absl::Seconds(1),
+                      now + absl::Minutes(2) - absl::Seconds(1)))
+                  .empty());
 }
 
 TEST(InMemoryIndexTest, QueryForRangesIsEmpty) {
@@ -138,11 +239,76 @@ TEST(InMemoryIndexTest, QueryForRangesIsEmpty) {
   index.AddItem(3, tokenizer.TokenizeTimeRange(now + absl::Minutes(1),
                                                now + absl::Minutes(3)));
 
-  StrictMock<MockFunction<void(uint64_t)>> on_item;
-  EXPECT_CALL(on_item, Call(_)).Times(0);
-  index.QueryUnion(
-      tokenizer.TokenizeTimePoint(now + absl::Minutes(3) + absl::Seconds(1)),
-      on_item.AsStdFunction());
+  EXPECT_TRUE(index
+                  .QueryUnion(tokenizer.TokenizeTimePoint(
+                      now + absl::Minutes(3) + absl::Seconds(1)))
+                  .empty());
+}
+
+TEST(InMemoryIndexTest, RemoveItem) {
+  const Tokenizer tokenizer = Tokenizer({absl::Seconds(1), absl::Minutes(1)});
+  const absl::Time now = absl::Now();
+  const std::vector<TimeRangeToken> tokens = tokenizer.TokenizeTimePoint(now);
+  InMemoryIndex index;
+  index.AddItem(1, tokens);
+  index.AddItem(2, tokens);
+  index.RemoveItem(1, tokens);
+  EXPECT_THAT(index.QueryUnion(tokens).ToVector(), ElementsAre(2));
+  index.RemoveItem(2, tokens);
+  EXPECT_TRUE(index.QueryUnion(tokens).empty());
+  EXPECT_EQ(index.QueryCount(tokens), 0);
+}
+
+TEST(InMemoryIndexTest, IntersectionAndCount) {
+  const TimeRangeToken a(0, 1), b(0, 2), c(1, 0), missing(1, 1);
+  InMemoryIndex index;
+  for (uint64_t item = 0; item < 10000; ++item) {
+    index.AddItem(item, {a});
+    if (item % 2 == 0) index.AddItem(item, {b});
+    if (item % 3 == 0) index.AddItem(item, {c});
+  }
+  const std::vector<uint64_t> items =
+      index.QueryIntersection({a, b, c}).ToVector();
+  EXPECT_EQ(items.size(), 1667);
+  EXPECT_EQ(items.back(), 9996);
+  EXPECT_TRUE(index.QueryIntersection({a, missing}).empty());
+  EXPECT_EQ(index.QueryCount({b}), 5000);
+  EXPECT_EQ(index.QueryCount({b, c}), 6667);
+  EXPECT_EQ(index.QueryCount({b, c, missing}), 6667);
+}
+
+TEST(TokenizerTest, MatchesAgreesWithIndex) {
+  const Tokenizer tokenizer =
+      Tokenizer({absl::Seconds(1), absl::Seconds(10), absl::Minutes(1)});
+  const absl::Time epoch = absl::UnixEpoch();
+  const std::vector<std::pair<absl::Duration, absl::Duration>> ranges = {
+      {absl::Seconds(0), absl::Seconds(0)},
+      {absl::Seconds(5), absl::Milliseconds(5500)},
+      {absl::Seconds(9), absl::Seconds(70)},
+      {absl::Seconds(-3), absl::Seconds(12)},
+      {absl::Seconds(12), absl::Seconds(11)},
+      {absl::Seconds(59), absl::Seconds(61)},
+  };
+  for (const auto& item : ranges) {
+    const absl::Time start = epoch + item.first, end = epoch + item.second;
+    // Points are looked up by range and ranges by point.
+    InMemoryIndex points, ranges_index;
+    points.AddItem(1, tokenizer.TokenizeTimePoint(start));
+    points.AddItem(1, tokenizer.TokenizeTimePoint(end));
+    ranges_index.AddItem(1, tokenizer.TokenizeTimeRange(start, end));
+
+    for (const auto& query : ranges) {
+      const absl::Time query_start = epoch + query.first,
+                       query_end = epoch + query.second;
+      const bool found =
+          points.QueryCount(
+              tokenizer.TokenizeTimeRange(query_start, query_end)) > 0 ||
+          ranges_index.QueryCount(tokenizer.TokenizeTimePoint(query_start)) > 0;
+      EXPECT_EQ(tokenizer.Matches(start, end, query_start, query_end), found)
+          << "item [" << start << "," << end << ") query [" << query_start
+          << "," << query_end << ")";
+    }
+  }
 }
 
 }  // namespace
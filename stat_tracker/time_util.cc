@@ -2,12 +2,10 @@
 
 #include <time.h>
 
-#include "absl/time/clock.h"
-
 namespace stat_tracker {
 
-absl::Duration TimeoutFromContext(const grpc::ServerContext& context) {
-  return absl::FromChrono(context.deadline()) - absl::Now();
+absl::Time DeadlineFromContext(const grpc::ServerContext& context) {
+  return absl::FromChrono(context.deadline());
 }
 
 absl::Time FromProtoTimestamp(const google::protobuf::Timestamp& timestamp) {
@@ -8,7 +8,7 @@
 
 namespace stat_tracker {
 
-absl::Duration TimeoutFromContext(const grpc::ServerContext& context);
+absl::Time DeadlineFromContext(const grpc::ServerContext& context);
 
 absl::Time FromProtoTimestamp(const google::protobuf::Timestamp& timestamp);
 absl::Duration FromProtoDuration(const google::protobuf::Duration& duration);
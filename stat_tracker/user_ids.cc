@@ -0,0 +1,72 @@
+#include "stat_tracker/user_ids.h"
+
+#include "absl/strings/str_cat.h"
+#include "google/protobuf/wrappers.pb.h"
+#include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+#include "stat_tracker/key.h"
+
+namespace stat_tracker {
+
+namespace {
+
+util::StatusOr<leveldb::Status, uint64_t> GetUInt64(
+    storage::StorageInterface* storage, const Key& key) {
+  std::string value_bytes;
+  RETURN_IF_ERROR(storage->Get(leveldb::ReadOptions(), key, &value_bytes));
+  google::protobuf::UInt64Value value;
+  if (!value.ParseFromString(value_bytes)) {
+    return leveldb::Status::Corruption(
+        absl::StrCat("key ", absl::string_view(key), " not parseable."));
+  }
+  return value.value();
+}
+
+void PutUInt64(const Key& key, uint64_t value, leveldb::WriteBatch* batch) {
+  google::protobuf::UInt64Value uint64_value;
+  uint64_value.set_value(value);
+  batch->Put(key, uint64_value.SerializeAsString());
+}
+
+}  // namespace
+
+util::StatusOr<leveldb::Status, uint64_t> UserIds::Lookup(
+    const std::string& user_id) {
+  {
+    absl::ReaderMutexLock l(&mu_);
+    auto it = ids_.find(user_id);
+    if (it != ids_.end()) return it->second;
+  }
+  ASSIGN_OR_RETURN(const uint64_t id,
+                   GetUInt64(storage_.get(), Key::ForUserId(user_id)));
+  absl::MutexLock l(&mu_);
+  ids_.emplace(user_id, id);
+  return id;
+}
+
+util::StatusOr<leveldb::Status, uint64_t> UserIds::Intern(
+    const std::string& user_id) {
+  auto id_or = Lookup(user_id);
+  if (!id_or.status().IsNotFound()) return id_or;
+
+  absl::MutexLock intern_lock(&intern_mu_);
+  id_or = Lookup(user_id);
+  if (!id_or.status().IsNotFound()) return id_or;
+
+  const Key next_id_key = Key::NextUserId();
+  auto next_id_or = GetUInt64(storage_.get(), next_id_key);
+  if (next_id_or.status().IsNotFound()) next_id_or = uint64_t{0};
+  RETURN_IF_ERROR(next_id_or.status());
+  const uint64_t id = next_id_or.ValueOrDie();
+
+  leveldb::WriteBatch batch;
+  PutUInt64(next_id_key, id + 1, &batch);
+  PutUInt64(Key::ForUserId(user_id), id, &batch);
+  RETURN_IF_ERROR(storage_->Write(leveldb::WriteOptions(), &batch));
+
+  absl::MutexLock l(&mu_);
+  ids_.emplace(user_id, id);
+  return id;
+}
+
+}  // namespace stat_tracker
@@ -0,0 +1,43 @@
+#ifndef STAT_TRACKER_USER_IDS_H_
+#define STAT_TRACKER_USER_IDS_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "leveldb/status.h"
+#include "storage/storage.h"
+#include "util/status.h"
+
+namespace stat_tracker {
+
+// Interns user_id strings into the 64-bit ids that prefix every per-user key.
+// A mapping never changes once written, so mappings are cached for the
+// lifetime of the process.
+class UserIds {
+ public:
+  explicit UserIds(std::shared_ptr<storage::StorageInterface> storage)
+      : storage_(std::move(storage)) {}
+
+  // Returns NotFound if `user_id` has never been interned.
+  util::StatusOr<leveldb::Status, uint64_t> Lookup(const std::string& user_id);
+
+  // Assigns and persists a new id if `user_id` doesn't have one yet.
+  util::StatusOr<leveldb::Status, uint64_t> Intern(const std::string& user_id);
+
+ private:
+  std::shared_ptr<storage::StorageInterface> storage_;
+
+  absl::Mutex mu_;
+  absl::flat_hash_map<std::string, uint64_t> ids_;
+
+  // Serializes assignment of new ids, which read-modify-writes the global
+  // next-user counter.
+  absl::Mutex intern_mu_;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_USER_IDS_H_
@@ -0,0 +1,50 @@
+#include "stat_tracker/user_ids.h"
+
+#include "glog/logging.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "storage/testing/leveldb.h"
+#include "util/status_test_macros.h"
+
+namespace stat_tracker {
+namespace {
+
+class UserIdsTest : public ::testing::Test {
+ protected:
+  UserIdsTest() : leveldb_env_("user_ids_test.leveldb") {}
+
+  storage::LevelDbTestEnvironment leveldb_env_;
+};
+
+TEST_F(UserIdsTest, LookupUnknownUser) {
+  UserIds user_ids(leveldb_env_.db());
+  EXPECT_TRUE(user_ids.Lookup("jack").status().IsNotFound());
+}
+
+TEST_F(UserIdsTest, InternAssignsDistinctIds) {
+  UserIds user_ids(leveldb_env_.db());
+  ASSERT_OK_AND_ASSIGN(const uint64_t jack, user_ids.Intern("jack"));
+  ASSERT_OK_AND_ASSIGN(const uint64_t jill, user_ids.Intern("jill"));
+  EXPECT_NE(jack, jill);
+
+  ASSERT_OK_AND_ASSIGN(const uint64_t jack_again, user_ids.Intern("jack"));
+  EXPECT_EQ(jack, jack_again);
+  ASSERT_OK_AND_ASSIGN(const uint64_t jack_lookup, user_ids.Lookup("jack"));
+  EXPECT_EQ(jack, jack_lookup);
+}
+
+TEST_F(UserIdsTest, IdsArePersisted) {
+  uint64_t jack;
+  {
+    UserIds user_ids(leveldb_env_.db());
+    ASSERT_OK_AND_ASSIGN(jack, user_ids.Intern("jack"));
+  }
+  UserIds user_ids(leveldb_env_.db());
+  ASSERT_OK_AND_ASSIGN(const uint64_t jack_lookup, user_ids.Lookup("jack"));
+  EXPECT_EQ(jack, jack_lookup);
+  ASSERT_OK_AND_ASSIGN(const uint64_t jill, user_ids.Intern("jill"));
+  EXPECT_NE(jack, jill);
+}
+
+}  // namespace
+}  // namespace stat_tracker
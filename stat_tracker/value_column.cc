@@ -0,0 +1,183 @@
+#include "stat_tracker/value_column.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "google/protobuf/wrappers.pb.h"
+#include "util/varint.h"
+
+namespace stat_tracker {
+
+namespace {
+
+constexpr char kIntegerTag = 'i';
+constexpr char kRealTag = 'd';
+constexpr size_t kRealSize = 8;
+
+// Enough independent partial results to fill two 256-bit registers of
+// doubles, or to hide the latency of their additions.
+constexpr size_t kLanes = 8;
+
+}  // namespace
+
+absl::optional<NumericValue> ParseNumericValue(
+    const google::protobuf::Any& value) {
+  google::protobuf::Int64Value int64_value;
+  google::protobuf::Int32Value int32_value;
+  google::protobuf::UInt32Value uint32_value;
+  google::protobuf::UInt64Value uint64_value;
+  google::protobuf::DoubleValue double_value;
+  google::protobuf::FloatValue float_value;
+  if (value.UnpackTo(&int64_value)) {
+    return NumericValue::Integer(int64_value.value());
+  }
+  if (value.UnpackTo(&int32_value)) {
+    return NumericValue::Integer(int32_value.value());
+  }
+  if (value.UnpackTo(&uint32_value)) {
+    return NumericValue::Integer(uint32_value.value());
+  }
+  if (value.UnpackTo(&uint64_value)) {
+    if (uint64_value.value() <=
+        static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+      return NumericValue::Integer(
+          static_cast<int64_t>(uint64_value.value()));
+    }
+    return NumericValue::Real(static_cast<double>(uint64_value.value()));
+  }
+  double real;
+  if (value.UnpackTo(&double_value)) {
+    real = double_value.value();
+  } else if (value.UnpackTo(&float_value)) {
+    real = float_value.value();
+  } else {
+    return absl::nullopt;
+  }
+  if (std::isnan(real)) return absl::nullopt;
+  return NumericValue::Real(real);
+}
+
+void EncodeNumericValue(const NumericValue& value, std::string* dst) {
+  if (value.is_integer) {
+    dst->push_back(kIntegerTag);
+    util::PutVarint64(util::ZigZagEncode64(value.integer), dst);
+    return;
+  }
+  uint64_t bits;
+  std::memcpy(&bits, &value.real, sizeof(bits));
+  dst->push_back(kRealTag);
+  char buf[kRealSize];
+  for (size_t i = 0; i < kRealSize; ++i) {
+    buf[i] = static_cast<char>(bits & 0xff);
+    bits >>= 8;
+  }
+  dst->append(buf, kRealSize);
+}
+
+bool DecodeNumericValue(absl::string_view cell,
+                        absl::optional<NumericValue>* value) {
+  if (cell.empty()) {
+    *value = absl::nullopt;
+    return true;
+  }
+  const char tag = cell.front();
+  cell.remove_prefix(1);
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(cell.data());
+  const uint8_t* const end = p + cell.size();
+  if (tag == kIntegerTag) {
+    uint64_t zigzag;
+    p = util::GetVarint64(p, end, &zigzag);
+    if (p != end) return false;
+    *value = NumericValue::Integer(util::ZigZagDecode64(zigzag));
+    return true;
+  }
+  if (tag != kRealTag || cell.size() != kRealSize) return false;
+  uint64_t bits = 0;
+  for (int i = kRealSize - 1; i >= 0; --i) bits = (bits << 8) | p[i];
+  double real;
+  std::memcpy(&real, &bits, sizeof(real));
+  *value = NumericValue::Real(real);
+  return true;
+}
+
+void NumericAggregate::Merge(const NumericAggregate& other) {
+  count += other.count;
+  sum += other.sum;
+  min = std::min(min, other.min);
+  max = std::max(max, other.max);
+}
+
+NumericAggregate AggregateIntegers(absl::Span<const int64_t> values) {
+  // Unsigned, so that overflowing sums wrap rather than being undefined.
+  uint64_t sum[kLanes] = {};
+  int64_t min[kLanes], max[kLanes];
+  std::fill(min, min + kLanes, std::numeric_limits<int64_t>::max());
+  std::fill(max, max + kLanes, std::numeric_limits<int64_t>::min());
+  const size_t size = values.size();
+  const size_t vectorized = size - size % kLanes;
+  for (size_t i = 0; i < vectorized; i += kLanes) {
+    for (size_t j = 0; j < kLanes; ++j) {
+      const int64_t value = values[i + j];
+      sum[j] += static_cast<uint64_t>(value);
+      min[j] = value < min[j] ? value : min[j];
+      max[j] = value > max[j] ? value : max[j];
+    }
+  }
+  for (size_t i = vectorized; i < size; ++i) {
+    sum[0] += static_cast<uint64_t>(values[i]);
+    min[0] = std::min(min[0], values[i]);
+    max[0] = std::max(max[0], values[i]);
+  }
+
+  uint64_t total = 0;
+  NumericAggregate aggregate;
+  aggregate.count = size;
+  if (size == 0) return aggregate;
+  for (size_t j = 0; j < kLanes; ++j) {
+    total += sum[j];
+    aggregate.min = std::min(aggregate.min, static_cast<double>(min[j]));
+    aggregate.max = std::max(aggregate.max, static_cast<double>(max[j]));
+  }
+  aggregate.sum = static_cast<double>(static_cast<int64_t>(total));
+  return aggregate;
+}
+
+NumericAggregate AggregateReals(absl::Span<const double> values) {
+  double sum[kLanes] = {};
+  double min[kLanes], max[kLanes];
+  std::fill(min, min + kLanes, std::numeric_limits<double>::infinity());
+  std::fill(max, max + kLanes, -std::numeric_limits<double>::infinity());
+  const size_t size = values.size();
+  const size_t vectorized = size - size % kLanes;
+  for (size_t i = 0; i < vectorized; i += kLanes) {
+    for (size_t j = 0; j < kLanes; ++j) {
+      const double value = values[i + j];
+      sum[j] += value;
+      min[j] = value < min[j] ? value : min[j];
+      max[j] = value > max[j] ? value : max[j];
+    }
+  }
+  for (size_t i = vectorized; i < size; ++i) {
+    sum[0] += values[i];
+    min[0] = std::min(min[0], values[i]);
+    max[0] = std::max(max[0], values[i]);
+  }
+
+  NumericAggregate aggregate;
+  aggregate.count = size;
+  for (size_t j = 0; j < kLanes; ++j) {
+    aggregate.sum += sum[j];
+    aggregate.min = std::min(aggregate.min, min[j]);
+    aggregate.max = std::max(aggregate.max, max[j]);
+  }
+  return aggregate;
+}
+
+NumericAggregate ValueColumn::Aggregate() const {
+  NumericAggregate aggregate = AggregateIntegers(integers_);
+  aggregate.Merge(AggregateReals(reals_));
+  return aggregate;
+}
+
+}  // namespace stat_tracker
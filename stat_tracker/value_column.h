@@ -0,0 +1,87 @@
+#ifndef STAT_TRACKER_VALUE_COLUMN_H_
+#define STAT_TRACKER_VALUE_COLUMN_H_
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "google/protobuf/any.pb.h"
+
+namespace stat_tracker {
+
+// An event value that is a number: one of the google.protobuf wrappers of
+// integers or floating point numbers, packed into the event's Any.
+struct NumericValue {
+  bool is_integer = true;
+  int64_t integer = 0;
+  double real = 0;
+
+  static NumericValue Integer(int64_t value) { return {true, value, 0}; }
+  static NumericValue Real(double value) { return {false, 0, value}; }
+
+  double ToDouble() const {
+    return is_integer ? static_cast<double>(integer) : real;
+  }
+};
+
+// The number in `value`, if it's one. Unsigned integers past the int64 range
+// are taken as reals, and NaNs as no number.
+absl::optional<NumericValue> ParseNumericValue(
+    const google::protobuf::Any& value);
+
+// Each event's numeric value is kept, beside the event itself, in the row
+// that orders it by start time (see key.h), so that scanning a time range of
+// those rows reads just the values, with no events to parse. A row is empty
+// if the event has no numeric value, or else a type byte and the integer as
+// a zigzag varint, or the real as a little-endian IEEE double.
+void EncodeNumericValue(const NumericValue& value, std::string* dst);
+
+// Returns false if `cell` is malformed.
+bool DecodeNumericValue(absl::string_view cell,
+                        absl::optional<NumericValue>* value);
+
+// The count, sum, min and max of some numbers.
+struct NumericAggregate {
+  int64_t count = 0;
+  double sum = 0;
+  // Only meaningful if count > 0.
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+
+  double mean() const { return sum / count; }
+  void Merge(const NumericAggregate& other);
+};
+
+// Aggregation kernels over contiguous arrays. They keep several partial
+// results, one per lane, and fold them at the end, so that compilers can
+// vectorize the loop; min and max are selects rather than branches. Integers
+// are summed exactly, in int64, unless the sum overflows, and then converted.
+NumericAggregate AggregateIntegers(absl::Span<const int64_t> values);
+NumericAggregate AggregateReals(absl::Span<const double> values);
+
+// The numeric values of some events, split by type into contiguous arrays
+// for the kernels.
+class ValueColumn {
+ public:
+  void Add(const NumericValue& value) {
+    if (value.is_integer) {
+      integers_.push_back(value.integer);
+    } else {
+      reals_.push_back(value.real);
+    }
+  }
+
+  NumericAggregate Aggregate() const;
+
+ private:
+  std::vector<int64_t> integers_;
+  std::vector<double> reals_;
+};
+
+}  // namespace stat_tracker
+
+#endif  // STAT_TRACKER_VALUE_COLUMN_H_
@@ -0,0 +1,28 @@
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "stat_tracker/value_column.h"
+
+static void BM_AggregateIntegers(benchmark::State& state) {
+  std::mt19937_64 rng(0);
+  std::vector<int64_t> values(state.range(0));
+  for (int64_t& value : values) value = rng() >> 16;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(stat_tracker::AggregateIntegers(values));
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+BENCHMARK(BM_AggregateIntegers)->Arg(1000)->Arg(1000000);
+
+static void BM_AggregateReals(benchmark::State& state) {
+  std::mt19937_64 rng(0);
+  std::uniform_real_distribution<double> real(-1e6, 1e6);
+  std::vector<double> values(state.range(0));
+  for (double& value : values) value = real(rng);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(stat_tracker::AggregateReals(values));
+  }
+  state.SetItemsProcessed(state.iterations() * values.size());
+}
+BENCHMARK(BM_AggregateReals)->Arg(1000)->Arg(1000000);
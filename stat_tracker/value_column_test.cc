@@ -0,0 +1,110 @@
+#include "stat_tracker/value_column.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/wrappers.pb.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace stat_tracker {
+namespace {
+
+template <typename Wrapper, typename T>
+absl::optional<NumericValue> Parse(T value) {
+  Wrapper wrapper;
+  wrapper.set_value(value);
+  google::protobuf::Any any;
+  any.PackFrom(wrapper);
+  return ParseNumericValue(any);
+}
+
+TEST(ValueColumnTest, ParsesWrappedNumbers) {
+  absl::optional<NumericValue> value =
+      Parse<google::protobuf::Int64Value>(int64_t{-5});
+  ASSERT_TRUE(value.has_value());
+  EXPECT_TRUE(value->is_integer);
+  EXPECT_EQ(-5, value->integer);
+
+  value = Parse<google::protobuf::UInt32Value>(uint32_t{7});
+  ASSERT_TRUE(value.has_value());
+  EXPECT_EQ(7, value->integer);
+
+  value = Parse<google::protobuf::UInt64Value>(~uint64_t{0});
+  ASSERT_TRUE(value.has_value());
+  EXPECT_FALSE(value->is_integer);
+  EXPECT_EQ(std::pow(2.0, 64), value->real);
+
+  value = Parse<google::protobuf::FloatValue>(0.5f);
+  ASSERT_TRUE(value.has_value());
+  EXPECT_FALSE(value->is_integer);
+  EXPECT_EQ(0.5, value->real);
+
+  EXPECT_FALSE(Parse<google::protobuf::DoubleValue>(
+                   std::numeric_limits<double>::quiet_NaN())
+                   .has_value());
+  EXPECT_FALSE(Parse<google::protobuf::StringValue>("5").has_value());
+  EXPECT_FALSE(ParseNumericValue(google::protobuf::Any()).has_value());
+}
+
+TEST(ValueColumnTest, EncodeDecode) {
+  for (const NumericValue& value :
+       {NumericValue::Integer(0), NumericValue::Integer(-300),
+        NumericValue::Integer(std::numeric_limits<int64_t>::max()),
+        NumericValue::Real(-2.25), NumericValue::Real(1e300)}) {
+    std::string cell;
+    EncodeNumericValue(value, &cell);
+    absl::optional<NumericValue> decoded;
+    ASSERT_TRUE(DecodeNumericValue(cell, &decoded));
+    ASSERT_TRUE(decoded.has_value());
+    EXPECT_EQ(value.is_integer, decoded->is_integer);
+    EXPECT_EQ(value.ToDouble(), decoded->ToDouble());
+    EXPECT_FALSE(DecodeNumericValue(cell.substr(0, cell.size() - 1),
+                                    &decoded));
+    EXPECT_FALSE(DecodeNumericValue(cell + "x", &decoded));
+  }
+  absl::optional<NumericValue> none = NumericValue::Integer(1);
+  ASSERT_TRUE(DecodeNumericValue("", &none));
+  EXPECT_FALSE(none.has_value());
+}
+
+TEST(ValueColumnTest, MatchesAggregatingSlowly) {
+  std::mt19937_64 rng(0);
+  std::uniform_int_distribution<int64_t> integer(-1000000, 1000000);
+  std::uniform_int_distribution<int> real(-1000, 1000);
+  // Sizes around multiples of the kernels' lane counts.
+  for (int size : {0, 1, 7, 8, 9, 100, 1001}) {
+    ValueColumn column;
+    NumericAggregate expected;
+    for (int i = 0; i < size; ++i) {
+      // Quarters, so that sums are exact whatever the order.
+      const NumericValue value =
+          i % 3 == 0 ? NumericValue::Real(real(rng) / 4.0)
+                     : NumericValue::Integer(integer(rng));
+      column.Add(value);
+      ++expected.count;
+      expected.sum += value.ToDouble();
+      expected.min = std::min(expected.min, value.ToDouble());
+      expected.max = std::max(expected.max, value.ToDouble());
+    }
+    const NumericAggregate aggregate = column.Aggregate();
+    EXPECT_EQ(expected.count, aggregate.count) << size;
+    EXPECT_EQ(expected.sum, aggregate.sum) << size;
+    if (size > 0) {
+      EXPECT_EQ(expected.min, aggregate.min) << size;
+      EXPECT_EQ(expected.max, aggregate.max) << size;
+    }
+  }
+}
+
+TEST(ValueColumnTest, SumsIntegersExactly) {
+  // 2^53 + 1 isn't a double, but the sum of the integers is.
+  const std::vector<int64_t> values = {int64_t{1} << 53, 1, 1};
+  EXPECT_EQ(static_cast<double>((int64_t{1} << 53) + 2),
+            AggregateIntegers(values).sum);
+}
+
+}  // namespace
+}  // namespace stat_tracker
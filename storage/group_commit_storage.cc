@@ -0,0 +1,76 @@
+#include "storage/group_commit_storage.h"
+
+#include <vector>
+
+namespace storage {
+
+struct GroupCommitStorage::Writer {
+  leveldb::WriteBatch* batch;
+  bool sync;
+  bool done = false;
+  leveldb::Status status;
+  absl::CondVar cv;
+};
+
+bool GroupCommitStorage::GroupIsFull() const {
+  return queued_bytes_ >= options_.max_group_bytes;
+}
+
+leveldb::Status GroupCommitStorage::Write(const leveldb::WriteOptions& options,
+                                          leveldb::WriteBatch* batch) {
+  Writer writer;
+  writer.batch = batch;
+  writer.sync = options.sync;
+  const size_t batch_bytes = batch->ApproximateSize();
+
+  absl::MutexLock l(&mu_);
+  writers_.push_back(&writer);
+  queued_bytes_ += batch_bytes;
+  while (!writer.done && writers_.front() != &writer) writer.cv.Wait(&mu_);
+  if (writer.done) return writer.status;
+
+  if (writer.sync && options_.max_delay > absl::ZeroDuration()) {
+    mu_.AwaitWithDeadline(
+        absl::Condition(this, &GroupCommitStorage::GroupIsFull),
+        absl::Now() + options_.max_delay);
+  }
+
+  // Take in queued writers up to the size limit, always including this one.
+  std::vector<Writer*> group;
+  leveldb::WriteOptions group_options;
+  size_t group_bytes = 0;
+  for (Writer* member : writers_) {
+    const size_t member_bytes = member->batch->ApproximateSize();
+    if (!group.empty() &&
+        group_bytes + member_bytes > options_.max_group_bytes) {
+      break;
+    }
+    group.push_back(member);
+    group_bytes += member_bytes;
+    group_options.sync |= member->sync;
+  }
+  queued_bytes_ -= group_bytes;
+
+  leveldb::WriteBatch merged;
+  leveldb::WriteBatch* group_batch = batch;
+  if (group.size() > 1) {
+    for (const Writer* member : group) merged.Append(*member->batch);
+    group_batch = &merged;
+  }
+
+  // Later writers queue up behind this group while it is written.
+  mu_.Unlock();
+  const leveldb::Status status = storage_->Write(group_options, group_batch);
+  mu_.Lock();
+
+  for (Writer* member : group) {
+    writers_.pop_front();
+    member->status = status;
+    member->done = true;
+    if (member != &writer) member->cv.Signal();
+  }
+  if (!writers_.empty()) writers_.front()->cv.Signal();
+  return status;
+}
+
+}  // namespace storage
@@ -0,0 +1,81 @@
+#ifndef STORAGE_GROUP_COMMIT_STORAGE_H_
+#define STORAGE_GROUP_COMMIT_STORAGE_H_
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "storage/storage.h"
+
+namespace storage {
+
+// Merges concurrent writes into one write of the underlying storage, so that
+// many sync writes share a single fsync. Writers queue up; the first one in
+// the queue leads a group, writes the merged batches of the writers behind it
+// and returns the result to all of them. Every write of a group is synced if
+// any of them asks for it. Reads go straight to the underlying storage.
+class GroupCommitStorage : public StorageInterface {
+ public:
+  struct Options {
+    // How long the leader of a group that syncs waits for more writers to
+    // join it. Unsynced groups never wait; they only take in the writers
+    // that queued while the previous group was being written.
+    absl::Duration max_delay = absl::ZeroDuration();
+    // A group takes no more writers once its batch is this large, and stops
+    // waiting for them.
+    size_t max_group_bytes = 1 << 20;
+  };
+
+  GroupCommitStorage(std::shared_ptr<StorageInterface> storage,
+                     const Options& options)
+      : storage_(std::move(storage)), options_(options) {}
+
+  leveldb::Status Get(const leveldb::ReadOptions& options,
+                      const leveldb::Slice& key, std::string* value) override {
+    return storage_->Get(options, key, value);
+  }
+
+  std::unique_ptr<leveldb::Iterator> NewIterator(
+      const leveldb::ReadOptions& options) override {
+    return storage_->NewIterator(options);
+  }
+
+  // Returns once the group holding `batch` is written.
+  leveldb::Status Write(const leveldb::WriteOptions& options,
+                        leveldb::WriteBatch* batch) override;
+
+  const leveldb::Snapshot* GetSnapshot() override {
+    return storage_->GetSnapshot();
+  }
+  void ReleaseSnapshot(const leveldb::Snapshot* snapshot) override {
+    storage_->ReleaseSnapshot(snapshot);
+  }
+
+  void CompactRange(const leveldb::Slice* begin,
+                    const leveldb::Slice* end) override {
+    storage_->CompactRange(begin, end);
+  }
+
+  StorageInterface* storage() const { return storage_.get(); }
+
+ private:
+  struct Writer;
+
+  // Whether the queued writers fill a group. `mu_` must be held.
+  bool GroupIsFull() const;
+
+  const std::shared_ptr<StorageInterface> storage_;
+  const Options options_;
+
+  absl::Mutex mu_;
+  // The front writer leads the group being written.
+  std::deque<Writer*> writers_;
+  size_t queued_bytes_ = 0;
+};
+
+}  // namespace storage
+
+#endif  // STORAGE_GROUP_COMMIT_STORAGE_H_
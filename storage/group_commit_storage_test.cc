@@ -0,0 +1,119 @@
+#include "storage/group_commit_storage.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/time/clock.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "storage/in_memory_storage.h"
+#include "util/status_test_macros.h"
+
+namespace storage {
+namespace {
+
+// Counts the writes that reach InMemoryStorage, and fails them on request.
+class CountingStorage : public InMemoryStorage {
+ public:
+  leveldb::Status Write(const leveldb::WriteOptions& options,
+                        leveldb::WriteBatch* batch) override {
+    ++num_writes;
+    if (options.sync) ++num_syncs;
+    if (fail) return leveldb::Status::IOError("disk full");
+    return InMemoryStorage::Write(options, batch);
+  }
+
+  std::atomic<int> num_writes{0};
+  std::atomic<int> num_syncs{0};
+  bool fail = false;
+};
+
+constexpr int kNumWriters = 4;
+
+leveldb::WriteBatch BatchFor(int i) {
+  leveldb::WriteBatch batch;
+  batch.Put("key" + std::to_string(i), "value");
+  return batch;
+}
+
+class GroupCommitStorageTest : public ::testing::Test {
+ protected:
+  // Syncing leaders wait until kNumWriters batches are queued.
+  GroupCommitStorageTest() {
+    auto counting = std::make_shared<CountingStorage>();
+    counting_ = counting.get();
+    GroupCommitStorage::Options options;
+    options.max_delay = absl::Seconds(30);
+    options.max_group_bytes = kNumWriters * BatchFor(0).ApproximateSize();
+    storage_ = absl::make_unique<GroupCommitStorage>(counting, options);
+  }
+
+  // Writes one batch from each of kNumWriters threads and returns their
+  // results.
+  std::vector<leveldb::Status> WriteConcurrently(bool sync) {
+    std::vector<leveldb::Status> statuses(kNumWriters);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < kNumWriters; ++i) {
+      writers.emplace_back([this, i, sync, &statuses]() {
+        leveldb::WriteOptions options;
+        options.sync = sync;
+        leveldb::WriteBatch batch = BatchFor(i);
+        statuses[i] = storage_->Write(options, &batch);
+      });
+    }
+    for (std::thread& writer : writers) writer.join();
+    return statuses;
+  }
+
+  CountingStorage* counting_;
+  std::unique_ptr<GroupCommitStorage> storage_;
+};
+
+TEST_F(GroupCommitStorageTest, SyncWritesShareOneWrite) {
+  for (const leveldb::Status& status : WriteConcurrently(/*sync=*/true)) {
+    EXPECT_OK(status);
+  }
+  EXPECT_EQ(counting_->num_writes, 1);
+  EXPECT_EQ(counting_->num_syncs, 1);
+  std::string value;
+  for (int i = 0; i < kNumWriters; ++i) {
+    ASSERT_OK(storage_->Get(leveldb::ReadOptions(), "key" + std::to_string(i),
+                            &value));
+    EXPECT_EQ(value, "value");
+  }
+}
+
+TEST_F(GroupCommitStorageTest, UnsyncedWritesDontWait) {
+  const absl::Time start = absl::Now();
+  leveldb::WriteBatch batch = BatchFor(0);
+  ASSERT_OK(storage_->Write(leveldb::WriteOptions(), &batch));
+  EXPECT_LT(absl::Now() - start, absl::Seconds(10));
+  EXPECT_EQ(counting_->num_writes, 1);
+  EXPECT_EQ(counting_->num_syncs, 0);
+}
+
+TEST_F(GroupCommitStorageTest, EveryWriterGetsTheGroupsError) {
+  counting_->fail = true;
+  for (const leveldb::Status& status : WriteConcurrently(/*sync=*/true)) {
+    EXPECT_TRUE(status.IsIOError()) << status.ToString();
+  }
+  EXPECT_EQ(counting_->num_writes, 1);
+}
+
+TEST_F(GroupCommitStorageTest, ReadsSeeTheUnderlyingStorage) {
+  leveldb::WriteBatch batch = BatchFor(0);
+  ASSERT_OK(counting_->Write(leveldb::WriteOptions(), &batch));
+  std::string value;
+  ASSERT_OK(storage_->Get(leveldb::ReadOptions(), "key0", &value));
+  auto it = storage_->NewIterator(leveldb::ReadOptions());
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid());
+  EXPECT_EQ(it->key().ToString(), "key0");
+}
+
+}  // namespace
+}  // namespace storage
@@ -0,0 +1,268 @@
+#include "storage/in_memory_storage.h"
+
+#include "absl/memory/memory.h"
+
+namespace storage {
+
+struct InMemoryStorage::Node {
+  Node(const leveldb::Slice& key, uint64_t sequence, bool deleted,
+       const leveldb::Slice& value, int height)
+      : key(key.ToString()),
+        sequence(sequence),
+        deleted(deleted),
+        value(value.ToString()),
+        next(new std::atomic<Node*>[height]) {
+    for (int level = 0; level < height; ++level) {
+      next[level].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  Node* Next(int level) const {
+    return next[level].load(std::memory_order_acquire);
+  }
+
+  // Whether this node sorts before (key, sequence): keys ascend and the
+  // versions of a key go from newest to oldest.
+  bool Before(const leveldb::Slice& other_key, uint64_t other_sequence) const {
+    const int cmp = leveldb::Slice(key).compare(other_key);
+    return cmp < 0 || (cmp == 0 && sequence > other_sequence);
+  }
+
+  const std::string key;
+  const uint64_t sequence;
+  const bool deleted;
+  const std::string value;
+  std::unique_ptr<std::atomic<Node*>[]> next;
+};
+
+namespace {
+
+class SequenceSnapshot : public leveldb::Snapshot {
+ public:
+  explicit SequenceSnapshot(uint64_t sequence) : sequence(sequence) {}
+
+  const uint64_t sequence;
+};
+
+}  // namespace
+
+// Positioned on the newest version of a key visible at `sequence_`, skipping
+// keys whose visible version is a deletion.
+class InMemoryStorage::Iterator : public leveldb::Iterator {
+ public:
+  Iterator(const InMemoryStorage* storage, uint64_t sequence)
+      : storage_(storage), sequence_(sequence) {}
+
+  bool Valid() const override { return node_ != nullptr; }
+
+  void SeekToFirst() override {
+    node_ = SettleForward(storage_->head_->Next(0));
+  }
+
+  void SeekToLast() override {
+    Node* last = storage_->head_;
+    for (int level = storage_->max_height_.load(std::memory_order_relaxed) - 1;
+         level >= 0; --level) {
+      while (last->Next(level) != nullptr) last = last->Next(level);
+    }
+    node_ = last == storage_->head_ ? nullptr : SettleBackward(last->key);
+  }
+
+  void Seek(const leveldb::Slice& target) override {
+    node_ = SettleForward(
+        storage_->FindGreaterOrEqual(target, sequence_, nullptr));
+  }
+
+  void Next() override { node_ = SettleForward(SkipKey(node_)); }
+
+  void Prev() override {
+    Node* before = storage_->FindLessThan(node_->key);
+    node_ = before == storage_->head_ ? nullptr : SettleBackward(before->key);
+  }
+
+  leveldb::Slice key() const override { return node_->key; }
+  leveldb::Slice value() const override { return node_->value; }
+  leveldb::Status status() const override { return leveldb::Status::OK(); }
+
+ private:
+  static Node* SkipKey(Node* node) {
+    const std::string& key = node->key;
+    Node* next = node->Next(0);
+    while (next != nullptr && next->key == key) next = next->Next(0);
+    return next;
+  }
+
+  // `node` must be the first node of its key, or its first visible version.
+  Node* SettleForward(Node* node) const {
+    while (node != nullptr) {
+      if (node->sequence > sequence_) {
+        node = node->Next(0);
+      } else if (node->deleted) {
+        node = SkipKey(node);
+      } else {
+        return node;
+      }
+    }
+    return nullptr;
+  }
+
+  Node* SettleBackward(std::string key) const {
+    while (true) {
+      Node* visible = storage_->FindGreaterOrEqual(key, sequence_, nullptr);
+      if (visible != nullptr && visible->key == key && !visible->deleted) {
+        return visible;
+      }
+      Node* before = storage_->FindLessThan(key);
+      if (before == storage_->head_) return nullptr;
+      key = before->key;
+    }
+  }
+
+  const InMemoryStorage* const storage_;
+  const uint64_t sequence_;
+  Node* node_ = nullptr;
+};
+
+class InMemoryStorage::Inserter : public leveldb::WriteBatch::Handler {
+ public:
+  Inserter(InMemoryStorage* storage, uint64_t sequence)
+      : storage_(storage), sequence_(sequence) {}
+
+  void Put(const leveldb::Slice& key, const leveldb::Slice& value) override {
+    storage_->Insert(key, ++sequence_, false, value);
+  }
+
+  void Delete(const leveldb::Slice& key) override {
+    storage_->Insert(key, ++sequence_, true, leveldb::Slice());
+  }
+
+  uint64_t sequence() const { return sequence_; }
+
+ private:
+  InMemoryStorage* const storage_;
+  uint64_t sequence_;
+};
+
+InMemoryStorage::InMemoryStorage()
+    : head_(new Node(leveldb::Slice(), 0, false, leveldb::Slice(),
+                     kMaxHeight)),
+      max_height_(1),
+      last_sequence_(0),
+      random_state_(0x9e3779b97f4a7c15) {}
+
+InMemoryStorage::~InMemoryStorage() {
+  Node* node = head_;
+  while (node != nullptr) {
+    Node* next = node->Next(0);
+    delete node;
+    node = next;
+  }
+}
+
+uint64_t InMemoryStorage::SequenceFor(
+    const leveldb::ReadOptions& options) const {
+  if (options.snapshot != nullptr) {
+    return static_cast<const SequenceSnapshot*>(options.snapshot)->sequence;
+  }
+  return last_sequence_.load(std::memory_order_acquire);
+}
+
+InMemoryStorage::Node* InMemoryStorage::FindGreaterOrEqual(
+    const leveldb::Slice& key, uint64_t sequence, Node** prev) const {
+  Node* node = head_;
+  int level = max_height_.load(std::memory_order_relaxed) - 1;
+  while (true) {
+    Node* next = node->Next(level);
+    if (next != nullptr && next->Before(key, sequence)) {
+      node = next;
+    } else {
+      if (prev != nullptr) prev[level] = node;
+      if (level == 0) return next;
+      --level;
+    }
+  }
+}
+
+InMemoryStorage::Node* InMemoryStorage::FindLessThan(
+    const leveldb::Slice& key) const {
+  Node* node = head_;
+  int level = max_height_.load(std::memory_order_relaxed) - 1;
+  while (true) {
+    Node* next = node->Next(level);
+    if (next != nullptr && leveldb::Slice(next->key).compare(key) < 0) {
+      node = next;
+    } else {
+      if (level == 0) return node;
+      --level;
+    }
+  }
+}
+
+int InMemoryStorage::RandomHeight() {
+  int height = 1;
+  while (height < kMaxHeight) {
+    random_state_ ^= random_state_ << 13;
+    random_state_ ^= random_state_ >> 7;
+    random_state_ ^= random_state_ << 17;
+    if (random_state_ % 4 != 0) break;
+    ++height;
+  }
+  return height;
+}
+
+// Only called with write_mu_ held. Readers may be traversing concurrently, so
+// the node is fully built before the release stores that link it in.
+void InMemoryStorage::Insert(const leveldb::Slice& key, uint64_t sequence,
+                             bool deleted, const leveldb::Slice& value) {
+  Node* prev[kMaxHeight];
+  FindGreaterOrEqual(key, sequence, prev);
+  const int height = RandomHeight();
+  const int max_height = max_height_.load(std::memory_order_relaxed);
+  if (height > max_height) {
+    for (int level = max_height; level < height; ++level) prev[level] = head_;
+    max_height_.store(height, std::memory_order_relaxed);
+  }
+  Node* node = new Node(key, sequence, deleted, value, height);
+  for (int level = 0; level < height; ++level) {
+    node->next[level].store(prev[level]->Next(level),
+                            std::memory_order_relaxed);
+    prev[level]->next[level].store(node, std::memory_order_release);
+  }
+}
+
+leveldb::Status InMemoryStorage::Get(const leveldb::ReadOptions& options,
+                                     const leveldb::Slice& key,
+                                     std::string* value) {
+  const Node* node = FindGreaterOrEqual(key, SequenceFor(options), nullptr);
+  if (node == nullptr || leveldb::Slice(node->key) != key || node->deleted) {
+    return leveldb::Status::NotFound(key);
+  }
+  *value = node->value;
+  return leveldb::Status::OK();
+}
+
+std::unique_ptr<leveldb::Iterator> InMemoryStorage::NewIterator(
+    const leveldb::ReadOptions& options) {
+  return absl::make_unique<Iterator>(this, SequenceFor(options));
+}
+
+leveldb::Status InMemoryStorage::Write(const leveldb::WriteOptions& options,
+                                       leveldb::WriteBatch* batch) {
+  absl::MutexLock lock(&write_mu_);
+  Inserter inserter(this, last_sequence_.load(std::memory_order_relaxed));
+  const leveldb::Status status = batch->Iterate(&inserter);
+  // Iterate only fails on a malformed batch. Its applied prefix is published
+  // anyway so that sequence numbers are never reused.
+  last_sequence_.store(inserter.sequence(), std::memory_order_release);
+  return status;
+}
+
+const leveldb::Snapshot* InMemoryStorage::GetSnapshot() {
+  return new SequenceSnapshot(last_sequence_.load(std::memory_order_acquire));
+}
+
+void InMemoryStorage::ReleaseSnapshot(const leveldb::Snapshot* snapshot) {
+  delete static_cast<const SequenceSnapshot*>(snapshot);
+}
+
+}  // namespace storage
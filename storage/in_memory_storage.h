@@ -0,0 +1,75 @@
+#ifndef STORAGE_IN_MEMORY_STORAGE_H_
+#define STORAGE_IN_MEMORY_STORAGE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/synchronization/mutex.h"
+#include "storage/storage.h"
+
+namespace storage {
+
+// A multi-version skip list, in the manner of leveldb's memtable: every write
+// inserts a node tagged with a sequence number and nothing is ever removed,
+// so reads traverse it without locks while writers serialize on a mutex.
+// Publishing a batch's last sequence number makes the whole batch visible at
+// once, and a snapshot is just a sequence number.
+//
+// Memory grows with every write, overwritten or not, so this is meant for
+// tests and for profiling the service without an engine's I/O.
+class InMemoryStorage : public StorageInterface {
+ public:
+  InMemoryStorage();
+  ~InMemoryStorage() override;
+
+  leveldb::Status Get(const leveldb::ReadOptions& options,
+                      const leveldb::Slice& key, std::string* value) override;
+
+  std::unique_ptr<leveldb::Iterator> NewIterator(
+      const leveldb::ReadOptions& options) override;
+
+  leveldb::Status Write(const leveldb::WriteOptions& options,
+                        leveldb::WriteBatch* batch) override;
+
+  const leveldb::Snapshot* GetSnapshot() override;
+  void ReleaseSnapshot(const leveldb::Snapshot* snapshot) override;
+
+  // Nothing is ever removed, so there's nothing to reclaim.
+  void CompactRange(const leveldb::Slice* begin,
+                    const leveldb::Slice* end) override {}
+
+ private:
+  struct Node;
+  class Iterator;
+  class Inserter;
+
+  static constexpr int kMaxHeight = 12;
+
+  uint64_t SequenceFor(const leveldb::ReadOptions& options) const;
+
+  // First node at or after (key, sequence), in order of increasing key and
+  // then decreasing sequence, and with `prev` set to the last node before it
+  // at each level if not null.
+  Node* FindGreaterOrEqual(const leveldb::Slice& key, uint64_t sequence,
+                           Node** prev) const;
+  // Last node with a key less than `key`, or head_.
+  Node* FindLessThan(const leveldb::Slice& key) const;
+
+  void Insert(const leveldb::Slice& key, uint64_t sequence, bool deleted,
+              const leveldb::Slice& value);
+  int RandomHeight();
+
+  Node* const head_;
+  std::atomic<int> max_height_;
+  // Highest sequence number whose batch is fully inserted.
+  std::atomic<uint64_t> last_sequence_;
+
+  absl::Mutex write_mu_;
+  uint64_t random_state_;
+};
+
+}  // namespace storage
+
+#endif  // STORAGE_IN_MEMORY_STORAGE_H_
@@ -0,0 +1,66 @@
+#include "storage/leveldb_storage.h"
+
+#include "absl/memory/memory.h"
+#include "glog/logging.h"
+#include "leveldb/helpers/memenv.h"
+
+namespace storage {
+
+namespace {
+
+util::StatusOr<leveldb::Status, std::unique_ptr<leveldb::DB>> OpenDb(
+    leveldb::Env* env, const std::string& path) {
+  leveldb::Options options;
+  options.create_if_missing = true;
+  if (env != nullptr) options.env = env;
+  leveldb::DB* db;
+  RETURN_IF_ERROR(leveldb::DB::Open(options, path, &db));
+  return absl::WrapUnique(db);
+}
+
+}  // namespace
+
+util::StatusOr<leveldb::Status, std::unique_ptr<LevelDbStorage>>
+LevelDbStorage::Open(const std::string& path) {
+  LOG(INFO) << "opening leveldb path: " << path;
+  ASSIGN_OR_RETURN(std::unique_ptr<leveldb::DB> db, OpenDb(nullptr, path));
+  return absl::make_unique<LevelDbStorage>(std::move(db));
+}
+
+util::StatusOr<leveldb::Status, std::unique_ptr<LevelDbStorage>>
+LevelDbStorage::OpenInMemory() {
+  auto env = absl::WrapUnique(leveldb::NewMemEnv(leveldb::Env::Default()));
+  ASSIGN_OR_RETURN(std::unique_ptr<leveldb::DB> db, OpenDb(env.get(), "/mem"));
+  return absl::WrapUnique(new LevelDbStorage(std::move(env), std::move(db)));
+}
+
+leveldb::Status LevelDbStorage::Get(const leveldb::ReadOptions& options,
+                                    const leveldb::Slice& key,
+                                    std::string* value) {
+  return db_->Get(options, key, value);
+}
+
+std::unique_ptr<leveldb::Iterator> LevelDbStorage::NewIterator(
+    const leveldb::ReadOptions& options) {
+  return absl::WrapUnique(db_->NewIterator(options));
+}
+
+leveldb::Status LevelDbStorage::Write(const leveldb::WriteOptions& options,
+                                      leveldb::WriteBatch* batch) {
+  return db_->Write(options, batch);
+}
+
+const leveldb::Snapshot* LevelDbStorage::GetSnapshot() {
+  return db_->GetSnapshot();
+}
+
+void LevelDbStorage::ReleaseSnapshot(const leveldb::Snapshot* snapshot) {
+  db_->ReleaseSnapshot(snapshot);
+}
+
+void LevelDbStorage::CompactRange(const leveldb::Slice* begin,
+                                  const leveldb::Slice* end) {
+  db_->CompactRange(begin, end);
+}
+
+}  // namespace storage
@@ -0,0 +1,56 @@
+#ifndef STORAGE_LEVELDB_STORAGE_H_
+#define STORAGE_LEVELDB_STORAGE_H_
+
+#include <memory>
+#include <string>
+
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "storage/storage.h"
+#include "util/status.h"
+
+namespace storage {
+
+class LevelDbStorage : public StorageInterface {
+ public:
+  // Opens, creating if missing, the database at `path`.
+  static util::StatusOr<leveldb::Status, std::unique_ptr<LevelDbStorage>> Open(
+      const std::string& path);
+
+  // Opens an empty database kept in memory by leveldb's NewMemEnv.
+  static util::StatusOr<leveldb::Status, std::unique_ptr<LevelDbStorage>>
+  OpenInMemory();
+
+  explicit LevelDbStorage(std::unique_ptr<leveldb::DB> db)
+      : LevelDbStorage(nullptr, std::move(db)) {}
+
+  leveldb::Status Get(const leveldb::ReadOptions& options,
+                      const leveldb::Slice& key, std::string* value) override;
+
+  std::unique_ptr<leveldb::Iterator> NewIterator(
+      const leveldb::ReadOptions& options) override;
+
+  leveldb::Status Write(const leveldb::WriteOptions& options,
+                        leveldb::WriteBatch* batch) override;
+
+  const leveldb::Snapshot* GetSnapshot() override;
+  void ReleaseSnapshot(const leveldb::Snapshot* snapshot) override;
+
+  void CompactRange(const leveldb::Slice* begin,
+                    const leveldb::Slice* end) override;
+
+  leveldb::DB* db() const { return db_.get(); }
+
+ private:
+  LevelDbStorage(std::unique_ptr<leveldb::Env> env,
+                 std::unique_ptr<leveldb::DB> db)
+      : env_(std::move(env)), db_(std::move(db)) {}
+
+  // Declared first so that it outlives the database using it.
+  std::unique_ptr<leveldb::Env> env_;
+  std::unique_ptr<leveldb::DB> db_;
+};
+
+}  // namespace storage
+
+#endif  // STORAGE_LEVELDB_STORAGE_H_
@@ -0,0 +1,51 @@
+#include "storage/storage.h"
+
+#include "absl/memory/memory.h"
+#include "storage/in_memory_storage.h"
+#include "storage/leveldb_storage.h"
+
+namespace storage {
+
+bool ParseBackend(absl::string_view name, Backend* backend) {
+  for (Backend candidate :
+       {Backend::kLevelDb, Backend::kLevelDbMemEnv, Backend::kInMemory}) {
+    if (name == BackendName(candidate)) {
+      *backend = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+absl::string_view BackendName(Backend backend) {
+  switch (backend) {
+    case Backend::kLevelDb:
+      return "leveldb";
+    case Backend::kLevelDbMemEnv:
+      return "leveldb_memenv";
+    case Backend::kInMemory:
+      return "in_memory";
+  }
+  return "unknown";
+}
+
+util::StatusOr<leveldb::Status, std::unique_ptr<StorageInterface>> OpenStorage(
+    Backend backend, const std::string& path) {
+  std::unique_ptr<StorageInterface> storage;
+  switch (backend) {
+    case Backend::kLevelDb: {
+      ASSIGN_OR_RETURN(storage, LevelDbStorage::Open(path));
+      break;
+    }
+    case Backend::kLevelDbMemEnv: {
+      ASSIGN_OR_RETURN(storage, LevelDbStorage::OpenInMemory());
+      break;
+    }
+    case Backend::kInMemory:
+      storage = absl::make_unique<InMemoryStorage>();
+      break;
+  }
+  return storage;
+}
+
+}  // namespace storage
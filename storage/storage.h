@@ -0,0 +1,92 @@
+#ifndef STORAGE_STORAGE_H_
+#define STORAGE_STORAGE_H_
+
+#include <memory>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "leveldb/db.h"
+#include "leveldb/iterator.h"
+#include "leveldb/options.h"
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+#include "leveldb/write_batch.h"
+#include "util/status.h"
+
+namespace storage {
+
+// A sorted key-value store with atomic batches and point-in-time snapshots.
+// It borrows leveldb's vocabulary types, so every engine is ordered bytewise,
+// reports leveldb::Status and takes a leveldb::WriteBatch, and any of them can
+// serve a database written by another.
+class StorageInterface {
+ public:
+  StorageInterface() = default;
+  virtual ~StorageInterface() = default;
+
+  StorageInterface(const StorageInterface&) = delete;
+  StorageInterface& operator=(const StorageInterface&) = delete;
+
+  // Returns NotFound if there's no value for `key`.
+  virtual leveldb::Status Get(const leveldb::ReadOptions& options,
+                              const leveldb::Slice& key,
+                              std::string* value) = 0;
+
+  virtual std::unique_ptr<leveldb::Iterator> NewIterator(
+      const leveldb::ReadOptions& options) = 0;
+
+  // Applies every update in `batch` or none of them.
+  virtual leveldb::Status Write(const leveldb::WriteOptions& options,
+                                leveldb::WriteBatch* batch) = 0;
+
+  // Snapshots are passed in ReadOptions::snapshot and must be released.
+  virtual const leveldb::Snapshot* GetSnapshot() = 0;
+  virtual void ReleaseSnapshot(const leveldb::Snapshot* snapshot) = 0;
+
+  // Reclaims the space of deleted and overwritten keys in [*begin, *end),
+  // where a null bound is open, so that reads stop skipping over them. May
+  // take long; a hint that does nothing on engines without compactions.
+  virtual void CompactRange(const leveldb::Slice* begin,
+                            const leveldb::Slice* end) = 0;
+};
+
+// Holds a snapshot of `storage` for as long as it lives.
+class ScopedSnapshot {
+ public:
+  explicit ScopedSnapshot(StorageInterface* storage)
+      : storage_(storage), snapshot_(storage->GetSnapshot()) {}
+  ~ScopedSnapshot() { storage_->ReleaseSnapshot(snapshot_); }
+
+  ScopedSnapshot(const ScopedSnapshot&) = delete;
+  ScopedSnapshot& operator=(const ScopedSnapshot&) = delete;
+
+  leveldb::ReadOptions read_options() const {
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot_;
+    return options;
+  }
+
+ private:
+  StorageInterface* const storage_;
+  const leveldb::Snapshot* const snapshot_;
+};
+
+enum class Backend {
+  kLevelDb,
+  // leveldb on an in-memory leveldb::Env: the engine's CPU cost, no I/O.
+  kLevelDbMemEnv,
+  // InMemoryStorage.
+  kInMemory,
+};
+
+// Accepts "leveldb", "leveldb_memenv" and "in_memory".
+bool ParseBackend(absl::string_view name, Backend* backend);
+absl::string_view BackendName(Backend backend);
+
+// `path` is ignored by the in-memory backends.
+util::StatusOr<leveldb::Status, std::unique_ptr<StorageInterface>> OpenStorage(
+    Backend backend, const std::string& path);
+
+}  // namespace storage
+
+#endif  // STORAGE_STORAGE_H_
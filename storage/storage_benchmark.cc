@@ -0,0 +1,141 @@
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "leveldb/write_batch.h"
+#include "storage/group_commit_storage.h"
+#include "storage/storage.h"
+#include "storage/testing/leveldb.h"
+
+// Every benchmark takes the backend as its first argument, so that engine
+// costs can be compared with each other and with the service benchmarks.
+
+namespace {
+
+constexpr int kNumKeys = 10000;
+
+storage::Backend BackendArg(const benchmark::State& state) {
+  return static_cast<storage::Backend>(state.range(0));
+}
+
+std::string KeyFor(int i) {
+  char key[16];
+  std::snprintf(key, sizeof(key), "key%08d", i);
+  return key;
+}
+
+void Fill(storage::StorageInterface* storage) {
+  leveldb::WriteBatch batch;
+  for (int i = 0; i < kNumKeys; ++i) {
+    batch.Put(KeyFor(i), std::string(100, 'v'));
+  }
+  storage->Write(leveldb::WriteOptions(), &batch);
+}
+
+void AllBackends(benchmark::internal::Benchmark* benchmark) {
+  for (storage::Backend backend :
+       {storage::Backend::kLevelDb, storage::Backend::kLevelDbMemEnv,
+        storage::Backend::kInMemory}) {
+    benchmark->Arg(static_cast<int>(backend));
+  }
+}
+
+}  // namespace
+
+static void BM_Write(benchmark::State& state) {
+  storage::LevelDbTestEnvironment env("storage_benchmark.leveldb",
+                                      BackendArg(state));
+  const std::string value(100, 'v');
+  int i = 0;
+  for (auto _ : state) {
+    leveldb::WriteBatch batch;
+    batch.Put(KeyFor(i++ % kNumKeys), value);
+    env.db()->Write(leveldb::WriteOptions(), &batch);
+  }
+  state.SetLabel(std::string(storage::BackendName(BackendArg(state))));
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Write)->Apply(AllBackends);
+
+static void BM_Get(benchmark::State& state) {
+  storage::LevelDbTestEnvironment env("storage_benchmark.leveldb",
+                                      BackendArg(state));
+  Fill(env.db().get());
+  std::string value;
+  int i = 0;
+  for (auto _ : state) {
+    env.db()->Get(leveldb::ReadOptions(), KeyFor(i++ * 7919 % kNumKeys),
+                  &value);
+    benchmark::DoNotOptimize(value.data());
+  }
+  state.SetLabel(std::string(storage::BackendName(BackendArg(state))));
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Get)->Apply(AllBackends);
+
+// Scans of 100 consecutive keys, the shape of a posting or event prefix read.
+static void BM_PrefixScan(benchmark::State& state) {
+  storage::LevelDbTestEnvironment env("storage_benchmark.leveldb",
+                                      BackendArg(state));
+  Fill(env.db().get());
+  int64_t num_rows = 0;
+  int i = 0;
+  for (auto _ : state) {
+    const std::string prefix = KeyFor(i++ * 100 % kNumKeys).substr(0, 9);
+    auto it = env.db()->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+      benchmark::DoNotOptimize(it->value().data());
+      ++num_rows;
+    }
+  }
+  state.SetLabel(std::string(storage::BackendName(BackendArg(state))));
+  state.SetItemsProcessed(num_rows);
+}
+BENCHMARK(BM_PrefixScan)->Apply(AllBackends);
+
+// Synced writes from concurrent requests on leveldb, written directly (0) or
+// through GroupCommitStorage with the argument as its delay in microseconds.
+static void BM_ConcurrentSyncWrite(benchmark::State& state) {
+  static std::unique_ptr<storage::LevelDbTestEnvironment> env;
+  static std::unique_ptr<storage::GroupCommitStorage> group_commit;
+  if (state.thread_index() == 0) {
+    env = absl::make_unique<storage::LevelDbTestEnvironment>(
+        "storage_benchmark.leveldb", storage::Backend::kLevelDb);
+    if (state.range(0) > 0) {
+      storage::GroupCommitStorage::Options options;
+      options.max_delay = absl::Microseconds(state.range(0));
+      group_commit =
+          absl::make_unique<storage::GroupCommitStorage>(env->db(), options);
+    }
+  }
+  leveldb::WriteOptions options;
+  options.sync = true;
+  const std::string value(100, 'v');
+  storage::StorageInterface* storage = nullptr;
+  int i = state.thread_index();
+  for (auto _ : state) {
+    if (storage == nullptr) {
+      storage = group_commit != nullptr ? group_commit.get() : env->db().get();
+    }
+    leveldb::WriteBatch batch;
+    batch.Put(KeyFor(i % kNumKeys), value);
+    i += state.threads();
+    storage->Write(options, &batch);
+  }
+  if (state.thread_index() == 0) {
+    group_commit.reset();
+    env.reset();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ConcurrentSyncWrite)
+    ->Arg(0)
+    ->Arg(100)
+    ->Arg(1000)
+    ->Threads(16)
+    ->UseRealTime();
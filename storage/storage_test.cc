@@ -0,0 +1,178 @@
+#include "storage/storage.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+#include "storage/testing/leveldb.h"
+#include "util/status_test_macros.h"
+
+namespace storage {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Pair;
+
+class StorageTest : public ::testing::TestWithParam<Backend> {
+ protected:
+  StorageTest() : env_("storage_test.leveldb", GetParam()) {}
+
+  leveldb::Status Write(
+      const std::vector<std::pair<std::string, std::string>>& puts,
+      const std::vector<std::string>& deletes = {}) {
+    leveldb::WriteBatch batch;
+    for (const auto& put : puts) batch.Put(put.first, put.second);
+    for (const std::string& key : deletes) batch.Delete(key);
+    return env_.db()->Write(leveldb::WriteOptions(), &batch);
+  }
+
+  std::vector<std::pair<std::string, std::string>> Scan(
+      const leveldb::ReadOptions& options = leveldb::ReadOptions()) {
+    std::vector<std::pair<std::string, std::string>> rows;
+    auto it = env_.db()->NewIterator(options);
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      rows.emplace_back(it->key().ToString(), it->value().ToString());
+    }
+    EXPECT_OK(it->status());
+    return rows;
+  }
+
+  LevelDbTestEnvironment env_;
+};
+
+TEST_P(StorageTest, GetMissing) {
+  std::string value;
+  EXPECT_TRUE(env_.db()
+                  ->Get(leveldb::ReadOptions(), "missing", &value)
+                  .IsNotFound());
+}
+
+TEST_P(StorageTest, WriteThenGet) {
+  ASSERT_OK(Write({{"a", "1"}, {"b", "2"}}));
+  ASSERT_OK(Write({{"a", "3"}}, {"b"}));
+  std::string value;
+  ASSERT_OK(env_.db()->Get(leveldb::ReadOptions(), "a", &value));
+  EXPECT_EQ(value, "3");
+  EXPECT_TRUE(
+      env_.db()->Get(leveldb::ReadOptions(), "b", &value).IsNotFound());
+}
+
+TEST_P(StorageTest, IteratesInBytewiseOrder) {
+  ASSERT_OK(Write({{std::string("\x01\x02", 2), "x"},
+                   {std::string("\x00\xff", 2), "y"},
+                   {"\xff", "z"},
+                   {std::string("\x01", 1), "w"}}));
+  ASSERT_OK(Write({}, {"\xff"}));
+  EXPECT_THAT(Scan(), ElementsAre(Pair(std::string("\x00\xff", 2), "y"),
+                                  Pair("\x01", "w"),
+                                  Pair(std::string("\x01\x02", 2), "x")));
+}
+
+TEST_P(StorageTest, SeekAndPrev) {
+  ASSERT_OK(Write({{"a", "1"}, {"c", "3"}, {"e", "5"}}));
+  ASSERT_OK(Write({}, {"c"}));
+  auto it = env_.db()->NewIterator(leveldb::ReadOptions());
+  it->Seek("b");
+  ASSERT_TRUE(it->Valid());
+  EXPECT_EQ(it->key().ToString(), "e");
+  it->Prev();
+  ASSERT_TRUE(it->Valid());
+  EXPECT_EQ(it->key().ToString(), "a");
+  it->Prev();
+  EXPECT_FALSE(it->Valid());
+  it->SeekToLast();
+  ASSERT_TRUE(it->Valid());
+  EXPECT_EQ(it->key().ToString(), "e");
+  it->Seek("f");
+  EXPECT_FALSE(it->Valid());
+}
+
+TEST_P(StorageTest, SnapshotIsolation) {
+  ASSERT_OK(Write({{"a", "1"}, {"b", "2"}}));
+  const leveldb::Snapshot* snapshot = env_.db()->GetSnapshot();
+  ASSERT_OK(Write({{"a", "changed"}, {"c", "new"}}, {"b"}));
+
+  leveldb::ReadOptions at_snapshot;
+  at_snapshot.snapshot = snapshot;
+  std::string value;
+  ASSERT_OK(env_.db()->Get(at_snapshot, "a", &value));
+  EXPECT_EQ(value, "1");
+  EXPECT_THAT(Scan(at_snapshot), ElementsAre(Pair("a", "1"), Pair("b", "2")));
+  EXPECT_THAT(Scan(), ElementsAre(Pair("a", "changed"), Pair("c", "new")));
+  env_.db()->ReleaseSnapshot(snapshot);
+}
+
+TEST_P(StorageTest, ScopedSnapshot) {
+  ASSERT_OK(Write({{"a", "1"}}));
+  const ScopedSnapshot snapshot(env_.db().get());
+  ASSERT_OK(Write({{"a", "2"}}));
+
+  std::string value;
+  ASSERT_OK(env_.db()->Get(snapshot.read_options(), "a", &value));
+  EXPECT_EQ(value, "1");
+  EXPECT_THAT(Scan(snapshot.read_options()), ElementsAre(Pair("a", "1")));
+}
+
+TEST_P(StorageTest, ReadersSeeWholeBatches) {
+  constexpr int kNumWrites = 2000;
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    for (int i = 0; i < kNumWrites; ++i) {
+      const std::string value = std::to_string(i);
+      Write({{"a", value}, {"b", value}});
+    }
+    done = true;
+  });
+  while (!done) {
+    const leveldb::Snapshot* snapshot = env_.db()->GetSnapshot();
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot;
+    std::string a, b;
+    const bool has_a = env_.db()->Get(options, "a", &a).ok();
+    const bool has_b = env_.db()->Get(options, "b", &b).ok();
+    env_.db()->ReleaseSnapshot(snapshot);
+    ASSERT_EQ(has_a, has_b);
+    ASSERT_EQ(a, b);
+  }
+  writer.join();
+}
+
+TEST_P(StorageTest, EmptyBatch) {
+  leveldb::WriteBatch batch;
+  ASSERT_OK(env_.db()->Write(leveldb::WriteOptions(), &batch));
+  EXPECT_THAT(Scan(), IsEmpty());
+}
+
+TEST_P(StorageTest, CompactRangeKeepsLiveKeys) {
+  ASSERT_OK(Write({{"a", "1"}, {"b", "2"}, {"c", "3"}}));
+  ASSERT_OK(Write({{"b", "4"}}, {"a"}));
+  const leveldb::Slice begin("a"), end("c");
+  env_.db()->CompactRange(&begin, &end);
+  env_.db()->CompactRange(nullptr, nullptr);
+  EXPECT_THAT(Scan(), ElementsAre(Pair("b", "4"), Pair("c", "3")));
+}
+
+INSTANTIATE_TEST_SUITE_P(AllBackends, StorageTest,
+                         ::testing::Values(Backend::kLevelDb,
+                                           Backend::kLevelDbMemEnv,
+                                           Backend::kInMemory),
+                         [](const ::testing::TestParamInfo<Backend>& info) {
+                           return std::string(BackendName(info.param));
+                         });
+
+TEST(BackendTest, ParseBackend) {
+  Backend backend;
+  ASSERT_TRUE(ParseBackend("in_memory", &backend));
+  EXPECT_EQ(backend, Backend::kInMemory);
+  ASSERT_TRUE(ParseBackend("leveldb_memenv", &backend));
+  EXPECT_EQ(backend, Backend::kLevelDbMemEnv);
+  EXPECT_FALSE(ParseBackend("rocksdb", &backend));
+}
+
+}  // namespace
+}  // namespace storage
@@ -7,35 +7,37 @@
 #include "absl/strings/str_cat.h"
 #include "glog/logging.h"
 #include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+#include "storage/leveldb_storage.h"
 
 namespace storage {
 
 namespace {
 
+// Benchmarks run outside of the test runner, without TEST_TMPDIR.
 absl::string_view GetTestTmpDir() {
-  return absl::string_view(std::getenv("TEST_TMPDIR"));
+  const char* test_tmpdir = std::getenv("TEST_TMPDIR");
+  return test_tmpdir != nullptr ? test_tmpdir : "/tmp";
 }
 
-util::StatusOr<leveldb::Status, std::unique_ptr<leveldb::DB>> OpenTestDb(
-    absl::string_view path) {
-  leveldb::Options options;
-  options.create_if_missing = true;
-
-  LOG(INFO) << "leveldb path: " << path;
-  leveldb::DB* db;
-  RETURN_IF_ERROR(leveldb::DB::Open(options, std::string(path), &db));
-  return absl::WrapUnique(db);
+util::StatusOr<leveldb::Status, std::unique_ptr<StorageInterface>>
+OpenTestDb(absl::string_view path, Backend backend) {
+  LOG(INFO) << BackendName(backend) << " path: " << path;
+  return OpenStorage(backend, std::string(path));
 }
 
 }  // namespace
 
-LevelDbTestEnvironment::LevelDbTestEnvironment(absl::string_view relative_path)
+LevelDbTestEnvironment::LevelDbTestEnvironment(absl::string_view relative_path,
+                                               Backend backend)
     : path_(absl::StrCat(GetTestTmpDir(), "/", relative_path)),
-      db_(OpenTestDb(path_).ValueOrDie()) {}
+      backend_(backend),
+      db_(OpenTestDb(path_, backend).ValueOrDie()) {}
 
 LevelDbTestEnvironment::~LevelDbTestEnvironment() {
   DumpContentsToInfoLogs();
   db_.reset();
+  if (backend_ != Backend::kLevelDb) return;
   const auto status = leveldb::DestroyDB(path_, leveldb::Options());
   CHECK(status.ok()) << status.ToString();
 }
@@ -43,15 +45,17 @@ LevelDbTestEnvironment::~LevelDbTestEnvironment() {
 void LevelDbTestEnvironment::DumpContentsToInfoLogs() {
   LOG(INFO) << "Dumping contents of " << path_;
 
+  auto* leveldb_storage = dynamic_cast<LevelDbStorage*>(db_.get());
   for (const std::string property : {"leveldb.stats", "leveldb.sstables",
                                      "leveldb.approximate-memory-usage"}) {
     std::string info_str;
-    if (db_->GetProperty(property, &info_str)) {
+    if (leveldb_storage != nullptr &&
+        leveldb_storage->db()->GetProperty(property, &info_str)) {
       LOG(INFO) << property << ": " << info_str;
     }
   }
 
-  auto it = absl::WrapUnique(db_->NewIterator(leveldb::ReadOptions()));
+  auto it = db_->NewIterator(leveldb::ReadOptions());
   if (it == nullptr) return;
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
     LOG(INFO) << absl::CHexEscape(it->key().ToString()) << " = "
@@ -71,14 +75,18 @@ leveldb::Status LevelDbTestEnvironment::Put(absl::string_view key,
                                             absl::string_view value) {
   leveldb::WriteOptions options;
   options.sync = true;
-  return db_->Put(options, leveldb::Slice(key.data(), key.size()),
-                  std::string(value));
+  leveldb::WriteBatch batch;
+  batch.Put(leveldb::Slice(key.data(), key.size()),
+            leveldb::Slice(value.data(), value.size()));
+  return db_->Write(options, &batch);
 }
 
 leveldb::Status LevelDbTestEnvironment::Delete(absl::string_view key) {
   leveldb::WriteOptions options;
   options.sync = true;
-  return db_->Delete(options, leveldb::Slice(key.data(), key.size()));
+  leveldb::WriteBatch batch;
+  batch.Delete(leveldb::Slice(key.data(), key.size()));
+  return db_->Write(options, &batch);
 }
 
 }  // namespace storage
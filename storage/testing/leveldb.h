@@ -5,15 +5,18 @@
 #include <string>
 
 #include "absl/strings/string_view.h"
-#include "leveldb/db.h"
 #include "leveldb/status.h"
+#include "storage/storage.h"
 #include "util/status.h"
 
 namespace storage {
 
 class LevelDbTestEnvironment {
  public:
-  explicit LevelDbTestEnvironment(absl::string_view relative_path);
+  // On-disk backends live at `relative_path` under TEST_TMPDIR and are
+  // destroyed along with the environment.
+  explicit LevelDbTestEnvironment(absl::string_view relative_path,
+                                  Backend backend = Backend::kLevelDb);
 
   ~LevelDbTestEnvironment();
 
@@ -23,11 +26,13 @@ class LevelDbTestEnvironment {
   leveldb::Status Put(absl::string_view key, absl::string_view value);
   leveldb::Status Delete(absl::string_view key);
 
-  std::shared_ptr<leveldb::DB> db() const { return db_; }
+  std::shared_ptr<StorageInterface> db() const { return db_; }
+  Backend backend() const { return backend_; }
 
  private:
   const std::string path_;
-  std::shared_ptr<leveldb::DB> db_;
+  const Backend backend_;
+  std::shared_ptr<StorageInterface> db_;
 };
 
 }  // namespace storage
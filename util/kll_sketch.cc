@@ -0,0 +1,177 @@
+#include "util/kll_sketch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include "util/varint.h"
+
+namespace util {
+
+namespace {
+
+constexpr size_t kMinCapacity = 2;
+
+void PutDouble(double value, std::string* dst) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  char buf[8];
+  for (int i = 0; i < 8; ++i) {
+    buf[i] = static_cast<char>(bits & 0xff);
+    bits >>= 8;
+  }
+  dst->append(buf, 8);
+}
+
+}  // namespace
+
+constexpr int KllSketch::kDefaultK;
+
+KllSketch::KllSketch(int k) : k_(k), levels_(1) {}
+
+size_t KllSketch::Capacity(size_t h) const {
+  const size_t depth = levels_.size() - 1 - h;
+  return std::max(kMinCapacity, static_cast<size_t>(std::ceil(
+                                    k_ * std::pow(2.0 / 3.0, depth))));
+}
+
+void KllSketch::Add(double value) {
+  levels_[0].push_back(value);
+  ++size_;
+  ++count_;
+  Compress();
+}
+
+void KllSketch::Merge(const KllSketch& other) {
+  if (other.levels_.size() > levels_.size()) {
+    levels_.resize(other.levels_.size());
+  }
+  for (size_t h = 0; h < other.levels_.size(); ++h) {
+    levels_[h].insert(levels_[h].end(), other.levels_[h].begin(),
+                      other.levels_[h].end());
+  }
+  size_ += other.size_;
+  count_ += other.count_;
+  Compress();
+}
+
+void KllSketch::Compress() {
+  for (;;) {
+    size_t capacity = 0;
+    for (size_t h = 0; h < levels_.size(); ++h) capacity += Capacity(h);
+    if (size_ <= capacity) return;
+
+    // Some level must be over its capacity.
+    size_t h = 0;
+    while (levels_[h].size() < Capacity(h)) ++h;
+    if (h + 1 == levels_.size()) levels_.emplace_back();
+    std::vector<double>& level = levels_[h];
+    std::vector<double>& next = levels_[h + 1];
+    std::sort(level.begin(), level.end());
+    // The smallest item stays behind if there's an odd one out, and one item
+    // of each pair of the rest is promoted.
+    const size_t odd = level.size() % 2;
+    for (size_t i = odd + (compactions_ & 1); i < level.size(); i += 2) {
+      next.push_back(level[i]);
+    }
+    ++compactions_;
+    size_ -= (level.size() - odd) / 2;
+    level.resize(odd);
+  }
+}
+
+int64_t KllSketch::Rank(double value) const {
+  int64_t rank = 0;
+  for (size_t h = 0; h < levels_.size(); ++h) {
+    for (double item : levels_[h]) {
+      if (item <= value) rank += int64_t{1} << h;
+    }
+  }
+  return rank;
+}
+
+double KllSketch::Quantile(double q) const {
+  return Quantile(*this, KllSketch(k_), q);
+}
+
+double KllSketch::Quantile(const KllSketch& added, const KllSketch& removed,
+                           double q) {
+  std::vector<std::pair<double, int64_t>> items;
+  items.reserve(added.size_ + removed.size_);
+  for (size_t h = 0; h < added.levels_.size(); ++h) {
+    for (double item : added.levels_[h]) {
+      items.emplace_back(item, int64_t{1} << h);
+    }
+  }
+  for (size_t h = 0; h < removed.levels_.size(); ++h) {
+    for (double item : removed.levels_[h]) {
+      items.emplace_back(item, -(int64_t{1} << h));
+    }
+  }
+  if (items.empty()) return std::numeric_limits<double>::quiet_NaN();
+  std::sort(items.begin(), items.end());
+
+  const int64_t count = added.count_ - removed.count_;
+  const int64_t target = std::max<int64_t>(
+      1, static_cast<int64_t>(std::ceil(q * static_cast<double>(count))));
+  int64_t rank = 0;
+  for (size_t i = 0; i < items.size(); ++i) {
+    rank += items[i].second;
+    // Equal values only have a rank together.
+    const bool last_of_value =
+        i + 1 == items.size() || items[i + 1].first != items[i].first;
+    if (last_of_value && rank >= target) return items[i].first;
+  }
+  return items.back().first;
+}
+
+void KllSketch::Encode(std::string* dst) const {
+  PutVarint64(k_, dst);
+  PutVarint64(count_, dst);
+  PutVarint64(compactions_, dst);
+  PutVarint64(levels_.size(), dst);
+  for (const std::vector<double>& level : levels_) {
+    PutVarint64(level.size(), dst);
+    for (double item : level) PutDouble(item, dst);
+  }
+}
+
+bool KllSketch::Decode(absl::string_view encoded, KllSketch* sketch) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(encoded.data());
+  const uint8_t* const end = p + encoded.size();
+  uint64_t k, count, compactions, num_levels;
+  if ((p = GetVarint64(p, end, &k)) == nullptr ||
+      (p = GetVarint64(p, end, &count)) == nullptr ||
+      (p = GetVarint64(p, end, &compactions)) == nullptr ||
+      (p = GetVarint64(p, end, &num_levels)) == nullptr || k == 0 ||
+      k > std::numeric_limits<int>::max() || num_levels == 0 ||
+      num_levels > 64) {
+    return false;
+  }
+  KllSketch decoded(static_cast<int>(k));
+  decoded.count_ = static_cast<int64_t>(count);
+  decoded.compactions_ = compactions;
+  decoded.levels_.resize(num_levels);
+  for (std::vector<double>& level : decoded.levels_) {
+    uint64_t size;
+    if ((p = GetVarint64(p, end, &size)) == nullptr ||
+        size > static_cast<uint64_t>(end - p) / 8) {
+      return false;
+    }
+    level.resize(size);
+    for (double& item : level) {
+      uint64_t bits = 0;
+      for (int i = 7; i >= 0; --i) bits = (bits << 8) | p[i];
+      std::memcpy(&item, &bits, sizeof(item));
+      p += 8;
+    }
+    decoded.size_ += size;
+  }
+  if (p != end) return false;
+  *sketch = std::move(decoded);
+  return true;
+}
+
+}  // namespace util
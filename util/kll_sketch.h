@@ -0,0 +1,68 @@
+#ifndef UTIL_KLL_SKETCH_H_
+#define UTIL_KLL_SKETCH_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace util {
+
+// A KLL quantile sketch of a stream of doubles: items are kept in levels,
+// those of level h standing for 2^h items each. A level that outgrows its
+// capacity is compacted by sorting it and promoting every other item to the
+// next level, so the sketch holds O(k) items however long the stream, and
+// the rank of any value is off by about 1.7 / k of the stream's length.
+// Sketches merge, with the error bound of a sketch of both streams.
+//
+// Compactions alternate which half they promote, rather than flip a coin,
+// so that sketches, and their encodings, are reproducible.
+class KllSketch {
+ public:
+  static constexpr int kDefaultK = 200;
+
+  KllSketch() : KllSketch(kDefaultK) {}
+  explicit KllSketch(int k);
+
+  void Add(double value);
+  void Merge(const KllSketch& other);
+
+  // The number of values added, including those of merged sketches.
+  int64_t count() const { return count_; }
+  bool empty() const { return count_ == 0; }
+
+  // Approximately how many of the values are at most `value`.
+  int64_t Rank(double value) const;
+
+  // The smallest sketched value whose rank is at least q * count(), for q in
+  // [0, 1]. The sketch must not be empty.
+  double Quantile(double q) const;
+
+  // Like Quantile, of the values of `added` that aren't in `removed`, which
+  // must sketch values that were added to `added`. The rank error is that of
+  // both sketches, so it grows with the number of removed values.
+  static double Quantile(const KllSketch& added, const KllSketch& removed,
+                         double q);
+
+  void Encode(std::string* dst) const;
+  // Returns false if `encoded` is malformed.
+  static bool Decode(absl::string_view encoded, KllSketch* sketch);
+
+ private:
+  // The most items level h may hold before it's compacted.
+  size_t Capacity(size_t h) const;
+  // Compacts levels until the sketch is within its capacity.
+  void Compress();
+
+  int k_;
+  int64_t count_ = 0;
+  uint64_t compactions_ = 0;
+  // Item weights double from one level to the next.
+  std::vector<std::vector<double>> levels_;
+  size_t size_ = 0;
+};
+
+}  // namespace util
+
+#endif  // UTIL_KLL_SKETCH_H_
@@ -0,0 +1,90 @@
+#include "util/kll_sketch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "googletest/include/gtest/gtest.h"
+
+namespace util {
+namespace {
+
+// How far `value` is from being the q-quantile of sorted `values`, as a
+// fraction of their number.
+double RankError(const std::vector<double>& values, double q, double value) {
+  const double rank =
+      std::upper_bound(values.begin(), values.end(), value) - values.begin();
+  const double lower =
+      std::lower_bound(values.begin(), values.end(), value) - values.begin();
+  const double target = q * values.size();
+  if (target > rank) return (target - rank) / values.size();
+  if (target < lower) return (lower - target) / values.size();
+  return 0;
+}
+
+TEST(KllSketchTest, SmallStreamsAreExact) {
+  KllSketch sketch;
+  EXPECT_TRUE(sketch.empty());
+  for (double value : {5.0, 1.0, 3.0, 3.0, 2.0}) sketch.Add(value);
+  EXPECT_EQ(5, sketch.count());
+  EXPECT_EQ(1.0, sketch.Quantile(0));
+  EXPECT_EQ(2.0, sketch.Quantile(0.4));
+  EXPECT_EQ(3.0, sketch.Quantile(0.5));
+  EXPECT_EQ(5.0, sketch.Quantile(1));
+  EXPECT_EQ(4, sketch.Rank(3.0));
+}
+
+TEST(KllSketchTest, BoundsRankErrorOfMergedStreams) {
+  std::mt19937_64 rng(0);
+  std::lognormal_distribution<double> value(0, 2);
+  std::vector<double> values;
+  KllSketch sketch;
+  for (int part = 0; part < 10; ++part) {
+    KllSketch part_sketch;
+    for (int i = 0; i < 10000; ++i) {
+      values.push_back(value(rng));
+      part_sketch.Add(values.back());
+    }
+    sketch.Merge(part_sketch);
+  }
+  std::sort(values.begin(), values.end());
+  EXPECT_EQ(values.size(), sketch.count());
+  for (double q : {0.0, 0.01, 0.25, 0.5, 0.9, 0.99, 1.0}) {
+    EXPECT_LT(RankError(values, q, sketch.Quantile(q)), 0.02) << q;
+  }
+}
+
+TEST(KllSketchTest, QuantileWithoutRemovedValues) {
+  KllSketch added, removed;
+  for (int i = 1; i <= 10; ++i) added.Add(i);
+  for (int i = 1; i <= 4; ++i) removed.Add(i);
+  EXPECT_EQ(5.0, KllSketch::Quantile(added, removed, 0));
+  EXPECT_EQ(7.0, KllSketch::Quantile(added, removed, 0.5));
+  EXPECT_EQ(10.0, KllSketch::Quantile(added, removed, 1));
+}
+
+TEST(KllSketchTest, EncodeDecode) {
+  KllSketch sketch(20);
+  for (int i = 0; i < 1000; ++i) sketch.Add(std::sqrt(i));
+  std::string encoded;
+  sketch.Encode(&encoded);
+
+  KllSketch decoded;
+  ASSERT_TRUE(KllSketch::Decode(encoded, &decoded));
+  EXPECT_EQ(sketch.count(), decoded.count());
+  for (double q : {0.0, 0.3, 0.7, 1.0}) {
+    EXPECT_EQ(sketch.Quantile(q), decoded.Quantile(q));
+  }
+  std::string reencoded;
+  decoded.Encode(&reencoded);
+  EXPECT_EQ(encoded, reencoded);
+
+  EXPECT_FALSE(KllSketch::Decode(encoded.substr(0, encoded.size() - 1),
+                                 &decoded));
+  EXPECT_FALSE(KllSketch::Decode(encoded + "x", &decoded));
+}
+
+}  // namespace
+}  // namespace util
@@ -1,30 +1,46 @@
 #ifndef UTIL_LOCK_MAP_H_
 #define UTIL_LOCK_MAP_H_
 
-#include <unordered_set>
+#include <array>
+#include <cstddef>
+#include <unordered_map>
 #include <utility>
-#include <iostream>
 
-#include "absl/debugging/symbolize.h"
+#include "absl/hash/hash.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
 
 namespace util {
 
-template <typename Key>
+// Locks keys, exclusively or shared. Keys are spread over shards by hash, each
+// with its own mutex, and only locked or awaited keys take up memory. Every
+// key has its own FIFO queue of waiters: a release wakes only the waiters of
+// its key that can now be granted, and a shared request doesn't overtake an
+// exclusive one that waits before it.
+template <typename Key, typename Hash = absl::Hash<Key>>
 class LockMap {
+ private:
+  struct Entry;
+  struct Shard;
+  using Node = std::pair<const Key, Entry>;
+
  public:
+  enum class Mode { kShared, kExclusive };
+
   class Lock {
    public:
-    Lock(Lock&& other) : map_(other.map_), key_(std::move(other.key_)) {
-      other.map_ = nullptr;
+    Lock(Lock&& other)
+        : shard_(other.shard_), node_(other.node_), mode_(other.mode_) {
+      other.shard_ = nullptr;
     }
 
     Lock& operator=(Lock&& other) {
       release();
-      std::swap(map_, other.map_);
-      std::swap(key_, other.key_);
+      std::swap(shard_, other.shard_);
+      std::swap(node_, other.node_);
+      std::swap(mode_, other.mode_);
       return *this;
     }
 
@@ -34,62 +50,154 @@ class LockMap {
     ~Lock() { release(); }
 
    private:
-    Lock(LockMap* map, const Key& key) : map_(map), key_(key) {}
+    Lock(Shard* shard, Node* node, Mode mode)
+        : shard_(shard), node_(node), mode_(mode) {}
 
     void release() {
-      if (map_ == nullptr) return;
-      map_->ReleaseKey(key_);
-      map_ = nullptr;
+      if (shard_ == nullptr) return;
+      LockMap::Release(shard_, node_, mode_);
+      shard_ = nullptr;
     }
 
-    LockMap<Key>* map_;
-    Key key_;
+    Shard* shard_;
+    Node* node_;
+    Mode mode_;
 
     friend class LockMap;
   };
 
   LockMap() = default;
 
+  LockMap(const LockMap&) = delete;
+  LockMap& operator=(const LockMap&) = delete;
+
   void EnableDebugLog(const char* name) {
-    mu_.EnableDebugLog(name);
+    for (Shard& shard : shards_) shard.mu.EnableDebugLog(name);
   }
 
-  Lock Acquire(const Key& key) {
-    auto key_is_free = [this, &key]() {
-      return locked_keys_.find(key) == locked_keys_.end();
-    };
-    mu_.LockWhen(absl::Condition(&key_is_free));
-    locked_keys_.insert(key);
-    mu_.Unlock();
-    return Lock(this, key);
+  Lock Acquire(const Key& key, Mode mode = Mode::kExclusive) {
+    return *AcquireWithDeadline(key, absl::InfiniteFuture(), mode);
   }
 
   absl::optional<Lock> AcquireWithTimeout(const Key& key,
-                                          absl::Duration timeout) {
-    auto key_is_free = [this, &key]() {
-      return locked_keys_.find(key) == locked_keys_.end();
-    };
-    if (mu_.LockWhenWithTimeout(absl::Condition(&key_is_free), timeout)) {
-      locked_keys_.insert(key);
-      mu_.Unlock();
-      return absl::make_optional(Lock(this, key));
+                                          absl::Duration timeout,
+                                          Mode mode = Mode::kExclusive) {
+    return AcquireWithDeadline(key, absl::Now() + timeout, mode);
+  }
+
+  // Returns nullopt if the lock isn't granted by `deadline`.
+  absl::optional<Lock> AcquireWithDeadline(const Key& key,
+                                           absl::Time deadline,
+                                           Mode mode = Mode::kExclusive) {
+    Shard& shard = shards_[Hash()(key) % kNumShards];
+    absl::MutexLock l(&shard.mu);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+      it = shard.entries.emplace(key, Entry()).first;
     }
-    mu_.Unlock();
-    return absl::nullopt;
+    Node& node = *it;
+    Entry& entry = node.second;
+    if (entry.first_waiter == nullptr && CanGrant(entry, mode)) {
+      Grant(&entry, mode);
+      return absl::make_optional(Lock(&shard, &node, mode));
+    }
+
+    Waiter waiter(mode);
+    Waiter** last = &entry.first_waiter;
+    while (*last != nullptr) last = &(*last)->next;
+    *last = &waiter;
+    while (!waiter.granted) {
+      if (waiter.cv.WaitWithDeadline(&shard.mu, deadline) && !waiter.granted) {
+        Waiter** link = &entry.first_waiter;
+        while (*link != &waiter) link = &(*link)->next;
+        *link = waiter.next;
+        // The waiters it held up may go ahead now.
+        GrantWaiters(&entry);
+        EraseIfUnused(&shard, &node);
+        return absl::nullopt;
+      }
+    }
+    return absl::make_optional(Lock(&shard, &node, mode));
   }
 
  private:
-  void ReleaseKey(const Key& key) {
-    absl::MutexLock l(&mu_);
-    locked_keys_.erase(key);
+  struct Waiter {
+    explicit Waiter(Mode mode) : mode(mode) {}
+
+    const Mode mode;
+    bool granted = false;
+    Waiter* next = nullptr;
+    absl::CondVar cv;
+  };
+
+  struct Entry {
+    int num_shared = 0;
+    bool exclusive = false;
+    // The queue of waiters, linked through their `next`. Waiters live on the
+    // stacks of the threads that wait.
+    Waiter* first_waiter = nullptr;
+  };
+
+  struct Shard {
+    absl::Mutex mu;
+    std::unordered_map<Key, Entry, Hash> entries;
+  };
+
+  static constexpr size_t kNumShards = 64;
+
+  static bool CanGrant(const Entry& entry, Mode mode) {
+    return !entry.exclusive &&
+           (mode == Mode::kShared || entry.num_shared == 0);
+  }
+
+  static void Grant(Entry* entry, Mode mode) {
+    if (mode == Mode::kExclusive) {
+      entry->exclusive = true;
+    } else {
+      ++entry->num_shared;
+    }
+  }
+
+  // Grants the waiters at the front of the queue that can go ahead. The shard
+  // must be locked.
+  static void GrantWaiters(Entry* entry) {
+    while (entry->first_waiter != nullptr &&
+           CanGrant(*entry, entry->first_waiter->mode)) {
+      Waiter* const waiter = entry->first_waiter;
+      entry->first_waiter = waiter->next;
+      Grant(entry, waiter->mode);
+      waiter->granted = true;
+      waiter->cv.Signal();
+    }
   }
 
-  absl::Mutex mu_;
-  std::unordered_set<Key> locked_keys_;
+  static void EraseIfUnused(Shard* shard, Node* node) {
+    const Entry& entry = node->second;
+    if (entry.exclusive || entry.num_shared > 0 ||
+        entry.first_waiter != nullptr) {
+      return;
+    }
+    shard->entries.erase(shard->entries.find(node->first));
+  }
 
-  friend class Lock;
+  static void Release(Shard* shard, Node* node, Mode mode) {
+    absl::MutexLock l(&shard->mu);
+    Entry& entry = node->second;
+    if (mode == Mode::kExclusive) {
+      entry.exclusive = false;
+    } else {
+      --entry.num_shared;
+    }
+    GrantWaiters(&entry);
+    EraseIfUnused(shard, node);
+  }
+
+  std::array<Shard, kNumShards> shards_;
 };
 
+template <typename Key, typename Hash>
+constexpr size_t LockMap<Key, Hash>::kNumShards;
+
 }  // namespace util
 
 #endif  // UTIL_LOCK_MAP_H_
@@ -0,0 +1,71 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "benchmark/benchmark.h"
+#include "util/lock_map.h"
+
+namespace {
+
+using StringLockMap = util::LockMap<std::string>;
+
+constexpr int kNumKeys = 10000;
+
+enum Skew {
+  // Every key is equally likely.
+  kUniform = 0,
+  // Nine in ten acquisitions go to one of ten hot keys.
+  kHotKeys = 1,
+  // Every acquisition goes to the same key.
+  kOneKey = 2,
+};
+
+// Keys in the order one thread acquires them, like user ids of requests.
+std::vector<std::string> GenerateKeys(Skew skew, int seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> any_key(0, kNumKeys - 1);
+  std::uniform_int_distribution<int> hot_key(0, 9);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::vector<std::string> keys;
+  for (int i = 0; i < 4096; ++i) {
+    int key = 0;
+    switch (skew) {
+      case kUniform:
+        key = any_key(rng);
+        break;
+      case kHotKeys:
+        key = percent(rng) < 90 ? hot_key(rng) : any_key(rng);
+        break;
+      case kOneKey:
+        break;
+    }
+    keys.push_back(absl::StrCat("user", key));
+  }
+  return keys;
+}
+
+}  // namespace
+
+// Acquires and releases locks on keys of the given skew, exclusively or
+// shared, from every thread.
+static void BM_AcquireRelease(benchmark::State& state) {
+  // Shared by every run; it's empty whenever no run is in progress.
+  static StringLockMap* const lock_map = new StringLockMap;
+  const std::vector<std::string> keys =
+      GenerateKeys(static_cast<Skew>(state.range(0)), state.thread_index());
+  const StringLockMap::Mode mode = state.range(1)
+                                       ? StringLockMap::Mode::kShared
+                                       : StringLockMap::Mode::kExclusive;
+  size_t i = 0;
+  for (auto _ : state) {
+    auto lock = lock_map->Acquire(keys[i++ % keys.size()], mode);
+    benchmark::DoNotOptimize(lock);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AcquireRelease)
+    ->ArgNames({"skew", "shared"})
+    ->ArgsProduct({{kUniform, kHotKeys, kOneKey}, {0, 1}})
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
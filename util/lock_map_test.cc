@@ -1,7 +1,10 @@
 #include "util/lock_map.h"
 
 #include <iostream>
+#include <thread>
 
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "googlemock/include/gmock/gmock.h"
 #include "googletest/include/gtest/gtest.h"
@@ -9,6 +12,8 @@
 namespace util {
 namespace {
 
+using Mode = LockMap<int>::Mode;
+
 TEST(LockMapTest, AcquireFree) {
   LockMap<int> lock_map;
   EXPECT_TRUE(
@@ -44,5 +49,68 @@ TEST(LockMapTest, MoveIntoLock) {
       lock_map.AcquireWithTimeout(234, absl::ZeroDuration()).has_value());
 }
 
+TEST(LockMapTest, SharedLocksShare) {
+  LockMap<int> lock_map;
+  auto first = lock_map.AcquireWithTimeout(123, absl::ZeroDuration(),
+                                           Mode::kShared);
+  ASSERT_TRUE(first.has_value());
+  EXPECT_TRUE(
+      lock_map.AcquireWithTimeout(123, absl::ZeroDuration(), Mode::kShared)
+          .has_value());
+  EXPECT_FALSE(lock_map.AcquireWithTimeout(123, absl::ZeroDuration()));
+  first.reset();
+  EXPECT_TRUE(
+      lock_map.AcquireWithTimeout(123, absl::ZeroDuration()).has_value());
+}
+
+TEST(LockMapTest, DeadlineInThePast) {
+  LockMap<int> lock_map;
+  auto lock = lock_map.Acquire(123);
+  const absl::Time start = absl::Now();
+  EXPECT_FALSE(lock_map.AcquireWithDeadline(123, start - absl::Seconds(1)));
+  EXPECT_FALSE(lock_map.AcquireWithTimeout(123, absl::Milliseconds(10)));
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(10));
+}
+
+TEST(LockMapTest, WaiterGetsReleasedLock) {
+  LockMap<int> lock_map;
+  absl::optional<LockMap<int>::Lock> lock = lock_map.Acquire(123);
+  absl::Notification acquired;
+  std::thread waiter([&]() {
+    auto waiting = lock_map.AcquireWithTimeout(123, absl::Seconds(30));
+    EXPECT_TRUE(waiting.has_value());
+    acquired.Notify();
+  });
+  EXPECT_FALSE(
+      acquired.WaitForNotificationWithTimeout(absl::Milliseconds(10)));
+  lock.reset();
+  waiter.join();
+  EXPECT_TRUE(acquired.HasBeenNotified());
+}
+
+// A shared lock waits behind an exclusive waiter rather than starving it, and
+// gets in once that waiter gives up.
+TEST(LockMapTest, SharedWaitsBehindExclusiveWaiter) {
+  LockMap<int> lock_map;
+  auto shared = lock_map.Acquire(123, Mode::kShared);
+  absl::Notification gave_up;
+  std::thread exclusive([&]() {
+    EXPECT_FALSE(lock_map.AcquireWithTimeout(123, absl::Milliseconds(200)));
+    gave_up.Notify();
+  });
+  // Give the exclusive waiter time to queue.
+  absl::SleepFor(absl::Milliseconds(50));
+  EXPECT_FALSE(gave_up.HasBeenNotified());
+  EXPECT_FALSE(
+      lock_map.AcquireWithTimeout(123, absl::ZeroDuration(), Mode::kShared));
+  const absl::Time start = absl::Now();
+  EXPECT_TRUE(
+      lock_map.AcquireWithTimeout(123, absl::Seconds(30), Mode::kShared)
+          .has_value());
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(100));
+  exclusive.join();
+  EXPECT_TRUE(gave_up.HasBeenNotified());
+}
+
 }  // namespace
 }  // namespace util
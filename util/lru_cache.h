@@ -0,0 +1,176 @@
+#ifndef UTIL_LRU_CACHE_H_
+#define UTIL_LRU_CACHE_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <utility>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/hash/hash.h"
+#include "absl/synchronization/mutex.h"
+
+namespace util {
+
+struct CacheCounters {
+  int64_t hits = 0;
+  int64_t misses = 0;
+  int64_t evictions = 0;
+};
+
+// Maps keys to immutable values, evicting the least recently used entries
+// once their total charge passes a budget. Keys are spread over shards by
+// hash, each with its own mutex, LRU list and an equal share of the budget.
+//
+// Lookups hand out shared pointers, so evicting or replacing an entry never
+// invalidates a value in use. To fill the cache from a read that may race
+// with writers, take a generation from the missed Lookup before reading, and
+// insert with it: the insert is dropped if the key's shard has changed since.
+template <typename Key, typename Value, typename Hash = absl::Hash<Key>>
+class ShardedLruCache {
+ public:
+  explicit ShardedLruCache(size_t max_charge)
+      : max_shard_charge_(max_charge / kNumShards) {}
+
+  ShardedLruCache(const ShardedLruCache&) = delete;
+  ShardedLruCache& operator=(const ShardedLruCache&) = delete;
+
+  // Returns null on a miss, and then sets `generation` if it's given.
+  std::shared_ptr<const Value> Lookup(const Key& key,
+                                      uint64_t* generation = nullptr) {
+    Shard& shard = ShardOf(key);
+    absl::MutexLock l(&shard.mu);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+      ++shard.counters.misses;
+      if (generation != nullptr) *generation = shard.generation;
+      return nullptr;
+    }
+    ++shard.counters.hits;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->value;
+  }
+
+  // Inserts or replaces the entry of `key`. Values whose charge alone is
+  // over a shard's budget aren't cached.
+  void Insert(const Key& key, std::shared_ptr<const Value> value,
+              size_t charge) {
+    Shard& shard = ShardOf(key);
+    absl::MutexLock l(&shard.mu);
+    ++shard.generation;
+    InsertLocked(&shard, key, std::move(value), charge);
+  }
+
+  // Like Insert, unless the shard of `key` changed since the Lookup that
+  // returned `generation`. Returns whether it inserted.
+  bool InsertIfUnchanged(const Key& key, std::shared_ptr<const Value> value,
+                         size_t charge, uint64_t generation) {
+    Shard& shard = ShardOf(key);
+    absl::MutexLock l(&shard.mu);
+    if (shard.generation != generation) return false;
+    InsertLocked(&shard, key, std::move(value), charge);
+    return true;
+  }
+
+  void Erase(const Key& key) {
+    Shard& shard = ShardOf(key);
+    absl::MutexLock l(&shard.mu);
+    ++shard.generation;
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) EraseLocked(&shard, it->second);
+  }
+
+  // Erases every entry whose key satisfies `pred`. Visits every shard.
+  template <typename Pred>
+  void EraseIf(Pred pred) {
+    for (Shard& shard : shards_) {
+      absl::MutexLock l(&shard.mu);
+      ++shard.generation;
+      for (auto it = shard.lru.begin(); it != shard.lru.end();) {
+        auto next = std::next(it);
+        if (pred(it->key)) EraseLocked(&shard, it);
+        it = next;
+      }
+    }
+  }
+
+  void Clear() {
+    EraseIf([](const Key&) { return true; });
+  }
+
+  CacheCounters counters() const {
+    CacheCounters total;
+    for (const Shard& shard : shards_) {
+      absl::MutexLock l(&shard.mu);
+      total.hits += shard.counters.hits;
+      total.misses += shard.counters.misses;
+      total.evictions += shard.counters.evictions;
+    }
+    return total;
+  }
+
+  size_t charge() const {
+    size_t total = 0;
+    for (const Shard& shard : shards_) {
+      absl::MutexLock l(&shard.mu);
+      total += shard.charge;
+    }
+    return total;
+  }
+
+ private:
+  struct Node {
+    Key key;
+    std::shared_ptr<const Value> value;
+    size_t charge;
+  };
+  using NodeList = std::list<Node>;
+
+  struct Shard {
+    mutable absl::Mutex mu;
+    // Most recently used first.
+    NodeList lru;
+    absl::flat_hash_map<Key, typename NodeList::iterator, Hash> entries;
+    size_t charge = 0;
+    // Bumped by every change but a fill from InsertIfUnchanged.
+    uint64_t generation = 0;
+    CacheCounters counters;
+  };
+
+  static constexpr size_t kNumShards = 16;
+
+  Shard& ShardOf(const Key& key) { return shards_[Hash()(key) % kNumShards]; }
+
+  void InsertLocked(Shard* shard, const Key& key,
+                    std::shared_ptr<const Value> value, size_t charge) {
+    auto it = shard->entries.find(key);
+    if (it != shard->entries.end()) EraseLocked(shard, it->second);
+    if (charge > max_shard_charge_) return;
+    shard->lru.push_front(Node{key, std::move(value), charge});
+    shard->entries.emplace(key, shard->lru.begin());
+    shard->charge += charge;
+    while (shard->charge > max_shard_charge_) {
+      EraseLocked(shard, std::prev(shard->lru.end()));
+      ++shard->counters.evictions;
+    }
+  }
+
+  static void EraseLocked(Shard* shard, typename NodeList::iterator node) {
+    shard->charge -= node->charge;
+    shard->entries.erase(node->key);
+    shard->lru.erase(node);
+  }
+
+  const size_t max_shard_charge_;
+  std::array<Shard, kNumShards> shards_;
+};
+
+template <typename Key, typename Value, typename Hash>
+constexpr size_t ShardedLruCache<Key, Value, Hash>::kNumShards;
+
+}  // namespace util
+
+#endif  // UTIL_LRU_CACHE_H_
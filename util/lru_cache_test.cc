@@ -0,0 +1,91 @@
+#include "util/lru_cache.h"
+
+#include <memory>
+#include <string>
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace util {
+namespace {
+
+// Puts every key in the same shard, so that one shard's LRU order shows.
+struct SameShard {
+  size_t operator()(int) const { return 0; }
+};
+
+using Cache = ShardedLruCache<int, std::string, SameShard>;
+
+std::shared_ptr<const std::string> Value(const std::string& value) {
+  return std::make_shared<const std::string>(value);
+}
+
+TEST(ShardedLruCacheTest, InsertLookupErase) {
+  ShardedLruCache<int, std::string> cache(1 << 20);
+  EXPECT_EQ(cache.Lookup(1), nullptr);
+  cache.Insert(1, Value("a"), 10);
+  ASSERT_NE(cache.Lookup(1), nullptr);
+  EXPECT_EQ(*cache.Lookup(1), "a");
+  cache.Insert(1, Value("b"), 20);
+  EXPECT_EQ(*cache.Lookup(1), "b");
+  EXPECT_EQ(cache.charge(), 20);
+
+  cache.Erase(1);
+  EXPECT_EQ(cache.Lookup(1), nullptr);
+  EXPECT_EQ(cache.charge(), 0);
+
+  const CacheCounters counters = cache.counters();
+  EXPECT_EQ(counters.hits, 3);
+  EXPECT_EQ(counters.misses, 2);
+  EXPECT_EQ(counters.evictions, 0);
+}
+
+TEST(ShardedLruCacheTest, EvictsLeastRecentlyUsed) {
+  // Room for three entries of charge 1 in the shard.
+  Cache cache(3 * 16);
+  cache.Insert(1, Value("a"), 1);
+  cache.Insert(2, Value("b"), 1);
+  cache.Insert(3, Value("c"), 1);
+  const std::shared_ptr<const std::string> held = cache.Lookup(1);
+  cache.Insert(4, Value("d"), 1);
+  EXPECT_EQ(cache.Lookup(2), nullptr);
+  EXPECT_NE(cache.Lookup(1), nullptr);
+  EXPECT_NE(cache.Lookup(3), nullptr);
+  EXPECT_NE(cache.Lookup(4), nullptr);
+
+  // Big enough to evict two; too big to cache at all.
+  cache.Insert(5, Value("e"), 2);
+  EXPECT_EQ(cache.charge(), 3);
+  cache.Insert(6, Value("f"), 4);
+  EXPECT_EQ(cache.Lookup(6), nullptr);
+  EXPECT_EQ(cache.counters().evictions, 3);
+  EXPECT_EQ(*held, "a");
+}
+
+TEST(ShardedLruCacheTest, InsertIfUnchangedDropsStaleFills) {
+  Cache cache(1 << 20);
+  uint64_t generation;
+  ASSERT_EQ(cache.Lookup(1, &generation), nullptr);
+  EXPECT_TRUE(cache.InsertIfUnchanged(1, Value("a"), 1, generation));
+  EXPECT_EQ(*cache.Lookup(1), "a");
+
+  // A write invalidates the key while a reader reads the old value.
+  ASSERT_EQ(cache.Lookup(2, &generation), nullptr);
+  cache.Erase(2);
+  EXPECT_FALSE(cache.InsertIfUnchanged(2, Value("stale"), 1, generation));
+  EXPECT_EQ(cache.Lookup(2), nullptr);
+}
+
+TEST(ShardedLruCacheTest, EraseIf) {
+  ShardedLruCache<int, std::string> cache(1 << 20);
+  for (int key = 0; key < 100; ++key) cache.Insert(key, Value("x"), 1);
+  cache.EraseIf([](int key) { return key % 2 == 0; });
+  EXPECT_EQ(cache.charge(), 50);
+  EXPECT_EQ(cache.Lookup(2), nullptr);
+  EXPECT_NE(cache.Lookup(3), nullptr);
+  cache.Clear();
+  EXPECT_EQ(cache.charge(), 0);
+}
+
+}  // namespace
+}  // namespace util
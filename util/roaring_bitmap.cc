@@ -0,0 +1,250 @@
+#include "util/roaring_bitmap.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace util {
+
+namespace {
+
+int PopCount(const std::vector<uint64_t>& words) {
+  int count = 0;
+  for (uint64_t word : words) count += __builtin_popcountll(word);
+  return count;
+}
+
+}  // namespace
+
+constexpr uint32_t RoaringBitmap::kMaxArraySize;
+constexpr int RoaringBitmap::kBitsetWords;
+
+bool RoaringBitmap::Container::Add(uint16_t low) {
+  if (is_bitset()) {
+    uint64_t& word = bits[low / 64];
+    const uint64_t bit = uint64_t{1} << (low % 64);
+    if (word & bit) return false;
+    word |= bit;
+    ++cardinality;
+    return true;
+  }
+  auto pos = std::lower_bound(array.begin(), array.end(), low);
+  if (pos != array.end() && *pos == low) return false;
+  if (cardinality == kMaxArraySize) {
+    ToBitset();
+    return Add(low);
+  }
+  array.insert(pos, low);
+  ++cardinality;
+  return true;
+}
+
+bool RoaringBitmap::Container::Remove(uint16_t low) {
+  if (is_bitset()) {
+    uint64_t& word = bits[low / 64];
+    const uint64_t bit = uint64_t{1} << (low % 64);
+    if ((word & bit) == 0) return false;
+    word &= ~bit;
+    if (--cardinality <= kMaxArraySize) ToArray();
+    return true;
+  }
+  auto pos = std::lower_bound(array.begin(), array.end(), low);
+  if (pos == array.end() || *pos != low) return false;
+  array.erase(pos);
+  --cardinality;
+  if (array.size() * 4 < array.capacity()) array.shrink_to_fit();
+  return true;
+}
+
+bool RoaringBitmap::Container::Contains(uint16_t low) const {
+  if (is_bitset()) return (bits[low / 64] >> (low % 64)) & 1;
+  return std::binary_search(array.begin(), array.end(), low);
+}
+
+void RoaringBitmap::Container::ToBitset() {
+  bits.assign(kBitsetWords, 0);
+  for (uint16_t low : array) bits[low / 64] |= uint64_t{1} << (low % 64);
+  std::vector<uint16_t>().swap(array);
+}
+
+void RoaringBitmap::Container::ToArray() {
+  array.clear();
+  array.reserve(cardinality);
+  for (int i = 0; i < kBitsetWords; ++i) {
+    for (uint64_t word = bits[i]; word != 0; word &= word - 1) {
+      array.push_back(i * 64 + __builtin_ctzll(word));
+    }
+  }
+  std::vector<uint64_t>().swap(bits);
+}
+
+void RoaringBitmap::Container::UnionWith(const Container& other) {
+  if (!is_bitset() && !other.is_bitset() &&
+      cardinality + other.cardinality <= kMaxArraySize) {
+    std::vector<uint16_t> merged;
+    merged.reserve(cardinality + other.cardinality);
+    std::set_union(array.begin(), array.end(), other.array.begin(),
+                   other.array.end(), std::back_inserter(merged));
+    array.swap(merged);
+    cardinality = array.size();
+    return;
+  }
+  if (!is_bitset()) ToBitset();
+  if (other.is_bitset()) {
+    for (int i = 0; i < kBitsetWords; ++i) bits[i] |= other.bits[i];
+  } else {
+    for (uint16_t low : other.array) {
+      bits[low / 64] |= uint64_t{1} << (low % 64);
+    }
+  }
+  cardinality = PopCount(bits);
+  if (cardinality <= kMaxArraySize) ToArray();
+}
+
+void RoaringBitmap::Container::IntersectWith(const Container& other) {
+  if (!is_bitset()) {
+    if (other.is_bitset()) {
+      array.erase(std::remove_if(array.begin(), array.end(),
+                                 [&other](uint16_t low) {
+                                   return !other.Contains(low);
+                                 }),
+                  array.end());
+    } else {
+      std::vector<uint16_t> kept;
+      std::set_intersection(array.begin(), array.end(), other.array.begin(),
+                            other.array.end(), std::back_inserter(kept));
+      array.swap(kept);
+    }
+    cardinality = array.size();
+    return;
+  }
+  if (!other.is_bitset()) {
+    std::vector<uint16_t> kept;
+    for (uint16_t low : other.array) {
+      if (Contains(low)) kept.push_back(low);
+    }
+    std::vector<uint64_t>().swap(bits);
+    array.swap(kept);
+    cardinality = array.size();
+    return;
+  }
+  for (int i = 0; i < kBitsetWords; ++i) bits[i] &= other.bits[i];
+  cardinality = PopCount(bits);
+  if (cardinality <= kMaxArraySize) ToArray();
+}
+
+std::vector<RoaringBitmap::Container>::iterator RoaringBitmap::Find(
+    uint64_t key) {
+  return std::lower_bound(
+      containers_.begin(), containers_.end(), key,
+      [](const Container& container, uint64_t key) {
+        return container.key < key;
+      });
+}
+
+std::vector<RoaringBitmap::Container>::const_iterator RoaringBitmap::Find(
+    uint64_t key) const {
+  return const_cast<RoaringBitmap*>(this)->Find(key);
+}
+
+bool RoaringBitmap::Add(uint64_t id) {
+  const uint64_t key = id >> 16;
+  auto it = Find(key);
+  if (it == containers_.end() || it->key != key) {
+    it = containers_.insert(it, Container{key, 0, {}, {}});
+  }
+  return it->Add(static_cast<uint16_t>(id));
+}
+
+bool RoaringBitmap::Remove(uint64_t id) {
+  const uint64_t key = id >> 16;
+  auto it = Find(key);
+  if (it == containers_.end() || it->key != key) return false;
+  if (!it->Remove(static_cast<uint16_t>(id))) return false;
+  if (it->cardinality == 0) containers_.erase(it);
+  return true;
+}
+
+bool RoaringBitmap::Contains(uint64_t id) const {
+  const uint64_t key = id >> 16;
+  auto it = Find(key);
+  return it != containers_.end() && it->key == key &&
+         it->Contains(static_cast<uint16_t>(id));
+}
+
+uint64_t RoaringBitmap::cardinality() const {
+  uint64_t cardinality = 0;
+  for (const Container& container : containers_) {
+    cardinality += container.cardinality;
+  }
+  return cardinality;
+}
+
+RoaringBitmap& RoaringBitmap::operator|=(const RoaringBitmap& other) {
+  std::vector<Container> merged;
+  merged.reserve(containers_.size() + other.containers_.size());
+  auto it = containers_.begin();
+  auto other_it = other.containers_.begin();
+  while (it != containers_.end() || other_it != other.containers_.end()) {
+    if (other_it == other.containers_.end() ||
+        (it != containers_.end() && it->key < other_it->key)) {
+      merged.push_back(std::move(*it++));
+    } else if (it == containers_.end() || other_it->key < it->key) {
+      merged.push_back(*other_it++);
+    } else {
+      it->UnionWith(*other_it++);
+      merged.push_back(std::move(*it++));
+    }
+  }
+  containers_.swap(merged);
+  return *this;
+}
+
+RoaringBitmap& RoaringBitmap::operator&=(const RoaringBitmap& other) {
+  auto out = containers_.begin();
+  auto other_it = other.containers_.begin();
+  for (auto it = containers_.begin(); it != containers_.end(); ++it) {
+    while (other_it != other.containers_.end() && other_it->key < it->key) {
+      ++other_it;
+    }
+    if (other_it == other.containers_.end()) break;
+    if (other_it->key != it->key) continue;
+    it->IntersectWith(*other_it);
+    if (it->cardinality == 0) continue;
+    if (out != it) *out = std::move(*it);
+    ++out;
+  }
+  containers_.erase(out, containers_.end());
+  return *this;
+}
+
+std::vector<uint64_t> RoaringBitmap::ToVector() const {
+  std::vector<uint64_t> ids;
+  ids.reserve(cardinality());
+  ForEach([&ids](uint64_t id) { ids.push_back(id); });
+  return ids;
+}
+
+size_t RoaringBitmap::MemoryUsage() const {
+  size_t bytes = containers_.capacity() * sizeof(Container);
+  for (const Container& container : containers_) {
+    bytes += container.array.capacity() * sizeof(uint16_t) +
+             container.bits.capacity() * sizeof(uint64_t);
+  }
+  return bytes;
+}
+
+bool operator==(const RoaringBitmap& lhs, const RoaringBitmap& rhs) {
+  if (lhs.containers_.size() != rhs.containers_.size()) return false;
+  for (size_t i = 0; i < lhs.containers_.size(); ++i) {
+    const RoaringBitmap::Container& a = lhs.containers_[i];
+    const RoaringBitmap::Container& b = rhs.containers_[i];
+    // A container's form follows from its cardinality.
+    if (a.key != b.key || a.cardinality != b.cardinality ||
+        a.array != b.array || a.bits != b.bits) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace util
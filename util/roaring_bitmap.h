@@ -0,0 +1,93 @@
+#ifndef UTIL_ROARING_BITMAP_H_
+#define UTIL_ROARING_BITMAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace util {
+
+// A set of uint64 ids, compressed like a Roaring bitmap: ids are grouped by
+// their high 48 bits, and each group keeps its low 16 bits in a container that
+// is a sorted array while it holds at most kMaxArraySize of them and a 2^16
+// bit bitset past that. Sparse ids cost about two bytes each and dense ones
+// down to a bit each; set operations work a container at a time.
+class RoaringBitmap {
+ public:
+  RoaringBitmap() = default;
+
+  // Both return whether the set changed.
+  bool Add(uint64_t id);
+  bool Remove(uint64_t id);
+
+  bool Contains(uint64_t id) const;
+  bool empty() const { return containers_.empty(); }
+  uint64_t cardinality() const;
+
+  RoaringBitmap& operator|=(const RoaringBitmap& other);
+  RoaringBitmap& operator&=(const RoaringBitmap& other);
+
+  // Calls `on_id` with every id, in increasing order.
+  template <typename F>
+  void ForEach(F on_id) const;
+  std::vector<uint64_t> ToVector() const;
+
+  // Approximate heap bytes held.
+  size_t MemoryUsage() const;
+
+  friend bool operator==(const RoaringBitmap& lhs, const RoaringBitmap& rhs);
+
+ private:
+  static constexpr uint32_t kMaxArraySize = 4096;
+  static constexpr int kBitsetWords = (1 << 16) / 64;
+
+  struct Container {
+    // Bits 16 and up of the ids.
+    uint64_t key;
+    uint32_t cardinality;
+    // Exactly one is in use: the sorted low bits, or the bitset if it's
+    // non-empty.
+    std::vector<uint16_t> array;
+    std::vector<uint64_t> bits;
+
+    bool is_bitset() const { return !bits.empty(); }
+    bool Add(uint16_t low);
+    bool Remove(uint16_t low);
+    bool Contains(uint16_t low) const;
+    void ToBitset();
+    void ToArray();
+    void UnionWith(const Container& other);
+    void IntersectWith(const Container& other);
+  };
+
+  // The container of `key`, or where it would be inserted.
+  std::vector<Container>::iterator Find(uint64_t key);
+  std::vector<Container>::const_iterator Find(uint64_t key) const;
+
+  // Sorted by key, none empty.
+  std::vector<Container> containers_;
+};
+
+inline bool operator!=(const RoaringBitmap& lhs, const RoaringBitmap& rhs) {
+  return !(lhs == rhs);
+}
+
+template <typename F>
+void RoaringBitmap::ForEach(F on_id) const {
+  for (const Container& container : containers_) {
+    const uint64_t high = container.key << 16;
+    if (!container.is_bitset()) {
+      for (uint16_t low : container.array) on_id(high | low);
+      continue;
+    }
+    for (int i = 0; i < kBitsetWords; ++i) {
+      for (uint64_t word = container.bits[i]; word != 0; word &= word - 1) {
+        on_id(high | (i * 64 + __builtin_ctzll(word)));
+      }
+    }
+  }
+}
+
+}  // namespace util
+
+#endif  // UTIL_ROARING_BITMAP_H_
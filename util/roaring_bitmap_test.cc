@@ -0,0 +1,106 @@
+#include "util/roaring_bitmap.h"
+
+#include <cstdint>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace util {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+using ::testing::IsEmpty;
+
+RoaringBitmap FromIds(const std::set<uint64_t>& ids) {
+  RoaringBitmap bitmap;
+  for (uint64_t id : ids) bitmap.Add(id);
+  return bitmap;
+}
+
+// Ids spread over a few containers, some sparse and some dense enough to be
+// bitsets.
+std::set<uint64_t> RandomIds(std::mt19937_64* rng, size_t num_ids) {
+  std::set<uint64_t> ids;
+  std::uniform_int_distribution<int> container(0, 3);
+  std::uniform_int_distribution<uint64_t> low(0, 0x3fff);
+  while (ids.size() < num_ids) {
+    const uint64_t c = container(*rng);
+    ids.insert((c << 40 | c << 16) + low(*rng) * (c + 1));
+  }
+  return ids;
+}
+
+TEST(RoaringBitmapTest, AddRemoveContains) {
+  RoaringBitmap bitmap;
+  EXPECT_TRUE(bitmap.empty());
+  EXPECT_TRUE(bitmap.Add(5));
+  EXPECT_FALSE(bitmap.Add(5));
+  EXPECT_TRUE(bitmap.Add(uint64_t{1} << 63));
+  EXPECT_TRUE(bitmap.Add(70000));
+  EXPECT_TRUE(bitmap.Contains(70000));
+  EXPECT_FALSE(bitmap.Contains(70001));
+  EXPECT_EQ(bitmap.cardinality(), 3);
+  EXPECT_THAT(bitmap.ToVector(), ElementsAre(5, 70000, uint64_t{1} << 63));
+
+  EXPECT_TRUE(bitmap.Remove(5));
+  EXPECT_FALSE(bitmap.Remove(5));
+  EXPECT_TRUE(bitmap.Remove(70000));
+  EXPECT_TRUE(bitmap.Remove(uint64_t{1} << 63));
+  EXPECT_TRUE(bitmap.empty());
+}
+
+TEST(RoaringBitmapTest, DenseContainerBecomesBitsetAndBack) {
+  RoaringBitmap bitmap;
+  std::vector<uint64_t> ids;
+  for (uint64_t id = 0; id < 10000; ++id) {
+    bitmap.Add(id);
+    ids.push_back(id);
+  }
+  EXPECT_EQ(bitmap.cardinality(), 10000);
+  EXPECT_THAT(bitmap.ToVector(), ElementsAreArray(ids));
+  // A bitset of 2^16 bits rather than two bytes an id.
+  EXPECT_LT(bitmap.MemoryUsage(), 10000);
+
+  for (uint64_t id = 0; id < 9990; ++id) bitmap.Remove(id);
+  EXPECT_THAT(bitmap.ToVector(),
+              ElementsAreArray(ids.begin() + 9990, ids.end()));
+  EXPECT_LT(bitmap.MemoryUsage(), 200);
+}
+
+TEST(RoaringBitmapTest, UnionAndIntersectionAgreeWithSets) {
+  std::mt19937_64 rng(42);
+  for (int num_ids : {0, 10, 5000, 20000}) {
+    const std::set<uint64_t> a = RandomIds(&rng, num_ids);
+    const std::set<uint64_t> b = RandomIds(&rng, 6000);
+    std::set<uint64_t> expected_union = a, expected_intersection;
+    expected_union.insert(b.begin(), b.end());
+    for (uint64_t id : a) {
+      if (b.count(id)) expected_intersection.insert(id);
+    }
+
+    RoaringBitmap union_bitmap = FromIds(a);
+    union_bitmap |= FromIds(b);
+    EXPECT_THAT(union_bitmap.ToVector(), ElementsAreArray(expected_union));
+    EXPECT_EQ(union_bitmap, FromIds(expected_union));
+
+    RoaringBitmap intersection = FromIds(a);
+    intersection &= FromIds(b);
+    EXPECT_THAT(intersection.ToVector(),
+                ElementsAreArray(expected_intersection));
+    EXPECT_EQ(intersection, FromIds(expected_intersection));
+  }
+}
+
+TEST(RoaringBitmapTest, DisjointIntersectionIsEmpty) {
+  RoaringBitmap bitmap = FromIds({1, 2, 3});
+  bitmap &= FromIds({1 << 16, 4});
+  EXPECT_TRUE(bitmap.empty());
+  EXPECT_THAT(bitmap.ToVector(), IsEmpty());
+}
+
+}  // namespace
+}  // namespace util
@@ -0,0 +1,84 @@
+#ifndef UTIL_THREAD_POOL_H_
+#define UTIL_THREAD_POOL_H_
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+
+namespace util {
+
+// Runs scheduled closures on a fixed number of threads, in no particular
+// order. At most `max_pending` closures wait for a thread; scheduling more is
+// refused, so that callers can shed load instead of queueing without bound.
+// Destroying it runs whatever is still pending and joins the threads.
+class ThreadPool {
+ public:
+  ThreadPool(int num_threads, size_t max_pending) : max_pending_(max_pending) {
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.emplace_back([this]() { Run(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      absl::MutexLock lock(&mu_);
+      stopping_ = true;
+    }
+    for (std::thread& thread : threads_) thread.join();
+  }
+
+  // Returns false, without scheduling `fn`, if max_pending closures are
+  // already waiting.
+  bool TrySchedule(std::function<void()> fn) {
+    absl::MutexLock lock(&mu_);
+    if (pending_.size() >= max_pending_) return false;
+    pending_.push_back(std::move(fn));
+    return true;
+  }
+
+  // Blocks until everything scheduled so far has run.
+  void WaitUntilIdle() {
+    auto idle = [this]() { return pending_.empty() && num_running_ == 0; };
+    absl::MutexLock lock(&mu_);
+    mu_.Await(absl::Condition(&idle));
+  }
+
+ private:
+  void Run() {
+    auto has_work = [this]() { return !pending_.empty() || stopping_; };
+    while (true) {
+      std::function<void()> fn;
+      {
+        absl::MutexLock lock(&mu_);
+        mu_.Await(absl::Condition(&has_work));
+        if (pending_.empty()) return;
+        fn = std::move(pending_.front());
+        pending_.pop_front();
+        ++num_running_;
+      }
+      fn();
+      absl::MutexLock lock(&mu_);
+      --num_running_;
+    }
+  }
+
+  const size_t max_pending_;
+  absl::Mutex mu_;
+  std::deque<std::function<void()>> pending_;
+  int num_running_ = 0;
+  bool stopping_ = false;
+  // Last, so that they start after the state they read is initialized.
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace util
+
+#endif  // UTIL_THREAD_POOL_H_
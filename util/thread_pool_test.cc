@@ -0,0 +1,58 @@
+#include "util/thread_pool.h"
+
+#include <atomic>
+#include <vector>
+
+#include "absl/synchronization/notification.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace util {
+namespace {
+
+TEST(ThreadPoolTest, RunsEverything) {
+  std::atomic<int> num_ran{0};
+  ThreadPool pool(/*num_threads=*/4, /*max_pending=*/100);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(pool.TrySchedule([&num_ran]() { ++num_ran; }));
+  }
+  pool.WaitUntilIdle();
+  EXPECT_EQ(num_ran, 100);
+}
+
+TEST(ThreadPoolTest, RefusesPastMaxPending) {
+  absl::Notification started, release;
+  ThreadPool pool(/*num_threads=*/1, /*max_pending=*/1);
+  ASSERT_TRUE(pool.TrySchedule([&]() {
+    started.Notify();
+    release.WaitForNotification();
+  }));
+  started.WaitForNotification();
+  EXPECT_TRUE(pool.TrySchedule([]() {}));
+  EXPECT_FALSE(pool.TrySchedule([]() {}));
+  release.Notify();
+  pool.WaitUntilIdle();
+  EXPECT_TRUE(pool.TrySchedule([]() {}));
+}
+
+TEST(ThreadPoolTest, DestructorRunsPending) {
+  std::atomic<int> num_ran{0};
+  absl::Notification started, release;
+  {
+    ThreadPool pool(/*num_threads=*/1, /*max_pending=*/10);
+    ASSERT_TRUE(pool.TrySchedule([&]() {
+      started.Notify();
+      release.WaitForNotification();
+      ++num_ran;
+    }));
+    started.WaitForNotification();
+    for (int i = 0; i < 3; ++i) {
+      ASSERT_TRUE(pool.TrySchedule([&num_ran]() { ++num_ran; }));
+    }
+    release.Notify();
+  }
+  EXPECT_EQ(num_ran, 4);
+}
+
+}  // namespace
+}  // namespace util
@@ -0,0 +1,91 @@
+#ifndef UTIL_VARINT_H_
+#define UTIL_VARINT_H_
+
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace util {
+
+// LEB128 varints, as used by protobuf and leveldb.
+inline void PutVarint64(uint64_t value, std::string* dst) {
+  char buf[10];
+  int size = 0;
+  while (value >= 0x80) {
+    buf[size++] = static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  buf[size++] = static_cast<char>(value);
+  dst->append(buf, size);
+}
+
+// Returns the position after the varint, or nullptr if it's truncated or
+// longer than ten bytes.
+inline const uint8_t* GetVarint64(const uint8_t* p, const uint8_t* end,
+                                  uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift <= 63 && p < end; shift += 7) {
+    const uint64_t byte = *p++;
+    result |= (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+// Maps signed values of small magnitude to small unsigned ones.
+inline uint64_t ZigZagEncode64(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^
+         static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t ZigZagDecode64(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline void PutZigZag64(int64_t value, std::string* dst) {
+  PutVarint64(ZigZagEncode64(value), dst);
+}
+
+// Reads varints and byte strings off the front of `in`. The first read past
+// its end or of a malformed varint fails the reader, and every read after it
+// returns zero or empty, so decoders check ok() once at the end.
+class VarintReader {
+ public:
+  explicit VarintReader(absl::string_view in)
+      : p_(reinterpret_cast<const uint8_t*>(in.data())), end_(p_ + in.size()) {}
+
+  bool ok() const { return p_ != nullptr; }
+  bool done() const { return p_ == end_; }
+  // For decoders to fail the reader on a value out of range.
+  void Fail() { p_ = nullptr; }
+
+  uint64_t Varint() {
+    uint64_t value = 0;
+    if (p_ != nullptr) p_ = GetVarint64(p_, end_, &value);
+    return value;
+  }
+
+  int64_t ZigZag() { return ZigZagDecode64(Varint()); }
+
+  absl::string_view Bytes(uint64_t size) {
+    if (p_ == nullptr || static_cast<uint64_t>(end_ - p_) < size) {
+      p_ = nullptr;
+      return absl::string_view();
+    }
+    const absl::string_view bytes(reinterpret_cast<const char*>(p_), size);
+    p_ += size;
+    return bytes;
+  }
+
+ private:
+  const uint8_t* p_;
+  const uint8_t* const end_;
+};
+
+}  // namespace util
+
+#endif  // UTIL_VARINT_H_
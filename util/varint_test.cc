@@ -0,0 +1,79 @@
+#include "util/varint.h"
+
+#include <limits>
+
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace util {
+namespace {
+
+using ::testing::SizeIs;
+
+TEST(VarintTest, RoundTrip) {
+  for (uint64_t value : {uint64_t{0}, uint64_t{127}, uint64_t{128},
+                         uint64_t{300}, std::numeric_limits<uint64_t>::max()}) {
+    std::string encoded;
+    PutVarint64(value, &encoded);
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(encoded.data());
+    uint64_t decoded;
+    EXPECT_EQ(GetVarint64(p, p + encoded.size(), &decoded), p + encoded.size());
+    EXPECT_EQ(decoded, value);
+  }
+}
+
+TEST(VarintTest, Sizes) {
+  std::string encoded;
+  PutVarint64(127, &encoded);
+  EXPECT_THAT(encoded, SizeIs(1));
+  encoded.clear();
+  PutVarint64(std::numeric_limits<uint64_t>::max(), &encoded);
+  EXPECT_THAT(encoded, SizeIs(10));
+}
+
+TEST(VarintTest, Truncated) {
+  std::string encoded;
+  PutVarint64(300, &encoded);
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(encoded.data());
+  uint64_t decoded;
+  EXPECT_EQ(GetVarint64(p, p + 1, &decoded), nullptr);
+}
+
+TEST(VarintTest, ZigZag) {
+  EXPECT_EQ(ZigZagEncode64(0), 0);
+  EXPECT_EQ(ZigZagEncode64(-1), 1);
+  EXPECT_EQ(ZigZagEncode64(1), 2);
+  for (int64_t value : {int64_t{-300}, int64_t{300},
+                        std::numeric_limits<int64_t>::min(),
+                        std::numeric_limits<int64_t>::max()}) {
+    EXPECT_EQ(ZigZagDecode64(ZigZagEncode64(value)), value);
+  }
+}
+
+TEST(VarintTest, Reader) {
+  std::string encoded;
+  PutVarint64(300, &encoded);
+  PutZigZag64(-2, &encoded);
+  PutVarint64(3, &encoded);
+  encoded.append("abc");
+  VarintReader reader(encoded);
+  EXPECT_EQ(reader.Varint(), 300);
+  EXPECT_EQ(reader.ZigZag(), -2);
+  EXPECT_EQ(reader.Bytes(reader.Varint()), "abc");
+  EXPECT_TRUE(reader.ok());
+  EXPECT_TRUE(reader.done());
+
+  // Reads past the end fail the reader, and those after it read nothing.
+  EXPECT_EQ(reader.Varint(), 0);
+  EXPECT_FALSE(reader.ok());
+  EXPECT_EQ(reader.Bytes(0), "");
+
+  VarintReader short_reader(encoded.substr(0, encoded.size() - 1));
+  short_reader.Varint();
+  short_reader.ZigZag();
+  EXPECT_EQ(short_reader.Bytes(short_reader.Varint()), "");
+  EXPECT_FALSE(short_reader.ok());
+}
+
+}  // namespace
+}  // namespace util
@@ -0,0 +1,71 @@
+#ifndef UTIL_WORKER_THREAD_H_
+#define UTIL_WORKER_THREAD_H_
+
+#include <deque>
+#include <functional>
+#include <thread>
+#include <utility>
+
+#include "absl/synchronization/mutex.h"
+
+namespace util {
+
+// Runs scheduled closures one at a time, in order, on a dedicated thread.
+// Destroying it runs whatever is still pending and joins the thread.
+class WorkerThread {
+ public:
+  WorkerThread() : thread_([this]() { Run(); }) {}
+
+  WorkerThread(const WorkerThread&) = delete;
+  WorkerThread& operator=(const WorkerThread&) = delete;
+
+  ~WorkerThread() {
+    {
+      absl::MutexLock lock(&mu_);
+      stopping_ = true;
+    }
+    thread_.join();
+  }
+
+  void Schedule(std::function<void()> fn) {
+    absl::MutexLock lock(&mu_);
+    pending_.push_back(std::move(fn));
+  }
+
+  // Blocks until everything scheduled so far has run.
+  void WaitUntilIdle() {
+    auto idle = [this]() { return pending_.empty() && !running_; };
+    absl::MutexLock lock(&mu_);
+    mu_.Await(absl::Condition(&idle));
+  }
+
+ private:
+  void Run() {
+    auto has_work = [this]() { return !pending_.empty() || stopping_; };
+    while (true) {
+      std::function<void()> fn;
+      {
+        absl::MutexLock lock(&mu_);
+        mu_.Await(absl::Condition(&has_work));
+        if (pending_.empty()) return;
+        fn = std::move(pending_.front());
+        pending_.pop_front();
+        running_ = true;
+      }
+      fn();
+      absl::MutexLock lock(&mu_);
+      running_ = false;
+    }
+  }
+
+  absl::Mutex mu_;
+  std::deque<std::function<void()>> pending_;
+  bool running_ = false;
+  bool stopping_ = false;
+  // Last, so that it starts after the state it reads is initialized.
+  std::thread thread_;
+};
+
+}  // namespace util
+
+#endif  // UTIL_WORKER_THREAD_H_
@@ -0,0 +1,42 @@
+#include "util/worker_thread.h"
+
+#include <vector>
+
+#include "absl/synchronization/notification.h"
+#include "googlemock/include/gmock/gmock.h"
+#include "googletest/include/gtest/gtest.h"
+
+namespace util {
+namespace {
+
+using ::testing::ElementsAre;
+
+TEST(WorkerThreadTest, RunsInOrder) {
+  std::vector<int> ran;
+  WorkerThread worker;
+  for (int i = 0; i < 3; ++i) {
+    worker.Schedule([&ran, i]() { ran.push_back(i); });
+  }
+  worker.WaitUntilIdle();
+  EXPECT_THAT(ran, ElementsAre(0, 1, 2));
+}
+
+TEST(WorkerThreadTest, DestructorRunsPending) {
+  std::vector<int> ran;
+  absl::Notification started, release;
+  {
+    WorkerThread worker;
+    worker.Schedule([&]() {
+      started.Notify();
+      release.WaitForNotification();
+      ran.push_back(0);
+    });
+    worker.Schedule([&ran]() { ran.push_back(1); });
+    started.WaitForNotification();
+    release.Notify();
+  }
+  EXPECT_THAT(ran, ElementsAre(0, 1));
+}
+
+}  // namespace
+}  // namespace util